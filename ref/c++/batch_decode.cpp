@@ -0,0 +1,184 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "batch_decode.h"
+#include "payment_request.h"
+#include "sha256.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+
+namespace
+{
+
+/* Invoices taken at once; amortizes the atomic and keeps workers on separate cache lines of the columns. */
+const size_t CHUNK_SIZE = 64;
+
+/* The share of the batch a worker starts with. Once its own share is done, it steals chunks from the
+ * shares of the others, so a worker that got slow invoices does not hold up the batch. */
+struct alignas(64) work_range {
+    std::atomic<size_t> next;
+    size_t end;
+};
+
+/* Take the next chunk of @range, if any is left. */
+bool take_chunk(work_range& range, size_t* begin, size_t* end)
+{
+    if (range.next.load(std::memory_order_relaxed) >= range.end) return false;
+    *begin = range.next.fetch_add(CHUNK_SIZE, std::memory_order_relaxed);
+    if (*begin >= range.end) return false;
+    *end = std::min(*begin + CHUNK_SIZE, range.end);
+    return true;
+}
+
+/* Signed messages hashed at once; as many as the widest sha256 implementation takes. */
+const size_t HASH_GROUP = 8;
+
+/* What a worker decodes a chunk into. The signatures of the whole chunk are checked together. */
+struct worker_scratch {
+    payment_request::bolt11 invoices[CHUNK_SIZE];
+    size_t rows[CHUNK_SIZE];
+    int status[CHUNK_SIZE];
+    payment_request::signing_data signed_data[HASH_GROUP];
+};
+
+/* Hash the signed messages of the decoded invoices @begin to @end, which are at most a group. */
+void hash_group(worker_scratch& scratch, size_t begin, size_t end)
+{
+    const unsigned char* messages[HASH_GROUP];
+    size_t sizes[HASH_GROUP];
+    unsigned char hashes[HASH_GROUP][32];
+    for (size_t n = begin; n < end; ++n) {
+        messages[n - begin] = scratch.signed_data[n - begin].preimage;
+        sizes[n - begin] = scratch.signed_data[n - begin].size;
+    }
+    sha256::hash_many(messages, sizes, end - begin, hashes);
+    for (size_t n = begin; n < end; ++n) std::copy(hashes[n - begin], hashes[n - begin] + 32, scratch.invoices[n].signing_hash);
+}
+
+void clear_row(payment_request::decoded_batch& out, size_t i)
+{
+    out.status[i] = -1;
+    out.amount_msat[i] = 0;
+    out.timestamp[i] = 0;
+    out.expiry[i] = 0;
+    out.min_final_cltv_expiry[i] = 0;
+    out.network[i] = 0;
+    out.features[i] = 0;
+    out.payment_hash[i].fill(0);
+    out.signing_hash[i].fill(0);
+    out.receiver_id[i].fill(0);
+}
+
+void decode_rows(const std::string_view* invoices, size_t begin, size_t end, worker_scratch& scratch,
+                 payment_request::recovery_cache* cache, payment_request::decoded_batch& out)
+{
+    size_t decoded = 0, hashed = 0;
+    for (size_t i = begin; i < end; ++i) {
+        if (payment_request::decode(invoices[i], scratch.invoices[decoded], scratch.signed_data[decoded - hashed]) != 0) {
+            clear_row(out, i);
+            continue;
+        }
+        scratch.rows[decoded++] = i;
+        if (decoded - hashed == HASH_GROUP) {
+            hash_group(scratch, hashed, decoded);
+            hashed = decoded;
+        }
+    }
+    hash_group(scratch, hashed, decoded);
+    payment_request::check_signatures(scratch.invoices, decoded, scratch.status, cache);
+
+    for (size_t n = 0; n < decoded; ++n) {
+        const payment_request::bolt11& invoice = scratch.invoices[n];
+        const size_t i = scratch.rows[n];
+        if (scratch.status[n] != 0) {
+            clear_row(out, i);
+            continue;
+        }
+        out.status[i] = 0;
+        out.amount_msat[i] = invoice.sat_amount;
+        out.timestamp[i] = invoice.timestamp;
+        out.expiry[i] = invoice.expiry;
+        out.min_final_cltv_expiry[i] = invoice.min_final_cltv_expiry;
+        out.network[i] = invoice.network;
+        out.features[i] = invoice.features;
+        std::copy(invoice.payment_hash, invoice.payment_hash + 32, out.payment_hash[i].begin());
+        std::copy(invoice.signing_hash, invoice.signing_hash + 32, out.signing_hash[i].begin());
+        std::copy(invoice.receiver_id, invoice.receiver_id + 33, out.receiver_id[i].begin());
+    }
+}
+
+void worker(const std::string_view* invoices, work_range* ranges, unsigned threads, unsigned self,
+            payment_request::recovery_cache* cache, payment_request::decoded_batch& out)
+{
+    std::unique_ptr<worker_scratch> scratch(new worker_scratch);
+    size_t begin, end;
+    /* Own share first, then the others' in turn. */
+    for (unsigned n = 0; n < threads; ++n) {
+        work_range& range = ranges[(self + n) % threads];
+        while (take_chunk(range, &begin, &end)) decode_rows(invoices, begin, end, *scratch, cache, out);
+    }
+}
+
+}
+
+namespace payment_request
+{
+
+void decoded_batch::resize(size_t count) {
+    status.resize(count);
+    amount_msat.resize(count);
+    timestamp.resize(count);
+    expiry.resize(count);
+    min_final_cltv_expiry.resize(count);
+    network.resize(count);
+    features.resize(count);
+    payment_hash.resize(count);
+    signing_hash.resize(count);
+    receiver_id.resize(count);
+}
+
+void decode_batch(const std::string_view* invoices, size_t count, struct decoded_batch& out, unsigned threads,
+                  recovery_cache* cache) {
+    out.resize(count);
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::max<size_t>(1, std::min<size_t>(threads, (count + CHUNK_SIZE - 1) / CHUNK_SIZE));
+
+    std::unique_ptr<work_range[]> ranges(new work_range[threads]);
+    /* Shares are whole chunks, so two workers never write the same chunk of a column. */
+    const size_t chunks = (count + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    for (unsigned t = 0; t < threads; ++t) {
+        ranges[t].next.store(std::min(count, chunks * t / threads * CHUNK_SIZE), std::memory_order_relaxed);
+        ranges[t].end = std::min(count, chunks * (t + 1) / threads * CHUNK_SIZE);
+    }
+
+    /* The calling thread is worker 0. */
+    std::vector<std::thread> pool;
+    pool.reserve(threads - 1);
+    for (unsigned t = 1; t < threads; ++t)
+        pool.emplace_back(worker, invoices, ranges.get(), threads, t, cache, std::ref(out));
+    worker(invoices, ranges.get(), threads, 0, cache, out);
+    for (auto& thread : pool) thread.join();
+}
+
+}
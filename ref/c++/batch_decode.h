@@ -0,0 +1,62 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef BATCH_DECODE_H_
+#define BATCH_DECODE_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <array>
+#include <string_view>
+#include <vector>
+
+namespace payment_request
+{
+
+class recovery_cache;
+
+/** Decoded invoices of a batch, one column per field. Row i belongs to the i-th invoice. */
+struct decoded_batch {
+	std::vector<int8_t> status;                             // 0 if decoded, -1 on failure; other columns are 0 then.
+	std::vector<uint64_t> amount_msat;
+	std::vector<uint64_t> timestamp;
+	std::vector<uint64_t> expiry;
+	std::vector<uint32_t> min_final_cltv_expiry;
+	std::vector<uint8_t> network;                           // index into NETWORK_PREFIXES
+	std::vector<uint64_t> features;                         // as bolt11::features
+	std::vector<std::array<unsigned char, 32> > payment_hash;
+	std::vector<std::array<unsigned char, 32> > signing_hash;      // what the signature signs
+	std::vector<std::array<unsigned char, 33> > receiver_id;       // the payee, given or recovered
+
+	size_t size() const { return status.size(); }
+	void resize(size_t count);
+};
+
+/** Decode @count invoices into @out with the same parser as decode(). The invoices are spread over
+ *  @threads threads (0 means one per core) that steal chunks of work from each other. The signing
+ *  hashes of a chunk are computed together, several messages at once, and so are its signature
+ *  checks, which first look in @cache if one is given. */
+void decode_batch(const std::string_view* invoices, size_t count, struct decoded_batch& out, unsigned threads = 0,
+                  recovery_cache* cache = NULL);
+
+}
+
+#endif  // BATCH_DECODE_H_
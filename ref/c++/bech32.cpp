@@ -30,13 +30,21 @@ Making changes to decode a Lightning Invoice
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "bech32.h"
+#include "hrp.h"
 
+#include <array>
 #include <tuple>
+#include <utility>
 #include <vector>
 
 #include <assert.h>
 #include <stdint.h>
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CHARSET_X86 1
+#include <immintrin.h>
+#endif
+
 namespace bech32
 {
 
@@ -45,9 +53,8 @@ namespace
 
 typedef std::vector<uint8_t> data;
 
-/** The Bech32 character set for encoding. 
+/** The Bech32 character set for encoding. */
 const char* CHARSET = "qpzry9x8gf2tvdw0s3jn54khce6mua7l";
-*/
 
 /** The Bech32 character set for decoding. */
 const int8_t CHARSET_REV[128] = {
@@ -61,22 +68,91 @@ const int8_t CHARSET_REV[128] = {
      1,  0,  3, 16, 11, 28, 12, 14,  6,  4,  2, -1, -1, -1, -1, -1
 };
 
-/** Concatenate two byte arrays. */
-data cat(data x, const data& y) {
-    x.insert(x.end(), y.begin(), y.end());
-    return x;
-}
-
 /* Determine the final constant to use for the specified encoding. */
 uint32_t encoding_constant(Encoding encoding) {
     assert(encoding == Encoding::BECH32 || encoding == Encoding::BECH32M);
     return encoding == Encoding::BECH32 ? 1 : 0x2bc830a3;
 }
 
+/** Compute c0*k(x), where k(x) = x^6 mod g(x) and g(x) is the Bech32 generator (see polymod). */
+constexpr uint32_t generator_multiple(uint8_t c0)
+{
+    // We want to update `c` to correspond to a polynomial with one extra term. If the initial
+    // value of `c` consists of the coefficients of c(x) = f(x) mod g(x), we modify it to
+    // correspond to c'(x) = (f(x) * x + v_i) mod g(x), where v_i is the next input to
+    // process. Simplifying:
+    // c'(x) = (f(x) * x + v_i) mod g(x)
+    //         ((f(x) mod g(x)) * x + v_i) mod g(x)
+    //         (c(x) * x + v_i) mod g(x)
+    // If c(x) = c0*x^5 + c1*x^4 + c2*x^3 + c3*x^2 + c4*x + c5, we want to compute
+    // c'(x) = (c0*x^5 + c1*x^4 + c2*x^3 + c3*x^2 + c4*x + c5) * x + v_i mod g(x)
+    //       = c0*x^6 + c1*x^5 + c2*x^4 + c3*x^3 + c4*x^2 + c5*x + v_i mod g(x)
+    //       = c0*(x^6 mod g(x)) + c1*x^5 + c2*x^4 + c3*x^3 + c4*x^2 + c5*x + v_i
+    // If we call (x^6 mod g(x)) = k(x), this can be written as
+    // c'(x) = (c1*x^5 + c2*x^4 + c3*x^3 + c4*x^2 + c5*x + v_i) + c0*k(x)
+
+    // This function computes c0*k(x); polymod_step() adds it to c1*x^5 + ... + c5*x + v_i.
+    // For each set bit n in c0, conditionally add {2^n}k(x):
+    uint32_t c = 0;
+    if (c0 & 1)  c ^= 0x3b6a57b2; //     k(x) = {29}x^5 + {22}x^4 + {20}x^3 + {21}x^2 + {29}x + {18}
+    if (c0 & 2)  c ^= 0x26508e6d; //  {2}k(x) = {19}x^5 +  {5}x^4 +     x^3 +  {3}x^2 + {19}x + {13}
+    if (c0 & 4)  c ^= 0x1ea119fa; //  {4}k(x) = {15}x^5 + {10}x^4 +  {2}x^3 +  {6}x^2 + {15}x + {26}
+    if (c0 & 8)  c ^= 0x3d4233dd; //  {8}k(x) = {30}x^5 + {20}x^4 +  {4}x^3 + {12}x^2 + {30}x + {29}
+    if (c0 & 16) c ^= 0x2a1462b3; // {16}k(x) = {21}x^5 +     x^4 +  {8}x^3 + {24}x^2 + {21}x + {19}
+    return c;
+}
+
+/** The multiples of k(x) for every value of c0, so a step needs one lookup instead of five
+ *  data-dependent conditional XORs. */
+struct GeneratorTable
+{
+    uint32_t multiple[32];
+
+    constexpr GeneratorTable() : multiple() {
+        for (int c0 = 0; c0 < 32; ++c0) multiple[c0] = generator_multiple(c0);
+    }
+};
+
+constexpr GeneratorTable GENERATOR_TABLE;
+
+/** Update the checksum state `c` with one more 5-bit value. */
+constexpr uint32_t polymod_step(uint32_t c, uint8_t v_i)
+{
+    // Compute c1*x^5 + c2*x^4 + c3*x^3 + c4*x^2 + c5*x + v_i, and add c0*k(x) to it.
+    return ((c & 0x1ffffff) << 5) ^ v_i ^ GENERATOR_TABLE.multiple[c >> 25];
+}
+
+/** Number of 5-bit values folded into the checksum state per step of polymod. */
+constexpr size_t FOLD_SIZE = 6;
+
+/** The state after feeding FOLD_SIZE zeros, for every value of every 5-bit group of the state.
+ *  The update is linear over GF(2), so feeding FOLD_SIZE values into c yields the XOR of
+ *  fold[j][c_j] over the groups c_j of c (group 0 being c0, the highest) with the values
+ *  themselves packed into a 30-bit integer: the values are all shifted in, but none are shifted
+ *  out again. As the state holds exactly FOLD_SIZE groups, all of them are shifted out and
+ *  the lookups do not depend on each other, unlike FOLD_SIZE successive polymod_step calls. */
+struct FoldTable
+{
+    uint32_t fold[FOLD_SIZE][32];
+
+    constexpr FoldTable() : fold() {
+        for (size_t j = 0; j < FOLD_SIZE; ++j) {
+            for (uint32_t v = 0; v < 32; ++v) {
+                uint32_t c = v << (5 * (FOLD_SIZE - 1 - j));
+                for (size_t i = 0; i < FOLD_SIZE; ++i) c = polymod_step(c, 0);
+                fold[j][v] = c;
+            }
+        }
+    }
+};
+
+constexpr FoldTable FOLD_TABLE;
+
 /** This function will compute what 6 5-bit values to XOR into the last 6 input values, in order to
  *  make the checksum 0. These 6 values are packed together in a single 30-bit integer. The higher
- *  bits correspond to earlier values. */
-uint32_t polymod(const data& values)
+ *  bits correspond to earlier values. The computation continues from the state `c`, so that the
+ *  input can be fed in pieces without concatenating them first; start with c = 1. */
+uint32_t polymod(uint32_t c, const uint8_t* values, size_t size)
 {
     // The input is interpreted as a list of coefficients of a polynomial over F = GF(32), with an
     // implicit 1 in front. If the input is [v0,v1,v2,v3,v4], that polynomial is v(x) =
@@ -102,35 +178,19 @@ uint32_t polymod(const data& values)
     // polynomial constructed from just the values of v that were processed so far, mod g(x). In
     // the above example, `c` initially corresponds to 1 mod g(x), and after processing 2 inputs of
     // v, it corresponds to x^2 + v0*x + v1 mod g(x). As 1 mod g(x) = 1, that is the starting value
-    // for `c`.
-    uint32_t c = 1;
-    for (const auto v_i : values) {
-        // We want to update `c` to correspond to a polynomial with one extra term. If the initial
-        // value of `c` consists of the coefficients of c(x) = f(x) mod g(x), we modify it to
-        // correspond to c'(x) = (f(x) * x + v_i) mod g(x), where v_i is the next input to
-        // process. Simplifying:
-        // c'(x) = (f(x) * x + v_i) mod g(x)
-        //         ((f(x) mod g(x)) * x + v_i) mod g(x)
-        //         (c(x) * x + v_i) mod g(x)
-        // If c(x) = c0*x^5 + c1*x^4 + c2*x^3 + c3*x^2 + c4*x + c5, we want to compute
-        // c'(x) = (c0*x^5 + c1*x^4 + c2*x^3 + c3*x^2 + c4*x + c5) * x + v_i mod g(x)
-        //       = c0*x^6 + c1*x^5 + c2*x^4 + c3*x^3 + c4*x^2 + c5*x + v_i mod g(x)
-        //       = c0*(x^6 mod g(x)) + c1*x^5 + c2*x^4 + c3*x^3 + c4*x^2 + c5*x + v_i
-        // If we call (x^6 mod g(x)) = k(x), this can be written as
-        // c'(x) = (c1*x^5 + c2*x^4 + c3*x^3 + c4*x^2 + c5*x + v_i) + c0*k(x)
-
-        // First, determine the value of c0:
-        uint8_t c0 = c >> 25;
-
-        // Then compute c1*x^5 + c2*x^4 + c3*x^3 + c4*x^2 + c5*x + v_i:
-        c = ((c & 0x1ffffff) << 5) ^ v_i;
-
-        // Finally, for each set bit n in c0, conditionally add {2^n}k(x):
-        if (c0 & 1)  c ^= 0x3b6a57b2; //     k(x) = {29}x^5 + {22}x^4 + {20}x^3 + {21}x^2 + {29}x + {18}
-        if (c0 & 2)  c ^= 0x26508e6d; //  {2}k(x) = {19}x^5 +  {5}x^4 +     x^3 +  {3}x^2 + {19}x + {13}
-        if (c0 & 4)  c ^= 0x1ea119fa; //  {4}k(x) = {15}x^5 + {10}x^4 +  {2}x^3 +  {6}x^2 + {15}x + {26}
-        if (c0 & 8)  c ^= 0x3d4233dd; //  {8}k(x) = {30}x^5 + {20}x^4 +  {4}x^3 + {12}x^2 + {30}x + {29}
-        if (c0 & 16) c ^= 0x2a1462b3; // {16}k(x) = {21}x^5 +     x^4 +  {8}x^3 + {24}x^2 + {21}x + {19}
+    // for `c`. See generator_multiple for how a single value is processed; here FOLD_SIZE values
+    // are processed per iteration using FOLD_TABLE.
+    size_t i = 0;
+    for (; i + FOLD_SIZE <= size; i += FOLD_SIZE) {
+        const uint8_t* v = values + i;
+        c = FOLD_TABLE.fold[0][c >> 25] ^ FOLD_TABLE.fold[1][(c >> 20) & 0x1f] ^
+            FOLD_TABLE.fold[2][(c >> 15) & 0x1f] ^ FOLD_TABLE.fold[3][(c >> 10) & 0x1f] ^
+            FOLD_TABLE.fold[4][(c >> 5) & 0x1f] ^ FOLD_TABLE.fold[5][c & 0x1f] ^
+            (uint32_t{v[0]} << 25) ^ (uint32_t{v[1]} << 20) ^ (uint32_t{v[2]} << 15) ^
+            (uint32_t{v[3]} << 10) ^ (uint32_t{v[4]} << 5) ^ v[5];
+    }
+    for (; i < size; ++i) {
+        c = polymod_step(c, values[i]);
     }
     return c;
 }
@@ -140,68 +200,320 @@ unsigned char lc(unsigned char c) {
     return (c >= 'A' && c <= 'Z') ? (c - 'A') + 'a' : c;
 }
 
-/** Expand a HRP for use in checksum computation. */
-data expand_hrp(const std::string& hrp) {
-    data ret;
-    ret.reserve(hrp.size() + 90);
-    ret.resize(hrp.size() * 2 + 1);
-    for (size_t i = 0; i < hrp.size(); ++i) {
-        unsigned char c = hrp[i];
-        ret[i] = c >> 5;
-        ret[i + hrp.size() + 1] = c & 0x1f;
+/** Feed the expansion of a HRP into the checksum. The expansion is the high bits of every
+ *  character, a 0, and then the low bits of every character. */
+constexpr uint32_t polymod_expand_hrp(std::string_view hrp) {
+    uint32_t c = 1;
+    for (size_t i = 0; i < hrp.size(); ++i) c = polymod_step(c, static_cast<unsigned char>(hrp[i]) >> 5);
+    c = polymod_step(c, 0);
+    for (size_t i = 0; i < hrp.size(); ++i) c = polymod_step(c, static_cast<unsigned char>(hrp[i]) & 0x1f);
+    return c;
+}
+
+/** A HRP whose checksum state is computed at compile time. */
+struct KnownHrp
+{
+    std::string_view hrp;
+    uint32_t state;
+
+    constexpr KnownHrp(std::string_view h) : hrp(h), state(polymod_expand_hrp(h)) {}
+};
+
+template <size_t... I>
+constexpr std::array<KnownHrp, sizeof...(I)> known_hrps(std::index_sequence<I...>) {
+    return {{KnownHrp(payment_request::NETWORK_PREFIXES[I])...}};
+}
+
+/** The Lightning network prefixes (see payment_request::NETWORK_PREFIXES). An invoice without an
+ *  amount has exactly one of these as its HRP, so only its data part needs to be walked. */
+constexpr auto KNOWN_HRPS = known_hrps(std::make_index_sequence<payment_request::NETWORK_COUNT>());
+
+/** The checksum state after the expansion of a HRP, from the cache if it is a known one. */
+uint32_t polymod_hrp(std::string_view hrp) {
+    for (const auto& known : KNOWN_HRPS) {
+        if (known.hrp == hrp) return known.state;
     }
-    ret[hrp.size()] = 0;
-    return ret;
+    return polymod_expand_hrp(hrp);
 }
 
 /** Verify a checksum. */
-Encoding verify_checksum(const std::string& hrp, const data& values) {
+Encoding verify_checksum(std::string_view hrp, const uint8_t* values, size_t size) {
     // PolyMod computes what value to xor into the final values to make the checksum 0. However,
     // if we required that the checksum was 0, it would be the case that appending a 0 to a valid
     // list of values would result in a new valid list. For that reason, Bech32 requires the
     // resulting checksum to be 1 instead. In Bech32m, this constant was amended.
-    uint32_t check = polymod(cat(expand_hrp(hrp), values));
+    uint32_t check = polymod(polymod_hrp(hrp), values, size);
     if (check == encoding_constant(Encoding::BECH32)) return Encoding::BECH32;
     if (check == encoding_constant(Encoding::BECH32M)) return Encoding::BECH32M;
     return Encoding::INVALID;
 }
 
+/** Create a checksum, continuing from the state after the hrp and the values. */
+void create_checksum(uint32_t state, Encoding encoding, uint8_t* out)
+{
+    static const uint8_t zeroes[6] = {};
+    uint32_t mod = polymod(state, zeroes, 6) ^ encoding_constant(encoding); // Determine what to XOR into those 6 zeroes.
+    for (size_t i = 0; i < 6; ++i) {
+        // Convert the 5-bit groups in mod to checksum values.
+        out[i] = (mod >> (5 * (5 - i))) & 31;
+    }
+}
+
+/** Map @size data part characters to their 5-bit values, noting whether lower and upper case
+ *  letters were seen. Returns false on a character outside of the charset. */
+bool map_data_scalar(const char* in, size_t size, uint8_t* out, bool* lower, bool* upper) {
+    for (size_t i = 0; i < size; ++i) {
+        unsigned char c = in[i];
+        if (c >= 'a' && c <= 'z') *lower = true;
+        else if (c >= 'A' && c <= 'Z') *upper = true;
+        int8_t rev = c < 128 ? CHARSET_REV[c] : -1;
+        if (rev == -1) return false;    // invalid character
+        out[i] = rev;
+    }
+    return true;
+}
+
+#ifdef CHARSET_X86
+
+/* The vector versions below classify, fold the case of and look up 16 or 32 characters at once.
+ * Once upper case letters are folded, every character of the charset has 3, 6 or 7 as its high
+ * nibble, so the lookup is three byte shuffles of 16-entry rows of CHARSET_REV, indexed by the
+ * low nibble and picked by the high one. Anything else, bytes above 127 included, maps to -1. */
+
+__attribute__((target("ssse3")))
+bool map_data_ssse3(const char* in, size_t size, uint8_t* out, bool* lower, bool* upper) {
+    const __m128i row3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(CHARSET_REV + 0x30));
+    const __m128i row6 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(CHARSET_REV + 0x60));
+    const __m128i row7 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(CHARSET_REV + 0x70));
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    __m128i lowers = _mm_setzero_si128(), uppers = _mm_setzero_si128(), invalid = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        // Signed compares: bytes above 127 are negative and fall in neither range.
+        const __m128i is_upper = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('Z' + 1)));
+        const __m128i is_lower = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('z' + 1)));
+        uppers = _mm_or_si128(uppers, is_upper);
+        lowers = _mm_or_si128(lowers, is_lower);
+        c = _mm_or_si128(c, _mm_and_si128(is_upper, _mm_set1_epi8(0x20)));
+        const __m128i lo = _mm_and_si128(c, nibble);
+        const __m128i hi = _mm_and_si128(_mm_srli_epi16(c, 4), nibble);
+        const __m128i in3 = _mm_cmpeq_epi8(hi, _mm_set1_epi8(3));
+        const __m128i in6 = _mm_cmpeq_epi8(hi, _mm_set1_epi8(6));
+        const __m128i in7 = _mm_cmpeq_epi8(hi, _mm_set1_epi8(7));
+        __m128i rev = _mm_or_si128(_mm_or_si128(_mm_and_si128(in3, _mm_shuffle_epi8(row3, lo)),
+                                                _mm_and_si128(in6, _mm_shuffle_epi8(row6, lo))),
+                                   _mm_and_si128(in7, _mm_shuffle_epi8(row7, lo)));
+        rev = _mm_or_si128(rev, _mm_andnot_si128(_mm_or_si128(_mm_or_si128(in3, in6), in7), _mm_set1_epi8(-1)));
+        invalid = _mm_or_si128(invalid, rev);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), rev);
+    }
+    // Invalid characters map to -1, so they show in the sign bits.
+    if (_mm_movemask_epi8(invalid)) return false;
+    *lower |= _mm_movemask_epi8(lowers) != 0;
+    *upper |= _mm_movemask_epi8(uppers) != 0;
+    return map_data_scalar(in + i, size - i, out + i, lower, upper);
+}
+
+__attribute__((target("avx2")))
+bool map_data_avx2(const char* in, size_t size, uint8_t* out, bool* lower, bool* upper) {
+    const __m256i row3 = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(CHARSET_REV + 0x30)));
+    const __m256i row6 = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(CHARSET_REV + 0x60)));
+    const __m256i row7 = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(CHARSET_REV + 0x70)));
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i lowers = _mm256_setzero_si256(), uppers = _mm256_setzero_si256(), invalid = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+        const __m256i is_upper = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('A' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), c));
+        const __m256i is_lower = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), c));
+        uppers = _mm256_or_si256(uppers, is_upper);
+        lowers = _mm256_or_si256(lowers, is_lower);
+        c = _mm256_or_si256(c, _mm256_and_si256(is_upper, _mm256_set1_epi8(0x20)));
+        const __m256i lo = _mm256_and_si256(c, nibble);
+        const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(c, 4), nibble);
+        const __m256i in3 = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(3));
+        const __m256i in6 = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(6));
+        const __m256i in7 = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(7));
+        __m256i rev = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(in3, _mm256_shuffle_epi8(row3, lo)),
+                                                      _mm256_and_si256(in6, _mm256_shuffle_epi8(row6, lo))),
+                                      _mm256_and_si256(in7, _mm256_shuffle_epi8(row7, lo)));
+        rev = _mm256_or_si256(rev, _mm256_andnot_si256(_mm256_or_si256(_mm256_or_si256(in3, in6), in7), _mm256_set1_epi8(-1)));
+        invalid = _mm256_or_si256(invalid, rev);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), rev);
+    }
+    if (_mm256_movemask_epi8(invalid)) return false;
+    *lower |= _mm256_movemask_epi8(lowers) != 0;
+    *upper |= _mm256_movemask_epi8(uppers) != 0;
+    return map_data_ssse3(in + i, size - i, out + i, lower, upper);
+}
+
+#endif  // CHARSET_X86
+
 } // namespace
 
-/** Decode a Bech32 or Bech32m string. */
-DecodeResult decode(const std::string& str) {
+/** SSE2 alone has no byte shuffle to do the lookup in registers with, so it gets the scalar version. */
+MapImpl map_best() {
+#ifdef CHARSET_X86
+    static const MapImpl best = []() {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) return MapImpl::AVX2;
+        if (__builtin_cpu_supports("ssse3")) return MapImpl::SSSE3;
+        return MapImpl::SCALAR;
+    }();
+    return best;
+#else
+    return MapImpl::SCALAR;
+#endif
+}
+
+bool map_data(const char* in, size_t size, uint8_t* out, bool* lower, bool* upper, MapImpl impl) {
+#ifdef CHARSET_X86
+    if (impl == MapImpl::AVX2) return map_data_avx2(in, size, out, lower, upper);
+    if (impl == MapImpl::SSSE3) return map_data_ssse3(in, size, out, lower, upper);
+#else
+    (void)impl;
+#endif
+    return map_data_scalar(in, size, out, lower, upper);
+}
+
+/** Decode a Bech32 or Bech32m string into caller-provided storage. */
+Encoding decode(std::string_view str, DecodeBuffer& out) {
+    out.encoding = Encoding::INVALID;
+    out.hrp_size = 0;
+    out.data_size = 0;
+    out.malformed = true;
+    // if (str.size() > 90 || pos == str.npos || pos == 0 || pos + 7 > str.size()) {
+    // the limit of 90 does no make sense to lightning invoice
+    // The hrp ends at the last "1". A "1" is not in the charset of the data part and the caller's
+    // storage bounds the hrp, so only the first MAX_HRP_SIZE + 1 characters need to be searched:
+    // any later "1" is rejected by the charset check, as is a separator that comes too late.
+    size_t pos = str.substr(0, DecodeBuffer::MAX_HRP_SIZE + 1).rfind('1');    // final do hrp
+    // test if the "1"" was encontered or it is at the position 0 or the string is too short
+    if (pos == str.npos || pos == 0 || pos + 7 > str.size()) {
+        return Encoding::INVALID;
+    }
+    if (str.size() - 1 - pos > DecodeBuffer::MAX_DATA_SIZE) {
+        return Encoding::INVALID;
+    }
     bool lower = false, upper = false;
-    for (size_t i = 0; i < str.size(); ++i) {
+    for (size_t i = 0; i < pos; ++i) {
         unsigned char c = str[i];
         if (c >= 'a' && c <= 'z') lower = true;
         else if (c >= 'A' && c <= 'Z') upper = true;
-        else if (c < 33 || c > 126) return {};          // not a valid character
+        else if (c < 33 || c > 126) return Encoding::INVALID;    // not a valid character
+        out.hrp[i] = lc(c);
     }
-    if (lower && upper) return {};                      // Uper case and lower case at the same string
-    size_t pos = str.rfind('1');                        // final do hrp 
-    // if (str.size() > 90 || pos == str.npos || pos == 0 || pos + 7 > str.size()) {
-    // the limit of 90 does no make sense to lightning invoice
-    // test if the "1"" was encontered or it is at the position 0 or the string is too short
-    if (pos == str.npos || pos == 0 || pos + 7 > str.size()) {
-        return {};
+    // One pass over the data part validates, folds and maps it.
+    size_t size = str.size() - 1 - pos;
+    if (!map_data(str.data() + pos + 1, size, out.data, &lower, &upper)) {
+        return Encoding::INVALID;       // invalid character
+    }
+    if (lower && upper) return Encoding::INVALID;                // Uper case and lower case at the same string
+    out.malformed = false;
+    Encoding result = verify_checksum(std::string_view(out.hrp, pos), out.data, size);
+    if (result == Encoding::INVALID) return Encoding::INVALID;
+    out.encoding = result;
+    out.hrp_size = pos;
+    out.data_size = size - 6;
+    return result;
+}
+
+/** Finish a Bech32 or Bech32m string in place. */
+size_t encode_in_place(char* out, size_t hrp_size, size_t size, Encoding encoding) {
+    // BIP-173 and BIP350 require an encoder to return a lowercase Bech32/Bech32m string, but if
+    // given an uppercase HRP, the result will always be invalid.
+    for (size_t i = 0; i < hrp_size; ++i) assert(out[i] < 'A' || out[i] > 'Z');
+    assert(out[hrp_size] == '1');
+    uint8_t* values = reinterpret_cast<uint8_t*>(out + hrp_size + 1);
+    const uint32_t state = polymod(polymod_hrp(std::string_view(out, hrp_size)), values, size);
+    create_checksum(state, encoding, values + size);
+    for (size_t i = 0; i < size + 6; ++i) {
+        values[i] = CHARSET[values[i]];
     }
-    data values(str.size() - 1 - pos);
-    for (size_t i = 0; i < str.size() - 1 - pos; ++i) {
-        unsigned char c = str[i + pos + 1];
-        int8_t rev = CHARSET_REV[c];
+    return hrp_size + 1 + size + 6;
+}
 
-        if (rev == -1) {
-            return {};              // invalid character 
+/** Encode a Bech32 or Bech32m string. */
+std::string encode(const std::string& hrp, const std::vector<uint8_t>& values, Encoding encoding) {
+    std::string ret = hrp + '1';
+    ret.reserve(ret.size() + values.size() + 6);
+    ret.append(values.begin(), values.end());
+    ret.resize(ret.size() + 6);
+    encode_in_place(&ret[0], hrp.size(), values.size(), encoding);
+    return ret;
+}
+
+/** Decode a Bech32 or Bech32m string. */
+DecodeResult decode(const std::string& str) {
+    DecodeBuffer buf;
+    if (decode(std::string_view(str), buf) == Encoding::INVALID) return {};
+    return {buf.encoding, std::string(buf.hrp_view()), data(buf.data, buf.data + buf.data_size)};
+}
+
+void StreamDecoder::reset() {
+    head_size = 0;
+    hrp_size = 0;
+    data_size = 0;
+    state = 1;
+    resolved = false;
+    lower = upper = failed = false;
+}
+
+/** Split the first characters into the hrp and the first data part values. */
+bool StreamDecoder::resolve(uint8_t* values, size_t* size) {
+    const size_t pos = std::string_view(head, head_size).rfind('1');
+    if (pos == std::string_view::npos || pos == 0) return fail();
+    for (size_t i = 0; i < pos; ++i) head[i] = lc(head[i]);
+    hrp_size = pos;
+    state = polymod_hrp(hrp_view());
+    resolved = true;
+    return map(std::string_view(head + pos + 1, head_size - pos - 1), values, size);
+}
+
+/** Map data part characters to values, hand them out and fold them into the checksum. */
+bool StreamDecoder::map(std::string_view chars, uint8_t* values, size_t* size) {
+    if (data_size + chars.size() > DecodeBuffer::MAX_DATA_SIZE) return fail();
+    uint8_t* out = values + *size;
+    if (!map_data(chars.data(), chars.size(), out, &lower, &upper)) return fail();
+    if (lower && upper) return fail();
+    state = polymod(state, out, chars.size());
+    data_size += chars.size();
+    *size += chars.size();
+    return true;
+}
+
+bool StreamDecoder::push(std::string_view piece, uint8_t* values, size_t* size) {
+    *size = 0;
+    if (failed) return false;
+    size_t i = 0;
+    if (!resolved) {
+        for (; i < piece.size() && head_size < sizeof(head); ++i) {
+            unsigned char c = piece[i];
+            if (c >= 'a' && c <= 'z') lower = true;
+            else if (c >= 'A' && c <= 'Z') upper = true;
+            else if (c < 33 || c > 126) return fail();  // not a valid character
+            if (lower && upper) return fail();
+            head[head_size++] = c;
         }
-        values[i] = rev;
+        // Any "1" after the first MAX_HRP_SIZE + 1 characters is refused by the charset.
+        if (i == piece.size()) return true;
+        if (!resolve(values, size)) return false;
     }
-    std::string hrp;
-    for (size_t i = 0; i < pos; ++i) {
-        hrp += lc(str[i]);
+    return map(piece.substr(i), values, size);
+}
+
+Encoding StreamDecoder::finish(uint8_t* values, size_t* size) {
+    *size = 0;
+    if (failed) return Encoding::INVALID;
+    if (!resolved && !resolve(values, size)) return Encoding::INVALID;
+    if (data_size < 6) {
+        fail();
+        return Encoding::INVALID;
     }
-    Encoding result = verify_checksum(hrp, values);
-    if (result == Encoding::INVALID) return {};
-    return {result, std::move(hrp), data(values.begin(), values.end() - 6)};
+    if (state == encoding_constant(Encoding::BECH32)) return Encoding::BECH32;
+    if (state == encoding_constant(Encoding::BECH32M)) return Encoding::BECH32M;
+    return Encoding::INVALID;
 }
 
 } // namespace bech32
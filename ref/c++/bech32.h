@@ -23,9 +23,11 @@
 #define BECH32_H_ 1
 
 #include <string>
+#include <string_view>
 #include <tuple>
 #include <vector>
 
+#include <stddef.h>
 #include <stdint.h>
 
 namespace bech32
@@ -49,9 +51,99 @@ struct DecodeResult
     DecodeResult(Encoding enc, std::string&& h, std::vector<uint8_t>&& d) : encoding(enc), hrp(std::move(h)), data(std::move(d)) {}
 };
 
+/** Encode a Bech32 or Bech32m string. If hrp contains uppercase characters, this will cause an
+ *  assertion error. Encoding must be one of BECH32 or BECH32M. */
+std::string encode(const std::string& hrp, const std::vector<uint8_t>& values, Encoding encoding);
+
+/** Finish a Bech32 or Bech32m string in place, without allocating. @out holds the lower case hrp,
+ *  "1" and then @size 5-bit values, with room for 6 more. The checksum is appended and the values
+ *  are mapped to their characters. Returns the length of the string. */
+size_t encode_in_place(char* out, size_t hrp_size, size_t size, Encoding encoding);
+
+/** The implementations of mapping data part characters to their 5-bit values below. */
+enum class MapImpl {
+    SCALAR,  //! One character at a time through a 128-entry table
+    SSSE3,   //! 16 characters per step, looked up with byte shuffles
+    AVX2,    //! 32 characters per step, the same way; SSSE3 for the tail
+};
+
+/** The fastest implementation this CPU supports, detected once. */
+MapImpl map_best();
+
+/** Map @size data part characters to their 5-bit values at @out, case folded, noting whether lower
+ *  and upper case letters were seen in @lower and @upper. Returns false on a character outside of
+ *  the charset; @out and the flags are then unspecified. */
+bool map_data(const char* in, size_t size, uint8_t* out, bool* lower, bool* upper, MapImpl impl = map_best());
+
+/** Caller-owned storage for decoding without heap allocation. Can be reused across calls. */
+struct DecodeBuffer
+{
+    static constexpr size_t MAX_HRP_SIZE = 83;    //!< Longest human readable part accepted
+    static constexpr size_t MAX_DATA_SIZE = 7089; //!< Most 5-bit values accepted, checksum included
+
+    Encoding encoding;             //!< What encoding was detected in the result; Encoding::INVALID if failed.
+    size_t hrp_size;               //!< Number of characters in hrp
+    size_t data_size;              //!< Number of 5-bit values in data, excluding the checksum
+    char hrp[MAX_HRP_SIZE];        //!< The human readable part, lower cased
+    uint8_t data[MAX_DATA_SIZE];   //!< The payload, followed by the 6 checksum values
+    bool malformed;                //!< Whether the string was refused for anything but its checksum
+
+    DecodeBuffer() : encoding(Encoding::INVALID), hrp_size(0), data_size(0), malformed(false) {}
+
+    std::string_view hrp_view() const { return std::string_view(hrp, hrp_size); }
+};
+
+/** Decode a Bech32 or Bech32m string into caller-provided storage, without allocating.
+ *  Returns the detected encoding; Encoding::INVALID if failed or the input does not fit. */
+Encoding decode(std::string_view str, DecodeBuffer& out);
+
 /** Decode a Bech32 or Bech32m string. */
 DecodeResult decode(const std::string& str);
 
+/** Decodes a Bech32 or Bech32m string that arrives in pieces, with the same rules as decode().
+ *  Between pieces it keeps the checksum state, the case seen so far and the first characters,
+ *  which hold the hrp: it ends at the last "1" among the first MAX_HRP_SIZE + 1 characters, so
+ *  the data part values are handed out from then on, as soon as their piece is pushed. */
+class StreamDecoder
+{
+public:
+    /** Room push() needs for the values of a piece of @size characters. */
+    static constexpr size_t max_values(size_t size) { return size + DecodeBuffer::MAX_HRP_SIZE + 1; }
+
+    StreamDecoder() { reset(); }
+
+    /** Start a new string. */
+    void reset();
+
+    /** Feed the next @piece. The data part values it completes, checksum values included, are
+     *  written to @values, with room for max_values(piece.size()), and counted in @size. Returns
+     *  false once the string is known to be malformed. */
+    bool push(std::string_view piece, uint8_t* values, size_t* size);
+
+    /** End the string, writing the values still held back as push() does. Returns the encoding;
+     *  Encoding::INVALID if the string is malformed or its checksum does not hold. */
+    Encoding finish(uint8_t* values, size_t* size);
+
+    /** Whether the string was refused for anything but its checksum. */
+    bool malformed() const { return failed; }
+
+    /** The hrp, lower cased, once it is known: when the first values are handed out. */
+    std::string_view hrp_view() const { return std::string_view(head, hrp_size); }
+
+private:
+    bool fail() { failed = true; return false; }
+    bool resolve(uint8_t* values, size_t* size);
+    bool map(std::string_view chars, uint8_t* values, size_t* size);
+
+    char head[DecodeBuffer::MAX_HRP_SIZE + 1];  //!< The first characters; the hrp once resolved
+    size_t head_size;
+    size_t hrp_size;
+    size_t data_size;              //!< Values handed out so far
+    uint32_t state;                //!< Checksum state after the hrp and the values handed out
+    bool resolved;                 //!< Whether the hrp is known
+    bool lower, upper, failed;
+};
+
 }  // namespace bech32
 
 #endif  // BECH32_H_
@@ -0,0 +1,99 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdio.h>
+
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "convertbits.h"
+
+/* Throughput of the 5-bit <-> 8-bit regrouping: convertbits against every implementation this CPU
+ * supports, over the payload sizes of a hash, a signature and the longest field. */
+
+namespace
+{
+
+template <typename F>
+double ns_per_call(F f, size_t iterations) {
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i) f();
+    const auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+}
+
+void report(const char* name, size_t values, double ns) {
+    printf("  %-12s %8.1f ns/call %8.2f values/ns\n", name, ns, values / ns);
+}
+
+}
+
+int main(void) {
+    const size_t iterations = 200000;
+    const bech32::RegroupImpl impls[] = {bech32::RegroupImpl::SCALAR, bech32::RegroupImpl::BMI2, bech32::RegroupImpl::AVX2};
+    const char* names[] = {"scalar", "bmi2", "avx2"};
+    const size_t best = static_cast<size_t>(bech32::regroup_best());
+    std::mt19937 rng(0);
+    volatile uint8_t sink = 0;
+
+    for (size_t values : {52, 104, 1023}) {
+        std::vector<uint8_t> five(values);
+        for (auto& v : five) v = rng() % 32;
+        five.back() &= 0x10;                                    // keep the padding bits zero
+        std::vector<uint8_t> bytes((values * 5 + 7) / 8);
+
+        printf("5 -> 8, %zu values\n", values);
+        report("convertbits", values, ns_per_call([&]() {
+            std::vector<uint8_t> out;
+            bech32::convertbits(false, 5, 8, out, five);
+            sink = sink + out[0];
+        }, iterations));
+        for (size_t i = 0; i <= best; ++i) {
+            report(names[i], values, ns_per_call([&]() {
+                size_t size;
+                bech32::regroup_5to8(five.data(), five.size(), false, bytes.data(), &size, impls[i]);
+                sink = sink + bytes[0];
+            }, iterations));
+        }
+
+        size_t size;
+        bech32::regroup_5to8(five.data(), five.size(), false, bytes.data(), &size);
+        bytes.resize(size);
+        std::vector<uint8_t> back((bytes.size() * 8 + 4) / 5);
+        const std::vector<uint8_t> in(bytes);
+        printf("8 -> 5, %zu bytes\n", bytes.size());
+        report("convertbits", bytes.size(), ns_per_call([&]() {
+            std::vector<uint8_t> out;
+            bech32::convertbits(true, 8, 5, out, in);
+            sink = sink + out[0];
+        }, iterations));
+        for (size_t i = 0; i <= best && i <= 1; ++i) {
+            report(names[i], bytes.size(), ns_per_call([&]() {
+                size_t size;
+                bech32::regroup_8to5(in.data(), in.size(), true, back.data(), &size, impls[i]);
+                sink = sink + back[0];
+            }, iterations));
+        }
+    }
+    return 0;
+}
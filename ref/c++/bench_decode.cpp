@@ -0,0 +1,260 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bech32.h"
+#include "convertbits.h"
+#include "hint_arena.h"
+#include "payment_request.h"
+#include "recovery_cache.h"
+#include "stream_decoder.h"
+#include "test_vectors.h"
+
+/* Cost of each stage of decoding an invoice, per corpus: the valid and the invalid test vectors,
+ * and synthesized long invoices with a full description and three route fields of twelve hops.
+ * The checksum (polymod) is timed through encode_in_place, which copies the data part and maps it
+ * to characters too. The field parsing shows as the difference between the unchecked decode and
+ * bech32::decode. The stream decoder is fed 64 characters at a time, as from a socket. Each figure
+ * is the best of several runs. */
+
+namespace
+{
+
+size_t allocations = 0;
+
+}
+
+/* Once these are inlined, GCC sees free() on memory from operator new and warns, not knowing that
+ * this operator new is malloc(). */
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t size) {
+    allocations++;
+    void* p = malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+namespace
+{
+
+struct corpus {
+    const char* name;
+    std::vector<std::string> invoices;
+    size_t bytes = 0;                                   // summed over the invoices
+    bool valid;                                         // every invoice decodes
+
+    /* The bech32 decoding of each invoice, for the stages that start from it. */
+    std::vector<bech32::DecodeBuffer> decoded;
+    std::vector<std::vector<uint8_t> > fields;          // the data part before the signature
+};
+
+void push_uint(std::vector<uint8_t>& values, uint64_t value, size_t width) {
+    for (size_t i = width; i-- > 0; ) values.push_back((value >> (i * 5)) & 31);
+}
+
+void push_field(std::vector<uint8_t>& values, uint8_t type, const std::vector<uint8_t>& payload) {
+    std::vector<uint8_t> regrouped;
+    bech32::convertbits(true, 8, 5, regrouped, payload);
+    values.push_back(type);
+    push_uint(values, regrouped.size(), 2);
+    values.insert(values.end(), regrouped.begin(), regrouped.end());
+}
+
+std::vector<uint8_t> random_bytes(std::mt19937& rng, size_t size) {
+    std::vector<uint8_t> out(size);
+    for (auto& b : out) b = rng();
+    return out;
+}
+
+/* An invoice as long as the format allows in practice. It has no n field and a random signature,
+ * which is redrawn until a key can be recovered from it. */
+std::string long_invoice(std::mt19937& rng) {
+    std::vector<uint8_t> values;
+    push_uint(values, 1496314658, 7);
+    push_field(values, 1, random_bytes(rng, 32));               // p
+    push_field(values, 16, random_bytes(rng, 32));              // s
+    std::vector<uint8_t> description(639);
+    for (size_t i = 0; i < description.size(); ++i) description[i] = "lightning invoice "[i % 18];
+    push_field(values, 13, description);                        // d
+    for (int route = 0; route < 3; ++route) {
+        std::vector<uint8_t> hops;
+        for (int hop = 0; hop < 12; ++hop) {
+            std::vector<uint8_t> h = random_bytes(rng, 51);     // pubkey, scid, fees, cltv delta
+            h[0] = 2;
+            hops.insert(hops.end(), h.begin(), h.end());
+        }
+        push_field(values, 3, hops);                            // r
+    }
+    const size_t sig_at = values.size();
+    for (;;) {
+        values.resize(sig_at);
+        std::vector<uint8_t> sig = random_bytes(rng, 65);
+        sig[64] %= 2;
+        std::vector<uint8_t> regrouped;
+        bech32::convertbits(true, 8, 5, regrouped, sig);
+        values.insert(values.end(), regrouped.begin(), regrouped.end());
+        std::string invoice = bech32::encode("lnbc2500u", values, bech32::Encoding::BECH32);
+        payment_request::bolt11 out;
+        if (payment_request::decode(invoice, out) == 0) return invoice;
+    }
+}
+
+void prepare(corpus& c) {
+    for (const auto& invoice : c.invoices) {
+        c.bytes += invoice.size();
+        c.decoded.emplace_back();
+        bech32::DecodeBuffer& dec = c.decoded.back();
+        bech32::decode(invoice, dec);
+        const size_t size = dec.data_size >= 104 ? dec.data_size - 104 : 0;
+        c.fields.emplace_back(dec.data, dec.data + size);
+    }
+}
+
+/* Calls @f on each invoice of @c in turn, over and over, and reports the best time per call and
+ * the allocations per call. */
+template <typename F>
+void measure(const corpus& c, const char* name, F f) {
+    const size_t count = c.invoices.size();
+    for (size_t i = 0; i < count; ++i) f(i);
+    double best = 1e300;
+    size_t allocated = 0;
+    for (int run = 0; run < 5; ++run) {
+        size_t calls = 0;
+        const size_t allocations_before = allocations;
+        const auto start = std::chrono::steady_clock::now();
+        std::chrono::duration<double, std::nano> elapsed;
+        do {
+            for (size_t i = 0; i < count; ++i) f(i);
+            calls += count;
+            elapsed = std::chrono::steady_clock::now() - start;
+        } while (elapsed.count() < 2e7);
+        best = std::min(best, elapsed.count() / calls);
+        allocated = (allocations - allocations_before) / (calls / count);
+    }
+    const double ns = best;
+    printf("  %-28s %10.1f ns/invoice %8.1f MB/s %6.1f allocs/call\n", name, ns,
+        1e3 * c.bytes / count / ns, (double)allocated / count);
+}
+
+void run(corpus& c) {
+    prepare(c);
+    printf("%s: %zu invoices, %zu bytes on average\n", c.name, c.invoices.size(), c.bytes / c.invoices.size());
+    volatile size_t sink = 0;
+    bech32::DecodeBuffer dec;
+    measure(c, "bech32::decode (buffer)", [&](size_t i) {
+        sink = sink + (size_t)bech32::decode(c.invoices[i], dec);
+    });
+    measure(c, "bech32::decode (string)", [&](size_t i) {
+        sink = sink + bech32::decode(c.invoices[i]).data.size();
+    });
+    if (c.valid) {
+        std::vector<char> scratch(bech32::DecodeBuffer::MAX_HRP_SIZE + 1 + bech32::DecodeBuffer::MAX_DATA_SIZE);
+        measure(c, "polymod (encode_in_place)", [&](size_t i) {
+            const bech32::DecodeBuffer& d = c.decoded[i];
+            std::copy(d.hrp, d.hrp + d.hrp_size, scratch.data());
+            scratch[d.hrp_size] = '1';
+            std::copy(d.data, d.data + d.data_size, scratch.data() + d.hrp_size + 1);
+            sink = sink + bech32::encode_in_place(scratch.data(), d.hrp_size, d.data_size, d.encoding);
+        });
+        measure(c, "convertbits 5->8", [&](size_t i) {
+            std::vector<uint8_t> out;
+            bech32::convertbits(true, 5, 8, out, c.fields[i]);
+            sink = sink + out.size();
+        });
+        std::vector<uint8_t> bytes(bech32::DecodeBuffer::MAX_DATA_SIZE);
+        measure(c, "regroup_5to8", [&](size_t i) {
+            size_t size;
+            bech32::regroup_5to8(c.fields[i].data(), c.fields[i].size(), true, bytes.data(), &size);
+            sink = sink + size;
+        });
+    }
+    payment_request::bolt11 out;
+    payment_request::signing_data signed_data;
+    measure(c, "decode (unchecked)", [&](size_t i) {
+        sink = sink + payment_request::decode(c.invoices[i], out, signed_data);
+    });
+    payment_request::hint_arena hints;
+    measure(c, "decode (unchecked, hints)", [&](size_t i) {
+        hints.clear();
+        sink = sink + payment_request::decode(c.invoices[i], out, signed_data, &hints);
+    });
+    measure(c, "decode", [&](size_t i) {
+        sink = sink + payment_request::decode(c.invoices[i], out);
+    });
+    payment_request::stream_decoder stream(out);
+    measure(c, "decode (stream, 64B chunks)", [&](size_t i) {
+        const std::string_view invoice = c.invoices[i];
+        stream.reset();
+        int status = 0;
+        for (size_t pos = 0; pos < invoice.size() && status == 0; pos += 64) status = stream.push(invoice.substr(pos, 64));
+        sink = sink + (status == 0 ? stream.finish() : status);
+    });
+    payment_request::recovery_cache cache;
+    measure(c, "decode (recovery_cache)", [&](size_t i) {
+        sink = sink + payment_request::decode(c.invoices[i], out, cache);
+    });
+    measure(c, "decode (std::string)", [&](size_t i) {
+        sink = sink + payment_request::decode(c.invoices[i]).first;
+    });
+}
+
+}
+
+int main(void) {
+    corpus valid{"valid test vectors", {}, 0, true, {}, {}};
+    for (const auto& input : valid_invoice) valid.invoices.push_back(input.bech32_data);
+    corpus invalid{"invalid test vectors", {}, 0, false, {}, {}};
+    for (const auto& input : invalid_invoice) invalid.invoices.push_back(input.bech32_data);
+    corpus long_invoices{"long invoices", {}, 0, true, {}, {}};
+    std::mt19937 rng(0);
+    for (int i = 0; i < 16; ++i) long_invoices.invoices.push_back(long_invoice(rng));
+
+    run(valid);
+    run(invalid);
+    run(long_invoices);
+    return 0;
+}
@@ -0,0 +1,105 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdio.h>
+
+#include <chrono>
+#include <functional>
+#include <random>
+#include <vector>
+
+#include "batch_decode.h"
+#include "invoice_filter.h"
+
+/* Throughput of filtering a million decoded invoices on every condition at once, for each filter
+ * implementation this CPU supports and for a test of each row through a std::function, over the
+ * bytes of the columns read. Each figure is the best of several runs. */
+
+namespace
+{
+
+template <typename F>
+double best_ns(F f) {
+    double best = 1e300;
+    for (int run = 0; run < 5; ++run) {
+        const auto start = std::chrono::steady_clock::now();
+        f();
+        best = std::min(best, std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+void report(const char* name, size_t rows, size_t selected, double ns) {
+    /* status, amount, timestamp, expiry, cltv, network and features */
+    const size_t bytes = rows * (1 + 8 + 8 + 8 + 4 + 1 + 8);
+    printf("  %-16s %8.3f ns/row %8.2f GB/s %8zu selected\n", name, ns / rows, bytes / ns, selected);
+}
+
+}
+
+int main(void) {
+    const size_t count = 1 << 20;
+    payment_request::decoded_batch rows;
+    rows.resize(count);
+    std::mt19937_64 rng(0);
+    for (size_t i = 0; i < count; ++i) {
+        rows.status[i] = rng() % 16 == 0 ? -1 : 0;
+        rows.amount_msat[i] = rng() % 10000000;
+        rows.timestamp[i] = 1700000000 + rng() % 1000000;
+        rows.expiry[i] = 3600 + rng() % 86400;
+        rows.min_final_cltv_expiry[i] = 18 + rng() % 200;
+        rows.network[i] = rng() % payment_request::NETWORK_COUNT;
+        rows.features[i] = (uint64_t{1} << 8) | (rng() % 2 ? uint64_t{1} << 14 : 0);
+    }
+    payment_request::invoice_filter filter;
+    filter.min_amount = 1000;
+    filter.max_amount = 9000000;
+    filter.min_expires_at = 1700050000;
+    filter.min_final_cltv_expiry = 20;
+    filter.max_final_cltv_expiry = 200;
+    filter.networks = 1 | 2;
+    filter.required_features = uint64_t{1} << 14;
+
+    std::vector<uint64_t> selection(payment_request::compiled_filter::selection_words(count));
+    const char* names[] = {"scalar", "avx2"};
+    printf("filter, %zu rows\n", count);
+    for (int impl = 0; impl <= static_cast<int>(payment_request::filter_best()); ++impl) {
+        const payment_request::compiled_filter compiled(filter, static_cast<payment_request::filter_impl>(impl));
+        size_t selected = 0;
+        const double ns = best_ns([&]() { selected = compiled.select(rows, selection.data()); });
+        report(names[impl], count, selected, ns);
+    }
+    const std::function<bool(size_t)> test = [&](size_t i) {
+        const uint64_t expires_at = rows.timestamp[i] + rows.expiry[i];
+        return rows.status[i] == 0 && rows.amount_msat[i] >= filter.min_amount && rows.amount_msat[i] <= filter.max_amount &&
+            expires_at >= filter.min_expires_at && rows.min_final_cltv_expiry[i] >= filter.min_final_cltv_expiry &&
+            rows.min_final_cltv_expiry[i] <= filter.max_final_cltv_expiry && ((filter.networks >> rows.network[i]) & 1) &&
+            (rows.features[i] & filter.required_features) == filter.required_features;
+    };
+    size_t selected = 0;
+    const double ns = best_ns([&]() {
+        selected = 0;
+        for (size_t i = 0; i < count; ++i) selected += test(i);
+    });
+    report("std::function", count, selected, ns);
+    return 0;
+}
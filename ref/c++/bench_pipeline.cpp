@@ -0,0 +1,97 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "batch_decode.h"
+#include "decode_pipeline.h"
+#include "test_vectors.h"
+
+/* Throughput of decoding the valid test vectors over and over: with decode_batch, and through a
+ * decode_pipeline with one worker per stage, then with the extra cores on the signature stage.
+ * For the pipeline it shows where the time goes, by stage, and how deep the queues got. Each
+ * figure is the best of several runs. */
+
+namespace
+{
+
+void discard(const std::string_view*, const payment_request::bolt11*, const int*, size_t, void*) {}
+
+template <typename F>
+double best_ns(F f) {
+    double best = 1e300;
+    for (int run = 0; run < 3; ++run) {
+        const auto start = std::chrono::steady_clock::now();
+        f();
+        best = std::min(best, std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+void run_pipeline(const char* name, const payment_request::pipeline_config& config, const std::vector<std::string_view>& invoices) {
+    payment_request::pipeline_metrics metrics;
+    const double ns = best_ns([&]() {
+        payment_request::decode_pipeline pipeline(config, discard);
+        pipeline.submit(invoices.data(), invoices.size());
+        pipeline.flush();
+        metrics = pipeline.metrics();
+    });
+    printf("  %-24s %8.0f invoices/s %6llu submit waits\n", name, 1e9 * invoices.size() / ns,
+           (unsigned long long)metrics.submit_waits);
+    uint64_t busy = 0;
+    for (uint64_t stage_ns : metrics.busy_ns) busy += stage_ns;
+    for (size_t s = 0; s < payment_request::PIPELINE_STAGES; ++s) {
+        printf("    %-10s %2u workers %5.1f%% of the work %3zu deepest queue\n",
+               payment_request::name(static_cast<payment_request::pipeline_stage>(s)), config.workers[s],
+               100.0 * metrics.busy_ns[s] / busy, metrics.max_depth[s]);
+    }
+}
+
+}
+
+int main(void) {
+    std::vector<std::string> storage;
+    for (int round = 0; round < 2000; ++round) {
+        for (const auto& input : valid_invoice) storage.push_back(input.bech32_data);
+    }
+    std::vector<std::string_view> invoices(storage.begin(), storage.end());
+    const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    printf("pipeline, %zu invoices, %u cores\n", invoices.size(), cores);
+
+    payment_request::decoded_batch out;
+    const double batch_ns = best_ns([&]() { payment_request::decode_batch(invoices.data(), invoices.size(), out, cores); });
+    printf("  %-24s %8.0f invoices/s\n", "decode_batch", 1e9 * invoices.size() / batch_ns);
+
+    payment_request::pipeline_config config;
+    run_pipeline("pipeline 1/1/1/1", config, invoices);
+    if (cores > 4) {
+        config.workers[3] = cores - 3;
+        char name[32];
+        snprintf(name, sizeof(name), "pipeline 1/1/1/%u", config.workers[3]);
+        run_pipeline(name, config, invoices);
+    }
+    return 0;
+}
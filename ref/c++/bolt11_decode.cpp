@@ -0,0 +1,421 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "batch_decode.h"
+#include "decode_stats.h"
+#include "hrp.h"
+#include "payment_request.h"
+#include "recovery_cache.h"
+
+/* Decodes a file of invoices, one per line, and writes what each holds as JSON lines, CSV or
+ * fixed-size binary records, in the order of the input, with a summary on stderr. The input is
+ * mapped rather than read when it is a file, and lines are decoded in place, so the only copy of
+ * an invoice is the one the kernel makes into the page cache. Chunks of lines are decoded across
+ * all cores with decode_batch, then formatted across them too, each thread into its own buffer,
+ * and written in order. Signatures are checked through a recovery_cache, as logs tend to repeat
+ * invoices. Blank lines are skipped; line numbers count them.
+ *
+ *   bolt11_decode [-f json|csv|binary] [-t threads] [-u] [-o output] [input]
+ *
+ * With no input, or "-", invoices are read from stdin. -t takes 1 to 1024 threads; the default is
+ * one per core. -u skips the signature check, which is most of the cost of a decode; receiver_id
+ * is then only set from an n field. Reject reasons come from the decode stats, so a build with
+ * NO_DECODE_STATS reports them all as "none". */
+
+namespace
+{
+
+/* Lines decoded at once: enough to keep every core busy, few enough to start writing early. */
+const size_t CHUNK_LINES = 1 << 16;
+/* What is read from stdin at once. */
+const size_t READ_SIZE = 1 << 24;
+/* The most threads -t takes. */
+const unsigned MAX_THREADS = 1024;
+
+enum class output_format { JSON, CSV, BINARY };
+
+/* The binary format: this header, then one record per invoice line. Integers are little endian. */
+struct binary_header {
+    char magic[8];                                  // "BOLT11D\0"
+    uint32_t version;
+    uint32_t record_size;
+};
+
+struct binary_record {
+    uint64_t line;                                  // from 1
+    uint64_t amount_msat;
+    uint64_t timestamp;
+    uint64_t expiry;
+    uint64_t features;
+    uint32_t min_final_cltv_expiry;
+    int8_t status;                                  // 0 if decoded, -1 if rejected; the fields are 0 then
+    uint8_t reason;                                 // a reject_reason, NONE if decoded
+    uint8_t network;                                // index into NETWORK_PREFIXES
+    uint8_t reserved1;
+    unsigned char payment_hash[32];
+    unsigned char receiver_id[33];
+    unsigned char reserved2[15];
+};
+
+static_assert(sizeof(binary_record) == 128, "binary_record is part of the output format");
+
+struct options {
+    output_format format = output_format::JSON;
+    unsigned threads = 0;
+    bool unchecked = false;
+    const char* input = NULL;
+    const char* output = NULL;
+};
+
+/* The lines of a chunk, in place in the input, and what they decoded to. */
+struct chunk {
+    std::vector<std::string_view> invoices;
+    std::vector<uint64_t> lines;
+    payment_request::decoded_batch decoded;
+    std::vector<payment_request::reject_reason> reasons;
+    std::vector<std::string> formatted;             // one per thread
+    payment_request::recovery_cache cache;
+};
+
+struct totals {
+    uint64_t lines = 0;
+    uint64_t invoices = 0;
+    uint64_t bytes = 0;
+    uint64_t rejected[static_cast<size_t>(payment_request::reject_reason::COUNT)] = {};
+};
+
+/* Run @f(begin, end, thread) over @count rows split into @threads ranges, the calling thread
+ * taking the first. */
+template <typename F>
+void parallel_for(size_t count, unsigned threads, F f) {
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t) pool.emplace_back(f, count * t / threads, count * (t + 1) / threads, t);
+    f(0, count / threads, 0);
+    for (auto& thread : pool) thread.join();
+}
+
+void append_uint(std::string& out, uint64_t value) {
+    char digits[20];
+    const auto end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+    out.append(digits, end);
+}
+
+void append_hex(std::string& out, const unsigned char* data, size_t size) {
+    static const char DIGITS[] = "0123456789abcdef";
+    for (size_t i = 0; i < size; ++i) {
+        out += DIGITS[data[i] >> 4];
+        out += DIGITS[data[i] & 15];
+    }
+}
+
+/* Decode rows @begin to @end without checking signatures, as decode_batch does with them. */
+void decode_unchecked(chunk& c, size_t begin, size_t end) {
+    payment_request::bolt11 invoice;
+    payment_request::signing_data signed_data;
+    payment_request::decoded_batch& out = c.decoded;
+    for (size_t i = begin; i < end; ++i) {
+        const bool valid = payment_request::decode(c.invoices[i], invoice, signed_data) == 0;
+        out.status[i] = valid ? 0 : -1;
+        out.amount_msat[i] = valid ? invoice.sat_amount : 0;
+        out.timestamp[i] = valid ? invoice.timestamp : 0;
+        out.expiry[i] = valid ? invoice.expiry : 0;
+        out.min_final_cltv_expiry[i] = valid ? invoice.min_final_cltv_expiry : 0;
+        out.network[i] = valid ? invoice.network : 0;
+        out.features[i] = valid ? invoice.features : 0;
+        out.signing_hash[i].fill(0);
+        if (valid) std::copy(invoice.payment_hash, invoice.payment_hash + 32, out.payment_hash[i].begin());
+        else out.payment_hash[i].fill(0);
+        if (valid && invoice.has_receiver_id) std::copy(invoice.receiver_id, invoice.receiver_id + 33, out.receiver_id[i].begin());
+        else out.receiver_id[i].fill(0);
+        c.reasons[i] = payment_request::last_reject_reason();
+    }
+}
+
+/* Why the rejected rows of @begin to @end failed: decode_batch does not say, so they are decoded
+ * again, which is cheap as long as most invoices are valid. */
+void find_reasons(chunk& c, size_t begin, size_t end) {
+    payment_request::bolt11 invoice;
+    for (size_t i = begin; i < end; ++i) {
+        c.reasons[i] = payment_request::reject_reason::NONE;
+        if (c.decoded.status[i] == 0) continue;
+        payment_request::decode(c.invoices[i], invoice, c.cache);
+        c.reasons[i] = payment_request::last_reject_reason();
+    }
+}
+
+void format_json(const chunk& c, size_t i, std::string& out) {
+    const payment_request::decoded_batch& d = c.decoded;
+    out += "{\"line\":";
+    append_uint(out, c.lines[i]);
+    if (d.status[i] != 0) {
+        out += ",\"status\":\"rejected\",\"reason\":\"";
+        out += payment_request::name(c.reasons[i]);
+        out += "\"}\n";
+        return;
+    }
+    out += ",\"status\":\"ok\",\"network\":\"";
+    out += payment_request::NETWORK_PREFIXES[d.network[i]];
+    out += "\",\"amount_msat\":";
+    append_uint(out, d.amount_msat[i]);
+    out += ",\"timestamp\":";
+    append_uint(out, d.timestamp[i]);
+    out += ",\"expiry\":";
+    append_uint(out, d.expiry[i]);
+    out += ",\"min_final_cltv_expiry\":";
+    append_uint(out, d.min_final_cltv_expiry[i]);
+    out += ",\"features\":";
+    append_uint(out, d.features[i]);
+    out += ",\"payment_hash\":\"";
+    append_hex(out, d.payment_hash[i].data(), 32);
+    out += "\",\"receiver_id\":\"";
+    append_hex(out, d.receiver_id[i].data(), 33);
+    out += "\"}\n";
+}
+
+const char CSV_HEADER[] = "line,status,reason,network,amount_msat,timestamp,expiry,min_final_cltv_expiry,features,payment_hash,receiver_id\n";
+
+void format_csv(const chunk& c, size_t i, std::string& out) {
+    const payment_request::decoded_batch& d = c.decoded;
+    append_uint(out, c.lines[i]);
+    if (d.status[i] != 0) {
+        out += ",rejected,";
+        out += payment_request::name(c.reasons[i]);
+        out += ",,,,,,,,\n";
+        return;
+    }
+    out += ",ok,,";
+    out += payment_request::NETWORK_PREFIXES[d.network[i]];
+    out += ',';
+    append_uint(out, d.amount_msat[i]);
+    out += ',';
+    append_uint(out, d.timestamp[i]);
+    out += ',';
+    append_uint(out, d.expiry[i]);
+    out += ',';
+    append_uint(out, d.min_final_cltv_expiry[i]);
+    out += ',';
+    append_uint(out, d.features[i]);
+    out += ',';
+    append_hex(out, d.payment_hash[i].data(), 32);
+    out += ',';
+    append_hex(out, d.receiver_id[i].data(), 33);
+    out += '\n';
+}
+
+void format_binary(const chunk& c, size_t i, std::string& out) {
+    const payment_request::decoded_batch& d = c.decoded;
+    binary_record record;
+    memset(&record, 0, sizeof(record));
+    record.line = c.lines[i];
+    record.amount_msat = d.amount_msat[i];
+    record.timestamp = d.timestamp[i];
+    record.expiry = d.expiry[i];
+    record.features = d.features[i];
+    record.min_final_cltv_expiry = d.min_final_cltv_expiry[i];
+    record.status = d.status[i];
+    record.reason = static_cast<uint8_t>(c.reasons[i]);
+    record.network = d.network[i];
+    std::copy(d.payment_hash[i].begin(), d.payment_hash[i].end(), record.payment_hash);
+    std::copy(d.receiver_id[i].begin(), d.receiver_id[i].end(), record.receiver_id);
+    out.append(reinterpret_cast<const char*>(&record), sizeof(record));
+}
+
+/* Decode the lines gathered in @c, write them out in order and count them. Returns 0 on success,
+ * -1 if the output cannot be written. */
+int flush_chunk(chunk& c, const options& opts, unsigned threads, FILE* out, totals& sum) {
+    const size_t count = c.invoices.size();
+    if (count == 0) return 0;
+    c.reasons.resize(count);
+    if (opts.unchecked) {
+        c.decoded.resize(count);
+        parallel_for(count, threads, [&](size_t begin, size_t end, unsigned) { decode_unchecked(c, begin, end); });
+    } else {
+        payment_request::decode_batch(c.invoices.data(), count, c.decoded, threads, &c.cache);
+    }
+    c.formatted.resize(threads);
+    parallel_for(count, threads, [&](size_t begin, size_t end, unsigned t) {
+        if (!opts.unchecked) find_reasons(c, begin, end);
+        std::string& text = c.formatted[t];
+        text.clear();
+        for (size_t i = begin; i < end; ++i) {
+            switch (opts.format) {
+                case output_format::JSON: format_json(c, i, text); break;
+                case output_format::CSV: format_csv(c, i, text); break;
+                case output_format::BINARY: format_binary(c, i, text); break;
+            }
+        }
+    });
+    for (const auto& text : c.formatted) {
+        if (fwrite(text.data(), 1, text.size(), out) != text.size()) return -1;
+    }
+    sum.invoices += count;
+    for (size_t i = 0; i < count; ++i) {
+        if (c.decoded.status[i] != 0) sum.rejected[static_cast<size_t>(c.reasons[i])]++;
+    }
+    c.invoices.clear();
+    c.lines.clear();
+    return 0;
+}
+
+/* Split @size bytes of @data into lines and decode them, a chunk at a time. A last line without a
+ * newline is only taken if @final. Returns the bytes consumed, or -1 on a write error. */
+ptrdiff_t process(const char* data, size_t size, bool final, chunk& c, const options& opts, unsigned threads, FILE* out,
+                  totals& sum) {
+    size_t pos = 0;
+    while (pos < size) {
+        const char* newline = static_cast<const char*>(memchr(data + pos, '\n', size - pos));
+        if (!newline && !final) break;
+        size_t end = newline ? newline - data : size;
+        const size_t next = newline ? end + 1 : size;
+        sum.lines++;
+        if (end > pos && data[end - 1] == '\r') end--;
+        if (end > pos) {
+            c.invoices.emplace_back(data + pos, end - pos);
+            c.lines.push_back(sum.lines);
+        }
+        pos = next;
+        if (c.invoices.size() == CHUNK_LINES && flush_chunk(c, opts, threads, out, sum) != 0) return -1;
+    }
+    /* The views point into @data, which the caller may overwrite once this returns. */
+    if (flush_chunk(c, opts, threads, out, sum) != 0) return -1;
+    sum.bytes += pos;
+    return pos;
+}
+
+int usage() {
+    fprintf(stderr, "usage: bolt11_decode [-f json|csv|binary] [-t threads] [-u] [-o output] [input]\n");
+    return 2;
+}
+
+}
+
+int main(int argc, char** argv) {
+    options opts;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:t:uo:h")) != -1) {
+        switch (opt) {
+            case 'f':
+                if (strcmp(optarg, "json") == 0) opts.format = output_format::JSON;
+                else if (strcmp(optarg, "csv") == 0) opts.format = output_format::CSV;
+                else if (strcmp(optarg, "binary") == 0) opts.format = output_format::BINARY;
+                else return usage();
+                break;
+            case 't': {
+                const char* end = optarg + strlen(optarg);
+                const auto parsed = std::from_chars(optarg, end, opts.threads);
+                if (parsed.ec != std::errc() || parsed.ptr != end || opts.threads == 0 || opts.threads > MAX_THREADS)
+                    return usage();
+                break;
+            }
+            case 'u': opts.unchecked = true; break;
+            case 'o': opts.output = optarg; break;
+            default: return usage();
+        }
+    }
+    if (optind + 1 < argc) return usage();
+    if (optind < argc && strcmp(argv[optind], "-") != 0) opts.input = argv[optind];
+    const unsigned threads = opts.threads ? opts.threads : std::max(1u, std::thread::hardware_concurrency());
+
+    FILE* out = opts.output ? fopen(opts.output, "wb") : stdout;
+    if (!out) {
+        fprintf(stderr, "bolt11_decode: cannot open %s: %s\n", opts.output, strerror(errno));
+        return 1;
+    }
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+    if (opts.format == output_format::CSV) fputs(CSV_HEADER, out);
+    if (opts.format == output_format::BINARY) {
+        binary_header header = {{'B', 'O', 'L', 'T', '1', '1', 'D', 0}, 1, sizeof(binary_record)};
+        fwrite(&header, sizeof(header), 1, out);
+    }
+
+    chunk c;
+    totals sum;
+    const auto start = std::chrono::steady_clock::now();
+    ptrdiff_t status = 0;
+    if (opts.input) {
+        const int fd = open(opts.input, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            fprintf(stderr, "bolt11_decode: cannot open %s: %s\n", opts.input, strerror(errno));
+            if (fd >= 0) ::close(fd);
+            return 1;
+        }
+        if (st.st_size > 0) {
+            void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                fprintf(stderr, "bolt11_decode: cannot map %s: %s\n", opts.input, strerror(errno));
+                ::close(fd);
+                return 1;
+            }
+            madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+            status = process(static_cast<const char*>(mapping), st.st_size, true, c, opts, threads, out, sum);
+            munmap(mapping, st.st_size);
+        }
+        ::close(fd);
+    } else {
+        /* Read blocks, decode the whole lines and carry the last partial one over. */
+        std::vector<char> buffer(READ_SIZE);
+        size_t held = 0;
+        for (;;) {
+            if (held == buffer.size()) buffer.resize(buffer.size() * 2);
+            const size_t got = fread(buffer.data() + held, 1, buffer.size() - held, stdin);
+            held += got;
+            const bool final = got == 0;
+            status = process(buffer.data(), held, final, c, opts, threads, out, sum);
+            if (status < 0 || final) break;
+            std::copy(buffer.begin() + status, buffer.begin() + held, buffer.begin());
+            held -= status;
+        }
+    }
+    if (status < 0 || fflush(out) != 0 || (opts.output && fclose(out) != 0)) {
+        fprintf(stderr, "bolt11_decode: cannot write output: %s\n", strerror(errno));
+        return 1;
+    }
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    uint64_t rejected = 0;
+    for (uint64_t n : sum.rejected) rejected += n;
+    fprintf(stderr, "%llu lines, %llu invoices, %llu decoded, %llu rejected in %.3f s: %.0f invoices/s, %.1f MB/s\n",
+            (unsigned long long)sum.lines, (unsigned long long)sum.invoices, (unsigned long long)(sum.invoices - rejected),
+            (unsigned long long)rejected, seconds, sum.invoices / seconds, sum.bytes / seconds / 1e6);
+    for (size_t r = 0; r < static_cast<size_t>(payment_request::reject_reason::COUNT); ++r) {
+        if (sum.rejected[r])
+            fprintf(stderr, "  %-14s %llu\n", payment_request::name(static_cast<payment_request::reject_reason>(r)),
+                    (unsigned long long)sum.rejected[r]);
+    }
+    return 0;
+}
@@ -0,0 +1,221 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "compact_bolt11.h"
+#include "hrp.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+namespace
+{
+
+/* A cold record starts on 8 bytes and is laid out as:
+ *   flags (1 byte), prefix length (1 byte), description length (2 bytes, little endian),
+ *   route count, hop count, fallback count (2 bytes each, little endian), 2 bytes of padding,
+ *   features (8 bytes, little endian), prefix, payment secret (32 bytes), description hash (32 bytes, if HAS_DESCRIPTION_HASH),
+ *   receiver id (33 bytes, if HAS_RECEIVER_ID), description,
+ *   then, from the next multiple of 8, the route hints, their hops, the fallback addresses and their programs, as
+ *   expand() hands them out: they point into the record, which never moves.
+ */
+const unsigned char HAS_DESCRIPTION_HASH = 1;
+const unsigned char HAS_RECEIVER_ID = 2;
+const size_t RECORD_HEADER_SIZE = 20;
+
+size_t read_le16(const unsigned char* in)
+{
+    return in[0] | (in[1] << 8);
+}
+
+void write_le16(size_t v, unsigned char* out)
+{
+    out[0] = v & 0xff;
+    out[1] = v >> 8;
+}
+
+size_t round_up(size_t size)
+{
+    return (size + 7) & ~size_t{7};
+}
+
+size_t description_len(const unsigned char* record)
+{
+    return read_le16(record + 2);
+}
+
+uint64_t record_features(const unsigned char* record)
+{
+    uint64_t bits = 0;
+    for (int i = 7; i >= 0; --i) bits = (bits << 8) | record[12 + i];
+    return bits;
+}
+
+/* Offset of the payment secret, which follows the prefix. */
+size_t secret_offset(const unsigned char* record)
+{
+    return RECORD_HEADER_SIZE + record[1];
+}
+
+size_t description_hash_offset(const unsigned char* record)
+{
+    return secret_offset(record) + 32;
+}
+
+size_t receiver_id_offset(const unsigned char* record)
+{
+    return description_hash_offset(record) + ((record[0] & HAS_DESCRIPTION_HASH) ? 32 : 0);
+}
+
+size_t description_offset(const unsigned char* record)
+{
+    return receiver_id_offset(record) + ((record[0] & HAS_RECEIVER_ID) ? 33 : 0);
+}
+
+/* Offset of the route hints, which the hops and the fallback addresses follow. */
+size_t routes_offset(const unsigned char* record)
+{
+    return round_up(description_offset(record) + description_len(record));
+}
+
+}
+
+namespace payment_request
+{
+
+int bolt11_arena::add(const struct bolt11& invoice, compact_bolt11& out) {
+    if (invoice.prefix.size() > 255 || invoice.route_count > 0xffff || invoice.fallback_count > 0xffff ||
+        invoice.description_len > sizeof(invoice.description))
+        return -1;
+    size_t hops = 0, programs = 0;
+    for (size_t i = 0; i < invoice.route_count; ++i) hops += invoice.routes[i].size;
+    for (size_t i = 0; i < invoice.fallback_count; ++i) programs += invoice.fallbacks[i].size;
+    const size_t size = round_up(RECORD_HEADER_SIZE + invoice.prefix.size() + 32 + (invoice.has_description_hash ? 32 : 0) +
+                                 (invoice.has_receiver_id ? 33 : 0) + invoice.description_len) +
+        invoice.route_count * sizeof(route_hint) + hops * sizeof(route_hop) +
+        invoice.fallback_count * sizeof(fallback_address) + round_up(programs);
+    if (hops > 0xffff || size > BLOCK_SIZE) return -1;
+    used = round_up(used);
+    if (used + size > BLOCK_SIZE) {
+        blocks.emplace_back(new unsigned char[BLOCK_SIZE]);
+        used = 0;
+    }
+    out.sat_amount = invoice.sat_amount;
+    out.timestamp = invoice.timestamp;
+    memcpy(out.payment_hash, invoice.payment_hash, 32);
+    out.cold_offset = (blocks.size() - 1) * BLOCK_SIZE + used;
+    out.expiry = std::min<uint64_t>(invoice.expiry, UINT32_MAX);
+    out.min_final_cltv_expiry = invoice.min_final_cltv_expiry;
+
+    unsigned char* record = blocks.back().get() + used;
+    record[0] = (invoice.has_description_hash ? HAS_DESCRIPTION_HASH : 0) | (invoice.has_receiver_id ? HAS_RECEIVER_ID : 0);
+    record[1] = invoice.prefix.size();
+    write_le16(invoice.description_len, record + 2);
+    write_le16(invoice.route_count, record + 4);
+    write_le16(hops, record + 6);
+    write_le16(invoice.fallback_count, record + 8);
+    for (int i = 0; i < 8; ++i) record[12 + i] = invoice.features >> (8 * i);
+    memcpy(record + RECORD_HEADER_SIZE, invoice.prefix.data(), invoice.prefix.size());
+    memcpy(record + secret_offset(record), invoice.payment_secret, 32);
+    if (invoice.has_description_hash) memcpy(record + description_hash_offset(record), invoice.description_hash, 32);
+    if (invoice.has_receiver_id) memcpy(record + receiver_id_offset(record), invoice.receiver_id, 33);
+    memcpy(record + description_offset(record), invoice.description, invoice.description_len);
+    route_hint* route = reinterpret_cast<route_hint*>(record + routes_offset(record));
+    route_hop* hop = reinterpret_cast<route_hop*>(route + invoice.route_count);
+    fallback_address* fallback = reinterpret_cast<fallback_address*>(hop + hops);
+    unsigned char* program = reinterpret_cast<unsigned char*>(fallback + invoice.fallback_count);
+    for (size_t i = 0; i < invoice.route_count; ++i) {
+        route[i] = route_hint{hop, invoice.routes[i].size};
+        hop = std::copy(invoice.routes[i].hops, invoice.routes[i].hops + invoice.routes[i].size, hop);
+    }
+    for (size_t i = 0; i < invoice.fallback_count; ++i) {
+        fallback[i] = fallback_address{invoice.fallbacks[i].version, program, invoice.fallbacks[i].size};
+        program = std::copy(invoice.fallbacks[i].program, invoice.fallbacks[i].program + invoice.fallbacks[i].size, program);
+    }
+    used += size;
+    return 0;
+}
+
+const unsigned char* bolt11_arena::record(const compact_bolt11& invoice) const {
+    return blocks[invoice.cold_offset / BLOCK_SIZE].get() + invoice.cold_offset % BLOCK_SIZE;
+}
+
+std::string_view bolt11_arena::prefix(const compact_bolt11& invoice) const {
+    const unsigned char* r = record(invoice);
+    return std::string_view(reinterpret_cast<const char*>(r + RECORD_HEADER_SIZE), r[1]);
+}
+
+std::string_view bolt11_arena::description(const compact_bolt11& invoice) const {
+    const unsigned char* r = record(invoice);
+    return std::string_view(reinterpret_cast<const char*>(r + description_offset(r)), description_len(r));
+}
+
+const unsigned char* bolt11_arena::payment_secret(const compact_bolt11& invoice) const {
+    const unsigned char* r = record(invoice);
+    return r + secret_offset(r);
+}
+
+const unsigned char* bolt11_arena::description_hash(const compact_bolt11& invoice) const {
+    const unsigned char* r = record(invoice);
+    return (r[0] & HAS_DESCRIPTION_HASH) ? r + description_hash_offset(r) : NULL;
+}
+
+const unsigned char* bolt11_arena::receiver_id(const compact_bolt11& invoice) const {
+    const unsigned char* r = record(invoice);
+    return (r[0] & HAS_RECEIVER_ID) ? r + receiver_id_offset(r) : NULL;
+}
+
+uint64_t bolt11_arena::features(const compact_bolt11& invoice) const {
+    return record_features(record(invoice));
+}
+
+void bolt11_arena::expand(const compact_bolt11& invoice, struct bolt11& out) const {
+    out.prefix = std::string(prefix(invoice));
+    out.network = network_of(out.prefix);
+    out.timestamp = invoice.timestamp;
+    out.sat_amount = invoice.sat_amount;
+    memcpy(out.payment_hash, invoice.payment_hash, 32);
+    const unsigned char* id = receiver_id(invoice);
+    out.has_receiver_id = id != NULL;
+    if (id) memcpy(out.receiver_id, id, 33);
+    const std::string_view desc = description(invoice);
+    memcpy(out.description, desc.data(), desc.size());
+    out.description_len = desc.size();
+    const unsigned char* hash = description_hash(invoice);
+    out.has_description_hash = hash != NULL;
+    if (hash) memcpy(out.description_hash, hash, 32);
+    out.expiry = invoice.expiry;
+    out.min_final_cltv_expiry = invoice.min_final_cltv_expiry;
+    out.features = features(invoice);
+    memcpy(out.payment_secret, payment_secret(invoice), 32);
+    const unsigned char* r = record(invoice);
+    out.routes = reinterpret_cast<const route_hint*>(r + routes_offset(r));
+    out.route_count = read_le16(r + 4);
+    out.fallbacks = reinterpret_cast<const fallback_address*>(
+        reinterpret_cast<const route_hop*>(out.routes + out.route_count) + read_le16(r + 6));
+    out.fallback_count = read_le16(r + 8);
+    if (out.route_count == 0) out.routes = NULL;
+    if (out.fallback_count == 0) out.fallbacks = NULL;
+    out.tagged_fields = NULL;
+    out.tagged_field_count = 0;
+}
+
+}
@@ -0,0 +1,87 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef COMPACT_BOLT11_H_
+#define COMPACT_BOLT11_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include "payment_request.h"
+
+namespace payment_request
+{
+
+/** The fields read on every payment decision, in one cache line. The rest of the invoice lives in a
+ *  bolt11_arena, at cold_offset. The signature is not kept: compact invoices are meant to hold
+ *  invoices that were already validated. */
+struct alignas(64) compact_bolt11 {
+	uint64_t sat_amount;                            // in millisatoshi; 0 if the invoice has no amount
+	uint64_t timestamp;
+	unsigned char payment_hash[32];
+	uint64_t cold_offset;                           // where the cold fields are in the arena
+	uint32_t expiry;                                // saturated at UINT32_MAX seconds (136 years)
+	uint32_t min_final_cltv_expiry;
+};
+
+static_assert(sizeof(compact_bolt11) == 64, "compact_bolt11 must fill exactly one cache line");
+
+/** Storage for the variable-length fields of many compact invoices. Records are appended to large
+ *  blocks, so they are never moved and the views handed out stay valid while the arena lives. */
+class bolt11_arena {
+public:
+	/** Store the cold fields of @invoice and put its compact form in @out. 0 means success, -1 that
+	 *  the invoice does not fit a record: a prefix of 256 characters or more, 65536 or more routes,
+	 *  hops or fallback addresses, a description_len beyond the description, or more than a block
+	 *  in all. */
+	int add(const struct bolt11& invoice, compact_bolt11& out);
+
+	std::string_view prefix(const compact_bolt11& invoice) const;
+	std::string_view description(const compact_bolt11& invoice) const;
+	const unsigned char* payment_secret(const compact_bolt11& invoice) const;
+	/** NULL if the invoice has no description hash. */
+	const unsigned char* description_hash(const compact_bolt11& invoice) const;
+	/** NULL if the receiver id is not known. */
+	const unsigned char* receiver_id(const compact_bolt11& invoice) const;
+	uint64_t features(const compact_bolt11& invoice) const;
+
+	/** Rebuild the full bolt11 of a compact invoice; the signature is left untouched. Its route
+	 *  hints and fallback addresses point into the arena. */
+	void expand(const compact_bolt11& invoice, struct bolt11& out) const;
+
+	/** Bytes held by the arena, including the unused tail of the last block. */
+	size_t memory_usage() const { return blocks.size() * BLOCK_SIZE; }
+
+private:
+	static constexpr size_t BLOCK_SIZE = 1 << 20;
+
+	std::vector<std::unique_ptr<unsigned char[]> > blocks;
+	size_t used = BLOCK_SIZE;                       // bytes used in the last block
+
+	const unsigned char* record(const compact_bolt11& invoice) const;
+};
+
+}
+
+#endif  // COMPACT_BOLT11_H_
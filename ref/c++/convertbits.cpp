@@ -0,0 +1,188 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "convertbits.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define REGROUP_X86 1
+#include <immintrin.h>
+#endif
+
+namespace bech32
+{
+
+namespace
+{
+
+/** convertbits over raw buffers, appending at @out + *@out_size. */
+bool regroup_scalar(int frombits, int tobits, bool pad, const uint8_t* in, size_t size, uint8_t* out, size_t* out_size) {
+    int acc = 0;
+    int bits = 0;
+    size_t n = *out_size;
+    const int maxv = (1 << tobits) - 1;
+    const int max_acc = (1 << (frombits + tobits - 1)) - 1;
+    for (size_t i = 0; i < size; ++i) {
+        int value = in[i];
+        acc = ((acc << frombits) | value) & max_acc;
+        bits += frombits;
+        while (bits >= tobits) {
+            bits -= tobits;
+            out[n++] = (acc >> bits) & maxv;
+        }
+    }
+    *out_size = n;
+    if (pad) {
+        if (bits) out[(*out_size)++] = (acc << (tobits - bits)) & maxv;
+    } else if (bits >= frombits || ((acc << (tobits - bits)) & maxv)) {
+        return false;
+    }
+    return true;
+}
+
+#ifdef REGROUP_X86
+
+/** Regroup whole groups of 8 values into 5 bytes. Returns the number of values consumed. */
+__attribute__((target("bmi2")))
+size_t regroup_5to8_bmi2(const uint8_t* in, size_t size, uint8_t* out) {
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8, out += 5) {
+        uint64_t v;
+        memcpy(&v, in + i, 8);
+        // Put the first value in the top byte, gather the 8 low 5-bit groups into 40 bits and
+        // store them big endian.
+        uint64_t x = _pext_u64(__builtin_bswap64(v), 0x1f1f1f1f1f1f1f1fULL);
+        x = __builtin_bswap64(x << 24);
+        memcpy(out, &x, 5);
+    }
+    return i;
+}
+
+/** Regroup whole groups of 5 bytes into 8 values. Returns the number of bytes consumed. */
+__attribute__((target("bmi2")))
+size_t regroup_8to5_bmi2(const uint8_t* in, size_t size, uint8_t* out) {
+    size_t i = 0;
+    for (; i + 5 <= size; i += 5, out += 8) {
+        uint32_t head;
+        memcpy(&head, in + i, 4);
+        // Read 40 bits big endian and scatter them over the low 5 bits of 8 bytes, first value first.
+        // The 4 + 1 byte loads go to registers directly; a 5 byte copy into a uint64_t would stall
+        // store forwarding.
+        const uint64_t x = (uint64_t{__builtin_bswap32(head)} << 8) | in[i + 4];
+        uint64_t v = _pdep_u64(x, 0x1f1f1f1f1f1f1f1fULL);
+        v = __builtin_bswap64(v);
+        memcpy(out, &v, 8);
+    }
+    return i;
+}
+
+/** Regroup blocks of 32 values into 20 bytes. Each block stores 26 bytes, so this stops while at
+ *  least 10 more values are left for the tail to overwrite the excess. Returns the number of
+ *  values consumed. */
+__attribute__((target("avx2")))
+size_t regroup_5to8_avx2(const uint8_t* in, size_t size, uint8_t* out) {
+    // Pairs of values become 10-bit words (first * 32 + second), pairs of words 20-bit dwords.
+    const __m256i pair = _mm256_set1_epi16(0x0120);
+    const __m256i quad = _mm256_set1_epi32(0x00010400);
+    const __m256i low_dword = _mm256_set1_epi64x(0xffffffff);
+    // Each 64-bit lane then holds 40 bits, whose 5 bytes are stored big endian.
+    const __m256i order = _mm256_setr_epi8(4, 3, 2, 1, 0, 12, 11, 10, 9, 8, -1, -1, -1, -1, -1, -1,
+                                           4, 3, 2, 1, 0, 12, 11, 10, 9, 8, -1, -1, -1, -1, -1, -1);
+    size_t i = 0;
+    for (; i + 32 + 10 <= size; i += 32, out += 20) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+        v = _mm256_madd_epi16(_mm256_maddubs_epi16(v, pair), quad);
+        v = _mm256_or_si256(_mm256_slli_epi64(_mm256_and_si256(v, low_dword), 20), _mm256_srli_epi64(v, 32));
+        v = _mm256_shuffle_epi8(v, order);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm256_castsi256_si128(v));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 10), _mm256_extracti128_si256(v, 1));
+    }
+    return i;
+}
+
+#endif  // REGROUP_X86
+
+} // namespace
+
+bool convertbits(bool pad, int frombits, int tobits, std::vector<uint8_t>& out, const std::vector<uint8_t>& in) {
+    int acc = 0;
+    int bits = 0;
+    const int maxv = (1 << tobits) - 1;
+    const int max_acc = (1 << (frombits + tobits - 1)) - 1;
+    for (size_t i = 0; i < in.size(); ++i) {
+        int value = in[i];
+        acc = ((acc << frombits) | value) & max_acc;
+        bits += frombits;
+        while (bits >= tobits) {
+            bits -= tobits;
+            out.push_back((acc >> bits) & maxv);
+        }
+    }
+    if (pad) {
+        if (bits) out.push_back((acc << (tobits - bits)) & maxv);
+    } else if (bits >= frombits || ((acc << (tobits - bits)) & maxv)) {
+        return false;
+    }
+    return true;
+}
+
+RegroupImpl regroup_best() {
+#ifdef REGROUP_X86
+    static const RegroupImpl best = []() {
+        __builtin_cpu_init();
+        if (!__builtin_cpu_supports("bmi2")) return RegroupImpl::SCALAR;
+        return __builtin_cpu_supports("avx2") ? RegroupImpl::AVX2 : RegroupImpl::BMI2;
+    }();
+    return best;
+#else
+    return RegroupImpl::SCALAR;
+#endif
+}
+
+bool regroup_5to8(const uint8_t* in, size_t size, bool pad, uint8_t* out, size_t* out_size, RegroupImpl impl) {
+    size_t done = 0;
+    *out_size = 0;
+#ifdef REGROUP_X86
+    // Whole groups of 8 values map to 5 bytes and leave no bits behind, so the scalar code can
+    // take over the tail from scratch.
+    if (impl == RegroupImpl::AVX2) done = regroup_5to8_avx2(in, size, out);
+    if (impl != RegroupImpl::SCALAR) done += regroup_5to8_bmi2(in + done, size - done, out + done / 8 * 5);
+    *out_size = done / 8 * 5;
+#else
+    (void)impl;
+#endif
+    return regroup_scalar(5, 8, pad, in + done, size - done, out, out_size);
+}
+
+bool regroup_8to5(const uint8_t* in, size_t size, bool pad, uint8_t* out, size_t* out_size, RegroupImpl impl) {
+    size_t done = 0;
+    *out_size = 0;
+#ifdef REGROUP_X86
+    if (impl != RegroupImpl::SCALAR) done = regroup_8to5_bmi2(in, size, out);
+    *out_size = done / 5 * 8;
+#else
+    (void)impl;
+#endif
+    return regroup_scalar(8, 5, pad, in + done, size - done, out, out_size);
+}
+
+}  // namespace bech32
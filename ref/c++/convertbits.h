@@ -0,0 +1,57 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef CONVERTBITS_H_
+#define CONVERTBITS_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace bech32
+{
+
+/** Convert from one power-of-2 number base to another. */
+bool convertbits(bool pad, int frombits, int tobits, std::vector<uint8_t>& out, const std::vector<uint8_t>& in);
+
+/** The implementations of the 5-bit <-> 8-bit regrouping below. */
+enum class RegroupImpl {
+    SCALAR,  //! One value at a time through an accumulator, as convertbits
+    BMI2,    //! 8 values <-> 5 bytes per step with pext/pdep
+    AVX2,    //! 32 values -> 20 bytes per step with multiply-adds and a byte shuffle; BMI2 the other way
+};
+
+/** The fastest implementation this CPU supports, detected once. */
+RegroupImpl regroup_best();
+
+/** Regroup @size 5-bit values into bytes at @out, exactly as convertbits(@pad, 5, 8) would: without
+ *  @pad the leftover bits must be fewer than 5 and zero, with @pad they are left-aligned into one
+ *  more byte. @out needs room for (size * 5 + 7) / 8 bytes. Returns false if the padding is
+ *  invalid; @out_size gets the number of bytes written. */
+bool regroup_5to8(const uint8_t* in, size_t size, bool pad, uint8_t* out, size_t* out_size, RegroupImpl impl = regroup_best());
+
+/** Regroup @size bytes into 5-bit values at @out, exactly as convertbits(@pad, 8, 5) would. @out
+ *  needs room for (size * 8 + 4) / 5 values. Returns false if the padding is invalid. */
+bool regroup_8to5(const uint8_t* in, size_t size, bool pad, uint8_t* out, size_t* out_size, RegroupImpl impl = regroup_best());
+
+}  // namespace bech32
+
+#endif  // CONVERTBITS_H_
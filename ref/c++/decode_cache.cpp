@@ -0,0 +1,211 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "decode_cache.h"
+#include "hint_arena.h"
+
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+
+namespace
+{
+
+/* A fast hash of the invoice string, 8 bytes per step. Not collision resistant: a hit is only
+ * taken when the stored string matches too. */
+uint64_t hash_invoice(std::string_view invoice)
+{
+    const uint64_t k = 0x9E3779B97F4A7C15ULL;
+    uint64_t h = invoice.size() * k;
+    size_t i = 0;
+    for (; i + 8 <= invoice.size(); i += 8) {
+        uint64_t v;
+        memcpy(&v, invoice.data() + i, 8);
+        h = (h ^ v) * k;
+        h ^= h >> 29;
+    }
+    uint64_t tail = 0;
+    if (i < invoice.size()) memcpy(&tail, invoice.data() + i, invoice.size() - i);
+    h = (h ^ tail) * k;
+    return h ^ (h >> 32);
+}
+
+uint64_t expires_at(const payment_request::bolt11& invoice)
+{
+    return invoice.timestamp + std::min(invoice.expiry, UINT64_MAX - invoice.timestamp);
+}
+
+/* A cached invoice with the storage of its hints, which it is handed out through. */
+struct cached_invoice {
+    payment_request::bolt11 invoice;
+    std::unique_ptr<uint64_t[]> hints;
+};
+
+/* Copy the route hints, fallback addresses and tagged fields of @from to @storage and point @to
+ * at the copies; with @storage NULL, only count the bytes they take. Every array starts 8-byte
+ * aligned, and the hops of all the routes stay in one array. */
+size_t copy_hints(const payment_request::bolt11& from, payment_request::bolt11* to, unsigned char* storage)
+{
+    using namespace payment_request;
+    size_t used = 0;
+    auto take = [&](size_t size) -> void* {
+        void* at = storage ? storage + used : NULL;
+        used += (size + 7) & ~size_t{7};
+        return at;
+    };
+    size_t hop_count = 0;
+    for (size_t i = 0; i < from.route_count; ++i) hop_count += from.routes[i].size;
+    route_hint* routes = static_cast<route_hint*>(take(from.route_count * sizeof(route_hint)));
+    route_hop* hops = static_cast<route_hop*>(take(hop_count * sizeof(route_hop)));
+    fallback_address* fallbacks = static_cast<fallback_address*>(take(from.fallback_count * sizeof(fallback_address)));
+    tagged_field* fields = static_cast<tagged_field*>(take(from.tagged_field_count * sizeof(tagged_field)));
+    for (size_t i = 0; i < from.fallback_count; ++i) {
+        unsigned char* program = static_cast<unsigned char*>(take(from.fallbacks[i].size));
+        if (!storage) continue;
+        fallbacks[i] = from.fallbacks[i];
+        fallbacks[i].program = program;
+        std::copy(from.fallbacks[i].program, from.fallbacks[i].program + from.fallbacks[i].size, program);
+    }
+    for (size_t i = 0; i < from.tagged_field_count; ++i) {
+        const tagged_field& field = from.tagged_fields[i];
+        uint8_t* values = field.values ? static_cast<uint8_t*>(take(field.size)) : NULL;
+        if (!storage) continue;
+        fields[i] = field;
+        fields[i].values = values;
+        if (values) std::copy(field.values, field.values + field.size, values);
+    }
+    if (!storage) return used;
+    for (size_t i = 0; i < from.route_count; ++i) {
+        std::copy(from.routes[i].hops, from.routes[i].hops + from.routes[i].size, hops);
+        routes[i] = {hops, from.routes[i].size};
+        hops += from.routes[i].size;
+    }
+    to->routes = from.routes ? routes : NULL;
+    to->fallbacks = from.fallbacks ? fallbacks : NULL;
+    to->tagged_fields = from.tagged_fields ? fields : NULL;
+    return used;
+}
+
+}
+
+namespace payment_request
+{
+
+decode_cache::decode_cache(size_t capacity) : slots_per_shard(std::max<size_t>(1, (capacity + SHARDS - 1) / SHARDS)) {
+    for (auto& s : shards) s.slots.reserve(slots_per_shard);
+}
+
+/* Find a slot for a new entry: a free one while the shard fills up, then the first expired or not
+ * recently used one under the clock hand. */
+size_t decode_cache::take_slot(shard& s, uint64_t now) {
+    if (s.slots.size() < slots_per_shard) {
+        s.slots.emplace_back();
+        return s.slots.size() - 1;
+    }
+    while (true) {
+        slot& candidate = s.slots[s.hand];
+        const size_t taken = s.hand;
+        s.hand = (s.hand + 1) % s.slots.size();
+        if (candidate.referenced && candidate.expires_at > now) {
+            candidate.referenced = false;
+            continue;
+        }
+        s.index.erase(candidate.hash);
+        return taken;
+    }
+}
+
+std::shared_ptr<const struct bolt11> decode_cache::decode(std::string_view invoice, uint64_t now) {
+    const uint64_t hash = hash_invoice(invoice);
+    shard& s = shards[hash % SHARDS];
+    {
+        std::lock_guard<std::mutex> guard(s.lock);
+        auto found = s.index.find(hash);
+        if (found != s.index.end()) {
+            slot& entry = s.slots[found->second];
+            if (entry.invoice == invoice && entry.expires_at > now) {
+                entry.referenced = true;
+                s.hits++;
+                return entry.decoded;
+            }
+        }
+        s.misses++;
+    }
+
+    /* Parse outside of the lock, so other lookups in the shard are not held up. The hints go to an
+     * arena of the thread first, as their size is only known once decoded. */
+    thread_local hint_arena scratch;
+    scratch.clear();
+    std::shared_ptr<cached_invoice> cached = std::make_shared<cached_invoice>();
+    if (payment_request::decode(invoice, cached->invoice, scratch) != 0) return NULL;
+    cached->hints.reset(new uint64_t[copy_hints(cached->invoice, NULL, NULL) / 8]);
+    copy_hints(cached->invoice, &cached->invoice, reinterpret_cast<unsigned char*>(cached->hints.get()));
+    const std::shared_ptr<const struct bolt11> decoded(cached, &cached->invoice);
+    const uint64_t expiry = expires_at(*decoded);
+    if (expiry <= now) return decoded;
+
+    std::lock_guard<std::mutex> guard(s.lock);
+    auto found = s.index.find(hash);
+    const size_t taken = found != s.index.end() ? found->second : take_slot(s, now);
+    slot& entry = s.slots[taken];
+    entry.invoice.assign(invoice.data(), invoice.size());
+    entry.decoded = decoded;
+    entry.hash = hash;
+    entry.expires_at = expiry;
+    entry.referenced = true;
+    s.index[hash] = taken;
+    return decoded;
+}
+
+std::shared_ptr<const struct bolt11> decode_cache::decode(std::string_view invoice) {
+    return decode(invoice, time(NULL));
+}
+
+uint64_t decode_cache::hits() const {
+    uint64_t total = 0;
+    for (const auto& s : shards) {
+        std::lock_guard<std::mutex> guard(s.lock);
+        total += s.hits;
+    }
+    return total;
+}
+
+uint64_t decode_cache::misses() const {
+    uint64_t total = 0;
+    for (const auto& s : shards) {
+        std::lock_guard<std::mutex> guard(s.lock);
+        total += s.misses;
+    }
+    return total;
+}
+
+size_t decode_cache::size() const {
+    size_t total = 0;
+    for (const auto& s : shards) {
+        std::lock_guard<std::mutex> guard(s.lock);
+        total += s.index.size();
+    }
+    return total;
+}
+
+}
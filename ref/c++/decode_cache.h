@@ -0,0 +1,89 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef DECODE_CACHE_H_
+#define DECODE_CACHE_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "payment_request.h"
+
+namespace payment_request
+{
+
+/** Decoded invoices, keyed by the invoice string, for callers that decode the same invoice again
+ *  and again. A repeated decode costs a hash of the string and a lookup. Entries are immutable and
+ *  handed out shared, so they stay valid after eviction. Each owns its route hints, fallback
+ *  addresses and tagged fields, in one allocation of their size, so cached invoices can be paid
+ *  through private channels and encode back to the string they came from. The cache is split
+ *  into shards, each with its own lock and a CLOCK over a fixed number of slots; expired invoices
+ *  go first. */
+class decode_cache {
+public:
+	/** Room for @capacity invoices, rounded up to a whole number per shard. */
+	explicit decode_cache(size_t capacity = 4096);
+
+	/** Decode @invoice as decode() does with a hint_arena, or return the copy decoded earlier. @now is the current
+	 *  unix time: invoices that expired by then are not kept. Returns NULL if the invoice is invalid. */
+	std::shared_ptr<const struct bolt11> decode(std::string_view invoice, uint64_t now);
+	std::shared_ptr<const struct bolt11> decode(std::string_view invoice);
+
+	uint64_t hits() const;
+	uint64_t misses() const;
+	size_t size() const;
+
+private:
+	static constexpr size_t SHARDS = 16;
+
+	struct slot {
+		std::string invoice;
+		std::shared_ptr<const struct bolt11> decoded;
+		uint64_t hash;
+		uint64_t expires_at;                    // timestamp + expiry
+		bool referenced;                        // looked up since the clock hand last passed
+	};
+
+	struct alignas(64) shard {
+		mutable std::mutex lock;
+		std::vector<slot> slots;
+		std::unordered_map<uint64_t, size_t> index;     // hash of the invoice -> slot
+		size_t hand = 0;
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+	};
+
+	shard shards[SHARDS];
+	size_t slots_per_shard;
+
+	size_t take_slot(shard& s, uint64_t now);
+};
+
+}
+
+#endif  // DECODE_CACHE_H_
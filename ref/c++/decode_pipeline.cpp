@@ -0,0 +1,320 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "decode_pipeline.h"
+#include "decode_stats.h"
+#include "sha256.h"
+
+#include <assert.h>
+
+#include <algorithm>
+#include <chrono>
+
+namespace
+{
+
+/* Signed messages hashed at once; as many as the widest sha256 implementation takes. */
+const size_t HASH_GROUP = 8;
+
+/* Nothing to do for @rounds tries in a row: spin at first, then give the core away, then sleep,
+ * longer the longer it lasts. A long idle stage takes up to 200us to notice new work. */
+void idle_wait(unsigned rounds)
+{
+    if (rounds < 16) return;
+    if (rounds < 64) return std::this_thread::yield();
+    std::this_thread::sleep_for(std::chrono::microseconds(rounds < 256 ? 10 : 200));
+}
+
+}
+
+namespace payment_request
+{
+
+const char* name(pipeline_stage stage) {
+    switch (stage) {
+        case pipeline_stage::BECH32: return "bech32";
+        case pipeline_stage::FIELDS: return "fields";
+        case pipeline_stage::HASH: return "hash";
+        case pipeline_stage::SIGNATURE: return "signature";
+        case pipeline_stage::COUNT: break;
+    }
+    return "unknown";
+}
+
+/** A bounded queue of batch numbers for any number of producers and consumers, without locks:
+ *  each cell has a sequence number that tells whether it is ready to be written or read in the
+ *  current lap, and a position is claimed with a compare and swap (Vyukov's bounded MPMC queue).
+ *  Every batch is in one queue at most, so one that holds them all never fills up. */
+class decode_pipeline::batch_queue {
+public:
+    explicit batch_queue(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) size *= 2;
+        cells.reset(new cell[size]);
+        mask = size - 1;
+        for (size_t i = 0; i < size; ++i) cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    bool push(uint32_t value) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        cell* c;
+        for (;;) {
+            c = &cells[pos & mask];
+            const intptr_t lap = c->sequence.load(std::memory_order_acquire) - pos;
+            if (lap < 0) return false;                  // full
+            if (lap == 0 && tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            if (lap > 0) pos = tail.load(std::memory_order_relaxed);
+        }
+        c->value = value;
+        c->sequence.store(pos + 1, std::memory_order_release);
+        const size_t now = depth();
+        size_t seen = deepest.load(std::memory_order_relaxed);
+        while (now > seen && !deepest.compare_exchange_weak(seen, now, std::memory_order_relaxed)) {}
+        return true;
+    }
+
+    bool pop(uint32_t* value) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        cell* c;
+        for (;;) {
+            c = &cells[pos & mask];
+            const intptr_t lap = c->sequence.load(std::memory_order_acquire) - (pos + 1);
+            if (lap < 0) return false;                  // empty
+            if (lap == 0 && head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            if (lap > 0) pos = head.load(std::memory_order_relaxed);
+        }
+        *value = c->value;
+        c->sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t depth() const {
+        const size_t pushed = tail.load(std::memory_order_relaxed), popped = head.load(std::memory_order_relaxed);
+        return pushed > popped ? pushed - popped : 0;
+    }
+
+    size_t max_depth() const { return deepest.load(std::memory_order_relaxed); }
+
+private:
+    struct alignas(64) cell {
+        std::atomic<size_t> sequence;
+        uint32_t value;
+    };
+
+    std::unique_ptr<cell[]> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> tail{0};
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> deepest{0};
+};
+
+/* What a batch carries from stage to stage. */
+struct decode_pipeline::batch {
+    size_t count = 0;
+    std::unique_ptr<std::string_view[]> invoices;
+    std::unique_ptr<int[]> status;
+    std::unique_ptr<bech32::DecodeBuffer[]> dec;            // from BECH32 to FIELDS
+    std::unique_ptr<struct bolt11[]> decoded;
+    std::unique_ptr<struct signing_data[]> signed_data;     // from FIELDS to HASH
+};
+
+decode_pipeline::decode_pipeline(const pipeline_config& config_in, pipeline_sink sink_in, void* context_in)
+    : config(config_in), sink(sink_in), context(context_in) {
+    for (auto& workers_in : config.workers) workers_in = std::max(1u, workers_in);
+    config.batch_size = std::max<size_t>(1, config.batch_size);
+    config.batches = std::max<size_t>(1, config.batches);
+
+    pool.reset(new batch[config.batches]);
+    free_batches.reset(new batch_queue(config.batches));
+    for (auto& queue : queues) queue.reset(new batch_queue(config.batches));
+    for (size_t b = 0; b < config.batches; ++b) {
+        pool[b].invoices.reset(new std::string_view[config.batch_size]);
+        pool[b].status.reset(new int[config.batch_size]);
+        pool[b].dec.reset(new bech32::DecodeBuffer[config.batch_size]);
+        pool[b].decoded.reset(new struct bolt11[config.batch_size]);
+        pool[b].signed_data.reset(new struct signing_data[config.batch_size]);
+        free_batches->push(b);
+    }
+    for (size_t s = 0; s < PIPELINE_STAGES; ++s) {
+        for (unsigned t = 0; t < config.workers[s]; ++t)
+            workers.emplace_back(&decode_pipeline::work, this, static_cast<pipeline_stage>(s));
+    }
+}
+
+decode_pipeline::~decode_pipeline() {
+    flush();
+    stopping.store(true, std::memory_order_release);
+    for (auto& thread : workers) thread.join();
+}
+
+/** Fill a free batch with @count invoices, at most a batch, and queue it for the first stage.
+ *  Returns false if no batch is free. */
+bool decode_pipeline::fill(const std::string_view* invoices_in, size_t count) {
+    uint32_t b;
+    in_flight.fetch_add(1, std::memory_order_relaxed);
+    if (!free_batches->pop(&b)) {
+        in_flight.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+    std::copy(invoices_in, invoices_in + count, pool[b].invoices.get());
+    pool[b].count = count;
+    const bool queued = queues[0]->push(b);
+    assert(queued);
+    (void)queued;
+    return true;
+}
+
+void decode_pipeline::submit(const std::string_view* invoices_in, size_t count) {
+    unsigned rounds = 0;
+    while (count) {
+        const size_t size = std::min(count, config.batch_size);
+        if (!fill(invoices_in, size)) {
+            if (rounds == 0) submit_waits.fetch_add(1, std::memory_order_relaxed);
+            idle_wait(rounds++);
+            continue;
+        }
+        rounds = 0;
+        invoices_in += size;
+        count -= size;
+    }
+}
+
+size_t decode_pipeline::try_submit(const std::string_view* invoices_in, size_t count) {
+    size_t queued = 0;
+    while (queued < count) {
+        const size_t size = std::min(count - queued, config.batch_size);
+        if (!fill(invoices_in + queued, size)) break;
+        queued += size;
+    }
+    return queued;
+}
+
+void decode_pipeline::flush() {
+    for (unsigned rounds = 0; in_flight.load(std::memory_order_acquire) != 0; ++rounds) idle_wait(rounds);
+}
+
+pipeline_metrics decode_pipeline::metrics() const {
+    pipeline_metrics out;
+    for (size_t s = 0; s < PIPELINE_STAGES; ++s) {
+        out.depth[s] = queues[s]->depth();
+        out.max_depth[s] = queues[s]->max_depth();
+        out.batches[s] = counters[s].batches.load(std::memory_order_relaxed);
+        out.busy_ns[s] = counters[s].busy_ns.load(std::memory_order_relaxed);
+    }
+    out.submit_waits = submit_waits.load(std::memory_order_relaxed);
+    out.invoices = delivered.load(std::memory_order_relaxed);
+    out.rejected = rejected.load(std::memory_order_relaxed);
+    return out;
+}
+
+/** Take batches off the queue of @stage until the pipeline stops, and hand each to the next
+ *  stage; the last one hands them to the sink and frees them. */
+void decode_pipeline::work(pipeline_stage stage) {
+    const size_t s = static_cast<size_t>(stage);
+    unsigned rounds = 0;
+    for (;;) {
+        uint32_t b;
+        if (!queues[s]->pop(&b)) {
+            if (stopping.load(std::memory_order_acquire)) return;
+            idle_wait(rounds++);
+            continue;
+        }
+        rounds = 0;
+        const auto start = std::chrono::steady_clock::now();
+        run(stage, pool[b]);
+        counters[s].busy_ns.fetch_add(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(),
+            std::memory_order_relaxed);
+        counters[s].batches.fetch_add(1, std::memory_order_relaxed);
+        if (s + 1 < PIPELINE_STAGES) {
+            const bool queued = queues[s + 1]->push(b);
+            assert(queued);
+            (void)queued;
+            continue;
+        }
+        const batch& done = pool[b];
+        sink(done.invoices.get(), done.decoded.get(), done.status.get(), done.count, context);
+        delivered.fetch_add(done.count, std::memory_order_relaxed);
+        rejected.fetch_add(std::count(done.status.get(), done.status.get() + done.count, -1), std::memory_order_relaxed);
+        free_batches->push(b);
+        in_flight.fetch_sub(1, std::memory_order_release);
+    }
+}
+
+/** Run one stage over a batch. An invoice that fails a stage is skipped by the later ones; its
+ *  decode ends in decode_stats where it failed, and that of the others once their signature is
+ *  checked, as for decode(). */
+void decode_pipeline::run(pipeline_stage stage, batch& b) {
+    switch (stage) {
+    case pipeline_stage::BECH32:
+        for (size_t i = 0; i < b.count; ++i) {
+            const uint64_t start = stats::ticks();
+            const bool valid = bech32::decode(b.invoices[i], b.dec[i]) != bech32::Encoding::INVALID;
+            stats::record(decode_stage::BECH32, start);
+            b.status[i] = valid ? 0 : stats::finish(stats::reject_bech32(b.dec[i]));
+        }
+        break;
+    case pipeline_stage::FIELDS:
+        for (size_t i = 0; i < b.count; ++i) {
+            if (b.status[i] == 0 && decode(b.dec[i], b.decoded[i], b.signed_data[i]) != 0) b.status[i] = stats::finish(-1);
+        }
+        break;
+    case pipeline_stage::HASH: {
+        const unsigned char* messages[HASH_GROUP];
+        size_t sizes[HASH_GROUP], rows[HASH_GROUP];
+        unsigned char hashes[HASH_GROUP][32];
+        size_t grouped = 0;
+        for (size_t i = 0; i <= b.count; ++i) {
+            if (i < b.count && b.status[i] != 0) continue;
+            if (i < b.count) {
+                messages[grouped] = b.signed_data[i].preimage;
+                sizes[grouped] = b.signed_data[i].size;
+                rows[grouped++] = i;
+            }
+            if (grouped == HASH_GROUP || (i == b.count && grouped)) {
+                sha256::hash_many(messages, sizes, grouped, hashes);
+                for (size_t n = 0; n < grouped; ++n) std::copy(hashes[n], hashes[n] + 32, b.decoded[rows[n]].signing_hash);
+                grouped = 0;
+            }
+        }
+        break;
+    }
+    case pipeline_stage::SIGNATURE:
+        /* The runs of invoices that got this far are checked together. */
+        for (size_t begin = 0; begin < b.count;) {
+            if (b.status[begin] != 0) {
+                begin++;
+                continue;
+            }
+            size_t end = begin;
+            while (end < b.count && b.status[end] == 0) end++;
+            check_signatures(&b.decoded[begin], end - begin, &b.status[begin], config.cache);
+            for (size_t i = begin; i < end; ++i) stats::finish(b.status[i]);
+            begin = end;
+        }
+        break;
+    case pipeline_stage::COUNT:
+        break;
+    }
+}
+
+}
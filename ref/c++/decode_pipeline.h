@@ -0,0 +1,134 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef DECODE_PIPELINE_H_
+#define DECODE_PIPELINE_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "payment_request.h"
+
+namespace payment_request
+{
+
+class recovery_cache;
+
+/** The stages of a decode_pipeline, in order. */
+enum class pipeline_stage : uint8_t {
+	BECH32,         //! bech32::decode: the charset, the case and the checksum
+	FIELDS,         //! the hrp, the timestamp, the tagged fields and the signed message
+	HASH,           //! the signing hashes, several messages at once with sha256::hash_many
+	SIGNATURE,      //! check_signatures, then the sink
+	COUNT
+};
+
+static constexpr size_t PIPELINE_STAGES = static_cast<size_t>(pipeline_stage::COUNT);
+
+const char* name(pipeline_stage stage);
+
+struct pipeline_config {
+	unsigned workers[PIPELINE_STAGES] = {1, 1, 1, 1};       // threads per stage, at least 1
+	size_t batch_size = 32;                                 // invoices per batch
+	size_t batches = 16;                                    // batches in flight: bounds memory and every queue
+	recovery_cache* cache = NULL;                           // looked up before checking a signature, if given
+};
+
+/** Counters of a pipeline, read while it runs. Depths are in batches. */
+struct pipeline_metrics {
+	size_t depth[PIPELINE_STAGES];                          // waiting for each stage now
+	size_t max_depth[PIPELINE_STAGES];                      // the most seen waiting
+	uint64_t batches[PIPELINE_STAGES];                      // batches each stage went through
+	uint64_t busy_ns[PIPELINE_STAGES];                      // time its workers spent on them
+	uint64_t submit_waits;                                  // times submit() found no free batch
+	uint64_t invoices;                                      // invoices that reached the sink
+	uint64_t rejected;                                      // of which failed
+};
+
+/** Called with a batch of invoices that went through every stage, and the context given. @status[i]
+ *  is 0 if @invoices[i] was decoded into @decoded[i] and its signature checked, -1 if not. */
+typedef void (*pipeline_sink)(const std::string_view* invoices, const struct bolt11* decoded, const int* status,
+                              size_t count, void* context);
+
+/** Decodes invoices in stages, each with its own worker threads, so cores can be given to the
+ *  stages that cost the most. A fixed set of batches goes round: submit() takes a free one, each
+ *  stage hands it to the next through a bounded lock-free queue, and the last gives it back once
+ *  the sink has seen it. A burst therefore waits in submit() rather than growing the queues.
+ *  Batches may reach the sink out of order, and from several threads at once if the last stage
+ *  has several workers. Route hints and fallback addresses are not kept. */
+class decode_pipeline {
+public:
+	decode_pipeline(const pipeline_config& config, pipeline_sink sink, void* context = NULL);
+	/** Waits for the invoices in flight, then stops the workers. */
+	~decode_pipeline();
+
+	decode_pipeline(const decode_pipeline&) = delete;
+	decode_pipeline& operator=(const decode_pipeline&) = delete;
+
+	/** Queue @count invoices, which must stay valid until the sink has seen them, in batches of
+	 *  batch_size. Waits for a free batch when all are in flight. Safe to call from several
+	 *  threads. */
+	void submit(const std::string_view* invoices, size_t count);
+	/** As above, but only while batches are free. Returns how many invoices were queued. */
+	size_t try_submit(const std::string_view* invoices, size_t count);
+
+	/** Wait until no batch is in flight: everything submitted before has reached the sink. */
+	void flush();
+
+	pipeline_metrics metrics() const;
+
+private:
+	class batch_queue;
+	struct batch;
+	struct alignas(64) stage_counters {
+		std::atomic<uint64_t> batches{0};
+		std::atomic<uint64_t> busy_ns{0};
+	};
+
+	pipeline_config config;
+	pipeline_sink sink;
+	void* context;
+	std::unique_ptr<batch[]> pool;
+	/* The free batches, then the batches waiting for each stage. */
+	std::unique_ptr<batch_queue> free_batches;
+	std::unique_ptr<batch_queue> queues[PIPELINE_STAGES];
+	stage_counters counters[PIPELINE_STAGES];
+	std::atomic<size_t> in_flight{0};
+	std::atomic<uint64_t> submit_waits{0};
+	std::atomic<uint64_t> delivered{0};
+	std::atomic<uint64_t> rejected{0};
+	std::atomic<bool> stopping{false};
+	std::vector<std::thread> workers;
+
+	bool fill(const std::string_view* invoices, size_t count);
+	void work(pipeline_stage stage);
+	void run(pipeline_stage stage, batch& b);
+};
+
+}
+
+#endif  // DECODE_PIPELINE_H_
@@ -0,0 +1,225 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "decode_stats.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "bech32.h"
+
+namespace payment_request
+{
+
+const char* name(reject_reason reason) {
+    switch (reason) {
+        case reject_reason::NONE: return "none";
+        case reject_reason::CHARSET: return "charset";
+        case reject_reason::CHECKSUM: return "checksum";
+        case reject_reason::PREFIX: return "prefix";
+        case reject_reason::AMOUNT: return "amount";
+        case reject_reason::TOO_SHORT: return "too short";
+        case reject_reason::FIELD: return "field";
+        case reject_reason::MISSING_FIELD: return "missing field";
+        case reject_reason::SIGNATURE: return "signature";
+        case reject_reason::COUNT: break;
+    }
+    return "unknown";
+}
+
+const char* name(decode_stage stage) {
+    switch (stage) {
+        case decode_stage::BECH32: return "bech32";
+        case decode_stage::HEADER: return "header";
+        case decode_stage::FIELDS: return "fields";
+        case decode_stage::HASH: return "hash";
+        case decode_stage::SIGNATURE: return "signature";
+        case decode_stage::COUNT: break;
+    }
+    return "unknown";
+}
+
+}
+
+#ifdef NO_DECODE_STATS
+
+namespace payment_request
+{
+
+decode_stats collect_decode_stats() {
+    decode_stats out;
+    memset(&out, 0, sizeof(out));
+    return out;
+}
+
+reject_reason last_reject_reason() {
+    return reject_reason::NONE;
+}
+
+}
+
+#else
+
+namespace
+{
+
+using payment_request::decode_stage;
+using payment_request::decode_stats;
+using payment_request::reject_reason;
+
+const size_t REASONS = static_cast<size_t>(reject_reason::COUNT);
+const size_t STAGES = static_cast<size_t>(decode_stage::COUNT);
+
+/* The counters of one thread. Only that thread writes them, so an increment is a relaxed load and
+ * store, with no locked instruction; collect_decode_stats() may read them at any time. */
+struct thread_counters {
+    std::atomic<uint64_t> decodes{0};
+    std::atomic<uint64_t> rejected[REASONS] = {};
+    std::atomic<uint64_t> latency[STAGES][decode_stats::BUCKETS] = {};
+    reject_reason pending = reject_reason::NONE;     // why the decode in progress fails
+    reject_reason last = reject_reason::NONE;
+
+    void add_to(decode_stats& out) const {
+        out.decodes += decodes.load(std::memory_order_relaxed);
+        for (size_t r = 0; r < REASONS; ++r) out.rejected[r] += rejected[r].load(std::memory_order_relaxed);
+        for (size_t s = 0; s < STAGES; ++s)
+            for (size_t b = 0; b < decode_stats::BUCKETS; ++b)
+                out.latency[s][b] += latency[s][b].load(std::memory_order_relaxed);
+    }
+};
+
+void bump(std::atomic<uint64_t>& counter, uint64_t n = 1)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/* Every live thread's counters, and the sum of those of the threads that exited. */
+struct registry {
+    std::mutex lock;
+    std::vector<const thread_counters*> live;
+    decode_stats exited = {};
+};
+
+registry& global_registry()
+{
+    static registry r;
+    return r;
+}
+
+struct registration {
+    thread_counters counters;
+
+    registration() {
+        registry& r = global_registry();
+        std::lock_guard<std::mutex> guard(r.lock);
+        r.live.push_back(&counters);
+    }
+
+    ~registration() {
+        registry& r = global_registry();
+        std::lock_guard<std::mutex> guard(r.lock);
+        counters.add_to(r.exited);
+        r.live.erase(std::find(r.live.begin(), r.live.end(), &counters));
+    }
+};
+
+thread_counters& local()
+{
+    thread_local registration r;
+    return r.counters;
+}
+
+}
+
+namespace payment_request
+{
+
+decode_stats collect_decode_stats() {
+    registry& r = global_registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+    decode_stats out = r.exited;
+    for (const thread_counters* counters : r.live) counters->add_to(out);
+    return out;
+}
+
+reject_reason last_reject_reason() {
+    return local().last;
+}
+
+namespace stats
+{
+
+uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+uint64_t record(decode_stage stage, uint64_t start) {
+    const uint64_t now = ticks();
+    const uint64_t elapsed = now - start;
+    const size_t bucket = std::min<size_t>(63 - __builtin_clzll(elapsed | 1), decode_stats::BUCKETS - 1);
+    bump(local().latency[static_cast<size_t>(stage)][bucket]);
+    return now;
+}
+
+int reject(reject_reason reason) {
+    local().pending = reason;
+    return -1;
+}
+
+int reject_bech32(const bech32::DecodeBuffer& dec) {
+    return reject(dec.malformed ? reject_reason::CHARSET : reject_reason::CHECKSUM);
+}
+
+void reject_signatures(size_t count) {
+    bump(local().rejected[static_cast<size_t>(reject_reason::SIGNATURE)], count);
+}
+
+int finish(int status) {
+    thread_counters& counters = local();
+    bump(counters.decodes);
+    if (status != 0 && counters.pending != reject_reason::NONE) bump(counters.rejected[static_cast<size_t>(counters.pending)]);
+    /* A decode that failed with nothing pending failed its signature, which check_signatures()
+     * counted already. */
+    counters.last = status == 0 ? reject_reason::NONE :
+        counters.pending != reject_reason::NONE ? counters.pending : reject_reason::SIGNATURE;
+    counters.pending = reject_reason::NONE;
+    return status;
+}
+
+}
+
+}
+
+#endif
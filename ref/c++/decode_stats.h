@@ -0,0 +1,118 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef DECODE_STATS_H_
+#define DECODE_STATS_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace bech32
+{
+struct DecodeBuffer;
+}
+
+namespace payment_request
+{
+
+/** Why an invoice was rejected. */
+enum class reject_reason : uint8_t {
+	NONE,           //! not rejected
+	CHARSET,        //! not a bech32 string: no separator, invalid character, mixed case or too long
+	CHECKSUM,       //! a bech32 string whose checksum does not match
+	PREFIX,         //! the prefix is not one of a known network
+	AMOUNT,         //! malformed amount, multiplier or sub-millisatoshi precision
+	TOO_SHORT,      //! the data part cannot hold the timestamp and the signature
+	FIELD,          //! a tagged field runs past the signature or holds a malformed value
+	MISSING_FIELD,  //! no payment hash or no payment secret
+	SIGNATURE,      //! the signature is malformed or does not match the invoice
+	COUNT
+};
+
+/** The stages of a decode, timed separately. */
+enum class decode_stage : uint8_t {
+	BECH32,         //! charset validation, case folding and the checksum
+	HEADER,         //! the prefix, the amount, the timestamp and reading the signature
+	FIELDS,         //! the tagged fields, and regrouping the signed data into bytes
+	HASH,           //! the signing hash, for single decodes; batches hash with sha256::hash_many
+	SIGNATURE,      //! check_signatures, one sample per call however many invoices it checks
+	COUNT
+};
+
+const char* name(reject_reason reason);
+const char* name(decode_stage stage);
+
+/** Counters of every decode since the program started, summed over all threads. Build with
+ *  NO_DECODE_STATS to compile the instrumentation out; every counter then stays 0. */
+struct decode_stats {
+	static constexpr size_t BUCKETS = 32;
+
+	uint64_t decodes;                               // calls to the decode functions
+	uint64_t rejected[static_cast<size_t>(reject_reason::COUNT)];   // invoices, by reason
+	/** latency[s][b] counts the times stage s took [2^b, 2^(b+1)) ticks. A tick is a TSC cycle
+	 *  on x86, a nanosecond elsewhere. A stage is counted once it completes, except bech32,
+	 *  which is counted for refused strings too. */
+	uint64_t latency[static_cast<size_t>(decode_stage::COUNT)][BUCKETS];
+};
+
+/** Sum the counters of every thread, those that exited included. Each thread only ever writes
+ *  its own counters, so decoding threads are not slowed down by this. */
+decode_stats collect_decode_stats();
+
+/** Why the last decode of the calling thread failed; NONE if it succeeded. */
+reject_reason last_reject_reason();
+
+/** Used by the decoder to fill the counters of the calling thread. */
+namespace stats
+{
+
+#ifdef NO_DECODE_STATS
+
+inline uint64_t ticks() { return 0; }
+inline uint64_t record(decode_stage, uint64_t) { return 0; }
+inline int reject(reject_reason) { return -1; }
+inline int reject_bech32(const bech32::DecodeBuffer&) { return -1; }
+inline void reject_signatures(size_t) {}
+inline int finish(int status) { return status; }
+
+#else
+
+/** The current time, in ticks. */
+uint64_t ticks();
+/** Count @stage as having run from @start until now, and return now. */
+uint64_t record(decode_stage stage, uint64_t start);
+/** Note why the decode in progress fails, and return -1 for the caller to return. */
+int reject(reject_reason reason);
+/** As above, for a string bech32::decode refused into @dec: tell a bad checksum from the rest. */
+int reject_bech32(const bech32::DecodeBuffer& dec);
+/** Count @count invoices whose signature was found invalid. */
+void reject_signatures(size_t count);
+/** End a decode that returned @status, and return it. */
+int finish(int status);
+
+#endif
+
+}
+
+}
+
+#endif  // DECODE_STATS_H_
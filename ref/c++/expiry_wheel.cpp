@@ -0,0 +1,282 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "expiry_wheel.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <random>
+
+namespace
+{
+
+const size_t MIN_INDEX_SIZE = 64;
+/* How many expiring invoices ahead advance() prefetches the index slot of. */
+const size_t INDEX_AHEAD = 4;
+
+/* The first slot after @after whose bit is set in @bits, which covers @slots slots; @slots if none. */
+size_t next_slot(const uint64_t* bits, size_t slots, size_t after)
+{
+    for (size_t s = after + 1; s < slots; s = (s / 64 + 1) * 64) {
+        const uint64_t word = bits[s / 64] >> (s % 64);
+        if (word) return s + __builtin_ctzll(word);
+    }
+    return slots;
+}
+
+}
+
+namespace payment_request
+{
+
+expiry_wheel::expiry_wheel(uint64_t now) : current(now) {
+    std::random_device random;
+    for (uint64_t& word : seed) word = (uint64_t{random()} << 32) | random();
+    allocate();                                 // node 0 marks an empty index slot
+    index.assign(MIN_INDEX_SIZE, 0);
+}
+
+uint32_t expiry_wheel::allocate() {
+    if (free_list) {
+        const uint32_t n = free_list;
+        free_list = at(n).position;
+        return n;
+    }
+    if (node_count % NODES_PER_BLOCK == 0) nodes.emplace_back(new node[NODES_PER_BLOCK]);
+    return node_count++;
+}
+
+void expiry_wheel::release(uint32_t n) {
+    at(n).position = free_list;
+    free_list = n;
+}
+
+void expiry_wheel::link(uint32_t n, uint32_t bucket) {
+    node& e = at(n);
+    e.bucket = bucket;
+    e.position = buckets[bucket].size();
+    buckets[bucket].push_back(n);
+    if (bucket < FAR) occupied[bucket / SLOTS][bucket % SLOTS / 64] |= uint64_t{1} << (bucket % 64);
+    if (bucket == FAR) far_min = std::min(far_min, e.expires_at);
+}
+
+/* The last node of the bucket takes the place of the one unlinked. */
+void expiry_wheel::unlink(uint32_t n) {
+    const node& e = at(n);
+    std::vector<uint32_t>& bucket = buckets[e.bucket];
+    const uint32_t last = bucket.back();
+    bucket[e.position] = last;
+    at(last).position = e.position;
+    bucket.pop_back();
+    if (e.bucket < FAR && bucket.empty())
+        occupied[e.bucket / SLOTS][e.bucket % SLOTS / 64] &= ~(uint64_t{1} << (e.bucket % 64));
+}
+
+/** Link a node into the slot of the lowest level that tells its expiry apart from the current time:
+ *  the level of the highest byte in which they differ. */
+void expiry_wheel::place(uint32_t n) {
+    const uint64_t expires_at = at(n).expires_at;
+    if (expires_at <= current) return link(n, DUE);
+    const size_t level = (63 - __builtin_clzll(expires_at ^ current)) / 8;
+    if (level >= LEVELS) return link(n, FAR);
+    link(n, level * SLOTS + ((expires_at >> (8 * level)) & (SLOTS - 1)));
+}
+
+/** The next time a bucket needs emptying, and which. A level's slots come in order, and all of them
+ *  before the next slot of the level above, so the first occupied slot of the lowest level with
+ *  one is next. Invoices beyond the last level are placed again when the top level wraps into the
+ *  span of the first of them. */
+bool expiry_wheel::next_event(uint64_t* time, uint32_t* bucket) const {
+    if (!buckets[DUE].empty()) {
+        *time = current;
+        *bucket = DUE;
+        return true;
+    }
+    for (size_t level = 0; level < LEVELS; ++level) {
+        const size_t shift = 8 * level;
+        const size_t slot = next_slot(occupied[level], SLOTS, (current >> shift) & (SLOTS - 1));
+        if (slot == SLOTS) continue;
+        *time = ((current >> (shift + 8)) << (shift + 8)) | (uint64_t{slot} << shift);
+        *bucket = level * SLOTS + slot;
+        return true;
+    }
+    if (buckets[FAR].empty()) return false;
+    const size_t shift = 8 * LEVELS;
+    *time = std::max(((current >> shift) + 1) << shift, far_min >> shift << shift);
+    *bucket = FAR;
+    return true;
+}
+
+uint32_t expiry_wheel::find(const unsigned char payment_hash[32]) const {
+    const uint64_t bits = index_bits(payment_hash);
+    const size_t mask = index.size() - 1;
+    for (size_t i = home_slot(bits); index[i]; i = (i + 1) & mask) {
+        if (slot_tag(index[i]) != slot_tag(bits)) continue;
+        const uint32_t n = index[i] & 0xffffffff;
+        if (memcmp(at(n).payment_hash, payment_hash, 32) == 0) return n;
+    }
+    return 0;
+}
+
+void expiry_wheel::index_insert(uint64_t slot) {
+    const size_t mask = index.size() - 1;
+    size_t i = home_slot(slot);
+    while (index[i]) i = (i + 1) & mask;
+    index[i] = slot;
+}
+
+/** Remove node @n, whose payment hash has @bits, from the index, shifting back the entries after it
+ *  that probed past its slot, so that no probe ends early. */
+void expiry_wheel::index_erase(uint32_t n, uint64_t bits) {
+    const size_t mask = index.size() - 1;
+    size_t hole = home_slot(bits);
+    while ((index[hole] & 0xffffffff) != n) hole = (hole + 1) & mask;
+    for (size_t i = (hole + 1) & mask; index[i]; i = (i + 1) & mask) {
+        const size_t home = home_slot(index[i]);
+        /* An entry stays if its home is cyclically in (hole, i]. */
+        const bool stays = hole <= i ? (home > hole && home <= i) : (home > hole || home <= i);
+        if (stays) continue;
+        index[hole] = index[i];
+        hole = i;
+    }
+    index[hole] = 0;
+}
+
+/* The index is kept at most half full, so a probe ends after about two slots. */
+void expiry_wheel::grow() {
+    if ((count + 1) * 2 <= index.size()) return;
+    std::vector<uint64_t> old(index.size() * 2, 0);
+    old.swap(index);
+    for (uint64_t slot : old) {
+        if (slot) index_insert(slot);
+    }
+}
+
+bool expiry_wheel::insert_locked(const unsigned char payment_hash[32], uint64_t expires_at) {
+    if (find(payment_hash)) return false;
+    grow();
+    const uint32_t n = allocate();
+    memcpy(at(n).payment_hash, payment_hash, 32);
+    at(n).expires_at = expires_at;
+    index_insert(slot_tag(index_bits(payment_hash)) | n);
+    place(n);
+    count++;
+    return true;
+}
+
+bool expiry_wheel::insert(const unsigned char payment_hash[32], uint64_t expires_at) {
+    std::lock_guard<std::mutex> guard(lock);
+    return insert_locked(payment_hash, expires_at);
+}
+
+bool expiry_wheel::insert(const struct bolt11& invoice) {
+    return insert_batch(&invoice, 1) == 1;
+}
+
+size_t expiry_wheel::insert_batch(const struct bolt11* invoices, size_t count_in, bool* inserted) {
+    std::lock_guard<std::mutex> guard(lock);
+    size_t tracked = 0;
+    for (size_t i = 0; i < count_in; ++i) {
+        /* timestamp + expiry, saturated: an expiry too large to add never comes. */
+        const uint64_t expires_at = invoices[i].timestamp + invoices[i].expiry;
+        const bool ok = insert_locked(invoices[i].payment_hash, expires_at < invoices[i].timestamp ? UINT64_MAX : expires_at);
+        if (inserted) inserted[i] = ok;
+        tracked += ok;
+    }
+    return tracked;
+}
+
+bool expiry_wheel::cancel(const unsigned char payment_hash[32]) {
+    std::lock_guard<std::mutex> guard(lock);
+    const uint32_t n = find(payment_hash);
+    if (!n) return false;
+    unlink(n);
+    index_erase(n, index_bits(payment_hash));
+    release(n);
+    count--;
+    return true;
+}
+
+/** Empty buckets as their time comes, each under the lock: the invoices not due yet move down a
+ *  level, and the due ones are collected for the callback, which runs once the bucket is done. */
+size_t expiry_wheel::advance(uint64_t now, expiry_callback callback, void* context) {
+    std::vector<expired_invoice> expired;
+    size_t total = 0;
+    std::unique_lock<std::mutex> guard(lock);
+    uint64_t time;
+    uint32_t bucket;
+    while (next_event(&time, &bucket) && time <= now) {
+        current = std::max(current, time);
+        /* The bucket is swapped out, as invoices beyond the last level may be placed in it again. */
+        emptying.swap(buckets[bucket]);
+        if (bucket < FAR) occupied[bucket / SLOTS][bucket % SLOTS / 64] &= ~(uint64_t{1} << (bucket % 64));
+        if (bucket == FAR) far_min = UINT64_MAX;
+        /* The index bits of each node are worked out once, a few nodes ahead, for the prefetch. */
+        uint64_t ahead[INDEX_AHEAD];
+        for (size_t i = 0; i < std::min(INDEX_AHEAD, emptying.size()); ++i) ahead[i] = index_bits(at(emptying[i]).payment_hash);
+        for (size_t i = 0; i < emptying.size(); ++i) {
+            const uint64_t bits = ahead[i % INDEX_AHEAD];
+            if (i + 8 < emptying.size()) __builtin_prefetch(&at(emptying[i + 8]));
+            if (i + INDEX_AHEAD < emptying.size()) {
+                ahead[i % INDEX_AHEAD] = index_bits(at(emptying[i + INDEX_AHEAD]).payment_hash);
+                __builtin_prefetch(&index[home_slot(ahead[i % INDEX_AHEAD])]);
+            }
+            const uint32_t n = emptying[i];
+            const node& e = at(n);
+            if (e.expires_at > current) {
+                place(n);                       // down a level
+                continue;
+            }
+            expired.emplace_back();
+            memcpy(expired.back().payment_hash, e.payment_hash, 32);
+            expired.back().expires_at = e.expires_at;
+            index_erase(n, bits);
+            release(n);
+            count--;
+        }
+        emptying.clear();
+        if (expired.empty()) continue;
+        guard.unlock();
+        for (size_t i = 0; i < expired.size(); i += BATCH_SIZE)
+            callback(&expired[i], std::min(BATCH_SIZE, expired.size() - i), context);
+        total += expired.size();
+        expired.clear();
+        guard.lock();
+    }
+    current = std::max(current, now);
+    return total;
+}
+
+size_t expiry_wheel::size() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return count;
+}
+
+size_t expiry_wheel::memory_usage() const {
+    std::lock_guard<std::mutex> guard(lock);
+    size_t bytes = nodes.size() * NODES_PER_BLOCK * sizeof(node) + index.size() * sizeof(uint64_t);
+    for (const auto& bucket : buckets) bytes += bucket.capacity() * sizeof(uint32_t);
+    return bytes + emptying.capacity() * sizeof(uint32_t);
+}
+
+}
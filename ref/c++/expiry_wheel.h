@@ -0,0 +1,136 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef EXPIRY_WHEEL_H_
+#define EXPIRY_WHEEL_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "hash_index.h"
+#include "payment_request.h"
+
+namespace payment_request
+{
+
+/** An invoice whose expiry came. */
+struct expired_invoice {
+	unsigned char payment_hash[32];
+	uint64_t expires_at;                            // timestamp + expiry, in unix time
+};
+
+/** Called with up to expiry_wheel::BATCH_SIZE invoices that expired, and the context given. */
+typedef void (*expiry_callback)(const struct expired_invoice* batch, size_t count, void* context);
+
+/** Open invoices, keyed by payment hash, each expired exactly once when its time comes. Expiry times
+ *  are kept in a hierarchical timing wheel of one-second slots: four levels of 256 slots cover 2^32
+ *  seconds ahead, each level 256 times coarser than the one below, and an invoice moves down a level
+ *  when its slot comes, so it is touched at most four times whatever the number of open invoices.
+ *  Slots are arrays of node numbers, walked in order with the nodes ahead prefetched. Inserting and
+ *  cancelling are O(1). An invoice takes a 48-byte node, a place in a slot and two to four slots of
+ *  the index; nodes are reused. All calls are thread safe; expiry callbacks run without the lock
+ *  held, so they may insert and cancel. */
+class expiry_wheel {
+public:
+	static constexpr size_t BATCH_SIZE = 256;
+
+	/** Start the wheel at unix time @now. */
+	explicit expiry_wheel(uint64_t now);
+
+	/** Track an invoice until @expires_at. Returns false if @payment_hash is tracked already. One
+	 *  that is due already expires on the next advance(). */
+	bool insert(const unsigned char payment_hash[32], uint64_t expires_at);
+	/** Track a decoded invoice until its timestamp + expiry. */
+	bool insert(const struct bolt11& invoice);
+	/** Track @count decoded invoices, taking the lock once. @inserted[i] is false for one whose
+	 *  payment hash is tracked already, if @inserted is given. Returns the number tracked. */
+	size_t insert_batch(const struct bolt11* invoices, size_t count, bool* inserted = NULL);
+
+	/** Stop tracking the invoice with @payment_hash. Returns false if it is not tracked, which
+	 *  includes one that expired already. */
+	bool cancel(const unsigned char payment_hash[32]);
+
+	/** Move the wheel to unix time @now, handing every invoice that expired by then to @callback
+	 *  in batches. Returns how many expired. */
+	size_t advance(uint64_t now, expiry_callback callback, void* context = NULL);
+
+	size_t size() const;
+	/** Bytes held for nodes, slots and the index. */
+	size_t memory_usage() const;
+
+private:
+	static constexpr size_t LEVELS = 4;
+	static constexpr size_t SLOTS = 256;
+	/* Buckets: the slots of each level, then invoices beyond the last level, then due ones. */
+	static constexpr uint32_t FAR = LEVELS * SLOTS;
+	static constexpr uint32_t DUE = FAR + 1;
+	static constexpr uint32_t BUCKETS = DUE + 1;
+	static constexpr size_t NODES_PER_BLOCK = 1 << 12;
+
+	struct node {
+		unsigned char payment_hash[32];
+		uint64_t expires_at;
+		uint32_t bucket;
+		uint32_t position;                      // in the bucket; the next free node, while free
+	};
+
+	mutable std::mutex lock;
+	uint64_t current;                               // expiries up to here were handed out
+	std::vector<std::unique_ptr<node[]> > nodes;
+	uint32_t node_count = 0;                        // nodes handed out, node 0 included
+	uint32_t free_list = 0;                         // 0 if none is free
+	size_t count = 0;
+	std::vector<uint32_t> buckets[BUCKETS];
+	uint64_t occupied[LEVELS][SLOTS / 64] = {};
+	uint64_t far_min = UINT64_MAX;                  // no later than the first expiry beyond the levels
+	std::vector<uint32_t> emptying;                 // the bucket advance() is emptying
+	/* Open-addressing index by payment hash, probed linearly from keyed_bits() under seed, as the
+	 * hashes come from whoever wrote the invoices. Slots hold the node number in the low 32 bits,
+	 * 0 if empty, and the slot_tag() of the key bits in the high ones. Unlike the other tables the
+	 * home slot is picked from those same high bits, so that an erase finds the home of the entries
+	 * after it, and grow() moves them, without hashing their keys again. */
+	std::vector<uint64_t> index;
+	uint64_t seed[2];                               // random per wheel
+
+	node& at(uint32_t n) { return nodes[n / NODES_PER_BLOCK][n % NODES_PER_BLOCK]; }
+	const node& at(uint32_t n) const { return nodes[n / NODES_PER_BLOCK][n % NODES_PER_BLOCK]; }
+	uint32_t allocate();
+	void release(uint32_t n);
+	void link(uint32_t n, uint32_t bucket);
+	void unlink(uint32_t n);
+	void place(uint32_t n);
+	bool next_event(uint64_t* time, uint32_t* bucket) const;
+	uint64_t index_bits(const unsigned char payment_hash[32]) const { return keyed_bits(payment_hash, seed); }
+	size_t home_slot(uint64_t bits) const { return (bits >> 32) & (index.size() - 1); }
+	uint32_t find(const unsigned char payment_hash[32]) const;
+	void index_insert(uint64_t slot);
+	void index_erase(uint32_t n, uint64_t bits);
+	void grow();
+	bool insert_locked(const unsigned char payment_hash[32], uint64_t expires_at);
+};
+
+}
+
+#endif  // EXPIRY_WHEEL_H_
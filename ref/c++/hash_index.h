@@ -0,0 +1,78 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef HASH_INDEX_H_
+#define HASH_INDEX_H_ 1
+
+#include <stdint.h>
+#include <string.h>
+
+namespace payment_request
+{
+
+/* The indexes by payment hash or secret are open-addressing tables of uint64 slots, probed
+ * linearly. A slot holds the position of its entry in the low 32 bits, 0 if empty, and a tag from
+ * the key in the high ones, which skips most mismatches without reading the entry. */
+
+/** The bits of @key a table is probed from: SipHash-2-4 of the 32 bytes, under the 128-bit @seed
+ *  of the table. Payment hashes and secrets are whatever the invoice writer put in them, so a table
+ *  probed from their bare first bytes could be made to pile them into one run of slots. */
+inline uint64_t keyed_bits(const unsigned char key[32], const uint64_t seed[2])
+{
+	uint64_t v0 = 0x736f6d6570736575ULL ^ seed[0], v1 = 0x646f72616e646f6dULL ^ seed[1];
+	uint64_t v2 = 0x6c7967656e657261ULL ^ seed[0], v3 = 0x7465646279746573ULL ^ seed[1];
+	auto rotl = [](uint64_t x, int b) { return (x << b) | (x >> (64 - b)); };
+	auto round = [&]() {
+		v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+		v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+		v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+		v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+	};
+	/* Four whole words, then the final block, which only holds the length. */
+	for (int i = 0; i < 4; ++i) {
+		uint64_t m;
+		memcpy(&m, key + 8 * i, 8);
+		v3 ^= m;
+		round();
+		round();
+		v0 ^= m;
+	}
+	const uint64_t last = uint64_t{32} << 56;
+	v3 ^= last;
+	round();
+	round();
+	v0 ^= last;
+	v2 ^= 0xff;
+	for (int i = 0; i < 4; ++i) round();
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/** The tag a slot keeps for @bits: their high half, which is not used to pick the slot in tables
+ *  of up to 2^32 slots. */
+inline uint64_t slot_tag(uint64_t bits)
+{
+	return bits & 0xffffffff00000000ULL;
+}
+
+}
+
+#endif  // HASH_INDEX_H_
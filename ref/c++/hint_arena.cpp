@@ -0,0 +1,49 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "hint_arena.h"
+
+#include <assert.h>
+
+namespace payment_request
+{
+
+void* hint_arena::allocate_bytes(size_t size) {
+    /* Every hint type needs at most 8-byte alignment. */
+    const size_t offset = (used + 7) & ~size_t{7};
+    assert(size <= BLOCK_SIZE);
+    if (offset + size > BLOCK_SIZE || blocks.empty()) {
+        if (!blocks.empty()) ++current;
+        if (current == blocks.size()) blocks.emplace_back(new unsigned char[BLOCK_SIZE]);
+        used = size;
+        return blocks[current].get();
+    }
+    used = offset + size;
+    return blocks[current].get() + offset;
+}
+
+void hint_arena::clear() {
+    current = 0;
+    used = blocks.empty() ? BLOCK_SIZE : 0;
+}
+
+}
@@ -0,0 +1,61 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef HINT_ARENA_H_
+#define HINT_ARENA_H_ 1
+
+#include <stddef.h>
+#include <memory>
+#include <vector>
+
+namespace payment_request
+{
+
+/** Storage for the route hints and fallback addresses of decoded invoices. They are taken from
+ *  large blocks that never move, so a decoded invoice's hints stay valid while it is used, and
+ *  decoding costs no allocation once the blocks exist. Not thread safe: one arena per thread. */
+class hint_arena {
+public:
+	/** Room for @count objects of a hint type, contiguous. */
+	template <typename T>
+	T* allocate(size_t count) { return static_cast<T*>(allocate_bytes(count * sizeof(T))); }
+
+	/** Make all the memory available again. The hints of invoices decoded so far are gone. */
+	void clear();
+
+	/** Bytes held by the arena, including the unused tail of the last block. */
+	size_t memory_usage() const { return blocks.size() * BLOCK_SIZE; }
+
+private:
+	/* Larger than the hints of any invoice: the data part of one holds about 4 KiB. */
+	static constexpr size_t BLOCK_SIZE = 1 << 16;
+
+	std::vector<std::unique_ptr<unsigned char[]> > blocks;
+	size_t current = 0;                             // the block being filled
+	size_t used = BLOCK_SIZE;                       // bytes used in it
+
+	void* allocate_bytes(size_t size);
+};
+
+}
+
+#endif  // HINT_ARENA_H_
@@ -0,0 +1,176 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef HRP_H_
+#define HRP_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+
+#include "decode_stats.h"
+
+namespace payment_request
+{
+
+/** The network prefixes invoices are accepted for. Build with EXTRA_NETWORK_PREFIXES defined as a
+ *  comma-separated list of string literals to accept more networks, for instance
+ *  -DEXTRA_NETWORK_PREFIXES='"lnsb", "lntbr"'. A prefix has at most 8 lower case letters. */
+constexpr std::string_view NETWORK_PREFIXES[] = {
+	"lnbc",                                         // bitcoin mainnet
+	"lntb",                                         // bitcoin testnet
+	"lntbs",                                        // bitcoin signet
+	"lnbcrt",                                       // bitcoin regtest
+#ifdef EXTRA_NETWORK_PREFIXES
+	EXTRA_NETWORK_PREFIXES,
+#endif
+};
+
+constexpr size_t NETWORK_COUNT = sizeof(NETWORK_PREFIXES) / sizeof(NETWORK_PREFIXES[0]);
+
+/** What the hrp of an invoice says. */
+struct hrp_fields {
+	size_t prefix_size;                             // the prefix is the first prefix_size characters
+	size_t network;                                 // index into NETWORK_PREFIXES
+	uint64_t sat_amount;                            // in millisatoshi; 0 if the invoice has no amount
+};
+
+namespace hrp_detail
+{
+
+constexpr size_t MAX_PREFIX_SIZE = 8;
+
+/** A prefix of up to 8 characters packed into a word, the first in the low byte. No prefix packs
+ *  to 0, which marks an empty slot below. */
+constexpr uint64_t pack(std::string_view prefix) {
+	uint64_t word = 0;
+	for (size_t i = 0; i < prefix.size(); ++i) word |= uint64_t{static_cast<unsigned char>(prefix[i])} << (8 * i);
+	return word;
+}
+
+/** A perfect hash of the network prefixes: the top bits of the packed prefix times a multiplier
+ *  found at compile time map each to its own slot, so a lookup is one multiply and one compare. */
+constexpr size_t TABLE_BITS = NETWORK_COUNT <= 4 ? 4 : NETWORK_COUNT <= 16 ? 6 : NETWORK_COUNT <= 64 ? 8 : 10;
+constexpr size_t TABLE_SIZE = size_t{1} << TABLE_BITS;
+
+struct prefix_table {
+	uint64_t multiplier;
+	uint64_t words[TABLE_SIZE];
+	uint8_t networks[TABLE_SIZE];
+};
+
+constexpr size_t slot(uint64_t word, uint64_t multiplier) {
+	return (word * multiplier) >> (64 - TABLE_BITS);
+}
+
+constexpr prefix_table build_table() {
+	for (uint64_t seed = 1;; ++seed) {
+		/* splitmix64 of the seed: candidate multipliers with well mixed bits. */
+		uint64_t z = seed * 0x9e3779b97f4a7c15ULL;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		prefix_table table = {(z ^ (z >> 31)) | 1, {}, {}};
+		bool perfect = true;
+		for (size_t n = 0; n < NETWORK_COUNT && perfect; ++n) {
+			const uint64_t word = pack(NETWORK_PREFIXES[n]);
+			const size_t s = slot(word, table.multiplier);
+			perfect = table.words[s] == 0;
+			table.words[s] = word;
+			table.networks[s] = n;
+		}
+		if (perfect) return table;
+	}
+}
+
+constexpr bool prefixes_valid() {
+	for (size_t n = 0; n < NETWORK_COUNT; ++n) {
+		const std::string_view prefix = NETWORK_PREFIXES[n];
+		if (prefix.empty() || prefix.size() > MAX_PREFIX_SIZE) return false;
+		for (char c : prefix) if (c < 'a' || c > 'z') return false;
+		for (size_t m = 0; m < n; ++m) if (NETWORK_PREFIXES[m] == prefix) return false;
+	}
+	return true;
+}
+
+static_assert(prefixes_valid(), "network prefixes are distinct and have 1 to 8 lower case letters");
+static_assert(NETWORK_COUNT <= 255, "network indexes fit in a byte");
+
+constexpr prefix_table PREFIX_TABLE = build_table();
+
+}
+
+/** The index of @prefix in NETWORK_PREFIXES; NETWORK_COUNT if it is not one of them. */
+constexpr size_t network_of(std::string_view prefix) {
+	if (prefix.empty() || prefix.size() > hrp_detail::MAX_PREFIX_SIZE) return NETWORK_COUNT;
+	const uint64_t word = hrp_detail::pack(prefix);
+	const size_t s = hrp_detail::slot(word, hrp_detail::PREFIX_TABLE.multiplier);
+	return hrp_detail::PREFIX_TABLE.words[s] == word ? hrp_detail::PREFIX_TABLE.networks[s] : NETWORK_COUNT;
+}
+
+/** Split a lower case @hrp into its network prefix and its amount, as BOLT11 defines them. The
+ *  amount is computed in millisatoshi with integer arithmetic; one that does not fit in 64 bits
+ *  or is not a whole millisatoshi is refused. Returns NONE, PREFIX or AMOUNT. Usable at compile
+ *  time, and never allocates. */
+constexpr reject_reason parse_hrp(std::string_view hrp, hrp_fields& out) {
+	/* The prefix is all letters; the amount starts with a digit. */
+	size_t split = 0;
+	while (split < hrp.size() && (hrp[split] < '0' || hrp[split] > '9')) ++split;
+	if (split == 0 || split > hrp_detail::MAX_PREFIX_SIZE) return reject_reason::PREFIX;
+	const uint64_t word = hrp_detail::pack(hrp.substr(0, split));
+	const size_t s = hrp_detail::slot(word, hrp_detail::PREFIX_TABLE.multiplier);
+	if (hrp_detail::PREFIX_TABLE.words[s] != word) return reject_reason::PREFIX;
+	out.prefix_size = split;
+	out.network = hrp_detail::PREFIX_TABLE.networks[s];
+	out.sat_amount = 0;
+	if (split == hrp.size()) return reject_reason::NONE;
+
+	uint64_t value = 0;
+	size_t end = split;
+	for (; end < hrp.size() && hrp[end] >= '0' && hrp[end] <= '9'; ++end) {
+		const unsigned digit = hrp[end] - '0';
+		if (value > (UINT64_MAX - digit) / 10) return reject_reason::AMOUNT;
+		value = value * 10 + digit;
+	}
+	/* msat per unit: a bitcoin without a multiplier, m (milli), u (micro), n (nano); p (pico) is
+	 * a tenth of a msat. The multiplier, if any, ends the hrp. */
+	uint64_t msat = 100000000000;
+	if (end != hrp.size()) {
+		if (end + 1 != hrp.size()) return reject_reason::AMOUNT;
+		switch (hrp[end]) {
+			case 'm': msat = 100000000; break;
+			case 'u': msat = 100000; break;
+			case 'n': msat = 100; break;
+			case 'p':
+				if (value % 10) return reject_reason::AMOUNT;   // MUST fail on sub-millisatoshi precision
+				out.sat_amount = value / 10;
+				return reject_reason::NONE;
+			default: return reject_reason::AMOUNT;
+		}
+	}
+	if (value > UINT64_MAX / msat) return reject_reason::AMOUNT;
+	out.sat_amount = value * msat;
+	return reject_reason::NONE;
+}
+
+}
+
+#endif  // HRP_H_
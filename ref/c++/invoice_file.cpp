@@ -0,0 +1,380 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "invoice_file.h"
+#include "hash_index.h"
+#include "hint_arena.h"
+#include "hrp.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "invoice files are read in place, which needs a little endian host"
+#endif
+
+namespace
+{
+
+/* A file is laid out as: the header, the records, the index, the blob. The index is an
+ * open-addressing table of uint64 slots probed linearly from keyed_bits() of the payment hash,
+ * under a seed drawn for each file, as the hashes may come from anyone's invoices; it is kept at
+ * most half full. */
+struct file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;
+    uint64_t records_offset;
+    uint64_t index_offset;
+    uint64_t index_slots;
+    uint64_t blob_offset;
+    uint64_t blob_size;
+    uint64_t seed[2];                           // of keyed_bits() for the index
+};
+
+static_assert(sizeof(file_header) == 80, "file_header is part of the file format");
+
+const char MAGIC[8] = {'l', 'n', 'i', 'n', 'v', 'o', 'i', 'c'};
+
+/* In the blob, each route hint is its number of hops (1 byte) and the hops as an r field holds
+ * them, 51 bytes each; each fallback address is its version (1 byte), the size of its program
+ * (1 byte) and the program. */
+const size_t HOP_SIZE = 51;
+
+size_t hints_size(const payment_request::bolt11& invoice)
+{
+    size_t size = 0;
+    for (size_t i = 0; i < invoice.route_count; ++i) size += 1 + invoice.routes[i].size * HOP_SIZE;
+    for (size_t i = 0; i < invoice.fallback_count; ++i) size += 2 + invoice.fallbacks[i].size;
+    return size;
+}
+
+size_t blob_size(const payment_request::bolt11& invoice)
+{
+    return invoice.prefix.size() + (invoice.has_description_hash ? 32 : 0) + invoice.description_len + hints_size(invoice);
+}
+
+uint64_t read_be(const unsigned char* in, size_t size)
+{
+    uint64_t v = 0;
+    for (size_t i = 0; i < size; ++i) v = (v << 8) | in[i];
+    return v;
+}
+
+void write_be(uint64_t v, unsigned char* out, size_t size)
+{
+    for (size_t i = size; i-- > 0; v >>= 8) out[i] = v & 0xff;
+}
+
+/* The route hints and the fallback addresses of @invoice, laid out for the blob. */
+std::vector<unsigned char> hints_blob(const payment_request::bolt11& invoice)
+{
+    std::vector<unsigned char> out;
+    for (size_t i = 0; i < invoice.route_count; ++i) {
+        const payment_request::route_hint& route = invoice.routes[i];
+        out.push_back(route.size);
+        for (size_t h = 0; h < route.size; ++h) {
+            unsigned char hop[HOP_SIZE];
+            memcpy(hop, route.hops[h].pubkey, 33);
+            write_be(route.hops[h].short_channel_id, hop + 33, 8);
+            write_be(route.hops[h].fee_base_msat, hop + 41, 4);
+            write_be(route.hops[h].fee_proportional_millionths, hop + 45, 4);
+            write_be(route.hops[h].cltv_expiry_delta, hop + 49, 2);
+            out.insert(out.end(), hop, hop + HOP_SIZE);
+        }
+    }
+    for (size_t i = 0; i < invoice.fallback_count; ++i) {
+        const payment_request::fallback_address& fallback = invoice.fallbacks[i];
+        out.push_back(fallback.version);
+        out.push_back(fallback.size);
+        out.insert(out.end(), fallback.program, fallback.program + fallback.size);
+    }
+    return out;
+}
+
+payment_request::invoice_record make_record(const payment_request::bolt11& invoice, uint64_t blob_offset)
+{
+    payment_request::invoice_record r;
+    memset(&r, 0, sizeof(r));
+    memcpy(r.payment_hash, invoice.payment_hash, 32);
+    r.sat_amount = invoice.sat_amount;
+    r.timestamp = invoice.timestamp;
+    r.expiry = invoice.expiry;
+    r.min_final_cltv_expiry = invoice.min_final_cltv_expiry;
+    r.description_len = invoice.description_len;
+    r.prefix_len = invoice.prefix.size();
+    r.flags = (invoice.has_receiver_id ? r.HAS_RECEIVER_ID : 0) | (invoice.has_description_hash ? r.HAS_DESCRIPTION_HASH : 0);
+    memcpy(r.payment_secret, invoice.payment_secret, 32);
+    if (invoice.has_receiver_id) memcpy(r.receiver_id, invoice.receiver_id, 33);
+    r.sig_recovery_id = invoice.sig_recovery_id;
+    memcpy(r.sig, invoice.sig, 64);
+    memcpy(r.signing_hash, invoice.signing_hash, 32);
+    r.route_count = invoice.route_count;
+    r.fallback_count = invoice.fallback_count;
+    r.hints_size = hints_size(invoice);
+    r.features = invoice.features;
+    r.blob_offset = blob_offset;
+    return r;
+}
+
+}
+
+namespace payment_request
+{
+
+int write_invoice_file(const char* path, const struct bolt11* invoices, size_t count) {
+    if (count >= UINT32_MAX) return -1;
+    std::vector<uint64_t> index(64);
+    while (index.size() < count * 2) index.resize(index.size() * 2);
+    const size_t mask = index.size() - 1;
+    file_header header;
+    std::random_device random;
+    for (uint64_t& word : header.seed) word = (uint64_t{random()} << 32) | random();
+    uint64_t blob_total = 0;
+    for (size_t n = 0; n < count; ++n) {
+        const bolt11& invoice = invoices[n];
+        if (invoice.prefix.size() > 255 || invoice.route_count > 0xffff || invoice.fallback_count > 0xffff ||
+            hints_size(invoice) > 0xffff)
+            return -1;
+        for (size_t i = 0; i < invoice.route_count; ++i)
+            if (invoice.routes[i].size > 255) return -1;
+        for (size_t i = 0; i < invoice.fallback_count; ++i)
+            if (invoice.fallbacks[i].size > 255) return -1;
+        const uint64_t bits = keyed_bits(invoices[n].payment_hash, header.seed);
+        size_t i = bits & mask;
+        while (index[i]) i = (i + 1) & mask;
+        index[i] = slot_tag(bits) | (uint64_t{n} + 1);
+        blob_total += blob_size(invoices[n]);
+    }
+
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = invoice_file::VERSION;
+    header.record_size = sizeof(invoice_record);
+    header.count = count;
+    header.records_offset = sizeof(header);
+    header.index_offset = header.records_offset + count * sizeof(invoice_record);
+    header.index_slots = index.size();
+    header.blob_offset = header.index_offset + index.size() * sizeof(uint64_t);
+    header.blob_size = blob_total;
+
+    FILE* file = fopen(path, "wb");
+    if (!file) return -1;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    uint64_t blob_offset = 0;
+    for (size_t n = 0; ok && n < count; ++n) {
+        const invoice_record r = make_record(invoices[n], blob_offset);
+        ok = fwrite(&r, sizeof(r), 1, file) == 1;
+        blob_offset += blob_size(invoices[n]);
+    }
+    ok = ok && fwrite(index.data(), sizeof(uint64_t), index.size(), file) == index.size();
+    for (size_t n = 0; ok && n < count; ++n) {
+        const bolt11& invoice = invoices[n];
+        ok = fwrite(invoice.prefix.data(), 1, invoice.prefix.size(), file) == invoice.prefix.size() &&
+            (!invoice.has_description_hash || fwrite(invoice.description_hash, 32, 1, file) == 1) &&
+            fwrite(invoice.description, 1, invoice.description_len, file) == invoice.description_len;
+        const std::vector<unsigned char> hints = hints_blob(invoice);
+        ok = ok && (hints.empty() || fwrite(hints.data(), 1, hints.size(), file) == hints.size());
+    }
+    ok = fclose(file) == 0 && ok;
+    if (!ok) remove(path);
+    return ok ? 0 : -1;
+}
+
+int invoice_file::open(const char* path) {
+    close();
+    const int fd = ::open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(file_header)) {
+        ::close(fd);
+        return -1;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) return -1;
+    const size_t size = st.st_size;
+    /* Lookups jump around the file: read-ahead would only load pages no one asked for. */
+    madvise(map, size, MADV_RANDOM);
+
+    const file_header* header = static_cast<const file_header*>(map);
+    const uint64_t slots = header->index_slots;
+    if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 || header->version != VERSION ||
+        header->record_size != sizeof(invoice_record) || header->count >= UINT32_MAX ||
+        slots < 2 || (slots & (slots - 1)) != 0 || slots <= header->count || slots > size / sizeof(uint64_t) ||
+        header->records_offset % 8 != 0 || header->index_offset % 8 != 0 ||
+        header->records_offset > size || header->count > (size - header->records_offset) / sizeof(invoice_record) ||
+        header->index_offset > size || slots > (size - header->index_offset) / sizeof(uint64_t) ||
+        header->blob_offset > size || header->blob_size > size - header->blob_offset) {
+        munmap(map, size);
+        return -1;
+    }
+    const unsigned char* base = static_cast<const unsigned char*>(map);
+    mapping = map;
+    mapping_size = size;
+    records = reinterpret_cast<const invoice_record*>(base + header->records_offset);
+    count = header->count;
+    index = reinterpret_cast<const uint64_t*>(base + header->index_offset);
+    index_slots = slots;
+    blob = base + header->blob_offset;
+    blob_size = header->blob_size;
+    std::copy(header->seed, header->seed + 2, seed);
+    return 0;
+}
+
+void invoice_file::close() {
+    if (mapping) munmap(mapping, mapping_size);
+    mapping = NULL;
+    mapping_size = 0;
+    records = NULL;
+    count = 0;
+    index = NULL;
+    index_slots = 0;
+    blob = NULL;
+    blob_size = 0;
+}
+
+const invoice_record* invoice_file::find(const unsigned char payment_hash[32]) const {
+    if (!index) return NULL;
+    const uint64_t bits = keyed_bits(payment_hash, seed);
+    const size_t mask = index_slots - 1;
+    /* The index is never full, but a damaged file could make it so: stop after one lap. */
+    size_t i = bits & mask;
+    for (size_t probes = 0; probes < index_slots && index[i]; ++probes, i = (i + 1) & mask) {
+        if (slot_tag(index[i]) != slot_tag(bits)) continue;
+        const uint64_t n = (index[i] & 0xffffffff) - 1;
+        if (n < count && memcmp(records[n].payment_hash, payment_hash, 32) == 0) return &records[n];
+    }
+    return NULL;
+}
+
+const unsigned char* invoice_file::blob_fields(const invoice_record& record) const {
+    const size_t size = record.prefix_len + ((record.flags & record.HAS_DESCRIPTION_HASH) ? 32 : 0) + record.description_len +
+        record.hints_size;
+    if (record.blob_offset > blob_size || size > blob_size - record.blob_offset) return NULL;
+    return blob + record.blob_offset;
+}
+
+std::string_view invoice_file::prefix(const invoice_record& record) const {
+    const unsigned char* fields = blob_fields(record);
+    if (!fields) return std::string_view();
+    return std::string_view(reinterpret_cast<const char*>(fields), record.prefix_len);
+}
+
+const unsigned char* invoice_file::description_hash(const invoice_record& record) const {
+    const unsigned char* fields = blob_fields(record);
+    if (!fields || !(record.flags & record.HAS_DESCRIPTION_HASH)) return NULL;
+    return fields + record.prefix_len;
+}
+
+std::string_view invoice_file::description(const invoice_record& record) const {
+    const unsigned char* fields = blob_fields(record);
+    if (!fields) return std::string_view();
+    const size_t offset = record.prefix_len + ((record.flags & record.HAS_DESCRIPTION_HASH) ? 32 : 0);
+    return std::string_view(reinterpret_cast<const char*>(fields + offset), record.description_len);
+}
+
+/** Read the route hints and the fallback addresses of @record into @hints. False if they do not
+ *  add up to the counts and the size the record gives. */
+bool invoice_file::expand_hints(const invoice_record& record, struct bolt11& out, hint_arena& hints) const {
+    const unsigned char* fields = blob_fields(record);
+    if (!fields) return false;
+    const unsigned char* in = fields + record.prefix_len + ((record.flags & record.HAS_DESCRIPTION_HASH) ? 32 : 0) +
+        record.description_len;
+    const unsigned char* const end = in + record.hints_size;
+    /* Count the hops first, so that they take one array. */
+    size_t hops = 0;
+    const unsigned char* p = in;
+    for (size_t i = 0; i < record.route_count; ++i) {
+        if (p == end || *p > static_cast<size_t>(end - p - 1) / HOP_SIZE) return false;
+        hops += *p;
+        p += 1 + *p * HOP_SIZE;
+    }
+    route_hint* route = record.route_count ? hints.allocate<route_hint>(record.route_count) : NULL;
+    route_hop* hop = hops ? hints.allocate<route_hop>(hops) : NULL;
+    fallback_address* fallback = record.fallback_count ? hints.allocate<fallback_address>(record.fallback_count) : NULL;
+    for (size_t i = 0; i < record.route_count; ++i) {
+        const size_t size = *in++;
+        route[i] = route_hint{hop, size};
+        for (size_t h = 0; h < size; ++h, ++hop, in += HOP_SIZE) {
+            memcpy(hop->pubkey, in, 33);
+            hop->short_channel_id = read_be(in + 33, 8);
+            hop->fee_base_msat = read_be(in + 41, 4);
+            hop->fee_proportional_millionths = read_be(in + 45, 4);
+            hop->cltv_expiry_delta = read_be(in + 49, 2);
+        }
+    }
+    for (size_t i = 0; i < record.fallback_count; ++i) {
+        if (end - in < 2 || in[1] > end - in - 2) return false;
+        unsigned char* program = hints.allocate<unsigned char>(in[1]);
+        memcpy(program, in + 2, in[1]);
+        fallback[i] = fallback_address{in[0], program, in[1]};
+        in += 2 + in[1];
+    }
+    if (in != end) return false;
+    out.routes = route;
+    out.route_count = record.route_count;
+    out.fallbacks = fallback;
+    out.fallback_count = record.fallback_count;
+    return true;
+}
+
+void invoice_file::expand(const invoice_record& record, struct bolt11& out, hint_arena* hints) const {
+    out.prefix = std::string(prefix(record));
+    out.network = network_of(out.prefix);
+    out.timestamp = record.timestamp;
+    out.sat_amount = record.sat_amount;
+    memcpy(out.payment_hash, record.payment_hash, 32);
+    out.has_receiver_id = (record.flags & record.HAS_RECEIVER_ID) != 0;
+    memcpy(out.receiver_id, record.receiver_id, 33);
+    const std::string_view desc = description(record);
+    const size_t desc_len = std::min(desc.size(), sizeof(out.description));
+    if (desc_len) memcpy(out.description, desc.data(), desc_len);
+    out.description_len = desc_len;
+    const unsigned char* hash = description_hash(record);
+    out.has_description_hash = hash != NULL;
+    if (hash) memcpy(out.description_hash, hash, 32);
+    out.expiry = record.expiry;
+    out.min_final_cltv_expiry = record.min_final_cltv_expiry;
+    out.features = record.features;
+    memcpy(out.sig, record.sig, 64);
+    out.sig_recovery_id = record.sig_recovery_id;
+    memcpy(out.signing_hash, record.signing_hash, 32);
+    memcpy(out.payment_secret, record.payment_secret, 32);
+    out.fallbacks = NULL;
+    out.fallback_count = 0;
+    out.routes = NULL;
+    out.route_count = 0;
+    out.tagged_fields = NULL;
+    out.tagged_field_count = 0;
+    if (hints) expand_hints(record, out, *hints);
+}
+
+}
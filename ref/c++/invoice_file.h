@@ -0,0 +1,121 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef INVOICE_FILE_H_
+#define INVOICE_FILE_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+
+#include "payment_request.h"
+
+namespace payment_request
+{
+
+/** A decoded invoice as stored in an invoice file. Every field has a fixed width and place; the
+ *  prefix, the description hash, the description and hints_size bytes of route hints and fallback
+ *  addresses follow each other in the file's blob, at blob_offset. Integers are little endian, so
+ *  the record is read in place on the hosts this code builds for. */
+struct invoice_record {
+	unsigned char payment_hash[32];
+	uint64_t sat_amount;                            // in millisatoshi; 0 if the invoice has no amount
+	uint64_t timestamp;
+	uint64_t expiry;
+	uint32_t min_final_cltv_expiry;
+	uint16_t description_len;
+	uint8_t prefix_len;
+	uint8_t flags;                                  // HAS_RECEIVER_ID, HAS_DESCRIPTION_HASH
+	unsigned char payment_secret[32];
+	unsigned char receiver_id[33];                  // valid if and only if HAS_RECEIVER_ID
+	uint8_t sig_recovery_id;
+	unsigned char sig[64];
+	unsigned char signing_hash[32];
+	uint16_t route_count;
+	uint16_t fallback_count;
+	uint16_t hints_size;
+	unsigned char reserved[8];
+	uint64_t features;                              // the first 64 feature bits, as in bolt11
+	uint64_t blob_offset;                           // from the start of the blob
+
+	static constexpr uint8_t HAS_RECEIVER_ID = 1;
+	static constexpr uint8_t HAS_DESCRIPTION_HASH = 2;
+};
+
+static_assert(sizeof(invoice_record) == 256, "invoice_record is part of the file format");
+
+/** Write @count invoices to a new invoice file at @path: a header, the records, an index of the
+ *  records by payment hash and the blob. Where payment hashes repeat, lookups find the first
+ *  invoice. Returns 0 on success, -1 on failure. */
+int write_invoice_file(const char* path, const struct bolt11* invoices, size_t count);
+
+/** An invoice file, mapped into memory. Nothing is read or copied up front: records are used in
+ *  place, and a lookup touches one index slot, the record and its blob, so only the pages those
+ *  live on are ever loaded. */
+class invoice_file {
+public:
+	static constexpr uint32_t VERSION = 3;
+
+	invoice_file() {}
+	~invoice_file() { close(); }
+	invoice_file(const invoice_file&) = delete;
+	invoice_file& operator=(const invoice_file&) = delete;
+
+	/** Map the file at @path and check its header; 0 means success, -1 failure. */
+	int open(const char* path);
+	void close();
+
+	size_t size() const { return count; }
+	const invoice_record& record(size_t i) const { return records[i]; }
+
+	/** The invoice with @payment_hash, NULL if there is none. */
+	const invoice_record* find(const unsigned char payment_hash[32]) const;
+
+	/** The variable-length fields; empty, or NULL, if the record points outside the blob. */
+	std::string_view prefix(const invoice_record& record) const;
+	std::string_view description(const invoice_record& record) const;
+	/** NULL if the invoice has no description hash. */
+	const unsigned char* description_hash(const invoice_record& record) const;
+
+	/** Rebuild the full bolt11 of a record, signature included. Its route hints and fallback
+	 *  addresses are stored in @hints, if given, and it has none otherwise, or if they are
+	 *  damaged. */
+	void expand(const invoice_record& record, struct bolt11& out, hint_arena* hints = NULL) const;
+
+private:
+	void* mapping = NULL;
+	size_t mapping_size = 0;
+	const invoice_record* records = NULL;
+	size_t count = 0;
+	const uint64_t* index = NULL;                   // record number plus one in the low 32 bits, a tag in the high ones
+	size_t index_slots = 0;
+	uint64_t seed[2] = {};                          // the index is probed from keyed_bits() under this
+	const unsigned char* blob = NULL;
+	size_t blob_size = 0;
+
+	const unsigned char* blob_fields(const invoice_record& record) const;
+	bool expand_hints(const invoice_record& record, struct bolt11& out, hint_arena& hints) const;
+};
+
+}
+
+#endif  // INVOICE_FILE_H_
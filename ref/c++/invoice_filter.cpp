@@ -0,0 +1,261 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "invoice_filter.h"
+
+#include <algorithm>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define FILTER_X86 1
+#include <immintrin.h>
+#endif
+
+namespace
+{
+
+using payment_request::decoded_batch;
+using payment_request::invoice_filter;
+
+/* Each kernel tests @count rows from @begin, at most 64, and returns a bit per row, the first in
+ * the lowest bit. The rows of a failed decode hold zeros; the status kernel drops them. */
+
+template <typename T>
+uint64_t range_scalar(const T* v, size_t count, T lo, T hi) {
+    uint64_t bits = 0;
+    for (size_t i = 0; i < count; ++i) bits |= uint64_t{v[i] >= lo && v[i] <= hi} << i;
+    return bits;
+}
+
+/* timestamp + expiry, saturated: an expiry too large to add never runs out. */
+uint64_t expires_at(uint64_t timestamp, uint64_t expiry) {
+    const uint64_t sum = timestamp + expiry;
+    return sum < timestamp ? UINT64_MAX : sum;
+}
+
+uint64_t status_scalar(const decoded_batch& batch, size_t begin, size_t count, const invoice_filter&) {
+    const int8_t* status = batch.status.data() + begin;
+    uint64_t bits = 0;
+    for (size_t i = 0; i < count; ++i) bits |= uint64_t{status[i] == 0} << i;
+    return bits;
+}
+
+uint64_t amount_scalar(const decoded_batch& batch, size_t begin, size_t count, const invoice_filter& filter) {
+    return range_scalar(batch.amount_msat.data() + begin, count, filter.min_amount, filter.max_amount);
+}
+
+uint64_t expires_at_scalar(const decoded_batch& batch, size_t begin, size_t count, const invoice_filter& filter) {
+    const uint64_t* timestamp = batch.timestamp.data() + begin;
+    const uint64_t* expiry = batch.expiry.data() + begin;
+    uint64_t bits = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const uint64_t at = expires_at(timestamp[i], expiry[i]);
+        bits |= uint64_t{at >= filter.min_expires_at && at <= filter.max_expires_at} << i;
+    }
+    return bits;
+}
+
+uint64_t cltv_scalar(const decoded_batch& batch, size_t begin, size_t count, const invoice_filter& filter) {
+    return range_scalar(batch.min_final_cltv_expiry.data() + begin, count, filter.min_final_cltv_expiry, filter.max_final_cltv_expiry);
+}
+
+uint64_t network_scalar(const decoded_batch& batch, size_t begin, size_t count, const invoice_filter& filter) {
+    const uint8_t* network = batch.network.data() + begin;
+    uint64_t bits = 0;
+    for (size_t i = 0; i < count; ++i) bits |= ((filter.networks >> network[i]) & 1) << i;
+    return bits;
+}
+
+uint64_t features_scalar(const decoded_batch& batch, size_t begin, size_t count, const invoice_filter& filter) {
+    const uint64_t* features = batch.features.data() + begin;
+    uint64_t bits = 0;
+    for (size_t i = 0; i < count; ++i) bits |= uint64_t{(features[i] & filter.required_features) == filter.required_features} << i;
+    return bits;
+}
+
+#ifdef FILTER_X86
+
+/* AVX2 compares are signed; flipping the sign bit of both sides orders unsigned values. Rows past
+ * the last whole vector are left to the scalar kernels. */
+
+__attribute__((target("avx2")))
+uint64_t status_avx2(const decoded_batch& batch, size_t begin, size_t count, const invoice_filter& filter) {
+    const int8_t* status = batch.status.data() + begin;
+    uint64_t bits = 0;
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(status + i));
+        bits |= uint64_t{static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256())))} << i;
+    }
+    return i < count ? bits | status_scalar(batch, begin + i, count - i, filter) << i : bits;
+}
+
+/* Bits of the four 64-bit lanes of @lo <= @v <= @hi, all three with their sign bits flipped. */
+__attribute__((target("avx2")))
+inline uint64_t range_lanes(__m256i v, __m256i lo, __m256i hi) {
+    const __m256i out = _mm256_or_si256(_mm256_cmpgt_epi64(lo, v), _mm256_cmpgt_epi64(v, hi));
+    return ~_mm256_movemask_pd(_mm256_castsi256_pd(out)) & 0xf;
+}
+
+__attribute__((target("avx2")))
+uint64_t amount_avx2(const decoded_batch& batch, size_t begin, size_t count, const invoice_filter& filter) {
+    const uint64_t* amount = batch.amount_msat.data() + begin;
+    const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+    const __m256i lo = _mm256_xor_si256(_mm256_set1_epi64x(filter.min_amount), sign);
+    const __m256i hi = _mm256_xor_si256(_mm256_set1_epi64x(filter.max_amount), sign);
+    uint64_t bits = 0;
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m256i v = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(amount + i)), sign);
+        bits |= range_lanes(v, lo, hi) << i;
+    }
+    return i < count ? bits | amount_scalar(batch, begin + i, count - i, filter) << i : bits;
+}
+
+__attribute__((target("avx2")))
+uint64_t expires_at_avx2(const decoded_batch& batch, size_t begin, size_t count, const invoice_filter& filter) {
+    const uint64_t* timestamp = batch.timestamp.data() + begin;
+    const uint64_t* expiry = batch.expiry.data() + begin;
+    const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+    const __m256i lo = _mm256_xor_si256(_mm256_set1_epi64x(filter.min_expires_at), sign);
+    const __m256i hi = _mm256_xor_si256(_mm256_set1_epi64x(filter.max_expires_at), sign);
+    uint64_t bits = 0;
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m256i t = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(timestamp + i));
+        const __m256i e = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(expiry + i));
+        const __m256i sum = _mm256_add_epi64(t, e);
+        /* The sum wrapped if it is below the timestamp; it saturates to UINT64_MAX then. */
+        const __m256i wrapped = _mm256_cmpgt_epi64(_mm256_xor_si256(t, sign), _mm256_xor_si256(sum, sign));
+        const __m256i at = _mm256_xor_si256(_mm256_or_si256(sum, wrapped), sign);
+        bits |= range_lanes(at, lo, hi) << i;
+    }
+    return i < count ? bits | expires_at_scalar(batch, begin + i, count - i, filter) << i : bits;
+}
+
+__attribute__((target("avx2")))
+uint64_t cltv_avx2(const decoded_batch& batch, size_t begin, size_t count, const invoice_filter& filter) {
+    const uint32_t* cltv = batch.min_final_cltv_expiry.data() + begin;
+    const __m256i sign = _mm256_set1_epi32(INT32_MIN);
+    const __m256i lo = _mm256_xor_si256(_mm256_set1_epi32(filter.min_final_cltv_expiry), sign);
+    const __m256i hi = _mm256_xor_si256(_mm256_set1_epi32(filter.max_final_cltv_expiry), sign);
+    uint64_t bits = 0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m256i v = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(cltv + i)), sign);
+        const __m256i out = _mm256_or_si256(_mm256_cmpgt_epi32(lo, v), _mm256_cmpgt_epi32(v, hi));
+        bits |= uint64_t{~static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(out))) & 0xff} << i;
+    }
+    return i < count ? bits | cltv_scalar(batch, begin + i, count - i, filter) << i : bits;
+}
+
+/* The accepted networks as a byte per network index, looked up 32 rows at a time with a shuffle.
+ * Only for up to 16 networks, the entries a shuffle reaches. */
+__attribute__((target("avx2")))
+uint64_t network_avx2(const decoded_batch& batch, size_t begin, size_t count, const invoice_filter& filter) {
+    const uint8_t* network = batch.network.data() + begin;
+    alignas(16) uint8_t accepted[16];
+    for (size_t n = 0; n < 16; ++n) accepted[n] = ((filter.networks >> n) & 1) ? 0xff : 0;
+    const __m256i table = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(accepted)));
+    uint64_t bits = 0;
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(network + i));
+        bits |= uint64_t{static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_shuffle_epi8(table, v)))} << i;
+    }
+    return i < count ? bits | network_scalar(batch, begin + i, count - i, filter) << i : bits;
+}
+
+__attribute__((target("avx2")))
+uint64_t features_avx2(const decoded_batch& batch, size_t begin, size_t count, const invoice_filter& filter) {
+    const uint64_t* features = batch.features.data() + begin;
+    const __m256i required = _mm256_set1_epi64x(filter.required_features);
+    uint64_t bits = 0;
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(features + i));
+        const __m256i met = _mm256_cmpeq_epi64(_mm256_and_si256(v, required), required);
+        bits |= uint64_t{static_cast<uint32_t>(_mm256_movemask_pd(_mm256_castsi256_pd(met)))} << i;
+    }
+    return i < count ? bits | features_scalar(batch, begin + i, count - i, filter) << i : bits;
+}
+
+#endif  // FILTER_X86
+
+typedef payment_request::compiled_filter::kernel kernel;
+
+struct kernel_set {
+    kernel status, amount, expires_at, cltv, network, features;
+};
+
+const kernel_set SCALAR_KERNELS = {status_scalar, amount_scalar, expires_at_scalar, cltv_scalar, network_scalar, features_scalar};
+#ifdef FILTER_X86
+const kernel_set AVX2_KERNELS = {status_avx2, amount_avx2, expires_at_avx2, cltv_avx2,
+                                 payment_request::NETWORK_COUNT <= 16 ? network_avx2 : network_scalar, features_avx2};
+#endif
+
+}
+
+namespace payment_request
+{
+
+filter_impl filter_best() {
+#ifdef FILTER_X86
+    static const filter_impl best = []() {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") ? filter_impl::AVX2 : filter_impl::SCALAR;
+    }();
+    return best;
+#else
+    return filter_impl::SCALAR;
+#endif
+}
+
+compiled_filter::compiled_filter(const invoice_filter& filter, filter_impl impl) : filter(filter), kernel_count(0) {
+    const kernel_set* set = &SCALAR_KERNELS;
+#ifdef FILTER_X86
+    if (impl == filter_impl::AVX2) set = &AVX2_KERNELS;
+#else
+    (void)impl;
+#endif
+    const uint64_t all_networks = NETWORK_COUNT == 64 ? UINT64_MAX : (uint64_t{1} << NETWORK_COUNT) - 1;
+    kernels[kernel_count++] = set->status;
+    if (filter.min_amount != 0 || filter.max_amount != UINT64_MAX) kernels[kernel_count++] = set->amount;
+    if (filter.min_expires_at != 0 || filter.max_expires_at != UINT64_MAX) kernels[kernel_count++] = set->expires_at;
+    if (filter.min_final_cltv_expiry != 0 || filter.max_final_cltv_expiry != UINT32_MAX) kernels[kernel_count++] = set->cltv;
+    if ((filter.networks & all_networks) != all_networks) kernels[kernel_count++] = set->network;
+    if (filter.required_features != 0) kernels[kernel_count++] = set->features;
+}
+
+size_t compiled_filter::select(const decoded_batch& batch, uint64_t* selection) const {
+    const size_t rows = batch.size();
+    size_t selected = 0;
+    for (size_t begin = 0; begin < rows; begin += 64) {
+        const size_t count = std::min<size_t>(64, rows - begin);
+        uint64_t bits = kernels[0](batch, begin, count, filter);
+        for (size_t k = 1; k < kernel_count && bits; ++k) bits &= kernels[k](batch, begin, count, filter);
+        selection[begin / 64] = bits;
+        selected += __builtin_popcountll(bits);
+    }
+    return selected;
+}
+
+}
@@ -0,0 +1,83 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef INVOICE_FILTER_H_
+#define INVOICE_FILTER_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "batch_decode.h"
+#include "hrp.h"
+
+namespace payment_request
+{
+
+static_assert(NETWORK_COUNT <= 64, "a network is a bit of invoice_filter::networks");
+
+/** Conditions on decoded invoices; a selected invoice meets all of them. Ranges are inclusive, and
+ *  a condition left at its default accepts every invoice and costs nothing. */
+struct invoice_filter {
+	uint64_t min_amount = 0;                        // in millisatoshi; invoices without an amount have 0
+	uint64_t max_amount = UINT64_MAX;
+	uint64_t min_expires_at = 0;                    // timestamp + expiry, in unix time: now + 1 keeps the unexpired
+	uint64_t max_expires_at = UINT64_MAX;
+	uint32_t min_final_cltv_expiry = 0;
+	uint32_t max_final_cltv_expiry = UINT32_MAX;
+	uint64_t networks = UINT64_MAX;                 // bit n accepts NETWORK_PREFIXES[n]
+	uint64_t required_features = 0;                 // bits of bolt11::features that must all be set
+};
+
+/** The implementations of the filter kernels. */
+enum class filter_impl {
+	SCALAR,  //! One row at a time
+	AVX2,    //! 4 to 32 rows per compare, by column width
+};
+
+/** The fastest implementation this CPU supports, detected once. */
+filter_impl filter_best();
+
+/** An invoice_filter compiled for scanning decoded_batch columns. Only the conditions that can
+ *  reject an invoice are kept, each as a kernel that tests 64 rows of its columns at once and
+ *  gives a bit per row; a block of rows is dropped as soon as none of them is left. */
+class compiled_filter {
+public:
+	explicit compiled_filter(const invoice_filter& filter, filter_impl impl = filter_best());
+
+	/** Words of a selection over @rows rows. */
+	static size_t selection_words(size_t rows) { return (rows + 63) / 64; }
+
+	/** Set bit i % 64 of @selection[i / 64] if row i of @batch was decoded and meets the filter,
+	 *  and clear it otherwise; the bits past the last row are cleared. Returns the rows selected. */
+	size_t select(const decoded_batch& batch, uint64_t* selection) const;
+
+	typedef uint64_t (*kernel)(const decoded_batch& batch, size_t begin, size_t count, const invoice_filter& filter);
+
+private:
+	invoice_filter filter;
+	kernel kernels[6];                              // whether the row was decoded, then each condition kept
+	size_t kernel_count;
+};
+
+}
+
+#endif  // INVOICE_FILTER_H_
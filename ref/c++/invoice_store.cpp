@@ -0,0 +1,133 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "invoice_store.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include <algorithm>
+#include <mutex>
+#include <random>
+
+namespace
+{
+
+/* Indexes are kept at most half full, so a probe ends after about two slots. */
+const size_t MIN_TABLE_SIZE = 64;
+
+}
+
+namespace payment_request
+{
+
+invoice_store::invoice_store(size_t expected) {
+    std::random_device random;
+    for (uint64_t& word : seed) word = (uint64_t{random()} << 32) | random();
+    grow(expected);
+}
+
+void invoice_store::grow(size_t needed) {
+    size_t size = std::max(MIN_TABLE_SIZE, by_hash.size());
+    while (size < needed * 2) size *= 2;
+    if (size == by_hash.size()) return;
+    by_hash.assign(size, 0);
+    by_secret.assign(size, 0);
+    for (size_t n = 0; n < count; ++n) {
+        place(by_hash, index_bits(record(n).payment_hash), n);
+        place(by_secret, index_bits(arena.payment_secret(record(n))), n);
+    }
+}
+
+void invoice_store::place(std::vector<uint64_t>& table, uint64_t bits, uint32_t n) {
+    const size_t mask = table.size() - 1;
+    size_t i = bits & mask;
+    while (table[i]) i = (i + 1) & mask;
+    table[i] = slot_tag(bits) | (uint64_t{n} + 1);
+}
+
+const compact_bolt11* invoice_store::probe(const std::vector<uint64_t>& table, const unsigned char key[32], uint64_t bits,
+                                           bool secret) const {
+    const size_t mask = table.size() - 1;
+    for (size_t i = bits & mask; table[i]; i = (i + 1) & mask) {
+        if (slot_tag(table[i]) != slot_tag(bits)) continue;
+        const compact_bolt11& candidate = record((table[i] & 0xffffffff) - 1);
+        const unsigned char* stored = secret ? arena.payment_secret(candidate) : candidate.payment_hash;
+        if (memcmp(stored, key, 32) == 0) return &candidate;
+    }
+    return NULL;
+}
+
+size_t invoice_store::insert_batch(const struct bolt11* invoices, size_t count_in, bool* inserted) {
+    std::unique_lock<std::shared_mutex> guard(lock);
+    assert(count + count_in < UINT32_MAX);
+    grow(count + count_in);
+    const size_t mask = by_hash.size() - 1;
+    size_t stored = 0;
+    /* The hash of each payment hash is worked out once, a few invoices ahead, for the prefetch. */
+    const size_t AHEAD = 4;
+    uint64_t hash_bits[AHEAD];
+    for (size_t i = 0; i < std::min(AHEAD, count_in); ++i) hash_bits[i] = index_bits(invoices[i].payment_hash);
+    for (size_t i = 0; i < count_in; ++i) {
+        const uint64_t bits = hash_bits[i % AHEAD];
+        /* The slots of the next invoices are in cache by the time they are probed. */
+        if (i + AHEAD < count_in) {
+            hash_bits[i % AHEAD] = index_bits(invoices[i + AHEAD].payment_hash);
+            __builtin_prefetch(&by_hash[hash_bits[i % AHEAD] & mask]);
+        }
+        const bool duplicate = probe(by_hash, invoices[i].payment_hash, bits, false) != NULL;
+        compact_bolt11 compact;
+        const bool added = !duplicate && arena.add(invoices[i], compact) == 0;
+        if (inserted) inserted[i] = added;
+        if (!added) continue;
+        if (count % RECORDS_PER_BLOCK == 0) records.emplace_back(new compact_bolt11[RECORDS_PER_BLOCK]);
+        records.back()[count % RECORDS_PER_BLOCK] = compact;
+        const uint64_t secret_bits = index_bits(invoices[i].payment_secret);
+        if (!probe(by_secret, invoices[i].payment_secret, secret_bits, true)) place(by_secret, secret_bits, count);
+        place(by_hash, bits, count);
+        count++;
+        stored++;
+    }
+    return stored;
+}
+
+const compact_bolt11* invoice_store::find(const unsigned char payment_hash[32]) const {
+    std::shared_lock<std::shared_mutex> guard(lock);
+    return probe(by_hash, payment_hash, index_bits(payment_hash), false);
+}
+
+const compact_bolt11* invoice_store::find_by_secret(const unsigned char payment_secret[32]) const {
+    std::shared_lock<std::shared_mutex> guard(lock);
+    return probe(by_secret, payment_secret, index_bits(payment_secret), true);
+}
+
+void invoice_store::expand(const compact_bolt11& invoice, struct bolt11& out) const {
+    std::shared_lock<std::shared_mutex> guard(lock);
+    arena.expand(invoice, out);
+}
+
+size_t invoice_store::size() const {
+    std::shared_lock<std::shared_mutex> guard(lock);
+    return count;
+}
+
+}
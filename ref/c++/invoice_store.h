@@ -0,0 +1,90 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef INVOICE_STORE_H_
+#define INVOICE_STORE_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <shared_mutex>
+#include <vector>
+
+#include "compact_bolt11.h"
+#include "hash_index.h"
+#include "payment_request.h"
+
+namespace payment_request
+{
+
+/** Decoded invoices indexed by payment hash and by payment secret, for looking invoices up as
+ *  HTLCs arrive. Invoices are kept in their compact form, the cold fields in a bolt11_arena. The
+ *  indexes are open-addressing tables probed linearly. Payment hashes and secrets are whatever the
+ *  invoice says, so both are hashed under a key of the store's own, which invoices cannot make
+ *  collide.
+ *  Lookups may run concurrently with each other; inserts take the store exclusively, once per
+ *  batch. */
+class invoice_store {
+public:
+	/** Size the indexes for @expected invoices up front. */
+	explicit invoice_store(size_t expected = 0);
+
+	/** Store @count invoices. One whose payment hash is stored already, earlier in the batch
+	 *  included, is rejected as a duplicate, as is one bolt11_arena::add() cannot hold: @inserted[i]
+	 *  is false for it, if @inserted is given. Returns the number stored. */
+	size_t insert_batch(const struct bolt11* invoices, size_t count, bool* inserted = NULL);
+	bool insert(const struct bolt11& invoice) { return insert_batch(&invoice, 1) == 1; }
+
+	/** The invoice with @payment_hash, NULL if there is none. Stored invoices never move, so the
+	 *  pointer stays valid as long as the store. */
+	const compact_bolt11* find(const unsigned char payment_hash[32]) const;
+	/** The first invoice stored with @payment_secret, NULL if there is none. */
+	const compact_bolt11* find_by_secret(const unsigned char payment_secret[32]) const;
+
+	/** Rebuild the full bolt11 of a stored invoice, as bolt11_arena::expand does. */
+	void expand(const compact_bolt11& invoice, struct bolt11& out) const;
+
+	size_t size() const;
+
+private:
+	static constexpr size_t RECORDS_PER_BLOCK = 1 << 16;
+
+	mutable std::shared_mutex lock;
+	std::vector<std::unique_ptr<compact_bolt11[]> > records;
+	size_t count = 0;
+	bolt11_arena arena;
+	/* Slots hold the record number plus one in the low 32 bits, 0 if empty, and 32 more bits of
+	 * the key in the high ones to skip most mismatches without touching the record. */
+	std::vector<uint64_t> by_hash;
+	std::vector<uint64_t> by_secret;
+	uint64_t seed[2];                               // keys keyed_bits() for both indexes, random per store
+
+	const compact_bolt11& record(uint32_t n) const { return records[n / RECORDS_PER_BLOCK][n % RECORDS_PER_BLOCK]; }
+	uint64_t index_bits(const unsigned char key[32]) const { return keyed_bits(key, seed); }
+	const compact_bolt11* probe(const std::vector<uint64_t>& table, const unsigned char key[32], uint64_t bits, bool secret) const;
+	void place(std::vector<uint64_t>& table, uint64_t bits, uint32_t n);
+	void grow(size_t needed);
+};
+
+}
+
+#endif  // INVOICE_STORE_H_
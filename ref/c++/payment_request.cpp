@@ -20,59 +20,165 @@
  */
 #include "payment_request.h"
 #include "bech32.h"
+#include "convertbits.h"
+#include "decode_stats.h"
+#include "hint_arena.h"
+#include "hrp.h"
+#include "recovery_cache.h"
+#include "secp256k1.h"
+#include "sha256.h"
+#include "tagged_fields.h"
 
 namespace
 {
 
 typedef std::vector<uint8_t> data;
 
-/** Convert from one power-of-2 number base to another. */
-bool convertbits(bool pad, int frombits, int tobits, data& out, const data& in) {
-    int acc = 0;
-    int bits = 0;
-    const int maxv = (1 << tobits) - 1;
-    const int max_acc = (1 << (frombits + tobits - 1)) - 1;
-    for (size_t i = 0; i < in.size(); ++i) {
-        int value = in[i];
-        acc = ((acc << frombits) | value) & max_acc;
-        bits += frombits;
-        while (bits >= tobits) {
-            bits -= tobits;
-            out.push_back((acc >> bits) & maxv);
+/** Reads big-endian values straight out of a run of 5-bit values, with bounds checking. */
+class bit_reader {
+public:
+    bit_reader(const uint8_t* values, size_t size) : values(values), bits(size * 5), pos(0) {}
+
+    size_t bits_left() const { return bits - pos; }
+
+    /** Read a @width-bit big-endian unsigned integer. Bits above the low 64 must be zero. */
+    bool read_uint(size_t width, uint64_t* val) {
+        if (width > bits_left()) return false;
+        uint64_t v = 0;
+        while (width) {
+            const size_t offset = pos % 5;
+            const size_t take = std::min<size_t>(5 - offset, width);
+            if (v >> (64 - take)) return false;
+            v = (v << take) | ((values[pos / 5] >> (5 - offset - take)) & ((1u << take) - 1));
+            pos += take;
+            width -= take;
         }
+        *val = v;
+        return true;
     }
-    if (pad) {
-        if (bits) out.push_back((acc << (tobits - bits)) & maxv);
-    } else if (bits >= frombits || ((acc << (tobits - bits)) & maxv)) {
-        return false;
+
+    /** Regroup the rest into bytes at @out, which has room for @capacity. The last value may carry
+     *  up to 4 bits of padding, which must be zero. */
+    bool read_payload(unsigned char* out, size_t capacity, size_t* size) {
+        const size_t bytes = bits_left() / 8;
+        const size_t padding = bits_left() % 8;
+        if (bytes > capacity || padding >= 5) return false;
+        if (pos % 5 == 0) {
+            /* Field payloads start on a whole value, so the vectorized regrouping applies. */
+            if (!bech32::regroup_5to8(values + pos / 5, (bits - pos) / 5, false, out, size)) return false;
+            pos = bits;
+            return true;
+        }
+        uint64_t acc = 0;
+        if (!read_uint(pos % 5 ? 5 - pos % 5 : 0, &acc)) return false;
+        size_t acc_bits = (5 - pos % 5) % 5;
+        for (size_t i = 0; i < bytes; ++i) {
+            while (acc_bits < 8) {
+                acc = (acc << 5) | values[pos / 5];
+                pos += 5;
+                acc_bits += 5;
+            }
+            acc_bits -= 8;
+            out[i] = acc >> acc_bits;
+        }
+        if (acc & ((1u << acc_bits) - 1)) return false;
+        *size = bytes;
+        return true;
     }
-    return true;
-}
 
-// Function to convert a byte array to a hexadecimal array
-void bytes_to_hex(const std::vector<unsigned char>& in, char* out) {
-    for (size_t i = 0; i < in.size(); i++) {
-        out[i*2] = in[i] >> 4;
-        out[i*2+1] = in[i] & 0x0F;
+    /** Regroup the rest into exactly @size bytes. */
+    bool read_bytes(unsigned char* out, size_t size) {
+        size_t read;
+        return read_payload(out, size, &read) && read == size;
     }
-}
 
-/* Helper for pulling a variable-length big-endian int. */
-bool pull_uint(const data& in,uint64_t* val, size_t databits)
+private:
+    const uint8_t* values;
+    size_t bits;
+    size_t pos;                         // in bits
+};
+
+/** Writes 5-bit values, one per byte, into a caller buffer. Running out of room is remembered
+ *  and reported by ok(), so a sequence of writes needs a single check. */
+class value_writer {
+public:
+    value_writer(uint8_t* out, size_t capacity) : out(out), capacity(capacity), pos(0), overflow(false) {}
+
+    bool ok() const { return !overflow; }
+    size_t size() const { return pos; }
+
+    /** Write @value big endian in @width bits, a multiple of 5, zero extended past 64. */
+    void write_uint(uint64_t value, size_t width) {
+        if (width / 5 > capacity - pos) { overflow = true; return; }
+        for (size_t shift = width; shift > 0; shift -= 5) out[pos++] = shift - 5 < 64 ? (value >> (shift - 5)) & 0x1f : 0;
+    }
+
+    /** Copy @size values as they are. */
+    void write_values(const uint8_t* in, size_t size) {
+        if (size > capacity - pos) { overflow = true; return; }
+        std::copy(in, in + size, out + pos);
+        pos += size;
+    }
+
+    /** Regroup @size bytes into values, zero padding the last one. */
+    void write_bytes(const unsigned char* in, size_t size) {
+        if ((size * 8 + 4) / 5 > capacity - pos) { overflow = true; return; }
+        size_t written;
+        bech32::regroup_8to5(in, size, true, out + pos, &written);
+        pos += written;
+    }
+
+    /** Write a tagged field holding @size bytes. */
+    void write_field(uint8_t type, const unsigned char* in, size_t size) {
+        write_uint(type, 5);
+        write_uint((size * 8 + 4) / 5, 10);
+        write_bytes(in, size);
+    }
+
+    /** Write a tagged field holding @value in as few values as possible, but no fewer than @size. */
+    void write_uint_field(uint8_t type, uint64_t value, size_t size = 0) {
+        size_t width = 0;
+        while (width < 65 && (value >> width)) width += 5;
+        width = std::max(width, size * 5);
+        write_uint(type, 5);
+        write_uint(width / 5, 10);
+        write_uint(value, width);
+    }
+
+private:
+    uint8_t* out;
+    size_t capacity;
+    size_t pos;
+    bool overflow;
+};
+
+/* Number of 5-bit values of the timestamp and of the signature that ends the data part. */
+const size_t TIMESTAMP_SIZE = 7;
+const size_t SIGNATURE_SIZE = 104;
+
+/* Features this decoder understands; a set even bit outside of this list fails the payment. */
+const int known_features[] = {
+    8,                                  // var_onion_optin
+    14,                                 // payment_secret
+    16,                                 // basic_mpp
+    48,                                 // option_payment_metadata
+};
+
+/* Check the '9' field, whose bits are numbered from the least significant bit of the last value,
+ * and keep its first 64 bits in @bits. */
+bool read_features(const uint8_t* in, size_t size, uint64_t* bits)
 {
-    data out;
-    int tobits = 8;
-    int frombits = 5;
-    *val = 0;
-    /* Padd if size variable is not multiple of tobits */
-    bool need_padding = (in.size() * tobits) % tobits == 0;
-    /* Conver frombits base tobits base*/    
-    if (!convertbits(need_padding, frombits, tobits, out, in)) return false;
-    /* take the tobits base bytes and calculate the decima value */
-    for (long unsigned int i = 0; i < out.size(); ++i)
-        *val |= static_cast<uint64_t>(out[i]) << (8 * (out.size()-i-1));
-    /* Adjust the shifitng to databits value*/
-    *val = *val >> (out.size() * 8 - databits);    
+    *bits = 0;
+    for (size_t i = 0; i < size; ++i) {
+        for (int b = 0; b < 5; ++b) {
+            if (!((in[i] >> b) & 1)) continue;
+            int bit = (size - 1 - i) * 5 + b;
+            if (bit < 64) *bits |= uint64_t{1} << bit;
+            if (bit % 2) continue;              // MUST ignore unknown odd bits
+            if (std::find(std::begin(known_features), std::end(known_features), bit) == std::end(known_features))
+                return false;                   // MUST fail on unknown even bits
+        }
+    }
     return true;
 }
 
@@ -80,107 +186,723 @@ bool pull_uint(const data& in,uint64_t* val, size_t databits)
 
 namespace payment_request
 {
-struct bolt11 payment_request;
-std::vector<std::string> prefix_list = {"lnbc", "lntb", "lntbs", "lnbcrt"};
+
+namespace
+{
+
+/** Parse the prefix and the amount out of the hrp. A prefix has at most 8 characters, which
+ *  std::string keeps inline, so this does not allocate. */
+int decode_hrp(std::string_view hrp, struct bolt11& payment_request) {
+    /* BOLT11 - if it does NOT understand the prefix MUST fail the payment. */
+    struct hrp_fields fields;
+    const reject_reason reason = parse_hrp(hrp, fields);
+    if (reason != reject_reason::NONE) return stats::reject(reason);
+    payment_request.prefix.assign(hrp.data(), fields.prefix_size);
+    payment_request.network = fields.network;
+    payment_request.sat_amount = fields.sat_amount;
+    return 0;
+}
+
+/** Decode the bech32 string of an invoice into @dec. */
+int decode_bech32(std::string_view invoice, bech32::DecodeBuffer& dec) {
+    const uint64_t start = stats::ticks();
+    const bool valid = bech32::decode(invoice, dec) != bech32::Encoding::INVALID;
+    stats::record(decode_stage::BECH32, start);
+    return valid ? 0 : stats::reject_bech32(dec);
+}
+
+/** Decode everything up to the tagged fields: the hrp and the timestamp. Sets the defaults of the
+ *  fields that may be left out. */
+int decode_header(const bech32::DecodeBuffer& dec, struct bolt11& payment_request) {
+    const uint64_t start = stats::ticks();
+    /* The data part holds at least the timestamp and the signature. */
+    if (dec.data_size < TIMESTAMP_SIZE + SIGNATURE_SIZE) return stats::reject(reject_reason::TOO_SHORT);
+    if (decode_hrp(dec.hrp_view(), payment_request) != 0) return -1;
+    /* Take the timesatamp of the invoice*/
+    bit_reader timestamp(dec.data, TIMESTAMP_SIZE);
+    if(!timestamp.read_uint(35, &payment_request.timestamp)) return stats::reject(reject_reason::TOO_SHORT);
+    /* The signature ends the data part: 64 bytes and the recovery id. */
+    bit_reader signature(dec.data + dec.data_size - SIGNATURE_SIZE, SIGNATURE_SIZE);
+    unsigned char sig[65];
+    if (!signature.read_bytes(sig, 65) || sig[64] > 3) return stats::reject(reject_reason::SIGNATURE);
+    std::copy(sig, sig + 64, payment_request.sig);
+    payment_request.sig_recovery_id = sig[64];
+
+    /* Defaults for the fields that may be left out. */
+    payment_request.has_receiver_id = false;
+    payment_request.description_len = 0;
+    payment_request.has_description_hash = false;
+    payment_request.expiry = 3600;
+    payment_request.min_final_cltv_expiry = 18;
+    payment_request.features = 0;
+    payment_request.fallbacks = NULL;
+    payment_request.fallback_count = 0;
+    payment_request.routes = NULL;
+    payment_request.route_count = 0;
+    payment_request.tagged_fields = NULL;
+    payment_request.tagged_field_count = 0;
+    stats::record(decode_stage::HEADER, start);
+    return 0;
+}
+
+/** Find the tagged field at @pos: its type, and where its payload starts and ends. Returns false
+ *  if it runs past the signature. */
+bool next_field(const bech32::DecodeBuffer& dec, size_t pos, uint8_t* type, size_t* begin, size_t* end) {
+    const size_t tagged_end = dec.data_size - SIGNATURE_SIZE;
+    /* type (5 bits) and data_length (10 bits) precede every field */
+    if (pos + 3 > tagged_end) return false;
+    const size_t data_lenght = (dec.data[pos + 1] << 5) | dec.data[pos + 2];
+    if (data_lenght > tagged_end - pos - 3) return false;
+    *type = dec.data[pos];
+    *begin = pos + 3;
+    *end = pos + 3 + data_lenght;
+    return true;
+}
+
+/** The handler @fields has for a field of @type and @data_lenght values, or NULL for a field to
+ *  skip: one nobody handles, or one of the wrong length for its type. */
+field_handler field_handler_for(const field_table& fields, uint8_t type, size_t data_lenght) {
+    const field_entry& entry = fields.entries[type & 31];
+    if (entry.length && entry.length != data_lenght) return NULL;
+    return entry.handler;
+}
+
+/* A route hop takes 51 bytes: pubkey (33), short_channel_id (8), fee_base_msat (4),
+ * fee_proportional_millionths (4) and cltv_expiry_delta (2), all big endian. */
+const size_t HOP_SIZE = 51;
+/* The most bytes a field holds: data_length counts up to 1023 values. */
+const size_t MAX_FIELD_BYTES = 1023 * 5 / 8;
+
+/** Regroup the payload of an r field into @bytes and count its hops. Returns false if the field
+ *  is malformed. */
+bool read_route(const uint8_t* payload, size_t data_lenght, unsigned char* bytes, size_t* hops) {
+    bit_reader field(payload, data_lenght);
+    size_t size;
+    if (!field.read_payload(bytes, MAX_FIELD_BYTES, &size) || size % HOP_SIZE) return false;
+    *hops = size / HOP_SIZE;
+    return true;
+}
+
+/** Read an f field into @version and @program. Returns false for a field to skip: one of an
+ *  unknown version, or whose program does not have a size its version allows. */
+bool read_fallback(const uint8_t* payload, size_t data_lenght, uint64_t* version, unsigned char* program, size_t* size) {
+    bit_reader field(payload, data_lenght);
+    if (!field.read_uint(5, version) || !field.read_payload(program, MAX_FIELD_BYTES, size)) return false;
+    if (*version == 17 || *version == 18) return *size == 20;          // P2PKH, P2SH
+    if (*version == 0) return *size == 20 || *size == 32;               // P2WPKH, P2WSH
+    return *version <= 16 && *size >= 2 && *size <= 40;
+}
+
+uint64_t read_be(const unsigned char* in, size_t size) {
+    uint64_t v = 0;
+    for (size_t i = 0; i < size; ++i) v = (v << 8) | in[i];
+    return v;
+}
+
+void write_be(uint64_t v, unsigned char* out, size_t size) {
+    for (size_t i = size; i-- > 0; v >>= 8) out[i] = v & 0xff;
+}
+
+/** Store the route hints, the fallback addresses and the @count tagged fields, if any, of a decoded
+ *  invoice, which has @routes non-empty r fields with @hops hops in all and @fallbacks f fields to
+ *  keep. The fields were checked already; this walks them again, now that each kind can take one
+ *  contiguous array. Only the fields @fields hands to the route and fallback handlers are stored,
+ *  as those counted them, and never more than they counted. A tagged field keeps its values unless
+ *  the bolt11 holds it, which the last field of a type its standard handler converted it is. */
+void store_fields(const bech32::DecodeBuffer& dec, const field_table& fields, hint_arena& hints, size_t count, size_t routes,
+                  size_t hops, size_t fallbacks, struct bolt11& out) {
+    route_hop* hop = hops ? hints.allocate<route_hop>(hops) : NULL;
+    route_hint* route = routes ? hints.allocate<route_hint>(routes) : NULL;
+    fallback_address* fallback = fallbacks ? hints.allocate<fallback_address>(fallbacks) : NULL;
+    tagged_field* tagged = count ? hints.allocate<tagged_field>(count) : NULL;
+    const route_hop* const hops_end = hop + hops;
+    const route_hint* const routes_end = route + routes;
+    const fallback_address* const fallbacks_end = fallback + fallbacks;
+    out.routes = route;
+    out.route_count = routes;
+    out.fallbacks = fallback;
+    out.fallback_count = fallbacks;
+    out.tagged_fields = tagged;
+    out.tagged_field_count = 0;
+    /* The field of each single valued type the bolt11 holds so far, and where its values are. */
+    tagged_field* held[32] = {};
+    size_t held_begin[32];
+    unsigned char bytes[MAX_FIELD_BYTES];
+    uint8_t type;
+    size_t begin, end;
+    for (size_t pos = TIMESTAMP_SIZE; pos < dec.data_size - SIGNATURE_SIZE; pos = end) {
+        if (!next_field(dec, pos, &type, &begin, &end)) break;
+        const field_handler handler = field_handler_for(fields, type, end - begin);
+        bool holds = false;
+        if (handler == field_handlers::route) {
+            size_t size;
+            holds = read_route(dec.data + begin, end - begin, bytes, &size) && size != 0 && route != routes_end &&
+                    size <= static_cast<size_t>(hops_end - hop);
+            if (holds) {
+                *route++ = route_hint{hop, size};
+                for (const unsigned char* in = bytes; in < bytes + size * HOP_SIZE; in += HOP_SIZE, ++hop) {
+                    std::copy(in, in + 33, hop->pubkey);
+                    hop->short_channel_id = read_be(in + 33, 8);
+                    hop->fee_base_msat = read_be(in + 41, 4);
+                    hop->fee_proportional_millionths = read_be(in + 45, 4);
+                    hop->cltv_expiry_delta = read_be(in + 49, 2);
+                }
+            }
+        } else if (handler == field_handlers::fallback) {
+            uint64_t version;
+            size_t size;
+            holds = read_fallback(dec.data + begin, end - begin, &version, bytes, &size) && fallback != fallbacks_end;
+            if (holds) {
+                unsigned char* program = hints.allocate<unsigned char>(size);
+                std::copy(bytes, bytes + size, program);
+                *fallback++ = fallback_address{static_cast<uint8_t>(version), program, size};
+            }
+        } else if (handler && handler == STANDARD_FIELDS.entries[type].handler) {
+            /* Feature bits from 64 on are not kept, so a 9 field with any set stays as it came. */
+            uint64_t features;
+            holds = type != FIELD_FEATURES || bit_reader(dec.data + begin, end - begin).read_uint((end - begin) * 5, &features);
+            if (holds && held[type]) {
+                uint8_t* values = hints.allocate<uint8_t>(held[type]->size);
+                std::copy(dec.data + held_begin[type], dec.data + held_begin[type] + held[type]->size, values);
+                held[type]->values = values;
+            }
+        }
+        if (out.tagged_field_count == count) continue;
+        tagged_field& field = tagged[out.tagged_field_count++];
+        field = tagged_field{type, static_cast<uint16_t>(end - begin), NULL};
+        if (holds && type != FIELD_ROUTE && type != FIELD_FALLBACK) {
+            held[type] = &field;
+            held_begin[type] = begin;
+        } else if (!holds) {
+            uint8_t* values = hints.allocate<uint8_t>(end - begin);
+            std::copy(dec.data + begin, dec.data + end, values);
+            field.values = values;
+        }
+    }
+}
+
+/** Build the message the signature commits to. The values are already mapped, so one regrouping
+ *  pass gives the bytes that are hashed. */
+void signing_preimage(const bech32::DecodeBuffer& dec, struct signing_data& signed_data) {
+    size_t size;
+    std::copy(dec.hrp, dec.hrp + dec.hrp_size, signed_data.preimage);
+    bech32::regroup_5to8(dec.data, dec.data_size - SIGNATURE_SIZE, true, signed_data.preimage + dec.hrp_size, &size);
+    signed_data.size = dec.hrp_size + size;
+}
+
+/** Decode the Lightning Payment Request bech32 decoded into @dec, handing each tagged field to its
+ *  handler in @fields, and leave the message the signature commits to in @signed_data, if given. */
+int decode_data(const bech32::DecodeBuffer& dec, struct bolt11& payment_request, struct signing_data* signed_data, hint_arena* hints,
+                const field_table& fields = STANDARD_FIELDS, void* context = NULL) {
+    if (decode_header(dec, payment_request) != 0) return -1;
+    const uint64_t start = stats::ticks();
+    struct field_state state{payment_request, context, 0, 0, 0};
+    uint32_t handled = 0;
+    size_t count = 0;
+
+    uint8_t type;
+    size_t begin, end;
+    const size_t tagged_end = dec.data_size - SIGNATURE_SIZE;
+    size_t data_part_pointer = TIMESTAMP_SIZE; // timestamp lenght
+    while (data_part_pointer < tagged_end) {
+        if (!next_field(dec, data_part_pointer, &type, &begin, &end)) return stats::reject(reject_reason::FIELD);
+        data_part_pointer = end;
+        ++count;
+        /* MUST skip unknown fields, and p, h, s or n fields of the wrong length */
+        const field_handler handler = field_handler_for(fields, type, end - begin);
+        if (!handler) continue;
+        if (handler(dec.data + begin, end - begin, state) != 0) return stats::reject(reject_reason::FIELD);
+        handled |= 1u << type;
+    }
+    /* A payment hash and a payment secret are required. */
+    if (!(handled & (1u << FIELD_PAYMENT_HASH)) || !(handled & (1u << FIELD_PAYMENT_SECRET)))
+        return stats::reject(reject_reason::MISSING_FIELD);
+    if (hints) store_fields(dec, fields, *hints, count, state.routes, state.hops, state.fallbacks, payment_request);
+    if (signed_data) signing_preimage(dec, *signed_data);
+    stats::record(decode_stage::FIELDS, start);
+    return 0;
+}
+
+/** As above, from the bech32 string, leaving its decoding in @dec. */
+int decode(std::string_view invoice, struct bolt11& payment_request, bech32::DecodeBuffer& dec, struct signing_data* signed_data, hint_arena* hints,
+           const field_table& fields = STANDARD_FIELDS, void* context = NULL) {
+    if (decode_bech32(invoice, dec) != 0) return -1;
+    return decode_data(dec, payment_request, signed_data, hints, fields, context);
+}
+
+/** Decode a Lightning Payment Request and check its signature, leaving the bech32 decoding in @dec. */
+int decode_checked(std::string_view invoice, struct bolt11& out, bech32::DecodeBuffer& dec, recovery_cache* cache, hint_arena* hints = NULL,
+                   const field_table& fields = STANDARD_FIELDS, void* context = NULL) {
+    struct signing_data signed_data;
+    int status;
+    if (decode(invoice, out, dec, &signed_data, hints, fields, context) != 0) return -1;
+    const uint64_t start = stats::ticks();
+    sha256::hash(signed_data.preimage, signed_data.size, out.signing_hash);
+    stats::record(decode_stage::HASH, start);
+    check_signatures(&out, 1, &status, cache);
+    return status;
+}
+
+}
+
+/** Decode a Lightning Payment Request into a caller-owned bolt11. **/
+int decode(std::string_view invoice, struct bolt11& out) {
+    bech32::DecodeBuffer dec;
+    return stats::finish(decode_checked(invoice, out, dec, NULL));
+}
+
+int decode(std::string_view invoice, struct bolt11& out, recovery_cache& cache) {
+    bech32::DecodeBuffer dec;
+    return stats::finish(decode_checked(invoice, out, dec, &cache));
+}
+
+int decode(std::string_view invoice, struct bolt11& out, hint_arena& hints) {
+    bech32::DecodeBuffer dec;
+    return stats::finish(decode_checked(invoice, out, dec, NULL, &hints));
+}
+
+int decode(std::string_view invoice, struct bolt11& out, struct signing_data& signed_data, hint_arena* hints) {
+    bech32::DecodeBuffer dec;
+    return stats::finish(decode(invoice, out, dec, &signed_data, hints));
+}
+
+int decode(std::string_view invoice, struct bolt11& out, const field_table& fields, void* context, hint_arena* hints) {
+    bech32::DecodeBuffer dec;
+    return stats::finish(decode_checked(invoice, out, dec, NULL, hints, fields, context));
+}
+
+int decode(const bech32::DecodeBuffer& dec, struct bolt11& out, struct signing_data& signed_data) {
+    return decode_data(dec, out, &signed_data, NULL);
+}
 
 /** Decode a Lightning Payment Request **/
 std::pair<int, data> decode(const std::string& invoice) {
-    const auto dec = bech32::decode(invoice);
-    if (dec.data.size() < 1) return std::make_pair(-1, data());
-    /* BOLT11 - if it does NOT understand the prefix MUST fail the payment. */
-    /* First find the invoice value field into hrp */
-    std::string hrp_value;
-    for (size_t i = 0; i < dec.hrp.size(); ++i) {
-        if (isdigit(dec.hrp[i])) {
-            hrp_value = dec.hrp.substr(i, dec.hrp.size()-1 );
-            payment_request.prefix = dec.hrp.substr(0, i);
+    struct bolt11 payment_request;
+    bech32::DecodeBuffer dec;
+    if (stats::finish(decode_checked(invoice, payment_request, dec, NULL)) != 0) return std::make_pair(-1, data());
+    return std::make_pair(0, data(dec.data, dec.data + dec.data_size));
+}
+
+namespace field_handlers
+{
+
+int payment_hash(const uint8_t* payload, size_t data_lenght, struct field_state& state) {
+    // 'p' Preimage of this provides proof of payment.
+    bit_reader field(payload, data_lenght);
+    return field.read_bytes(state.invoice.payment_hash, 32) ? 0 : -1;
+}
+
+int payment_secret(const uint8_t* payload, size_t data_lenght, struct field_state& state) {
+    // 's' This 256-bit secret prevents forwarding nodes from probing the payment recipient.
+    bit_reader field(payload, data_lenght);
+    return field.read_bytes(state.invoice.payment_secret, 32) ? 0 : -1;
+}
+
+int description(const uint8_t* payload, size_t data_lenght, struct field_state& state) {
+    // 'd' Short description of purpose of payment (UTF-8)
+    bit_reader field(payload, data_lenght);
+    size_t size;
+    if (!field.read_payload(state.invoice.description, sizeof(state.invoice.description), &size)) return -1;
+    state.invoice.description_len = size;
+    return 0;
+}
+
+int description_hash(const uint8_t* payload, size_t data_lenght, struct field_state& state) {
+    // 'h' 256-bit description of purpose of payment (SHA256).
+    bit_reader field(payload, data_lenght);
+    if (!field.read_bytes(state.invoice.description_hash, 32)) return -1;
+    state.invoice.has_description_hash = true;
+    return 0;
+}
+
+int receiver_id(const uint8_t* payload, size_t data_lenght, struct field_state& state) {
+    // 'n' 33-byte public key of the payee node
+    bit_reader field(payload, data_lenght);
+    if (!field.read_bytes(state.invoice.receiver_id, 33)) return -1;
+    state.invoice.has_receiver_id = true;
+    return 0;
+}
+
+int expiry(const uint8_t* payload, size_t data_lenght, struct field_state& state) {
+    // 'x' expiry time in seconds (big-endian). Default is 3600 (1 hour) if not specified.
+    bit_reader field(payload, data_lenght);
+    return field.read_uint(data_lenght * 5, &state.invoice.expiry) ? 0 : -1;
+}
+
+int min_final_cltv_expiry(const uint8_t* payload, size_t data_lenght, struct field_state& state) {
+    // 'c' min_final_cltv_expiry_delta to use for the last HTLC in the route. Default is 18 if not specified.
+    bit_reader field(payload, data_lenght);
+    uint64_t cltv;
+    if (!field.read_uint(data_lenght * 5, &cltv) || cltv > UINT32_MAX) return -1;
+    state.invoice.min_final_cltv_expiry = cltv;
+    return 0;
+}
+
+int features(const uint8_t* payload, size_t data_lenght, struct field_state& state) {
+    // '9' One or more 5-bit values containing features supported or required for receiving this payment.
+    return read_features(payload, data_lenght, &state.invoice.features) ? 0 : -1;
+}
+
+int route(const uint8_t* payload, size_t data_lenght, struct field_state& state) {
+    // 'r' One or more entries containing extra routing information for a private route; there may be more than one r field
+    unsigned char bytes[MAX_FIELD_BYTES];
+    size_t count;
+    if (!read_route(payload, data_lenght, bytes, &count)) return -1;
+    state.routes += count != 0;
+    state.hops += count;
+    return 0;
+}
+
+int fallback(const uint8_t* payload, size_t data_lenght, struct field_state& state) {
+    // 'f' Fallback on-chain address: a 5-bit version and a witness program or P2PKH or P2SH address.
+    unsigned char program[MAX_FIELD_BYTES];
+    uint64_t version;
+    size_t size;
+    state.fallbacks += read_fallback(payload, data_lenght, &version, program, &size);
+    return 0;
+}
+
+}
+
+namespace
+{
+
+/* Signatures handed to secp256k1::check_batch at once. */
+const size_t SIGNATURE_BATCH = 64;
+
+}
+
+/** Check the signatures of decoded invoices **/
+void check_signatures(struct bolt11* invoices, size_t count, int* status, recovery_cache* cache) {
+    const uint64_t start = stats::ticks();
+    secp256k1::signature_check checks[SIGNATURE_BATCH];
+    size_t rows[SIGNATURE_BATCH];
+    size_t invalid = 0;
+    for (size_t begin = 0; begin < count; begin += SIGNATURE_BATCH) {
+        const size_t end = std::min(count, begin + SIGNATURE_BATCH);
+        size_t n = 0;
+        for (size_t i = begin; i < end; ++i) {
+            struct bolt11& invoice = invoices[i];
+            unsigned char node_id[33];
+            if (cache && cache->lookup(invoice.signing_hash, invoice.sig, invoice.sig_recovery_id, node_id)) {
+                /* BOLT11 - if a valid n field is provided, MUST use it to validate the signature. */
+                if (!invoice.has_receiver_id) {
+                    std::copy(node_id, node_id + 33, invoice.receiver_id);
+                    invoice.has_receiver_id = true;
+                }
+                if (std::equal(node_id, node_id + 33, invoice.receiver_id)) {
+                    status[i] = 0;
+                    continue;
+                }
+            }
+            secp256k1::signature_check& check = checks[n];
+            check.hash = invoice.signing_hash;
+            check.sig = invoice.sig;
+            check.recovery_id = invoice.sig_recovery_id;
+            check.recover = !invoice.has_receiver_id;   // else MUST be able to recover the public key
+            if (invoice.has_receiver_id) std::copy(invoice.receiver_id, invoice.receiver_id + 33, check.pubkey);
+            rows[n++] = i;
+        }
+        secp256k1::check_batch(checks, n);
+        for (size_t k = 0; k < n; ++k) {
+            struct bolt11& invoice = invoices[rows[k]];
+            status[rows[k]] = checks[k].valid ? 0 : -1;
+            invalid += !checks[k].valid;
+            if (!checks[k].valid) continue;
+            if (checks[k].recover) {
+                std::copy(checks[k].pubkey, checks[k].pubkey + 33, invoice.receiver_id);
+                invoice.has_receiver_id = true;
+            }
+            if (cache) cache->insert(invoice.signing_hash, invoice.sig, invoice.sig_recovery_id, invoice.receiver_id);
+        }
+    }
+    stats::reject_signatures(invalid);
+    stats::record(decode_stage::SIGNATURE, start);
+}
+
+namespace
+{
+
+/** Write the prefix and the amount, with the largest multiplier that keeps it exact. */
+size_t encode_hrp(const struct bolt11& invoice, char* out, size_t capacity) {
+    /* msat per unit of each multiplier; p is a tenth of a msat. */
+    static const struct { char multiplier; uint64_t msat; } units[] = {
+        {0, 100000000000}, {'m', 100000000}, {'u', 100000}, {'n', 100},
+    };
+    char digits[24];
+    size_t n = 0;
+    char multiplier = 'p';
+    uint64_t value = invoice.sat_amount * 10;
+    for (const auto& unit : units) {
+        if (invoice.sat_amount % unit.msat == 0) {
+            multiplier = unit.multiplier;
+            value = invoice.sat_amount / unit.msat;
             break;
         }
     }
-    if(hrp_value == ""){                   /* If there is no value for the invoice */
-        payment_request.prefix = dec.hrp;
+    if (invoice.sat_amount == 0) {
+        multiplier = 0;                 // no amount
     } else {
-    /* Get the numeric value of the value hrp */
-        size_t invoice_value = std::stoul(hrp_value.substr(0,hrp_value.size()-1));
-        /*  m (milli): multiply by 0.001
-            u (micro): multiply by 0.000001
-            n (nano): multiply by 0.000000001
-            p (pico): multiply by 0.000000000001
-
-            Value will be calculated in msats
-        */
-        if(isdigit(hrp_value[hrp_value.size()-1])){
-            payment_request.sat_amount = invoice_value*100000000*1000;                       // There is no multiplier
-        } else {
-            switch (hrp_value[hrp_value.size()-1]) {
-                case 'm':
-                    payment_request.sat_amount = invoice_value*100000000;                    //*0.001*100000000*1000;
-                    break;
-                case 'u':
-                    payment_request.sat_amount = invoice_value*100000;                       //*0.000001*100000000*1000;
-                    break;
-                case 'n':
-                    payment_request.sat_amount = invoice_value*100;                          //*0.000000001*100000000*1000;
-                    break;
-                case 'p':
-                    payment_request.sat_amount = invoice_value*0.1;                          //*0.000000000001*100000000*1000;
-                    break;
-                default:
-                    return std::make_pair(-1, data());
-                    break;
-            }
+        if (multiplier == 'p' && invoice.sat_amount > UINT64_MAX / 10) return 0;
+        for (; value; value /= 10) digits[n++] = '0' + value % 10;
+    }
+    const size_t size = invoice.prefix.size() + n + (multiplier ? 1 : 0);
+    if (size > capacity) return 0;
+    std::copy(invoice.prefix.begin(), invoice.prefix.end(), out);
+    std::reverse_copy(digits, digits + n, out + invoice.prefix.size());
+    if (multiplier) out[size - 1] = multiplier;
+    return size;
+}
+
+/** Write the f field of @fallback. False if its program is larger than a field holds. */
+bool write_fallback(value_writer& writer, const fallback_address& fallback) {
+    if (fallback.size > MAX_FIELD_BYTES - 1) return false;
+    writer.write_uint(FIELD_FALLBACK, 5);
+    writer.write_uint(1 + (fallback.size * 8 + 4) / 5, 10);
+    writer.write_uint(fallback.version, 5);
+    writer.write_bytes(fallback.program, fallback.size);
+    return true;
+}
+
+/** Write the r field of @route. False if it has more hops than a field holds. */
+bool write_route(value_writer& writer, const route_hint& route) {
+    unsigned char bytes[MAX_FIELD_BYTES];
+    if (route.size > MAX_FIELD_BYTES / HOP_SIZE) return false;
+    for (size_t h = 0; h < route.size; ++h) {
+        unsigned char* out_hop = bytes + h * HOP_SIZE;
+        std::copy(route.hops[h].pubkey, route.hops[h].pubkey + 33, out_hop);
+        write_be(route.hops[h].short_channel_id, out_hop + 33, 8);
+        write_be(route.hops[h].fee_base_msat, out_hop + 41, 4);
+        write_be(route.hops[h].fee_proportional_millionths, out_hop + 45, 4);
+        write_be(route.hops[h].cltv_expiry_delta, out_hop + 49, 2);
+    }
+    writer.write_field(FIELD_ROUTE, bytes, route.size * HOP_SIZE);
+    return true;
+}
+
+/** Write the tagged fields of @invoice in their order, taking the r and the f fields the bolt11
+ *  holds from its routes and fallbacks in turn. */
+bool write_tagged_fields(value_writer& writer, const struct bolt11& invoice) {
+    size_t routes = 0, fallbacks = 0;
+    for (size_t i = 0; i < invoice.tagged_field_count; ++i) {
+        const tagged_field& field = invoice.tagged_fields[i];
+        if (field.values) {
+            writer.write_uint(field.type, 5);
+            writer.write_uint(field.size, 10);
+            writer.write_values(field.values, field.size);
+            continue;
+        }
+        switch (field.type) {
+        case FIELD_PAYMENT_HASH:
+            writer.write_field(field.type, invoice.payment_hash, 32);
+            break;
+        case FIELD_PAYMENT_SECRET:
+            writer.write_field(field.type, invoice.payment_secret, 32);
+            break;
+        case FIELD_DESCRIPTION:
+            writer.write_field(field.type, invoice.description, invoice.description_len);
+            break;
+        case FIELD_DESCRIPTION_HASH:
+            if (invoice.has_description_hash) writer.write_field(field.type, invoice.description_hash, 32);
+            break;
+        case FIELD_RECEIVER_ID:
+            if (invoice.has_receiver_id) writer.write_field(field.type, invoice.receiver_id, 33);
+            break;
+        case FIELD_EXPIRY:
+            writer.write_uint_field(field.type, invoice.expiry, field.size);
+            break;
+        case FIELD_MIN_FINAL_CLTV:
+            writer.write_uint_field(field.type, invoice.min_final_cltv_expiry, field.size);
+            break;
+        case FIELD_FEATURES:
+            writer.write_uint_field(field.type, invoice.features, field.size);
+            break;
+        case FIELD_ROUTE:
+            if (routes < invoice.route_count && !write_route(writer, invoice.routes[routes++])) return false;
+            break;
+        case FIELD_FALLBACK:
+            if (fallbacks < invoice.fallback_count && !write_fallback(writer, invoice.fallbacks[fallbacks++])) return false;
+            break;
         }
     }
-    /* if it does NOT understand the prefix MUST fail the payment.*/
-    if(std::find(prefix_list.begin(), prefix_list.end(), payment_request.prefix) == prefix_list.end())
-        return std::make_pair(-1, data());
-    /* Take the timesatamp of the invoice*/
-    if(!pull_uint(data(dec.data.begin(), dec.data.begin()+7), &payment_request.timestamp, 35)) return std::make_pair(-1, data());;
-
-    uint64_t data_lenght = 0;
-    data conv;
-    char preimage[64]; 
-    char secret[64];
-    int tobits = 8;
-    int frombits = 5;
-    int data_part_pointer = 7; // timestamp lenght
-    do {
-        conv = {};
-        if(!pull_uint(data(dec.data.begin() + data_part_pointer + 1, dec.data.begin() + data_part_pointer + 3), &data_lenght, 10)) return std::make_pair(-1, data());
-        bool need_padding = (data_lenght * tobits) % tobits == 0;   
-        if (!convertbits(need_padding, frombits, tobits,conv, data(dec.data.begin() + data_part_pointer + 3, dec.data.begin() + data_part_pointer + 3 + data_lenght))) {
-            return std::make_pair(-1, data());
+    return true;
+}
+
+/** Write the fields of @invoice in a fixed order. */
+bool write_fields(value_writer& writer, const struct bolt11& invoice) {
+    writer.write_field(FIELD_PAYMENT_HASH, invoice.payment_hash, 32);
+    writer.write_field(FIELD_PAYMENT_SECRET, invoice.payment_secret, 32);
+    if (invoice.description_len || !invoice.has_description_hash)
+        writer.write_field(FIELD_DESCRIPTION, invoice.description, invoice.description_len);
+    if (invoice.has_description_hash)
+        writer.write_field(FIELD_DESCRIPTION_HASH, invoice.description_hash, 32);
+    if (invoice.has_receiver_id)
+        writer.write_field(FIELD_RECEIVER_ID, invoice.receiver_id, 33);
+    if (invoice.expiry != 3600)
+        writer.write_uint_field(FIELD_EXPIRY, invoice.expiry);
+    if (invoice.min_final_cltv_expiry != 18)
+        writer.write_uint_field(FIELD_MIN_FINAL_CLTV, invoice.min_final_cltv_expiry);
+    if (invoice.features)
+        writer.write_uint_field(FIELD_FEATURES, invoice.features);
+    for (size_t i = 0; i < invoice.fallback_count; ++i)
+        if (!write_fallback(writer, invoice.fallbacks[i])) return false;
+    for (size_t i = 0; i < invoice.route_count; ++i)
+        if (!write_route(writer, invoice.routes[i])) return false;
+    return true;
+}
+
+}
+
+/** Encode a Lightning Payment Request **/
+size_t encode(const struct bolt11& invoice, char* out, size_t capacity) {
+    /* The timestamp has 35 bits: a later one would come back as another, not the one signed. */
+    if (invoice.timestamp >> 35) return 0;
+    const size_t hrp_size = encode_hrp(invoice, out, capacity);
+    if (hrp_size == 0 || hrp_size + 1 + 6 > capacity) return 0;
+    out[hrp_size] = '1';
+    /* The values go where their characters will be; bech32 maps them in place. */
+    value_writer writer(reinterpret_cast<uint8_t*>(out + hrp_size + 1), capacity - hrp_size - 1 - 6);
+    writer.write_uint(invoice.timestamp, 35);
+    if (!(invoice.tagged_fields ? write_tagged_fields(writer, invoice) : write_fields(writer, invoice))) return 0;
+    unsigned char signature[65];
+    std::copy(invoice.sig, invoice.sig + 64, signature);
+    signature[64] = invoice.sig_recovery_id;
+    writer.write_bytes(signature, 65);
+    if (!writer.ok()) return 0;
+    return bech32::encode_in_place(out, hrp_size, writer.size(), bech32::Encoding::BECH32);
+}
+
+size_t encode_batch(const struct bolt11* invoices, size_t count, char* out, size_t capacity, size_t* ends) {
+    size_t used = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const size_t size = encode(invoices[i], out + used, capacity - used);
+        if (size == 0) return i;
+        used += size;
+        ends[i] = used;
+    }
+    return count;
+}
+
+/** Index the tagged fields of a Lightning Payment Request. **/
+int lazy_bolt11::decode(std::string_view invoice) {
+    present = converted = valid = 0;
+    if (decode_bech32(invoice, dec) != 0 || decode_header(dec, fields) != 0) return stats::finish(-1);
+    const uint64_t start = stats::ticks();
+
+    uint8_t type;
+    size_t begin, end;
+    const size_t tagged_end = dec.data_size - SIGNATURE_SIZE;
+    size_t data_part_pointer = TIMESTAMP_SIZE; // timestamp lenght
+    while (data_part_pointer < tagged_end) {
+        if (!next_field(dec, data_part_pointer, &type, &begin, &end)) return stats::finish(stats::reject(reject_reason::FIELD));
+        data_part_pointer = end;
+        /* MUST skip p, h, s or n fields of the wrong length */
+        const field_entry& entry = STANDARD_FIELDS.entries[type];
+        if (entry.length && entry.length != end - begin) continue;
+        /* Fields that fail the whole payment are checked now; they are short. */
+        if (type == FIELD_FEATURES || type == FIELD_EXPIRY || type == FIELD_MIN_FINAL_CLTV) {
+            struct field_state state{fields, NULL, 0, 0, 0};
+            if (entry.handler(dec.data + begin, end - begin, state) != 0) return stats::finish(stats::reject(reject_reason::FIELD));
+            converted |= 1u << type;
+            valid |= 1u << type;
         }
-        switch(dec.data[data_part_pointer]){
-            case 1:                             // 'p' Preimage of this provides proof of payment.
-                bytes_to_hex(conv, preimage);
-                break;
-            case 16:                            // 's' This 256-bit secret prevents forwarding nodes from probing the payment recipient.
-                bytes_to_hex(conv, secret);
-                break;
-            case 'd':                           // Short description of purpose of payment (UTF-8)
-                break;
-            case 'm':                           // Additional metadata to attach to the payment.
-                break;
-            case 'h':                           // 256-bit description of purpose of payment (SHA256).
-                break;
-            case 'x':                           // expiry time in seconds (big-endian). Default is 3600 (1 hour) if not specified.
-                break;
-            case 'c':                           // min_final_cltv_expiry_delta to use for the last HTLC in the route. Default is 18 if not specified.
-                break;
-            case 'f':                           // variable, depending on version. Fallback on-chain address: for Bitcoin, this starts with a 5-bit version and contains a witness program or P2PKH or P2SH address.
-                break;
-            case 'r':                           // One or more entries containing extra routing information for a private route; there may be more than one r field
-                break;
-            case '9':
-                break;
-            default:                            // MUST skip over unknown fields
-                break;
+        present |= 1u << type;
+        field_begin[type] = begin;
+        field_end[type] = end;
+    }
+    /* A payment hash and a payment secret are required. */
+    if (!(present & (1u << FIELD_PAYMENT_HASH)) || !(present & (1u << FIELD_PAYMENT_SECRET)))
+        return stats::finish(stats::reject(reject_reason::MISSING_FIELD));
+
+    /* The signature is checked now, against the n field if there is a valid one. */
+    struct signing_data signed_data;
+    int status;
+    convert(FIELD_RECEIVER_ID);
+    signing_preimage(dec, signed_data);
+    const uint64_t hash_start = stats::record(decode_stage::FIELDS, start);
+    sha256::hash(signed_data.preimage, signed_data.size, fields.signing_hash);
+    stats::record(decode_stage::HASH, hash_start);
+    check_signatures(&fields, 1, &status);
+    if (status != 0) return stats::finish(-1);
+    valid |= 1u << FIELD_RECEIVER_ID;                   // recovered if it was not given
+    return stats::finish(0);
+}
+
+/** Convert the last field of @type, once. Returns whether it is present and well formed. */
+bool lazy_bolt11::convert(uint8_t type) {
+    if (!(converted & (1u << type))) {
+        converted |= 1u << type;
+        const field_handler handler = STANDARD_FIELDS.entries[type].handler;
+        if ((present & (1u << type)) && handler) {
+            struct field_state state{fields, NULL, 0, 0, 0};
+            const size_t size = field_end[type] - field_begin[type];
+            if (handler(dec.data + field_begin[type], size, state) == 0) valid |= 1u << type;
         }
-        data_part_pointer += data_lenght + 3;
-    } while (true);
- 
+    }
+    return valid & (1u << type);
+}
+
+const unsigned char* lazy_bolt11::payment_hash() {
+    return convert(FIELD_PAYMENT_HASH) ? fields.payment_hash : NULL;
+}
+
+const unsigned char* lazy_bolt11::payment_secret() {
+    return convert(FIELD_PAYMENT_SECRET) ? fields.payment_secret : NULL;
+}
+
+const unsigned char* lazy_bolt11::description_hash() {
+    return convert(FIELD_DESCRIPTION_HASH) ? fields.description_hash : NULL;
+}
+
+const unsigned char* lazy_bolt11::receiver_id() {
+    return convert(FIELD_RECEIVER_ID) ? fields.receiver_id : NULL;
+}
+
+std::string_view lazy_bolt11::description() {
+    if (!convert(FIELD_DESCRIPTION)) return std::string_view();
+    return std::string_view(reinterpret_cast<const char*>(fields.description), fields.description_len);
+}
+
+/** Store the route hints and the fallback addresses in @hints, once: both walk every r and f field,
+ *  as decode() does, and none are kept if one is malformed. */
+void lazy_bolt11::convert_hints(hint_arena& hints) {
+    if (converted & (1u << FIELD_ROUTE)) return;
+    converted |= (1u << FIELD_ROUTE) | (1u << FIELD_FALLBACK);
+    if (!(present & ((1u << FIELD_ROUTE) | (1u << FIELD_FALLBACK)))) return;
+    struct field_state state{fields, NULL, 0, 0, 0};
+    uint8_t type;
+    size_t begin, end;
+    for (size_t pos = TIMESTAMP_SIZE; pos < dec.data_size - SIGNATURE_SIZE; pos = end) {
+        if (!next_field(dec, pos, &type, &begin, &end)) return;
+        if (type != FIELD_ROUTE && type != FIELD_FALLBACK) continue;
+        if (STANDARD_FIELDS.entries[type].handler(dec.data + begin, end - begin, state) != 0) return;
+    }
+    valid |= (1u << FIELD_ROUTE) | (1u << FIELD_FALLBACK);
+    if (state.routes || state.fallbacks) store_fields(dec, STANDARD_FIELDS, hints, 0, state.routes, state.hops, state.fallbacks, fields);
+}
+
+const struct route_hint* lazy_bolt11::route_hints(hint_arena& hints, size_t* count) {
+    convert_hints(hints);
+    *count = fields.route_count;
+    return fields.routes;
+}
+
+const struct fallback_address* lazy_bolt11::fallbacks(hint_arena& hints, size_t* count) {
+    convert_hints(hints);
+    *count = fields.fallback_count;
+    return fields.fallbacks;
+}
+
+uint64_t lazy_bolt11::features() {
+    return fields.features;             // converted by decode(), or none
+}
+
+uint64_t lazy_bolt11::expiry() {
+    return fields.expiry;               // converted by decode(), or the default
+}
 
+uint32_t lazy_bolt11::min_final_cltv_expiry() {
+    return fields.min_final_cltv_expiry;
 }
 
 }
@@ -19,29 +19,70 @@
  * THE SOFTWARE.
  */
 
+#ifndef PAYMENT_REQUEST_H_
+#define PAYMENT_REQUEST_H_ 1
+
 #include <stdint.h>
 #include <vector>
 #include <string>
+#include <string_view>
 #include<algorithm>
 
+#include "bech32.h"
+
 namespace payment_request
 {
 
-/** Decode a Lightning Payment Request -1 means failure. */
-std::pair<int, std::vector<uint8_t> > decode(const std::string& addr);
+class recovery_cache;
+class hint_arena;
+
+/** One hop of a route hint: a private channel towards the receiver, from the node pubkey. */
+struct route_hop {
+	unsigned char pubkey[33];
+	uint64_t short_channel_id;
+	uint32_t fee_base_msat;
+	uint32_t fee_proportional_millionths;
+	uint16_t cltv_expiry_delta;
+};
+
+/** One r field: a route of hops, the last one ending at the receiver. */
+struct route_hint {
+	const struct route_hop* hops;
+	size_t size;
+};
+
+/** One f field: an on-chain address to pay to instead. @version is a witness version, 0 to 16,
+ *  with its witness program; or 17 for P2PKH and 18 for P2SH, with the 20-byte hash. */
+struct fallback_address {
+	uint8_t version;
+	const unsigned char* program;
+	size_t size;
+};
 
+/** A tagged field as decode() found it. @values keeps the 5-bit values, one per byte, of a field
+ *  the bolt11 does not hold: an unknown one such as m, one that was skipped, or one a later field
+ *  of its type replaced. It is NULL for a field the bolt11 holds, which encode() writes from there. */
+struct tagged_field {
+	uint8_t type;
+	uint16_t size;                                  // data_length, in 5-bit values
+	const uint8_t* values;
+};
 
 struct bolt11 {
 	std::string prefix;
+	uint8_t network;                                // index of the prefix in NETWORK_PREFIXES, set by decode()
 	uint64_t timestamp;
-	uint64_t sat_amount;
+	uint64_t sat_amount;                            // in millisatoshi; 0 if the invoice has no amount
 
 	unsigned char payment_hash[32];
-	unsigned char receiver_id[33];
+	unsigned char receiver_id[33];                  // valid if and only if has_receiver_id; recovered from sig if there is no n field.
+	bool has_receiver_id;
 
-	/* description_hash valid if and only if description is NULL. */
+	/* description_hash valid if and only if has_description_hash. */
 	unsigned char description[639];                 // Note that the maximum length of a Tagged Field's data is constricted by the maximum value of data_length. This is 1023 x 5 bits, or 639 bytes.
+	uint16_t description_len;
 	unsigned char description_hash[32];
+	bool has_description_hash;
 
 	/* How many seconds to pay from @timestamp above. */
 	uint64_t expiry;
@@ -49,20 +90,31 @@ struct bolt11 {
 	/* How many blocks final hop requires. */
 	uint32_t min_final_cltv_expiry;
 
-	/* If non-NULL, indicates fallback addresses to pay to. */
-	//const u8 **fallbacks;
+	/* Fallback addresses and route hints, in the hint_arena given to decode(); none without one.
+	 * The hops of all the routes are in one array, in the order of the r fields. f fields of an
+	 * unknown version or with a program of the wrong size are skipped. */
+	const struct fallback_address* fallbacks;
+	size_t fallback_count;
+	const struct route_hint* routes;
+	size_t route_count;
 
-	/* If non-NULL: array of route arrays */
-	//struct route_info **routes;
+	/* Every tagged field in the order it came, in the hint_arena given to decode(); none without
+	 * one. encode() writes exactly these fields, so that a decoded invoice encodes back to the
+	 * string it was decoded from. */
+	const struct tagged_field* tagged_fields;
+	size_t tagged_field_count;
 
 	/* signature of sha256 of entire thing. */
 	unsigned char sig[64];
+	uint8_t sig_recovery_id;                        // 0 to 3, selects the public key recovered from sig
+	unsigned char signing_hash[32];                 // sha256 of the hrp and the data part before the signature
 
 	/* payment secret, if any. */
 	unsigned char payment_secret[32];
 
-	/* Features bitmap, if any. */
-	//u8 *features;
+	/* Features bitmap: bit n is feature bit n of the 9 field, 0 without one. Bits from 64 on are
+	 * not kept; they are all odd, as an unknown even bit fails the invoice. */
+	uint64_t features;
 
 	/* Optional metadata to send with payment. */
 	//u8 *metadata;
@@ -70,4 +122,104 @@ struct bolt11 {
 	//struct list_head extra_fields;
 };
 
-}
\ No newline at end of file
+/** The message an invoice's signature commits to: the hrp, followed by the data part up to the
+ *  signature regrouped into bytes, zero padded. */
+struct signing_data {
+	static constexpr size_t MAX_SIZE = bech32::DecodeBuffer::MAX_HRP_SIZE + (bech32::DecodeBuffer::MAX_DATA_SIZE * 5 + 7) / 8;
+
+	size_t size;
+	unsigned char preimage[MAX_SIZE];
+};
+
+/** Decode a Lightning Payment Request into a caller-owned bolt11 and check its signature, as
+ *  check_signatures() does. Does not touch any shared state, so it can be called from several
+ *  threads at once. 0 means success, -1 failure. */
+int decode(std::string_view invoice, struct bolt11& out);
+
+/** As above, looking the signature up in @cache first and adding it once checked. */
+int decode(std::string_view invoice, struct bolt11& out, recovery_cache& cache);
+
+/** As above, also storing the route hints, the fallback addresses and the tagged fields in @hints.
+ *  They stay valid until @hints is cleared or destroyed. */
+int decode(std::string_view invoice, struct bolt11& out, hint_arena& hints);
+
+/** As above, but leave the signed message in @signed_data instead of hashing it, so that many can
+ *  be hashed at once with sha256::hash_many. signing_hash is not set and the signature is not
+ *  checked. Route hints, fallback addresses and tagged fields are stored in @hints, if given. */
+int decode(std::string_view invoice, struct bolt11& out, struct signing_data& signed_data, hint_arena* hints = NULL);
+
+/** As above, for an invoice bech32::decode already decoded into @dec, so that the two can run apart.
+ *  Unlike the others this does not end the decode in decode_stats: the caller does, with
+ *  stats::finish, once the signature is checked. */
+int decode(const bech32::DecodeBuffer& dec, struct bolt11& out, struct signing_data& signed_data);
+
+/** Check the signatures of @count decoded invoices whose signing_hash is set. With an n field the
+ *  signature is verified against it, otherwise the key is recovered into receiver_id. The
+ *  elliptic curve work of the invoices is done together, which costs less per invoice than one at
+ *  a time. @status[i] is 0 if the i-th is valid, -1 if not. */
+void check_signatures(struct bolt11* invoices, size_t count, int* status, recovery_cache* cache = NULL);
+
+/** Encode @invoice into @out, which has room for @capacity characters, without allocating. The
+ *  signature is copied from sig and sig_recovery_id. With tagged_fields set, those are written in
+ *  their order: the ones the bolt11 holds from its members, x, c and 9 in at least as many values
+ *  as they had, and the others as they came. Otherwise fields are written in a fixed order, x and c
+ *  only if they differ from their defaults, 9 if any feature is set, then the f and the r fields.
+ *  Returns the length of the invoice, 0 if it does not fit, has a timestamp of 2^35 or more or a
+ *  route hint of more than 12 hops, which no invoice holds. */
+size_t encode(const struct bolt11& invoice, char* out, size_t capacity);
+
+/** Encode @count invoices back to back into @out. The end of the i-th invoice is written to
+ *  @ends[i]. Returns how many were encoded, stopping at the first one that does not fit. */
+size_t encode_batch(const struct bolt11* invoices, size_t count, char* out, size_t capacity, size_t* ends);
+
+/** An invoice whose tagged fields are only located when it is decoded, and converted when first
+ *  read. Each conversion is kept, so fields that are never read cost no more than their header. */
+class lazy_bolt11 {
+public:
+	/** Decode the hrp and the timestamp, index the tagged fields and check the signature; 0 means
+	 *  success, -1 failure. Unlike decode(), a field whose payload is malformed only shows once it
+	 *  is read. */
+	int decode(std::string_view invoice);
+
+	const std::string& prefix() const { return fields.prefix; }
+	uint64_t timestamp() const { return fields.timestamp; }
+	uint64_t sat_amount() const { return fields.sat_amount; }
+
+	/* NULL if the field is malformed. */
+	const unsigned char* payment_hash();
+	const unsigned char* payment_secret();
+	/* NULL if the field is absent or malformed. */
+	const unsigned char* description_hash();
+	/* The n field, or the key recovered from the signature. */
+	const unsigned char* receiver_id();
+	/* Empty if the field is absent or malformed. */
+	std::string_view description();
+	uint64_t features();
+	uint64_t expiry();
+	uint32_t min_final_cltv_expiry();
+	/* The route hints and the fallback addresses, with their number in @count. Both are stored in
+	 * @hints the first time either is read, and the same ones handed out after that; they stay
+	 * valid until that arena is cleared. None if an r field is malformed. */
+	const struct route_hint* route_hints(hint_arena& hints, size_t* count);
+	const struct fallback_address* fallbacks(hint_arena& hints, size_t* count);
+
+private:
+	bech32::DecodeBuffer dec;
+	struct bolt11 fields;                           // the fields converted so far
+	uint16_t field_begin[32];                       // payload of the last field of each type
+	uint16_t field_end[32];
+	uint32_t present;                               // one bit per field type
+	uint32_t converted;
+	uint32_t valid;
+
+	bool convert(uint8_t type);
+	void convert_hints(hint_arena& hints);
+};
+
+/** Decode a Lightning Payment Request -1 means failure. On success the decoded 5-bit data part is
+ *  returned; use the overload above to get the decoded fields. */
+std::pair<int, std::vector<uint8_t> > decode(const std::string& addr);
+
+}
+
+#endif  // PAYMENT_REQUEST_H_
@@ -0,0 +1,78 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "recovery_cache.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+namespace payment_request
+{
+
+recovery_cache::recovery_cache(size_t capacity) : slots(std::max<size_t>(1, (capacity + SHARDS - 1) / SHARDS)) {
+    for (auto& s : shards) s.entries.reset(new entry[slots]());
+}
+
+/* The signing hash is a sha256 output, so its first bytes spread entries evenly; the signature is
+ * mixed in for invoices that differ only there. */
+recovery_cache::entry& recovery_cache::slot(const unsigned char signing_hash[32], const unsigned char sig[64], shard** owner) {
+    uint64_t h, s;
+    memcpy(&h, signing_hash, 8);
+    memcpy(&s, sig + 32, 8);
+    h ^= s;
+    *owner = &shards[h % SHARDS];
+    return (*owner)->entries[(h / SHARDS) % slots];
+}
+
+bool recovery_cache::lookup(const unsigned char signing_hash[32], const unsigned char sig[64], uint8_t recovery_id, unsigned char node_id[33]) {
+    shard* owner;
+    entry& e = slot(signing_hash, sig, &owner);
+    std::lock_guard<std::mutex> guard(owner->lock);
+    if (!e.used || e.recovery_id != recovery_id || memcmp(e.signing_hash, signing_hash, 32) != 0 || memcmp(e.sig, sig, 64) != 0)
+        return false;
+    std::copy(e.node_id, e.node_id + 33, node_id);
+    owner->hits++;
+    return true;
+}
+
+void recovery_cache::insert(const unsigned char signing_hash[32], const unsigned char sig[64], uint8_t recovery_id, const unsigned char node_id[33]) {
+    shard* owner;
+    entry& e = slot(signing_hash, sig, &owner);
+    std::lock_guard<std::mutex> guard(owner->lock);
+    std::copy(signing_hash, signing_hash + 32, e.signing_hash);
+    std::copy(sig, sig + 64, e.sig);
+    e.recovery_id = recovery_id;
+    std::copy(node_id, node_id + 33, e.node_id);
+    e.used = true;
+}
+
+uint64_t recovery_cache::hits() const {
+    uint64_t total = 0;
+    for (const auto& s : shards) {
+        std::lock_guard<std::mutex> guard(s.lock);
+        total += s.hits;
+    }
+    return total;
+}
+
+}
@@ -0,0 +1,77 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef RECOVERY_CACHE_H_
+#define RECOVERY_CACHE_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+
+namespace payment_request
+{
+
+/** Payee node ids of invoices whose signature was already checked, keyed by (signing hash,
+ *  signature, recovery id). The signing hash commits to every field, so a hit stands for the same
+ *  invoice and its signature needs no elliptic curve work. Fixed size: a new entry replaces the one
+ *  in its slot. Safe to share between threads; each shard has its own lock. */
+class recovery_cache {
+public:
+	/** Room for @capacity entries, rounded up to a whole number per shard. */
+	explicit recovery_cache(size_t capacity = 1 << 16);
+
+	/** Copy the node id stored for the signature into @node_id. Returns false if there is none. */
+	bool lookup(const unsigned char signing_hash[32], const unsigned char sig[64], uint8_t recovery_id, unsigned char node_id[33]);
+
+	/** Remember that @node_id made the signature, which must have been checked. */
+	void insert(const unsigned char signing_hash[32], const unsigned char sig[64], uint8_t recovery_id, const unsigned char node_id[33]);
+
+	/** Number of lookups that found an entry. */
+	uint64_t hits() const;
+
+private:
+	static constexpr size_t SHARDS = 16;
+
+	struct entry {
+		unsigned char signing_hash[32];
+		unsigned char sig[64];
+		uint8_t recovery_id;
+		bool used;
+		unsigned char node_id[33];
+	};
+
+	struct alignas(64) shard {
+		mutable std::mutex lock;
+		std::unique_ptr<entry[]> entries;
+		uint64_t hits = 0;
+	};
+
+	shard shards[SHARDS];
+	size_t slots;                                   // entries per shard
+
+	entry& slot(const unsigned char signing_hash[32], const unsigned char sig[64], shard** owner);
+};
+
+}
+
+#endif  // RECOVERY_CACHE_H_
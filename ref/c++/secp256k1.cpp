@@ -0,0 +1,685 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "secp256k1.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+namespace secp256k1
+{
+
+namespace
+{
+
+typedef unsigned __int128 uint128_t;
+
+/** An element of the field modulo p = 2^256 - 2^32 - 977, as 4 little-endian 64-bit limbs.
+ *  Always fully reduced. */
+struct field {
+    uint64_t n[4];
+};
+
+const field FIELD_P = {{0xFFFFFFFEFFFFFC2FULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL}};
+const uint64_t FIELD_C = 0x1000003D1ULL;            // 2^256 - p
+
+/** An integer modulo the group order n, in the same layout. */
+struct scalar {
+    uint64_t n[4];
+};
+
+const scalar ORDER = {{0xBFD25E8CD0364141ULL, 0xBAAEDCE6AF48A03BULL, 0xFFFFFFFFFFFFFFFEULL, 0xFFFFFFFFFFFFFFFFULL}};
+const uint64_t ORDER_C[3] = {0x402DA1732FC9BEBFULL, 0x4551231950B75FC4ULL, 1};   // 2^256 - n
+
+void read_be256(const unsigned char* in, uint64_t* n) {
+    for (int i = 0; i < 4; ++i) {
+        uint64_t v = 0;
+        for (int j = 0; j < 8; ++j) v = (v << 8) | in[(3 - i) * 8 + j];
+        n[i] = v;
+    }
+}
+
+void write_be256(const uint64_t* n, unsigned char* out) {
+    for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 8; ++j) out[(3 - i) * 8 + j] = n[i] >> (56 - 8 * j);
+    }
+}
+
+/** Whether @a >= @b, as 256-bit integers. */
+bool geq256(const uint64_t* a, const uint64_t* b) {
+    for (int i = 3; i >= 0; --i) {
+        if (a[i] != b[i]) return a[i] > b[i];
+    }
+    return true;
+}
+
+bool is_zero256(const uint64_t* a) {
+    return (a[0] | a[1] | a[2] | a[3]) == 0;
+}
+
+/** @r = @a + @b mod 2^256; returns the carry. */
+uint64_t add256(uint64_t* r, const uint64_t* a, const uint64_t* b) {
+    uint128_t c = 0;
+    for (int i = 0; i < 4; ++i) {
+        c += uint128_t{a[i]} + b[i];
+        r[i] = c;
+        c >>= 64;
+    }
+    return c;
+}
+
+/** @r = @a - @b mod 2^256; returns the borrow. */
+uint64_t sub256(uint64_t* r, const uint64_t* a, const uint64_t* b) {
+    uint64_t borrow = 0;
+    for (int i = 0; i < 4; ++i) {
+        const uint128_t d = uint128_t{a[i]} - b[i] - borrow;
+        r[i] = d;
+        borrow = (d >> 64) & 1;
+    }
+    return borrow;
+}
+
+/* Field arithmetic. */
+
+bool field_set_bytes(field& r, const unsigned char* in) {
+    read_be256(in, r.n);
+    return !geq256(r.n, FIELD_P.n);
+}
+
+field field_from_int(uint64_t v) {
+    return field{{v, 0, 0, 0}};
+}
+
+bool field_equal(const field& a, const field& b) {
+    return memcmp(a.n, b.n, sizeof(a.n)) == 0;
+}
+
+bool field_is_odd(const field& a) {
+    return a.n[0] & 1;
+}
+
+/** @r = @a + @b - p if that does not go below zero, else @a + @b; for @a + @b < 2^256 + p.
+ *  Adding 2^256 - p carries out exactly when @a + @b >= p, so the choice is a mask. */
+field field_reduce_once(const uint64_t* a, uint64_t carry) {
+    field r, t;
+    uint128_t c = uint128_t{a[0]} + FIELD_C;
+    t.n[0] = c;
+    for (int i = 1; i < 4; ++i) {
+        c = (c >> 64) + a[i];
+        t.n[i] = c;
+    }
+    const bool reduce = (c >> 64) | carry;
+    for (int i = 0; i < 4; ++i) r.n[i] = reduce ? t.n[i] : a[i];
+    return r;
+}
+
+field field_add(const field& a, const field& b) {
+    uint64_t s[4];
+    const uint64_t carry = add256(s, a.n, b.n);
+    return field_reduce_once(s, carry);
+}
+
+field field_sub(const field& a, const field& b) {
+    field r;
+    // On a borrow, add p back: subtract 2^256 - p.
+    const uint64_t borrow = sub256(r.n, a.n, b.n);
+    uint128_t d = uint128_t{r.n[0]} - (FIELD_C & -borrow);
+    r.n[0] = d;
+    for (int i = 1; i < 4; ++i) {
+        d = uint128_t{r.n[i]} - ((d >> 64) & 1);
+        r.n[i] = d;
+    }
+    return r;
+}
+
+field field_negate(const field& a) {
+    return field_sub(field_from_int(0), a);
+}
+
+/** A 192-bit accumulator for the columns of a product. */
+struct column {
+    uint64_t c0, c1, c2;
+
+    void add(uint64_t a, uint64_t b) {
+        const uint128_t t = uint128_t{a} * b;
+        uint128_t sum = uint128_t{c0} + static_cast<uint64_t>(t);
+        c0 = sum;
+        sum = (sum >> 64) + c1 + static_cast<uint64_t>(t >> 64);
+        c1 = sum;
+        c2 += sum >> 64;
+    }
+
+    /** Add 2 * @a * @b. */
+    void add2(uint64_t a, uint64_t b) {
+        const uint128_t t = uint128_t{a} * b;
+        const uint64_t lo = t, hi = t >> 64;
+        c2 += hi >> 63;
+        uint128_t sum = uint128_t{c0} + (lo << 1);
+        c0 = sum;
+        sum = (sum >> 64) + c1 + ((hi << 1) | (lo >> 63));
+        c1 = sum;
+        c2 += sum >> 64;
+    }
+
+    /** Take the low 64 bits out and shift the rest down. */
+    uint64_t extract() {
+        const uint64_t low = c0;
+        c0 = c1;
+        c1 = c2;
+        c2 = 0;
+        return low;
+    }
+};
+
+/** Reduce the 512-bit @w modulo p: the high half is worth 2^256 - p as much in the low half. */
+field field_reduce(const uint64_t* w) {
+    uint64_t r[4];
+    uint128_t c = 0;
+    for (int i = 0; i < 4; ++i) {
+        c += uint128_t{w[i + 4]} * FIELD_C + w[i];
+        r[i] = c;
+        c >>= 64;
+    }
+    c = c * FIELD_C + r[0];
+    r[0] = c;
+    for (int i = 1; i < 4; ++i) {
+        c = (c >> 64) + r[i];
+        r[i] = c;
+    }
+    return field_reduce_once(r, c >> 64);
+}
+
+field field_mul(const field& a, const field& b) {
+    // Product scanning, one column of the 512-bit product at a time.
+    uint64_t w[8];
+    column acc = {0, 0, 0};
+    acc.add(a.n[0], b.n[0]);
+    w[0] = acc.extract();
+    acc.add(a.n[0], b.n[1]);
+    acc.add(a.n[1], b.n[0]);
+    w[1] = acc.extract();
+    acc.add(a.n[0], b.n[2]);
+    acc.add(a.n[1], b.n[1]);
+    acc.add(a.n[2], b.n[0]);
+    w[2] = acc.extract();
+    acc.add(a.n[0], b.n[3]);
+    acc.add(a.n[1], b.n[2]);
+    acc.add(a.n[2], b.n[1]);
+    acc.add(a.n[3], b.n[0]);
+    w[3] = acc.extract();
+    acc.add(a.n[1], b.n[3]);
+    acc.add(a.n[2], b.n[2]);
+    acc.add(a.n[3], b.n[1]);
+    w[4] = acc.extract();
+    acc.add(a.n[2], b.n[3]);
+    acc.add(a.n[3], b.n[2]);
+    w[5] = acc.extract();
+    acc.add(a.n[3], b.n[3]);
+    w[6] = acc.extract();
+    w[7] = acc.c0;
+    return field_reduce(w);
+}
+
+field field_sqr(const field& a) {
+    // As field_mul, with each cross product added once, doubled.
+    uint64_t w[8];
+    column acc = {0, 0, 0};
+    acc.add(a.n[0], a.n[0]);
+    w[0] = acc.extract();
+    acc.add2(a.n[0], a.n[1]);
+    w[1] = acc.extract();
+    acc.add2(a.n[0], a.n[2]);
+    acc.add(a.n[1], a.n[1]);
+    w[2] = acc.extract();
+    acc.add2(a.n[0], a.n[3]);
+    acc.add2(a.n[1], a.n[2]);
+    w[3] = acc.extract();
+    acc.add2(a.n[1], a.n[3]);
+    acc.add(a.n[2], a.n[2]);
+    w[4] = acc.extract();
+    acc.add2(a.n[2], a.n[3]);
+    w[5] = acc.extract();
+    acc.add(a.n[3], a.n[3]);
+    w[6] = acc.extract();
+    w[7] = acc.c0;
+    return field_reduce(w);
+}
+
+field field_sqr_n(field a, int n) {
+    while (n--) a = field_sqr(a);
+    return a;
+}
+
+/** a^(2^n - 1) for the blocks of ones of the exponents below, shared by field_inv and field_sqrt. */
+field field_pow_x223(const field& a, field& x2, field& x22) {
+    x2 = field_mul(field_sqr(a), a);
+    const field x3 = field_mul(field_sqr(x2), a);
+    const field x6 = field_mul(field_sqr_n(x3, 3), x3);
+    const field x9 = field_mul(field_sqr_n(x6, 3), x3);
+    const field x11 = field_mul(field_sqr_n(x9, 2), x2);
+    x22 = field_mul(field_sqr_n(x11, 11), x11);
+    const field x44 = field_mul(field_sqr_n(x22, 22), x22);
+    const field x88 = field_mul(field_sqr_n(x44, 44), x44);
+    const field x176 = field_mul(field_sqr_n(x88, 88), x88);
+    const field x220 = field_mul(field_sqr_n(x176, 44), x44);
+    return field_mul(field_sqr_n(x220, 3), x3);
+}
+
+/** a^(p - 2), the inverse of a nonzero @a. */
+field field_inv(const field& a) {
+    field x2, x22;
+    field t = field_mul(field_sqr_n(field_pow_x223(a, x2, x22), 23), x22);
+    t = field_mul(field_sqr_n(t, 5), a);
+    t = field_mul(field_sqr_n(t, 3), x2);
+    return field_mul(field_sqr_n(t, 2), a);
+}
+
+/** a^((p + 1) / 4), a square root of @a if it has one. Returns whether it does. */
+bool field_sqrt(field& r, const field& a) {
+    field x2, x22;
+    field t = field_mul(field_sqr_n(field_pow_x223(a, x2, x22), 23), x22);
+    t = field_mul(field_sqr_n(t, 6), x2);
+    r = field_sqr_n(t, 2);
+    return field_equal(field_sqr(r), a);
+}
+
+/** Invert the nonzero elements @a[0..count) in place with a single inversion. */
+void field_inv_all(field* a, size_t count, field* scratch) {
+    if (count == 0) return;
+    scratch[0] = a[0];
+    for (size_t i = 1; i < count; ++i) scratch[i] = field_mul(scratch[i - 1], a[i]);
+    field inv = field_inv(scratch[count - 1]);
+    for (size_t i = count - 1; i > 0; --i) {
+        const field next = field_mul(inv, a[i]);
+        a[i] = field_mul(inv, scratch[i - 1]);
+        inv = next;
+    }
+    a[0] = inv;
+}
+
+/* Scalar arithmetic. */
+
+/** Set @r to @in modulo n. Returns whether it was already below n. */
+bool scalar_set_bytes(scalar& r, const unsigned char* in) {
+    read_be256(in, r.n);
+    if (!geq256(r.n, ORDER.n)) return true;
+    sub256(r.n, r.n, ORDER.n);
+    return false;
+}
+
+scalar scalar_negate(const scalar& a) {
+    scalar r;
+    if (is_zero256(a.n)) return a;
+    sub256(r.n, ORDER.n, a.n);
+    return r;
+}
+
+scalar scalar_mul(const scalar& a, const scalar& b) {
+    uint64_t w[8] = {0};
+    for (int i = 0; i < 4; ++i) {
+        uint128_t c = 0;
+        for (int j = 0; j < 4; ++j) {
+            c += uint128_t{a.n[i]} * b.n[j] + w[i + j];
+            w[i + j] = c;
+            c >>= 64;
+        }
+        w[i + 4] = c;
+    }
+    // Fold the part above 2^256 back in as multiples of 2^256 - n until nothing is left there.
+    while (w[4] | w[5] | w[6] | w[7]) {
+        uint64_t t[8] = {w[0], w[1], w[2], w[3], 0, 0, 0, 0};
+        for (int i = 0; i < 4; ++i) {
+            uint128_t c = 0;
+            for (int j = 0; j < 3; ++j) {
+                c += uint128_t{w[i + 4]} * ORDER_C[j] + t[i + j];
+                t[i + j] = c;
+                c >>= 64;
+            }
+            for (int k = i + 3; c && k < 8; ++k) {
+                c += t[k];
+                t[k] = c;
+                c >>= 64;
+            }
+        }
+        std::copy(t, t + 8, w);
+    }
+    scalar r;
+    std::copy(w, w + 4, r.n);
+    if (geq256(r.n, ORDER.n)) sub256(r.n, r.n, ORDER.n);
+    return r;
+}
+
+/** a^(n - 2), the inverse of a nonzero @a, with a 4-bit window. */
+scalar scalar_inv(const scalar& a) {
+    scalar table[16];
+    table[1] = a;
+    for (int i = 2; i < 16; ++i) table[i] = scalar_mul(table[i - 1], a);
+    scalar exponent;
+    sub256(exponent.n, ORDER.n, scalar{{2, 0, 0, 0}}.n);
+    scalar r = table[1];
+    bool started = false;
+    for (int i = 63; i >= 0; --i) {
+        const int nibble = (exponent.n[i / 16] >> (4 * (i % 16))) & 15;
+        if (started) {
+            for (int k = 0; k < 4; ++k) r = scalar_mul(r, r);
+            if (nibble) r = scalar_mul(r, table[nibble]);
+        } else if (nibble) {
+            r = table[nibble];
+            started = true;
+        }
+    }
+    return r;
+}
+
+void scalar_inv_all(scalar* a, size_t count, scalar* scratch) {
+    if (count == 0) return;
+    scratch[0] = a[0];
+    for (size_t i = 1; i < count; ++i) scratch[i] = scalar_mul(scratch[i - 1], a[i]);
+    scalar inv = scalar_inv(scratch[count - 1]);
+    for (size_t i = count - 1; i > 0; --i) {
+        const scalar next = scalar_mul(inv, a[i]);
+        a[i] = scalar_mul(inv, scratch[i - 1]);
+        inv = next;
+    }
+    a[0] = inv;
+}
+
+int scalar_nibble(const scalar& a, int i) {
+    return (a.n[i / 16] >> (4 * (i % 16))) & 15;
+}
+
+/* Points on y^2 = x^3 + 7. */
+
+struct affine {
+    field x, y;
+};
+
+/** Jacobian coordinates: x = X / Z^2, y = Y / Z^3. */
+struct jacobian {
+    field x, y, z;
+    bool infinity;
+};
+
+const jacobian INFINITY_POINT = {field_from_int(0), field_from_int(0), field_from_int(0), true};
+
+/** Find the point with x coordinate @x whose y is odd if @odd. */
+bool affine_from_x(affine& r, const field& x, bool odd) {
+    const field rhs = field_add(field_mul(field_sqr(x), x), field_from_int(7));
+    if (!field_sqrt(r.y, rhs)) return false;
+    if (field_is_odd(r.y) != odd) r.y = field_negate(r.y);
+    r.x = x;
+    return true;
+}
+
+jacobian jacobian_double(const jacobian& p) {
+    if (p.infinity || is_zero256(p.y.n)) return INFINITY_POINT;
+    // dbl-2009-l
+    const field a = field_sqr(p.x);
+    const field b = field_sqr(p.y);
+    const field c = field_sqr(b);
+    field d = field_sub(field_sub(field_sqr(field_add(p.x, b)), a), c);
+    d = field_add(d, d);
+    const field e = field_add(field_add(a, a), a);
+    const field f = field_sqr(e);
+    jacobian r;
+    r.infinity = false;
+    r.x = field_sub(f, field_add(d, d));
+    field c8 = field_add(c, c);
+    c8 = field_add(c8, c8);
+    c8 = field_add(c8, c8);
+    r.y = field_sub(field_mul(e, field_sub(d, r.x)), c8);
+    const field yz = field_mul(p.y, p.z);
+    r.z = field_add(yz, yz);
+    return r;
+}
+
+/** @p + @q, where @q has Z = 1. */
+jacobian jacobian_add_affine(const jacobian& p, const affine& q) {
+    if (p.infinity) return jacobian{q.x, q.y, field_from_int(1), false};
+    // madd-2007-bl
+    const field z1z1 = field_sqr(p.z);
+    const field u2 = field_mul(q.x, z1z1);
+    const field s2 = field_mul(field_mul(q.y, p.z), z1z1);
+    const field h = field_sub(u2, p.x);
+    field rr = field_sub(s2, p.y);
+    if (is_zero256(h.n)) {
+        if (is_zero256(rr.n)) return jacobian_double(p);
+        return INFINITY_POINT;
+    }
+    rr = field_add(rr, rr);
+    const field hh = field_sqr(h);
+    field i = field_add(hh, hh);
+    i = field_add(i, i);
+    const field j = field_mul(h, i);
+    const field v = field_mul(p.x, i);
+    jacobian r;
+    r.infinity = false;
+    r.x = field_sub(field_sub(field_sqr(rr), j), field_add(v, v));
+    const field y1j = field_mul(p.y, j);
+    r.y = field_sub(field_mul(rr, field_sub(v, r.x)), field_add(y1j, y1j));
+    r.z = field_sub(field_sub(field_sqr(field_add(p.z, h)), z1z1), hh);
+    return r;
+}
+
+jacobian jacobian_add(const jacobian& p, const jacobian& q) {
+    if (p.infinity) return q;
+    if (q.infinity) return p;
+    // add-2007-bl
+    const field z1z1 = field_sqr(p.z);
+    const field z2z2 = field_sqr(q.z);
+    const field u1 = field_mul(p.x, z2z2);
+    const field u2 = field_mul(q.x, z1z1);
+    const field s1 = field_mul(field_mul(p.y, q.z), z2z2);
+    const field s2 = field_mul(field_mul(q.y, p.z), z1z1);
+    const field h = field_sub(u2, u1);
+    field rr = field_sub(s2, s1);
+    if (is_zero256(h.n)) {
+        if (is_zero256(rr.n)) return jacobian_double(p);
+        return INFINITY_POINT;
+    }
+    rr = field_add(rr, rr);
+    const field h2 = field_add(h, h);
+    const field i = field_sqr(h2);
+    const field j = field_mul(h, i);
+    const field v = field_mul(u1, i);
+    jacobian r;
+    r.infinity = false;
+    r.x = field_sub(field_sub(field_sqr(rr), j), field_add(v, v));
+    const field s1j = field_mul(s1, j);
+    r.y = field_sub(field_mul(rr, field_sub(v, r.x)), field_add(s1j, s1j));
+    r.z = field_mul(field_sub(field_sub(field_sqr(field_add(p.z, q.z)), z1z1), z2z2), h);
+    return r;
+}
+
+/** j * 16^i * G for i < 64 and 0 < j < 16, so that a multiple of G takes one addition per
+ *  nibble of the scalar and no doublings. Built on first use. */
+struct generator_table {
+    affine points[64][16];
+
+    generator_table() {
+        static const unsigned char gx[32] = {
+            0x79, 0xBE, 0x66, 0x7E, 0xF9, 0xDC, 0xBB, 0xAC, 0x55, 0xA0, 0x62, 0x95, 0xCE, 0x87, 0x0B, 0x07,
+            0x02, 0x9B, 0xFC, 0xDB, 0x2D, 0xCE, 0x28, 0xD9, 0x59, 0xF2, 0x81, 0x5B, 0x16, 0xF8, 0x17, 0x98,
+        };
+        static const unsigned char gy[32] = {
+            0x48, 0x3A, 0xDA, 0x77, 0x26, 0xA3, 0xC4, 0x65, 0x5D, 0xA4, 0xFB, 0xFC, 0x0E, 0x11, 0x08, 0xA8,
+            0xFD, 0x17, 0xB4, 0x48, 0xA6, 0x85, 0x54, 0x19, 0x9C, 0x47, 0xD0, 0x8F, 0xFB, 0x10, 0xD4, 0xB8,
+        };
+        affine g;
+        field_set_bytes(g.x, gx);
+        field_set_bytes(g.y, gy);
+        jacobian* multiples = new jacobian[64 * 16];
+        field* zs = new field[64 * 16];
+        field* scratch = new field[64 * 16];
+        jacobian base = {g.x, g.y, field_from_int(1), false};
+        for (int i = 0; i < 64; ++i) {
+            multiples[i * 16 + 1] = base;
+            for (int j = 2; j < 16; ++j) multiples[i * 16 + j] = jacobian_add(multiples[i * 16 + j - 1], base);
+            base = jacobian_double(multiples[i * 16 + 8]);
+        }
+        size_t count = 0;
+        for (int i = 0; i < 64; ++i) {
+            for (int j = 1; j < 16; ++j) zs[count++] = multiples[i * 16 + j].z;
+        }
+        field_inv_all(zs, count, scratch);
+        count = 0;
+        for (int i = 0; i < 64; ++i) {
+            for (int j = 1; j < 16; ++j) {
+                const field zinv = zs[count++];
+                const field zinv2 = field_sqr(zinv);
+                points[i][j].x = field_mul(multiples[i * 16 + j].x, zinv2);
+                points[i][j].y = field_mul(multiples[i * 16 + j].y, field_mul(zinv2, zinv));
+            }
+        }
+        delete[] multiples;
+        delete[] zs;
+        delete[] scratch;
+    }
+};
+
+const generator_table& generator() {
+    static const generator_table* table = new generator_table();
+    return *table;
+}
+
+/** @u1 * G + @u2 * @q. */
+jacobian multiply_add(const scalar& u1, const scalar& u2, const affine& q) {
+    jacobian multiples[16];
+    multiples[1] = jacobian{q.x, q.y, field_from_int(1), false};
+    for (int j = 2; j < 16; ++j) multiples[j] = jacobian_add_affine(multiples[j - 1], q);
+    jacobian r = INFINITY_POINT;
+    for (int i = 63; i >= 0; --i) {
+        for (int k = 0; k < 4; ++k) r = jacobian_double(r);
+        const int nibble = scalar_nibble(u2, i);
+        if (nibble) r = jacobian_add(r, multiples[nibble]);
+    }
+    const generator_table& table = generator();
+    for (int i = 0; i < 64; ++i) {
+        const int nibble = scalar_nibble(u1, i);
+        if (nibble) r = jacobian_add_affine(r, table.points[i][nibble]);
+    }
+    return r;
+}
+
+/* Signatures checked together; bounds the stack used by check_batch(). */
+const size_t BATCH_SIZE = 64;
+
+/** check_batch() on at most BATCH_SIZE signatures. */
+void check_group(struct signature_check* checks, size_t count) {
+    affine points[BATCH_SIZE];          // R when recovering, the public key when verifying
+    scalar r[BATCH_SIZE], s[BATCH_SIZE], z[BATCH_SIZE];
+    scalar inverses[BATCH_SIZE], scalar_scratch[BATCH_SIZE];
+    size_t pending[BATCH_SIZE];
+    size_t n = 0;
+    for (size_t i = 0; i < count; ++i) {
+        struct signature_check& check = checks[i];
+        check.valid = false;
+        if (!scalar_set_bytes(r[n], check.sig) || !scalar_set_bytes(s[n], check.sig + 32)) continue;
+        if (is_zero256(r[n].n) || is_zero256(s[n].n)) continue;
+        scalar_set_bytes(z[n], check.hash);
+        if (check.recover) {
+            // R has x = r, or r + n if that is still a field element, and the parity of the id.
+            if (check.recovery_id < 0 || check.recovery_id > 3) continue;
+            field x;
+            std::copy(r[n].n, r[n].n + 4, x.n);
+            if (check.recovery_id & 2) {
+                if (add256(x.n, r[n].n, ORDER.n) || geq256(x.n, FIELD_P.n)) continue;
+            }
+            if (!affine_from_x(points[n], x, check.recovery_id & 1)) continue;
+            inverses[n] = r[n];
+        } else {
+            field x;
+            if ((check.pubkey[0] != 2 && check.pubkey[0] != 3) || !field_set_bytes(x, check.pubkey + 1)) continue;
+            if (!affine_from_x(points[n], x, check.pubkey[0] == 3)) continue;
+            inverses[n] = s[n];
+        }
+        pending[n++] = i;
+    }
+    scalar_inv_all(inverses, n, scalar_scratch);
+
+    jacobian results[BATCH_SIZE];
+    field zs[BATCH_SIZE], field_scratch[BATCH_SIZE];
+    size_t recovered[BATCH_SIZE];
+    size_t m = 0;
+    for (size_t k = 0; k < n; ++k) {
+        struct signature_check& check = checks[pending[k]];
+        if (check.recover) {
+            // Q = r^-1 (s R - z G)
+            results[k] = multiply_add(scalar_negate(scalar_mul(z[k], inverses[k])), scalar_mul(s[k], inverses[k]), points[k]);
+            if (results[k].infinity) continue;
+            zs[m] = results[k].z;
+            recovered[m++] = k;
+        } else {
+            // The x coordinate of s^-1 (z G + r Q), reduced modulo n, is r. Compared as X = x Z^2.
+            const jacobian p = multiply_add(scalar_mul(z[k], inverses[k]), scalar_mul(r[k], inverses[k]), points[k]);
+            if (p.infinity) continue;
+            const field zz = field_sqr(p.z);
+            field x;
+            std::copy(r[k].n, r[k].n + 4, x.n);
+            check.valid = field_equal(field_mul(x, zz), p.x);
+            if (!check.valid && !add256(x.n, r[k].n, ORDER.n) && !geq256(x.n, FIELD_P.n))
+                check.valid = field_equal(field_mul(x, zz), p.x);
+        }
+    }
+    field_inv_all(zs, m, field_scratch);
+    for (size_t l = 0; l < m; ++l) {
+        const jacobian& p = results[recovered[l]];
+        struct signature_check& check = checks[pending[recovered[l]]];
+        const field zinv2 = field_sqr(zs[l]);
+        const field x = field_mul(p.x, zinv2);
+        const field y = field_mul(p.y, field_mul(zinv2, zs[l]));
+        check.pubkey[0] = field_is_odd(y) ? 3 : 2;
+        write_be256(x.n, check.pubkey + 1);
+        check.valid = true;
+    }
+}
+
+} // namespace
+
+void check_batch(struct signature_check* checks, size_t count) {
+    for (size_t i = 0; i < count; i += BATCH_SIZE) check_group(checks + i, std::min(BATCH_SIZE, count - i));
+}
+
+bool recover(const unsigned char hash[32], const unsigned char sig[64], int recovery_id, unsigned char pubkey[33]) {
+    struct signature_check check;
+    check.hash = hash;
+    check.sig = sig;
+    check.recovery_id = recovery_id;
+    check.recover = true;
+    check_batch(&check, 1);
+    if (check.valid) std::copy(check.pubkey, check.pubkey + 33, pubkey);
+    return check.valid;
+}
+
+bool verify(const unsigned char hash[32], const unsigned char sig[64], const unsigned char pubkey[33]) {
+    struct signature_check check;
+    check.hash = hash;
+    check.sig = sig;
+    check.recovery_id = 0;
+    check.recover = false;
+    std::copy(pubkey, pubkey + 33, check.pubkey);
+    check_batch(&check, 1);
+    return check.valid;
+}
+
+}  // namespace secp256k1
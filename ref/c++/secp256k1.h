@@ -0,0 +1,56 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef SECP256K1_H_
+#define SECP256K1_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace secp256k1
+{
+
+/** A signature to check with check_batch(). */
+struct signature_check {
+    const unsigned char* hash;          //!< 32 bytes that were signed
+    const unsigned char* sig;           //!< 64 bytes: r and s, big endian
+    int recovery_id;                    //!< 0 to 3; only used to recover
+    bool recover;                       //!< recover the key into pubkey, rather than verify against it
+    unsigned char pubkey[33];           //!< compressed public key
+    bool valid;                         //!< set by check_batch()
+};
+
+/** Check @count signatures. Those with recover set get the public key that signed them, if any;
+ *  the others are verified against pubkey. The inversions of all of them are shared, so checking
+ *  many at once costs less per signature than one at a time. Public data only: not constant time. */
+void check_batch(struct signature_check* checks, size_t count);
+
+/** Recover the compressed public key that made the compact signature @sig over @hash. Returns
+ *  false if there is none. */
+bool recover(const unsigned char hash[32], const unsigned char sig[64], int recovery_id, unsigned char pubkey[33]);
+
+/** Verify the compact signature @sig over @hash against the compressed @pubkey. */
+bool verify(const unsigned char hash[32], const unsigned char sig[64], const unsigned char pubkey[33]);
+
+}  // namespace secp256k1
+
+#endif  // SECP256K1_H_
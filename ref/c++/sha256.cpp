@@ -0,0 +1,399 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "sha256.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SHA256_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+namespace sha256
+{
+
+namespace
+{
+
+const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+const uint32_t INITIAL_STATE[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+uint32_t read_be32(const unsigned char* p) {
+    return (uint32_t{p[0]} << 24) | (uint32_t{p[1]} << 16) | (uint32_t{p[2]} << 8) | p[3];
+}
+
+void write_be32(unsigned char* p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+void write_state(const uint32_t* state, unsigned char* hash) {
+    for (int i = 0; i < 8; ++i) write_be32(hash + 4 * i, state[i]);
+}
+
+/** A message cut into blocks. The whole blocks are read where the message is; the rest and the
+ *  padding make up the one or two blocks of tail. */
+struct message {
+    const unsigned char* data;
+    size_t full;                        // whole blocks at data
+    size_t blocks;                      // full, plus the blocks in tail
+    unsigned char tail[128];
+
+    void init(const unsigned char* in, size_t size) {
+        data = in;
+        full = size / 64;
+        const size_t rest = size % 64;
+        blocks = full + (rest + 9 > 64 ? 2 : 1);
+        const size_t tail_size = (blocks - full) * 64;
+        if (rest) memcpy(tail, in + full * 64, rest);
+        tail[rest] = 0x80;
+        memset(tail + rest + 1, 0, tail_size - rest - 1 - 8);
+        const uint64_t bits = uint64_t{size} * 8;
+        write_be32(tail + tail_size - 8, bits >> 32);
+        write_be32(tail + tail_size - 4, bits);
+    }
+
+    const unsigned char* block(size_t i) const { return i < full ? data + 64 * i : tail + 64 * (i - full); }
+};
+
+uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+void transform_scalar(uint32_t* s, const unsigned char* chunk, size_t blocks) {
+    for (; blocks; --blocks, chunk += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) w[i] = read_be32(chunk + 4 * i);
+        for (int i = 16; i < 64; ++i) {
+            const uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            const uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+        for (int i = 0; i < 64; ++i) {
+            const uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            const uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        s[0] += a; s[1] += b; s[2] += c; s[3] += d;
+        s[4] += e; s[5] += f; s[6] += g; s[7] += h;
+    }
+}
+
+#ifdef SHA256_X86
+
+/** Compress one block into each of @N states, round by round, so the latency of one chain of
+ *  sha256rnds2 is filled with the others. The states are in the ABEF/CDGH order of the extension. */
+template <int N>
+__attribute__((target("sha,sse4.1"), always_inline)) inline
+void rounds_shani(__m128i (&abef)[N], __m128i (&cdgh)[N], const unsigned char* const (&chunk)[N]) {
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i w[N][4], saved_abef[N], saved_cdgh[N];
+    for (int n = 0; n < N; ++n) {
+        saved_abef[n] = abef[n];
+        saved_cdgh[n] = cdgh[n];
+    }
+    // Unrolled, so the ring of message words stays in registers.
+#pragma GCC unroll 16
+    for (int q = 0; q < 16; ++q) {
+        const __m128i k = _mm_loadu_si128(reinterpret_cast<const __m128i*>(K + 4 * q));
+#pragma GCC unroll 2
+        for (int n = 0; n < N; ++n) {
+            __m128i& m = w[n][q % 4];
+            if (q < 4) {
+                m = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(chunk[n] + 16 * q)), bswap);
+            } else {
+                // w[q-4] + s0(w[q-3]) + w[q-7] + s1(w[q-2]), four words at a time.
+                const __m128i prev = w[n][(q + 3) % 4];
+                m = _mm_sha256msg1_epu32(m, w[n][(q + 1) % 4]);
+                m = _mm_add_epi32(m, _mm_alignr_epi8(prev, w[n][(q + 2) % 4], 4));
+                m = _mm_sha256msg2_epu32(m, prev);
+            }
+            const __m128i wk = _mm_add_epi32(m, k);
+            cdgh[n] = _mm_sha256rnds2_epu32(cdgh[n], abef[n], wk);
+            abef[n] = _mm_sha256rnds2_epu32(abef[n], cdgh[n], _mm_shuffle_epi32(wk, 0x0e));
+        }
+    }
+    for (int n = 0; n < N; ++n) {
+        abef[n] = _mm_add_epi32(abef[n], saved_abef[n]);
+        cdgh[n] = _mm_add_epi32(cdgh[n], saved_cdgh[n]);
+    }
+}
+
+__attribute__((target("sha,sse4.1")))
+void load_shani(const uint32_t* s, __m128i& abef, __m128i& cdgh) {
+    const __m128i dcba = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s)), 0xb1);
+    const __m128i efgh = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 4)), 0x1b);
+    abef = _mm_alignr_epi8(dcba, efgh, 8);
+    cdgh = _mm_blend_epi16(efgh, dcba, 0xf0);
+}
+
+__attribute__((target("sha,sse4.1")))
+void store_shani(uint32_t* s, __m128i abef, __m128i cdgh) {
+    const __m128i feba = _mm_shuffle_epi32(abef, 0x1b);
+    const __m128i dchg = _mm_shuffle_epi32(cdgh, 0xb1);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(s), _mm_blend_epi16(feba, dchg, 0xf0));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(s + 4), _mm_alignr_epi8(dchg, feba, 8));
+}
+
+__attribute__((target("sha,sse4.1")))
+void transform_shani(uint32_t* s, const unsigned char* chunk, size_t blocks) {
+    __m128i abef[1], cdgh[1];
+    load_shani(s, abef[0], cdgh[0]);
+    for (; blocks; --blocks, chunk += 64) {
+        const unsigned char* const chunks[1] = {chunk};
+        rounds_shani<1>(abef, cdgh, chunks);
+    }
+    store_shani(s, abef[0], cdgh[0]);
+}
+
+/** Hash two messages, interleaved for as many blocks as both have. */
+__attribute__((target("sha,sse4.1")))
+void hash_2_shani(const message* msgs, unsigned char (*hashes)[32]) {
+    uint32_t s[2][8];
+    __m128i abef[2], cdgh[2];
+    for (int n = 0; n < 2; ++n) load_shani(INITIAL_STATE, abef[n], cdgh[n]);
+    const size_t common = std::min(msgs[0].blocks, msgs[1].blocks);
+    for (size_t b = 0; b < common; ++b) {
+        const unsigned char* const chunks[2] = {msgs[0].block(b), msgs[1].block(b)};
+        rounds_shani<2>(abef, cdgh, chunks);
+    }
+    for (int n = 0; n < 2; ++n) {
+        __m128i one_abef[1] = {abef[n]}, one_cdgh[1] = {cdgh[n]};
+        for (size_t b = common; b < msgs[n].blocks; ++b) {
+            const unsigned char* const chunks[1] = {msgs[n].block(b)};
+            rounds_shani<1>(one_abef, one_cdgh, chunks);
+        }
+        store_shani(s[n], one_abef[0], one_cdgh[0]);
+        write_state(s[n], hashes[n]);
+    }
+}
+
+/** Transpose 8 rows of 8 words, so word i of every row ends up in out[i]. */
+__attribute__((target("avx2")))
+void transpose_avx2(const __m256i* row, __m256i* out) {
+    __m256i t[8], u[8];
+    for (int i = 0; i < 8; i += 2) {
+        t[i] = _mm256_unpacklo_epi32(row[i], row[i + 1]);
+        t[i + 1] = _mm256_unpackhi_epi32(row[i], row[i + 1]);
+    }
+    for (int i = 0; i < 8; i += 4) {
+        u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+        u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+        u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+        u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+    }
+    for (int i = 0; i < 4; ++i) {
+        out[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+        out[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+    }
+}
+
+__attribute__((target("avx2"), always_inline)) inline
+__m256i rotr_avx2(__m256i x, int n) {
+    return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+/** Hash up to 8 messages, one per lane. A lane whose message has no block left reads zeros, and
+ *  its state is kept as it was. */
+__attribute__((target("avx2")))
+void hash_8_avx2(const message* msgs, size_t lanes, unsigned char (*hashes)[32]) {
+    static const unsigned char zero_block[64] = {0};
+    const __m256i bswap = _mm256_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL,
+                                            0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    int32_t lane_blocks[8] = {0};
+    size_t most = 0;
+    for (size_t l = 0; l < lanes; ++l) {
+        lane_blocks[l] = msgs[l].blocks;
+        most = std::max(most, msgs[l].blocks);
+    }
+    const __m256i blocks = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lane_blocks));
+    __m256i s[8];
+    for (int i = 0; i < 8; ++i) s[i] = _mm256_set1_epi32(INITIAL_STATE[i]);
+
+    for (size_t b = 0; b < most; ++b) {
+        __m256i lo[8], hi[8], w[16];
+        for (size_t l = 0; l < 8; ++l) {
+            const unsigned char* chunk = l < lanes && b < msgs[l].blocks ? msgs[l].block(b) : zero_block;
+            lo[l] = _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(chunk)), bswap);
+            hi[l] = _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(chunk + 32)), bswap);
+        }
+        transpose_avx2(lo, w);
+        transpose_avx2(hi, w + 8);
+
+        __m256i a = s[0], bb = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+        for (int i = 0; i < 64; ++i) {
+            __m256i& wi = w[i % 16];
+            if (i >= 16) {
+                const __m256i w15 = w[(i + 1) % 16], w2 = w[(i + 14) % 16];
+                const __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(rotr_avx2(w15, 7), rotr_avx2(w15, 18)), _mm256_srli_epi32(w15, 3));
+                const __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(rotr_avx2(w2, 17), rotr_avx2(w2, 19)), _mm256_srli_epi32(w2, 10));
+                wi = _mm256_add_epi32(_mm256_add_epi32(wi, s0), _mm256_add_epi32(w[(i + 9) % 16], s1));
+            }
+            const __m256i sum1 = _mm256_xor_si256(_mm256_xor_si256(rotr_avx2(e, 6), rotr_avx2(e, 11)), rotr_avx2(e, 25));
+            const __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+            const __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(_mm256_add_epi32(h, sum1), _mm256_add_epi32(ch, wi)),
+                                                _mm256_set1_epi32(K[i]));
+            const __m256i sum0 = _mm256_xor_si256(_mm256_xor_si256(rotr_avx2(a, 2), rotr_avx2(a, 13)), rotr_avx2(a, 22));
+            const __m256i maj = _mm256_or_si256(_mm256_and_si256(a, bb), _mm256_and_si256(c, _mm256_or_si256(a, bb)));
+            h = g; g = f; f = e; e = _mm256_add_epi32(d, t1);
+            d = c; c = bb; bb = a; a = _mm256_add_epi32(t1, _mm256_add_epi32(sum0, maj));
+        }
+        const __m256i active = _mm256_cmpgt_epi32(blocks, _mm256_set1_epi32(b));
+        const __m256i next[8] = {a, bb, c, d, e, f, g, h};
+        for (int i = 0; i < 8; ++i) s[i] = _mm256_blendv_epi8(s[i], _mm256_add_epi32(s[i], next[i]), active);
+    }
+
+    uint32_t words[8][8];
+    for (int i = 0; i < 8; ++i) _mm256_storeu_si256(reinterpret_cast<__m256i*>(words[i]), s[i]);
+    for (size_t l = 0; l < lanes; ++l) {
+        uint32_t state[8];
+        for (int i = 0; i < 8; ++i) state[i] = words[i][l];
+        write_state(state, hashes[l]);
+    }
+}
+
+#endif  // SHA256_X86
+
+typedef void (*transform_fn)(uint32_t* s, const unsigned char* chunk, size_t blocks);
+
+transform_fn transform_for(Impl impl) {
+#ifdef SHA256_X86
+    if (impl == Impl::SHANI) return &transform_shani;
+#else
+    (void)impl;
+#endif
+    return &transform_scalar;
+}
+
+} // namespace
+
+bool supported(Impl impl) {
+#ifdef SHA256_X86
+    static const bool shani = []() {
+        __builtin_cpu_init();
+        unsigned int eax, ebx, ecx, edx;
+        // SHA extensions: CPUID leaf 7, EBX bit 29.
+        if (!__builtin_cpu_supports("sse4.1") || __get_cpuid_max(0, nullptr) < 7) return false;
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        return (ebx & (1u << 29)) != 0;
+    }();
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    switch (impl) {
+        case Impl::SCALAR: return true;
+        case Impl::AVX2: return avx2;
+        case Impl::SHANI: return shani;
+    }
+    return false;
+#else
+    return impl == Impl::SCALAR;
+#endif
+}
+
+Impl best() {
+    static const Impl best = supported(Impl::SHANI) ? Impl::SHANI : supported(Impl::AVX2) ? Impl::AVX2 : Impl::SCALAR;
+    return best;
+}
+
+void hasher::reset() {
+    std::copy(INITIAL_STATE, INITIAL_STATE + 8, state);
+    bytes = 0;
+}
+
+hasher& hasher::write(const unsigned char* data, size_t size) {
+    const transform_fn transform = transform_for(best());
+    size_t used = bytes % 64;
+    bytes += size;
+    if (used && used + size >= 64) {
+        memcpy(buf + used, data, 64 - used);
+        data += 64 - used;
+        size -= 64 - used;
+        transform(state, buf, 1);
+        used = 0;
+    }
+    if (size >= 64) {
+        transform(state, data, size / 64);
+        data += size / 64 * 64;
+        size %= 64;
+    }
+    if (size) memcpy(buf + used, data, size);
+    return *this;
+}
+
+void hasher::finalize(unsigned char hash[32]) {
+    static const unsigned char padding[64] = {0x80};
+    unsigned char length[8];
+    write_be32(length, bytes >> 29);
+    write_be32(length + 4, bytes << 3);
+    write(padding, 1 + ((119 - (bytes % 64)) % 64));
+    write(length, 8);
+    write_state(state, hash);
+}
+
+void hash(const unsigned char* data, size_t size, unsigned char hash[32], Impl impl) {
+    const transform_fn transform = transform_for(impl);
+    message msg;
+    msg.init(data, size);
+    uint32_t state[8];
+    std::copy(INITIAL_STATE, INITIAL_STATE + 8, state);
+    transform(state, msg.data, msg.full);
+    transform(state, msg.tail, msg.blocks - msg.full);
+    write_state(state, hash);
+}
+
+void hash_many(const unsigned char* const* data, const size_t* sizes, size_t count, unsigned char (*hashes)[32], Impl impl) {
+    size_t i = 0;
+#ifdef SHA256_X86
+    const size_t lanes = impl == Impl::AVX2 ? 8 : impl == Impl::SHANI ? 2 : 0;
+    message msgs[8];
+    // A last message on its own is hashed alone.
+    for (size_t group; lanes && i + 1 < count; i += group) {
+        group = std::min(lanes, count - i);
+        for (size_t l = 0; l < group; ++l) msgs[l].init(data[i + l], sizes[i + l]);
+        if (impl == Impl::AVX2) {
+            hash_8_avx2(msgs, group, hashes + i);
+        } else {
+            hash_2_shani(msgs, hashes + i);
+        }
+    }
+#endif
+    for (; i < count; ++i) hash(data[i], sizes[i], hashes[i], impl);
+}
+
+}  // namespace sha256
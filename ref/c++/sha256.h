@@ -0,0 +1,70 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef SHA256_H_
+#define SHA256_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace sha256
+{
+
+/** The implementations of the compression function. */
+enum class Impl {
+    SCALAR,  //! Portable, one block at a time
+    AVX2,    //! 8 messages at once, one per 32-bit lane
+    SHANI,   //! SHA extensions; batches interleave 2 messages to hide the round latency
+};
+
+/** Whether this CPU supports @impl, detected once. Each one needs its own feature: a CPU with the
+ *  SHA extensions need not have AVX2. */
+bool supported(Impl impl);
+
+/** The fastest implementation this CPU supports. */
+Impl best();
+
+/** Incremental SHA-256. */
+class hasher {
+public:
+    hasher() { reset(); }
+
+    void reset();
+    hasher& write(const unsigned char* data, size_t size);
+    void finalize(unsigned char hash[32]);
+
+private:
+    uint32_t state[8];
+    unsigned char buf[64];
+    uint64_t bytes;
+};
+
+/** Hash @size bytes at @data into @hash. */
+void hash(const unsigned char* data, size_t size, unsigned char hash[32], Impl impl = best());
+
+/** Hash @count messages at once: the i-th is the @sizes[i] bytes at @data[i] and its hash goes to
+ *  @hashes[i]. The messages may differ in length. */
+void hash_many(const unsigned char* const* data, const size_t* sizes, size_t count, unsigned char (*hashes)[32], Impl impl = best());
+
+}  // namespace sha256
+
+#endif  // SHA256_H_
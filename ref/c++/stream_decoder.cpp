@@ -0,0 +1,203 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "stream_decoder.h"
+#include "convertbits.h"
+#include "hrp.h"
+
+#include <algorithm>
+
+namespace payment_request
+{
+
+namespace
+{
+
+const size_t TIMESTAMP_SIZE = 7;
+/* The data part ends with the signature and the checksum; a field is known to be one once they
+ * have arrived after it. */
+const size_t TRAILER_SIZE = 104 + 6;
+const size_t SIGNATURE_SIZE = 104;
+
+}
+
+stream_decoder::stream_decoder(struct bolt11& out, const field_table& fields, void* context)
+    : state{out, context, 0, 0, 0}, fields(fields) {
+    reset();
+}
+
+void stream_decoder::reset() {
+    bech.reset();
+    hasher.reset();
+    state.routes = state.hops = state.fallbacks = 0;
+    pending_begin = pending_end = 0;
+    carry_size = 0;
+    received = 0;
+    handled = 0;
+    started = has_timestamp = done = false;
+}
+
+int stream_decoder::fail(reject_reason reason) {
+    done = true;
+    return stats::finish(stats::reject(reason));
+}
+
+int stream_decoder::push(std::string_view chunk) {
+    if (done) return -1;
+    uint8_t values[bech32::StreamDecoder::max_values(PIECE_SIZE)];
+    for (size_t i = 0; i < chunk.size(); i += PIECE_SIZE) {
+        size_t size;
+        if (!bech.push(chunk.substr(i, PIECE_SIZE), values, &size)) return fail(reject_reason::CHARSET);
+        if (take(values, size) != 0) return -1;
+    }
+    return 0;
+}
+
+/** Queue the data part values the bech32 decoder handed out and parse what they complete. The
+ *  hrp is known once there are any, so it is read with the first. */
+int stream_decoder::take(const uint8_t* values, size_t size) {
+    if (size == 0) return 0;
+    struct bolt11& out = state.invoice;
+    if (!started) {
+        /* BOLT11 - if it does NOT understand the prefix MUST fail the payment. */
+        const std::string_view hrp = bech.hrp_view();
+        struct hrp_fields parsed;
+        const reject_reason reason = parse_hrp(hrp, parsed);
+        if (reason != reject_reason::NONE) return fail(reason);
+        out.prefix.assign(hrp.data(), parsed.prefix_size);
+        out.network = parsed.network;
+        out.sat_amount = parsed.sat_amount;
+        /* Defaults for the fields that may be left out, as decode() sets them. */
+        out.has_receiver_id = false;
+        out.description_len = 0;
+        out.has_description_hash = false;
+        out.expiry = 3600;
+        out.min_final_cltv_expiry = 18;
+        out.features = 0;
+        out.fallbacks = NULL;
+        out.fallback_count = 0;
+        out.routes = NULL;
+        out.route_count = 0;
+        out.tagged_fields = NULL;
+        out.tagged_field_count = 0;
+        hasher.write(reinterpret_cast<const unsigned char*>(hrp.data()), hrp.size());
+        started = true;
+    }
+    if (pending_end + size > PENDING_SIZE) {
+        std::copy(pending + pending_begin, pending + pending_end, pending);
+        pending_end -= pending_begin;
+        pending_begin = 0;
+    }
+    std::copy(values, values + size, pending + pending_end);
+    pending_end += size;
+    received += size;
+    return parse(false);
+}
+
+/** Hand the pending fields to their handlers, as far as they are known not to be part of the
+ *  signature. At the @end of the invoice all of them are, and must end where the signature starts. */
+int stream_decoder::parse(bool end) {
+    if (!has_timestamp) {
+        if (pending_end - pending_begin < TIMESTAMP_SIZE) return 0;
+        const uint8_t* in = pending + pending_begin;
+        uint64_t timestamp = 0;
+        for (size_t i = 0; i < TIMESTAMP_SIZE; ++i) timestamp = (timestamp << 5) | in[i];
+        state.invoice.timestamp = timestamp;
+        hash(in, TIMESTAMP_SIZE);
+        pending_begin += TIMESTAMP_SIZE;
+        has_timestamp = true;
+    }
+    if (pending_end - pending_begin < TRAILER_SIZE) return 0;
+    const size_t tagged_end = pending_end - TRAILER_SIZE;
+    while (pending_begin < tagged_end) {
+        /* type (5 bits) and data_length (10 bits) precede every field */
+        const uint8_t* in = pending + pending_begin;
+        if (pending_begin + 3 > tagged_end) return end ? fail(reject_reason::FIELD) : 0;
+        const size_t data_length = (in[1] << 5) | in[2];
+        if (data_length > tagged_end - pending_begin - 3) return end ? fail(reject_reason::FIELD) : 0;
+        /* MUST skip unknown fields, and p, h, s or n fields of the wrong length */
+        const uint8_t type = in[0];
+        const field_entry& entry = fields.entries[type];
+        if (entry.handler && (!entry.length || entry.length == data_length)) {
+            if (entry.handler(in + 3, data_length, state) != 0) return fail(reject_reason::FIELD);
+            handled |= 1u << type;
+        }
+        hash(in, 3 + data_length);
+        pending_begin += 3 + data_length;
+    }
+    return 0;
+}
+
+/** Feed values of the signed part to the hash, regrouped into bytes eight values at a time. */
+void stream_decoder::hash(const uint8_t* values, size_t size) {
+    unsigned char bytes[PENDING_SIZE * 5 / 8];
+    size_t n;
+    if (carry_size) {
+        const size_t count = std::min(size, 8 - carry_size);
+        std::copy(values, values + count, carry + carry_size);
+        carry_size += count;
+        values += count;
+        size -= count;
+        if (carry_size < 8) return;
+        bech32::regroup_5to8(carry, 8, false, bytes, &n);
+        hasher.write(bytes, n);
+        carry_size = 0;
+    }
+    const size_t whole = size - size % 8;
+    bech32::regroup_5to8(values, whole, false, bytes, &n);
+    hasher.write(bytes, n);
+    std::copy(values + whole, values + size, carry);
+    carry_size = size - whole;
+}
+
+int stream_decoder::finish() {
+    if (done) return -1;
+    uint8_t values[bech32::StreamDecoder::max_values(0)];
+    size_t size;
+    const bech32::Encoding encoding = bech.finish(values, &size);
+    if (encoding == bech32::Encoding::INVALID) return fail(bech.malformed() ? reject_reason::CHARSET : reject_reason::CHECKSUM);
+    if (take(values, size) != 0) return -1;
+    /* The data part holds at least the timestamp and the signature. */
+    if (received < TIMESTAMP_SIZE + TRAILER_SIZE) return fail(reject_reason::TOO_SHORT);
+    if (parse(true) != 0) return -1;
+    /* A payment hash and a payment secret are required. */
+    if (!(handled & (1u << FIELD_PAYMENT_HASH)) || !(handled & (1u << FIELD_PAYMENT_SECRET)))
+        return fail(reject_reason::MISSING_FIELD);
+
+    /* The signature ends the data part: 64 bytes and the recovery id. */
+    struct bolt11& out = state.invoice;
+    unsigned char sig[65];
+    bech32::regroup_5to8(pending + pending_begin, SIGNATURE_SIZE, false, sig, &size);
+    if (sig[64] > 3) return fail(reject_reason::SIGNATURE);
+    std::copy(sig, sig + 64, out.sig);
+    out.sig_recovery_id = sig[64];
+    unsigned char bytes[5];
+    bech32::regroup_5to8(carry, carry_size, true, bytes, &size);
+    hasher.write(bytes, size);
+    hasher.finalize(out.signing_hash);
+    int status;
+    check_signatures(&out, 1, &status);
+    done = true;
+    return stats::finish(status);
+}
+
+}
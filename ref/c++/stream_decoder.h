@@ -0,0 +1,90 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef STREAM_DECODER_H_
+#define STREAM_DECODER_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+
+#include "bech32.h"
+#include "decode_stats.h"
+#include "payment_request.h"
+#include "sha256.h"
+#include "tagged_fields.h"
+
+namespace payment_request
+{
+
+/** Decodes an invoice whose text arrives in chunks of any size, without holding all of it. Each
+ *  tagged field is handed to its handler as soon as enough of the invoice has arrived to know it
+ *  is not part of the signature, and the signed part is hashed as it goes, so the invoice is
+ *  rejected as early as its text allows. Only the values of the last, unfinished field and of the
+ *  signature are kept. Route hints and fallback addresses are checked but not stored. */
+class stream_decoder {
+public:
+	/** Decode into @out, handing the tagged fields to the handlers in a copy of @fields with @context. */
+	explicit stream_decoder(struct bolt11& out, const field_table& fields = STANDARD_FIELDS, void* context = NULL);
+
+	/** Start decoding a new invoice. */
+	void reset();
+
+	/** Feed the next @chunk of the invoice. Returns -1 once the invoice is known to be invalid,
+	 *  0 otherwise. */
+	int push(std::string_view chunk);
+
+	/** End the invoice, then check its checksum, its last fields and its signature; 0 means
+	 *  success, -1 failure. Call reset() before decoding another one. */
+	int finish();
+
+private:
+	/* Characters mapped per step, which bounds what a step adds to the pending values. */
+	static constexpr size_t PIECE_SIZE = 256;
+	/* The longest field that is not yet known to be one, then the signature and the checksum,
+	 * and what a step adds. */
+	static constexpr size_t PENDING_SIZE = 2048;
+
+	bech32::StreamDecoder bech;
+	sha256::hasher hasher;
+	struct field_state state;
+	field_table fields;                              // a copy, so the table passed in may be a temporary
+	uint8_t pending[PENDING_SIZE];                  // values received but not parsed yet
+	size_t pending_begin;
+	size_t pending_end;
+	uint8_t carry[8];                               // values parsed but not hashed yet
+	size_t carry_size;
+	size_t received;                                // values received, checksum included
+	uint32_t handled;                               // one bit per field type handed to its handler
+	bool started;                                   // whether the hrp was read
+	bool has_timestamp;
+	bool done;                                      // refused or finished; reset() before the next
+
+	int fail(reject_reason reason);
+	int take(const uint8_t* values, size_t size);
+	int parse(bool end);
+	void hash(const uint8_t* values, size_t size);
+};
+
+}
+
+#endif  // STREAM_DECODER_H_
@@ -0,0 +1,124 @@
+/* Copyright (c) 2023 Marcello Pinsdorf
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef TAGGED_FIELDS_H_
+#define TAGGED_FIELDS_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+
+#include "payment_request.h"
+
+namespace payment_request
+{
+
+/* Field types, the 5-bit value of their bech32 character. */
+constexpr uint8_t FIELD_PAYMENT_HASH = 1;       // 'p'
+constexpr uint8_t FIELD_ROUTE = 3;              // 'r'
+constexpr uint8_t FIELD_FEATURES = 5;           // '9'
+constexpr uint8_t FIELD_EXPIRY = 6;             // 'x'
+constexpr uint8_t FIELD_FALLBACK = 9;           // 'f'
+constexpr uint8_t FIELD_DESCRIPTION = 13;       // 'd'
+constexpr uint8_t FIELD_PAYMENT_SECRET = 16;    // 's'
+constexpr uint8_t FIELD_RECEIVER_ID = 19;       // 'n'
+constexpr uint8_t FIELD_DESCRIPTION_HASH = 23;  // 'h'
+constexpr uint8_t FIELD_MIN_FINAL_CLTV = 24;    // 'c'
+constexpr uint8_t FIELD_METADATA = 27;          // 'm'
+
+/** The decode a field handler contributes to. */
+struct field_state {
+	struct bolt11& invoice;
+	void* context;                                  // as given to decode(); NULL for the standard fields
+	size_t routes;                                  // non-empty r fields so far, and their hops, stored
+	size_t hops;                                    // once every field is read
+	size_t fallbacks;                               // f fields to keep
+};
+
+/** Convert a field of @data_length 5-bit values at @payload into @state. Returns 0, or -1 to
+ *  fail the invoice. */
+typedef int (*field_handler)(const uint8_t* payload, size_t data_length, struct field_state& state);
+
+struct field_entry {
+	field_handler handler;                          // NULL to skip the field without converting it
+	uint16_t length;                                // the data_length to accept, 0 for any; fields of another length are skipped
+};
+
+/** How the decoder treats each of the 32 field types, indexed by type. Dispatching a field is one
+ *  lookup and one indirect call, and a field nobody handles costs only its header. Tables are
+ *  built at compile time from STANDARD_FIELDS with with() and without(). */
+struct field_table {
+	struct field_entry entries[32];
+
+	/** A copy that hands fields of @type and @length, 0 for any, to @handler. */
+	constexpr field_table with(uint8_t type, field_handler handler, uint16_t length = 0) const {
+		field_table table = *this;
+		table.entries[type & 31] = field_entry{handler, length};
+		return table;
+	}
+
+	/** A copy that skips fields of @type. */
+	constexpr field_table without(uint8_t type) const { return with(type, NULL); }
+};
+
+/** The handlers of the fields BOLT11 defines. */
+namespace field_handlers
+{
+
+int payment_hash(const uint8_t* payload, size_t data_length, struct field_state& state);
+int payment_secret(const uint8_t* payload, size_t data_length, struct field_state& state);
+int description(const uint8_t* payload, size_t data_length, struct field_state& state);
+int description_hash(const uint8_t* payload, size_t data_length, struct field_state& state);
+int receiver_id(const uint8_t* payload, size_t data_length, struct field_state& state);
+int expiry(const uint8_t* payload, size_t data_length, struct field_state& state);
+int min_final_cltv_expiry(const uint8_t* payload, size_t data_length, struct field_state& state);
+int features(const uint8_t* payload, size_t data_length, struct field_state& state);
+/** Check an r field and count its hops; they are stored once all fields are read. */
+int route(const uint8_t* payload, size_t data_length, struct field_state& state);
+/** Count an f field to keep; one of an unknown version or the wrong size is not kept. */
+int fallback(const uint8_t* payload, size_t data_length, struct field_state& state);
+
+}
+
+/** The fields this decoder reads, as BOLT11 defines them. p, s and h fields of other than 52
+ *  values and n fields of other than 53 are skipped, as BOLT11 requires. m fields, and every
+ *  type BOLT11 does not define, are skipped. */
+constexpr field_table STANDARD_FIELDS = field_table{}
+	.with(FIELD_PAYMENT_HASH, field_handlers::payment_hash, 52)
+	.with(FIELD_PAYMENT_SECRET, field_handlers::payment_secret, 52)
+	.with(FIELD_DESCRIPTION, field_handlers::description)
+	.with(FIELD_DESCRIPTION_HASH, field_handlers::description_hash, 52)
+	.with(FIELD_RECEIVER_ID, field_handlers::receiver_id, 53)
+	.with(FIELD_EXPIRY, field_handlers::expiry)
+	.with(FIELD_MIN_FINAL_CLTV, field_handlers::min_final_cltv_expiry)
+	.with(FIELD_FEATURES, field_handlers::features)
+	.with(FIELD_ROUTE, field_handlers::route)
+	.with(FIELD_FALLBACK, field_handlers::fallback);
+
+/** Decode and check an invoice as decode() does, with @fields telling how to treat each tagged
+ *  field. @context is handed to the handlers. A payment hash and a payment secret must still be
+ *  handled for the invoice to be valid. */
+int decode(std::string_view invoice, struct bolt11& out, const field_table& fields, void* context, hint_arena* hints = NULL);
+
+}
+
+#endif  // TAGGED_FIELDS_H_
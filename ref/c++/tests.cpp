@@ -20,89 +20,141 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
 
 #include "payment_request.h"
+#include "batch_decode.h"
+#include "compact_bolt11.h"
+#include "convertbits.h"
 #include "bech32.h"
+#include "sha256.h"
+#include "secp256k1.h"
+#include "recovery_cache.h"
+#include "decode_cache.h"
+#include "hash_index.h"
+#include "invoice_store.h"
+#include "invoice_file.h"
+#include "decode_stats.h"
+#include "hrp.h"
+#include "hint_arena.h"
+#include "tagged_fields.h"
+#include "stream_decoder.h"
+#include "invoice_filter.h"
+#include "expiry_wheel.h"
+#include "decode_pipeline.h"
+#include "test_vectors.h"
 
-struct invoice_data {
-    const std::string bech32_data;
+/* Fields decoded from some of the valid invoices of test_vectors.h. */
+struct invoice_fields {
+    size_t index;                       // into valid_invoice
+    uint64_t timestamp;
+    uint64_t sat_amount;                // in millisatoshi
+    uint64_t expiry;
+    uint32_t min_final_cltv_expiry;
+    const std::string description;
 };
 
-static const struct invoice_data valid_invoice[] = {
-    {
-        "lnbc1pvjluezsp5zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zygspp5qqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqypqdpl2pkx2ctnv5sxxmmwwd5kgetjypeh2ursdae8g6twvus8g6rfwvs8qun0dfjkxaq9qrsgq357wnc5r2ueh7ck6q93dj32dlqnls087fxdwk8qakdyafkq3yap9us6v52vjjsrvywa6rt52cm9r9zqt8r2t7mlcwspyetp5h2tztugp9lfyql"
-    },
-    {
-        "lnbc2500u1pvjluezsp5zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zygspp5qqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqypqdq5xysxxatsyp3k7enxv4jsxqzpu9qrsgquk0rl77nj30yxdy8j9vdx85fkpmdla2087ne0xh8nhedh8w27kyke0lp53ut353s06fv3qfegext0eh0ymjpf39tuven09sam30g4vgpfna3rh"
-    },
-    {
-        "lnbc2500u1pvjluezsp5zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zygspp5qqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqypqdpquwpc4curk03c9wlrswe78q4eyqc7d8d0xqzpu9qrsgqhtjpauu9ur7fw2thcl4y9vfvh4m9wlfyz2gem29g5ghe2aak2pm3ps8fdhtceqsaagty2vph7utlgj48u0ged6a337aewvraedendscp573dxr"
-    },
-    {
-        "lnbc20m1pvjluezsp5zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zygspp5qqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqypqhp58yjmdan79s6qqdhdzgynm4zwqd5d7xmw5fk98klysy043l2ahrqs9qrsgq7ea976txfraylvgzuxs8kgcw23ezlrszfnh8r6qtfpr6cxga50aj6txm9rxrydzd06dfeawfk6swupvz4erwnyutnjq7x39ymw6j38gp7ynn44"
-    },
-    {
-        "lntb20m1pvjluezsp5zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zygshp58yjmdan79s6qqdhdzgynm4zwqd5d7xmw5fk98klysy043l2ahrqspp5qqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqypqfpp3x9et2e20v6pu37c5d9vax37wxq72un989qrsgqdj545axuxtnfemtpwkc45hx9d2ft7x04mt8q7y6t0k2dge9e7h8kpy9p34ytyslj3yu569aalz2xdk8xkd7ltxqld94u8h2esmsmacgpghe9k8"
-    },
-    {
-        "lnbc20m1pvjluezsp5zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zygspp5qqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqypqhp58yjmdan79s6qqdhdzgynm4zwqd5d7xmw5fk98klysy043l2ahrqsfpp3qjmp7lwpagxun9pygexvgpjdc4jdj85fr9yq20q82gphp2nflc7jtzrcazrra7wwgzxqc8u7754cdlpfrmccae92qgzqvzq2ps8pqqqqqqpqqqqq9qqqvpeuqafqxu92d8lr6fvg0r5gv0heeeqgcrqlnm6jhphu9y00rrhy4grqszsvpcgpy9qqqqqqgqqqqq7qqzq9qrsgqdfjcdk6w3ak5pca9hwfwfh63zrrz06wwfya0ydlzpgzxkn5xagsqz7x9j4jwe7yj7vaf2k9lqsdk45kts2fd0fkr28am0u4w95tt2nsq76cqw0"
-    },
-    {
-        "lnbc20m1pvjluezsp5zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zygshp58yjmdan79s6qqdhdzgynm4zwqd5d7xmw5fk98klysy043l2ahrqspp5qqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqypqfppj3a24vwu6r8ejrss3axul8rxldph2q7z99qrsgqz6qsgww34xlatfj6e3sngrwfy3ytkt29d2qttr8qz2mnedfqysuqypgqex4haa2h8fx3wnypranf3pdwyluftwe680jjcfp438u82xqphf75ym"
-    },
-    {
-        "lnbc20m1pvjluezsp5zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zygshp58yjmdan79s6qqdhdzgynm4zwqd5d7xmw5fk98klysy043l2ahrqspp5qqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqypqfppqw508d6qejxtdg4y5r3zarvary0c5xw7k9qrsgqt29a0wturnys2hhxpner2e3plp6jyj8qx7548zr2z7ptgjjc7hljm98xhjym0dg52sdrvqamxdezkmqg4gdrvwwnf0kv2jdfnl4xatsqmrnsse"
-    },
-    {
-        "lnbc20m1pvjluezsp5zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zygshp58yjmdan79s6qqdhdzgynm4zwqd5d7xmw5fk98klysy043l2ahrqspp5qqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqypqfp4qrp33g0q5c5txsp9arysrx4k6zdkfs4nce4xj0gdcccefvpysxf3q9qrsgq9vlvyj8cqvq6ggvpwd53jncp9nwc47xlrsnenq2zp70fq83qlgesn4u3uyf4tesfkkwwfg3qs54qe426hp3tz7z6sweqdjg05axsrjqp9yrrwc"
-    },
-    {
-        "lnbc9678785340p1pwmna7lpp5gc3xfm08u9qy06djf8dfflhugl6p7lgza6dsjxq454gxhj9t7a0sd8dgfkx7cmtwd68yetpd5s9xar0wfjn5gpc8qhrsdfq24f5ggrxdaezqsnvda3kkum5wfjkzmfqf3jkgem9wgsyuctwdus9xgrcyqcjcgpzgfskx6eqf9hzqnteypzxz7fzypfhg6trddjhygrcyqezcgpzfysywmm5ypxxjemgw3hxjmn8yptk7untd9hxwg3q2d6xjcmtv4ezq7pqxgsxzmnyyqcjqmt0wfjjq6t5v4khxsp5zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zygsxqyjw5qcqp2rzjq0gxwkzc8w6323m55m4jyxcjwmy7stt9hwkwe2qxmy8zpsgg7jcuwz87fcqqeuqqqyqqqqlgqqqqn3qq9q9qrsgqrvgkpnmps664wgkp43l22qsgdw4ve24aca4nymnxddlnp8vh9v2sdxlu5ywdxefsfvm0fq3sesf08uf6q9a2ke0hc9j6z6wlxg5z5kqpu2v9wz"
-    },
-    {
-        "lnbc25m1pvjluezpp5qqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqypqdq5vdhkven9v5sxyetpdeessp5zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zygs9q5sqqqqqqqqqqqqqqqqsgq2a25dxl5hrntdtn6zvydt7d66hyzsyhqs4wdynavys42xgl6sgx9c4g7me86a27t07mdtfry458rtjr0v92cnmswpsjscgt2vcse3sgpz3uapa"
-    },
-    {
-        "LNBC25M1PVJLUEZPP5QQQSYQCYQ5RQWZQFQQQSYQCYQ5RQWZQFQQQSYQCYQ5RQWZQFQYPQDQ5VDHKVEN9V5SXYETPDEESSP5ZYG3ZYG3ZYG3ZYG3ZYG3ZYG3ZYG3ZYG3ZYG3ZYG3ZYG3ZYG3ZYGS9Q5SQQQQQQQQQQQQQQQQSGQ2A25DXL5HRNTDTN6ZVYDT7D66HYZSYHQS4WDYNAVYS42XGL6SGX9C4G7ME86A27T07MDTFRY458RTJR0V92CNMSWPSJSCGT2VCSE3SGPZ3UAPA"
-    },
-    {
-        "lnbc25m1pvjluezpp5qqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqypqdq5vdhkven9v5sxyetpdeessp5zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zygs9q5sqqqqqqqqqqqqqqqqsgq2qrqqqfppnqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqppnqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqpp4qqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqhpnqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqhp4qqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqspnqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqsp4qqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqnp5qqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqnpkqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqz599y53s3ujmcfjp5xrdap68qxymkqphwsexhmhr8wdz5usdzkzrse33chw6dlp3jhuhge9ley7j2ayx36kawe7kmgg8sv5ugdyusdcqzn8z9x"
-    },
-    {
-        "lnbc10m1pvjluezpp5qqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqypqdp9wpshjmt9de6zqmt9w3skgct5vysxjmnnd9jx2mq8q8a04uqsp5zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zygs9q2gqqqqqqsgq7hf8he7ecf7n4ffphs6awl9t6676rrclv9ckg3d3ncn7fct63p6s365duk5wrk202cfy3aj5xnnp5gs3vrdvruverwwq7yzhkf5a3xqpd05wjc"
-    },
+static const struct invoice_fields valid_fields[] = {
+    {0, 1496314658, 0, 3600, 18, "Please consider supporting this project"},
+    {1, 1496314658, 250000000, 60, 18, "1 cup coffee"},
+    {3, 1496314658, 2000000000, 3600, 18, ""},
+    {9, 1572468703, 967878534, 604800, 10, "Blockstream Store: 88.85 USD for Blockstream Ledger Nano S x 1, \"Back In My Day\" Sticker x 2, \"I Got Lightning Working\" Sticker x 2 and 1 more items"},
+    {13, 1496314658, 1000000000, 3600, 18, "payment metadata inside"},
 };
 
-static const struct invoice_data invalid_invoice[] = {
-    {
-        "lnbc25m1pvjluezpp5qqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqypqdq5vdhkven9v5sxyetpdeessp5zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zygs9q4psqqqqqqqqqqqqqqqqsgqtqyx5vggfcsll4wu246hz02kp85x4katwsk9639we5n5yngc3yhqkm35jnjw4len8vrnqnf5ejh0mzj9n3vz2px97evektfm2l6wqccp3y7372"
-    },
-    {
-        "lnbc2500u1pvjluezpp5qqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqypqdpquwpc4curk03c9wlrswe78q4eyqc7d8d0xqzpuyk0sg5g70me25alkluzd2x62aysf2pyy8edtjeevuv4p2d5p76r4zkmneet7uvyakky2zr4cusd45tftc9c5fh0nnqpnl2jfll544esqchsrnt"
-    },
-    {
-        "pvjluezpp5qqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqypqdpquwpc4curk03c9wlrswe78q4eyqc7d8d0xqzpuyk0sg5g70me25alkluzd2x62aysf2pyy8edtjeevuv4p2d5p76r4zkmneet7uvyakky2zr4cusd45tftc9c5fh0nnqpnl2jfll544esqchsrny"
-    },
-    {
-        "LNBC2500u1pvjluezpp5qqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqypqdpquwpc4curk03c9wlrswe78q4eyqc7d8d0xqzpuyk0sg5g70me25alkluzd2x62aysf2pyy8edtjeevuv4p2d5p76r4zkmneet7uvyakky2zr4cusd45tftc9c5fh0nnqpnl2jfll544esqchsrny"
-    },
-    {
-        "lnbc2500u1pvjluezpp5qqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqypqdq5xysxxatsyp3k7enxv4jsxqzpusp5zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zygs9qrsgqwgt7mcn5yqw3yx0w94pswkpq6j9uh6xfqqqtsk4tnarugeektd4hg5975x9am52rz4qskukxdmjemg92vvqz8nvmsye63r5ykel43pgz7zq0g2"
-    },
-    {
-        "lnbc1pvjluezpp5qqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqypqdpl2pkx2ctnv5sxxmmwwd5kgetjypeh2ursdae8g6na6hlh"
-    },
-    {
-        "lnbc2500x1pvjluezpp5qqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqypqdq5xysxxatsyp3k7enxv4jsxqzpusp5zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zygs9qrsgqrrzc4cvfue4zp3hggxp47ag7xnrlr8vgcmkjxk3j5jqethnumgkpqp23z9jclu3v0a7e0aruz366e9wqdykw6dxhdzcjjhldxq0w6wgqcnu43j"
-    },
-    {
-        "lnbc2500000001p1pvjluezpp5qqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqqqsyqcyq5rqwzqfqypqdq5xysxxatsyp3k7enxv4jsxqzpusp5zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zyg3zygs9qrsgq0lzc236j96a95uv0m3umg28gclm5lqxtqqwk32uuk4k6673k6n5kfvx3d2h8s295fad45fdhmusm8sjudfhlf6dcsxmfvkeywmjdkxcp99202x"
-    },
+/* Decode the hex string @in into @out, which has room for strlen(@in) / 2 bytes. */
+static void unhex(const char* in, unsigned char* out) {
+    for (size_t i = 0; in[2 * i]; ++i) sscanf(in + 2 * i, "%2hhx", &out[i]);
+}
+
+static std::string hex(const unsigned char* data, size_t size) {
+    std::string out;
+    for (size_t i = 0; i < size; ++i) {
+        char byte[3];
+        snprintf(byte, sizeof(byte), "%02x", data[i]);
+        out += byte;
+    }
+    return out;
+}
+
+/* The contents of the file at @path, empty if there is none. */
+static std::string read_file(const char* path) {
+    std::string out;
+    FILE* f = fopen(path, "rb");
+    if (!f) return out;
+    char buffer[4096];
+    size_t got;
+    while ((got = fread(buffer, 1, sizeof(buffer), f)) > 0) out.append(buffer, got);
+    fclose(f);
+    return out;
+}
+
+/* Whether two invoices have the same route hints and fallback addresses. */
+static bool same_hints(const payment_request::bolt11& a, const payment_request::bolt11& b) {
+    if (a.route_count != b.route_count || a.fallback_count != b.fallback_count) return false;
+    for (size_t i = 0; i < a.route_count; ++i) {
+        if (a.routes[i].size != b.routes[i].size) return false;
+        for (size_t h = 0; h < a.routes[i].size; ++h) {
+            const payment_request::route_hop& x = a.routes[i].hops[h];
+            const payment_request::route_hop& y = b.routes[i].hops[h];
+            if (memcmp(x.pubkey, y.pubkey, 33) != 0 || x.short_channel_id != y.short_channel_id ||
+                x.fee_base_msat != y.fee_base_msat || x.fee_proportional_millionths != y.fee_proportional_millionths ||
+                x.cltv_expiry_delta != y.cltv_expiry_delta)
+                return false;
+        }
+    }
+    for (size_t i = 0; i < a.fallback_count; ++i) {
+        if (a.fallbacks[i].version != b.fallbacks[i].version || a.fallbacks[i].size != b.fallbacks[i].size ||
+            memcmp(a.fallbacks[i].program, b.fallbacks[i].program, a.fallbacks[i].size) != 0)
+            return false;
+    }
+    return true;
+}
+
+/* Keeps the payment metadata of the m field, which the standard fields skip. */
+static int read_metadata(const uint8_t* payload, size_t data_length, payment_request::field_state& state) {
+    std::string& metadata = *static_cast<std::string*>(state.context);
+    uint8_t bytes[1023 * 5 / 8 + 1];
+    size_t size;
+    if (!bech32::regroup_5to8(payload, data_length, false, bytes, &size)) return -1;
+    metadata = hex(bytes, size);
+    return 0;
+}
+
+/* Collects the invoices an expiry_wheel hands out. */
+static void collect_expired(const payment_request::expired_invoice* batch, size_t count, void* context) {
+    auto& expired = *static_cast<std::vector<payment_request::expired_invoice>*>(context);
+    expired.insert(expired.end(), batch, batch + count);
+}
+
+/* What a decode_pipeline handed out, by the address of each invoice; the sink waits while @hold is set. */
+struct pipeline_output {
+    std::mutex lock;
+    std::map<const char*, std::pair<int, std::string> > results;    // status, payment hash
+    std::atomic<bool> hold{false};
 };
 
+static void collect_decoded(const std::string_view* invoices, const payment_request::bolt11* decoded, const int* status,
+                            size_t count, void* context) {
+    pipeline_output& output = *static_cast<pipeline_output*>(context);
+    while (output.hold.load()) std::this_thread::yield();
+    std::lock_guard<std::mutex> guard(output.lock);
+    for (size_t i = 0; i < count; ++i)
+        output.results[invoices[i].data()] = std::make_pair(status[i], status[i] == 0 ? hex(decoded[i].payment_hash, 32) : "");
+}
+
 int main(void) {
      int fail = 0;
     for (const auto& input : valid_invoice) {
@@ -115,6 +167,1183 @@ int main(void) {
         if (dec.first != -1)
             fail++;
     }
+    for (const auto& expected : valid_fields) {
+        payment_request::bolt11 invoice;
+        if (payment_request::decode(valid_invoice[expected.index].bech32_data, invoice) != 0 ||
+            invoice.timestamp != expected.timestamp ||
+            invoice.sat_amount != expected.sat_amount || invoice.expiry != expected.expiry ||
+            invoice.min_final_cltv_expiry != expected.min_final_cltv_expiry ||
+            std::string(invoice.description, invoice.description + invoice.description_len) != expected.description)
+            fail++;
+    }
+    /* The lazy decoder reads the same fields, and fails on the same invoices. */
+    for (const auto& expected : valid_fields) {
+        payment_request::bolt11 invoice;
+        payment_request::lazy_bolt11 lazy;
+        payment_request::decode(valid_invoice[expected.index].bech32_data, invoice);
+        if (lazy.decode(valid_invoice[expected.index].bech32_data) != 0 ||
+            lazy.sat_amount() != expected.sat_amount || lazy.expiry() != expected.expiry ||
+            lazy.min_final_cltv_expiry() != expected.min_final_cltv_expiry ||
+            lazy.description() != expected.description ||
+            !lazy.payment_hash() || memcmp(lazy.payment_hash(), invoice.payment_hash, 32) != 0)
+            fail++;
+    }
+    for (const auto& input : invalid_invoice) {
+        payment_request::bolt11 invoice;
+        payment_request::lazy_bolt11 lazy;
+        if ((lazy.decode(input.bech32_data) == 0) != (payment_request::decode(input.bech32_data, invoice) == 0))
+            fail++;
+    }
+    /* Its route hints and fallbacks are those decode() stores, converted once. */
+    payment_request::hint_arena lazy_hints;
+    for (const auto& input : valid_invoice) {
+        payment_request::bolt11 eager, lazy_fields;
+        payment_request::lazy_bolt11 lazy;
+        size_t route_count, fallback_count, again_count;
+        if (payment_request::decode(input.bech32_data, eager, lazy_hints) != 0 || lazy.decode(input.bech32_data) != 0)
+            fail++;
+        lazy_fields.routes = lazy.route_hints(lazy_hints, &route_count);
+        lazy_fields.route_count = route_count;
+        lazy_fields.fallbacks = lazy.fallbacks(lazy_hints, &fallback_count);
+        lazy_fields.fallback_count = fallback_count;
+        if (!same_hints(lazy_fields, eager) || lazy.route_hints(lazy_hints, &again_count) != lazy_fields.routes ||
+            again_count != route_count)
+            fail++;
+    }
+    payment_request::lazy_bolt11 lazy_routed;
+    size_t lazy_routes, lazy_fallbacks;
+    if (lazy_routed.decode(valid_invoice[5].bech32_data) != 0 || !lazy_routed.fallbacks(lazy_hints, &lazy_fallbacks) ||
+        lazy_fallbacks != 1 || !lazy_routed.route_hints(lazy_hints, &lazy_routes) || lazy_routes != 1)
+        fail++;
+    /* A batch decodes each invoice as decode() does; repeat the vectors to span several chunks. */
+    std::vector<std::string_view> batch;
+    for (int round = 0; round < 20; ++round) {
+        for (const auto& input : valid_invoice) batch.push_back(input.bech32_data);
+        for (const auto& input : invalid_invoice) batch.push_back(input.bech32_data);
+    }
+    payment_request::decoded_batch columns;
+    payment_request::decode_batch(batch.data(), batch.size(), columns, 4);
+    for (size_t i = 0; i < batch.size(); ++i) {
+        payment_request::bolt11 invoice;
+        int ret = payment_request::decode(batch[i], invoice);
+        if (columns.status[i] != ret || (ret == 0 &&
+            (columns.amount_msat[i] != invoice.sat_amount || columns.timestamp[i] != invoice.timestamp ||
+             columns.expiry[i] != invoice.expiry || columns.min_final_cltv_expiry[i] != invoice.min_final_cltv_expiry ||
+             columns.network[i] != invoice.network || columns.features[i] != invoice.features ||
+             !std::equal(invoice.payment_hash, invoice.payment_hash + 32, columns.payment_hash[i].begin()) ||
+             !std::equal(invoice.signing_hash, invoice.signing_hash + 32, columns.signing_hash[i].begin()) ||
+             !std::equal(invoice.receiver_id, invoice.receiver_id + 33, columns.receiver_id[i].begin()))))
+            fail++;
+    }
+    /* The compact form keeps every field but the signature, route hints and fallbacks included. */
+    payment_request::bolt11_arena arena;
+    payment_request::hint_arena compact_hints;
+    std::vector<payment_request::compact_bolt11> compact;
+    for (const auto& input : valid_invoice) {
+        payment_request::bolt11 invoice;
+        if (payment_request::decode(input.bech32_data, invoice, compact_hints) != 0) continue;
+        compact.emplace_back();
+        if (arena.add(invoice, compact.back()) != 0)
+            fail++;
+    }
+    for (size_t i = 0; i < compact.size(); ++i) {
+        payment_request::bolt11 invoice, expanded;
+        payment_request::decode(valid_invoice[i].bech32_data, invoice, compact_hints);
+        arena.expand(compact[i], expanded);
+        if (expanded.prefix != invoice.prefix || expanded.sat_amount != invoice.sat_amount ||
+            expanded.expiry != invoice.expiry || expanded.description_len != invoice.description_len ||
+            memcmp(expanded.description, invoice.description, invoice.description_len) != 0 ||
+            expanded.has_description_hash != invoice.has_description_hash ||
+            (invoice.has_description_hash && memcmp(expanded.description_hash, invoice.description_hash, 32) != 0) ||
+            expanded.features != invoice.features || arena.features(compact[i]) != invoice.features ||
+            memcmp(expanded.payment_secret, invoice.payment_secret, 32) != 0 || !same_hints(expanded, invoice))
+            fail++;
+    }
+    payment_request::bolt11 compact_routed;
+    arena.expand(compact[5], compact_routed);
+    if (compact_routed.route_count != 1 || compact_routed.routes[0].size != 2 || compact_routed.fallback_count != 1)
+        fail++;
+    /* An invoice too large for a record is refused, even built by hand, and leaves the arena and
+     * the store as they were. */
+    {
+        payment_request::bolt11 oversized = compact_routed;
+        oversized.prefix.assign(256, 'l');
+        payment_request::bolt11 undescribed = compact_routed;
+        undescribed.description_len = sizeof(undescribed.description) + 1;
+        std::vector<payment_request::route_hop> many_hops(20000, compact_routed.routes[0].hops[0]);
+        const payment_request::route_hint long_route = {many_hops.data(), many_hops.size()};
+        payment_request::bolt11 overrouted = compact_routed;
+        overrouted.routes = &long_route;
+        payment_request::compact_bolt11 refused;
+        const size_t arena_size = arena.memory_usage();
+        payment_request::invoice_store refusing_store;
+        for (const payment_request::bolt11* invoice : {&oversized, &undescribed, &overrouted}) {
+            if (arena.add(*invoice, refused) == 0 || refusing_store.insert(*invoice))
+                fail++;
+        }
+        if (arena.memory_usage() != arena_size || refusing_store.size() != 0 || refusing_store.find(compact_routed.payment_hash))
+            fail++;
+    }
+    /* The allocation-free decoder must agree with the allocating one. */
+    bech32::DecodeBuffer buf;
+    for (const auto& input : valid_invoice) {
+        auto dec = bech32::decode(input.bech32_data);
+        bech32::decode(input.bech32_data, buf);
+        if (buf.encoding != dec.encoding || buf.hrp_view() != dec.hrp ||
+            !std::equal(dec.data.begin(), dec.data.end(), buf.data, buf.data + buf.data_size))
+            fail++;
+    }
+    for (const auto& input : invalid_invoice) {
+        auto dec = bech32::decode(input.bech32_data);
+        if (bech32::decode(input.bech32_data, buf) != dec.encoding)
+            fail++;
+    }
+    /* A refused string tells a checksum that does not hold from anything else wrong with it. */
+    std::string bad_checksum = valid_invoice[0].bech32_data, mixed_case = valid_invoice[0].bech32_data;
+    bad_checksum.back() = bad_checksum.back() == 'q' ? 'p' : 'q';
+    mixed_case[mixed_case.rfind('1') + 1] = 'Q';
+    if (bech32::decode(bad_checksum, buf) != bech32::Encoding::INVALID || buf.malformed ||
+        bech32::decode(bad_checksum + "b", buf) != bech32::Encoding::INVALID || !buf.malformed ||
+        bech32::decode(mixed_case, buf) != bech32::Encoding::INVALID || !buf.malformed ||
+        bech32::decode(valid_invoice[0].bech32_data, buf) == bech32::Encoding::INVALID || buf.malformed)
+        fail++;
+    /* A decoded invoice encodes back to the string it came from, in lower case: with its tagged
+     * fields in their order, m and unknown ones included, the copied signature still checks. */
+    payment_request::hint_arena encode_hints;
+    std::vector<payment_request::bolt11> decoded(sizeof(valid_invoice) / sizeof(valid_invoice[0]));
+    for (size_t i = 0; i < decoded.size(); ++i) {
+        payment_request::bolt11 again;
+        char encoded[2048];
+        std::string lower(valid_invoice[i].bech32_data);
+        std::transform(lower.begin(), lower.end(), lower.begin(), [](char c) { return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c; });
+        if (payment_request::decode(valid_invoice[i].bech32_data, decoded[i], encode_hints) != 0) fail++;
+        size_t size = payment_request::encode(decoded[i], encoded, sizeof(encoded));
+        if (std::string_view(encoded, size) != lower || payment_request::decode(std::string_view(encoded, size), again) != 0)
+            fail++;
+    }
+    /* Without its tagged fields an invoice is written in a fixed order, which decodes to the same
+     * fields. That changes the signed message, so the copied signature is not checked. */
+    for (size_t i = 0; i < decoded.size(); ++i) {
+        payment_request::bolt11 fixed = decoded[i];
+        payment_request::bolt11 again;
+        payment_request::signing_data signed_data;
+        char encoded[2048];
+        fixed.tagged_fields = NULL;
+        size_t size = payment_request::encode(fixed, encoded, sizeof(encoded));
+        if (size == 0 || payment_request::decode(std::string_view(encoded, size), again, signed_data) != 0 ||
+            again.prefix != fixed.prefix || again.sat_amount != fixed.sat_amount ||
+            again.timestamp != fixed.timestamp || again.expiry != fixed.expiry ||
+            again.min_final_cltv_expiry != fixed.min_final_cltv_expiry ||
+            memcmp(again.payment_hash, fixed.payment_hash, 32) != 0 ||
+            memcmp(again.payment_secret, fixed.payment_secret, 32) != 0 ||
+            again.description_len != fixed.description_len ||
+            memcmp(again.description, fixed.description, again.description_len) != 0 ||
+            again.has_description_hash != fixed.has_description_hash || again.features != fixed.features ||
+            memcmp(again.sig, fixed.sig, 64) != 0 || again.sig_recovery_id != fixed.sig_recovery_id)
+            fail++;
+    }
+    /* An expiry of 2^60 or more takes 13 values, whose top bit is zero; the largest c takes 7. */
+    {
+        payment_request::bolt11 large = decoded[0];
+        payment_request::bolt11 again;
+        payment_request::signing_data signed_data;
+        char encoded[2048];
+        large.tagged_fields = NULL;
+        large.expiry = UINT64_MAX;
+        large.min_final_cltv_expiry = UINT32_MAX;
+        size_t size = payment_request::encode(large, encoded, sizeof(encoded));
+        if (size == 0 || payment_request::decode(std::string_view(encoded, size), again, signed_data) != 0 ||
+            again.expiry != UINT64_MAX || again.min_final_cltv_expiry != UINT32_MAX)
+            fail++;
+    }
+    /* A batch encodes the same strings back to back. */
+    std::vector<char> encoded(decoded.size() * 2048);
+    std::vector<size_t> ends(decoded.size());
+    if (payment_request::encode_batch(decoded.data(), decoded.size(), encoded.data(), encoded.size(), ends.data()) != decoded.size())
+        fail++;
+    for (size_t i = 0, begin = 0; i < decoded.size(); begin = ends[i++]) {
+        char single[2048];
+        size_t size = payment_request::encode(decoded[i], single, sizeof(single));
+        if (ends[i] - begin != size || memcmp(encoded.data() + begin, single, size) != 0)
+            fail++;
+    }
+    /* Every regrouping implementation matches convertbits, padding included. */
+    for (const auto& input : valid_invoice) {
+        const auto dec = bech32::decode(input.bech32_data);
+        for (bool pad : {false, true}) {
+            std::vector<uint8_t> bytes, values;
+            bool ok = bech32::convertbits(pad, 5, 8, bytes, dec.data);
+            bool back_ok = bech32::convertbits(pad, 8, 5, values, bytes);
+            for (auto impl : {bech32::RegroupImpl::SCALAR, bech32::RegroupImpl::BMI2, bech32::RegroupImpl::AVX2}) {
+                if (impl > bech32::regroup_best()) continue;
+                std::vector<uint8_t> out(dec.data.size()), back((bytes.size() * 8 + 4) / 5);
+                size_t size, back_size;
+                if (bech32::regroup_5to8(dec.data.data(), dec.data.size(), pad, out.data(), &size, impl) != ok ||
+                    (ok && !std::equal(bytes.begin(), bytes.end(), out.begin(), out.begin() + size)))
+                    fail++;
+                if (bech32::regroup_8to5(bytes.data(), bytes.size(), pad, back.data(), &back_size, impl) != back_ok ||
+                    (back_ok && !std::equal(values.begin(), values.end(), back.begin(), back.begin() + back_size)))
+                    fail++;
+            }
+        }
+    }
+    /* Every implementation of mapping characters to values matches the scalar one: on every byte
+     * value, on runs of mixed case that straddle the 16 and 32 character steps, and with an invalid
+     * byte at each offset. */
+    for (auto impl : {bech32::MapImpl::SSSE3, bech32::MapImpl::AVX2}) {
+        if (impl > bech32::map_best()) continue;
+        auto maps_alike = [impl](const std::string& chars) {
+            uint8_t expected[128], mapped[128];
+            bool lower = false, upper = false, impl_lower = false, impl_upper = false;
+            const bool ok = bech32::map_data(chars.data(), chars.size(), expected, &lower, &upper, bech32::MapImpl::SCALAR);
+            if (bech32::map_data(chars.data(), chars.size(), mapped, &impl_lower, &impl_upper, impl) != ok) return false;
+            return !ok || (lower == impl_lower && upper == impl_upper && std::equal(expected, expected + chars.size(), mapped));
+        };
+        for (int c = 0; c < 256; ++c) {
+            for (size_t at : {0, 1, 15, 16, 17, 31, 32, 33, 63, 64}) {
+                std::string chars(65, 'q');
+                chars[at] = c;
+                if (!maps_alike(chars))
+                    fail++;
+            }
+        }
+        static const char charset[] = "qpzry9x8gf2tvdw0s3jn54khce6mua7l";
+        for (size_t size = 1; size <= 100; ++size) {
+            std::string chars;
+            for (size_t i = 0; i < size; ++i) chars += charset[(i * 7) % 32];
+            std::string upper = chars;
+            for (char& c : upper) if (c >= 'a' && c <= 'z') c -= 'a' - 'A';
+            if (!maps_alike(chars) || !maps_alike(upper))
+                fail++;
+            for (size_t at = 0; at < size; ++at) {
+                std::string mixed = chars, invalid = chars, high = chars;
+                mixed[at] = upper[at];
+                invalid[at] = 'b';
+                high[at] = '\xff';
+                if (!maps_alike(mixed) || !maps_alike(invalid) || !maps_alike(high))
+                    fail++;
+            }
+        }
+    }
+    /* SHA-256 test vectors, the last spanning two blocks, with each implementation this CPU has. */
+    static const struct { const char* message; const char* hash; } sha256_vectors[] = {
+        {"", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"},
+        {"abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"},
+        {"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"},
+    };
+    for (const auto& vector : sha256_vectors) {
+        const unsigned char* message = reinterpret_cast<const unsigned char*>(vector.message);
+        for (auto impl : {sha256::Impl::SCALAR, sha256::Impl::AVX2, sha256::Impl::SHANI}) {
+            if (!sha256::supported(impl)) continue;
+            unsigned char hash[32];
+            char hex[65];
+            sha256::hash(message, strlen(vector.message), hash, impl);
+            for (int i = 0; i < 32; ++i) snprintf(hex + 2 * i, 3, "%02x", hash[i]);
+            if (strcmp(hex, vector.hash) != 0)
+                fail++;
+        }
+    }
+    /* Hashing many messages of different lengths at once gives the hashes of each, with each
+     * implementation this CPU has. */
+    std::vector<const unsigned char*> messages;
+    std::vector<size_t> sizes;
+    for (const auto& input : valid_invoice) {
+        for (size_t size : {input.bech32_data.size(), input.bech32_data.size() / 3, size_t{55}, size_t{64}}) {
+            messages.push_back(reinterpret_cast<const unsigned char*>(input.bech32_data.data()));
+            sizes.push_back(std::min(size, input.bech32_data.size()));
+        }
+    }
+    for (auto impl : {sha256::Impl::SCALAR, sha256::Impl::AVX2, sha256::Impl::SHANI}) {
+        if (!sha256::supported(impl)) continue;
+        std::vector<std::array<unsigned char, 32> > hashes(messages.size());
+        sha256::hash_many(messages.data(), sizes.data(), messages.size(), reinterpret_cast<unsigned char (*)[32]>(hashes.data()), impl);
+        for (size_t i = 0; i < messages.size(); ++i) {
+            unsigned char hash[32];
+            sha256::hasher().write(messages[i], sizes[i] / 2).write(messages[i] + sizes[i] / 2, sizes[i] - sizes[i] / 2).finalize(hash);
+            if (!std::equal(hash, hash + 32, hashes[i].begin()))
+                fail++;
+        }
+    }
+    /* The signing hash covers the hrp and the data part up to the signature, padded to bytes. */
+    for (const auto& input : valid_invoice) {
+        payment_request::bolt11 invoice;
+        const auto dec = bech32::decode(input.bech32_data);
+        std::vector<uint8_t> preimage(dec.hrp.begin(), dec.hrp.end());
+        bech32::convertbits(true, 5, 8, preimage, std::vector<uint8_t>(dec.data.begin(), dec.data.end() - 104));
+        unsigned char hash[32];
+        sha256::hash(preimage.data(), preimage.size(), hash);
+        if (payment_request::decode(input.bech32_data, invoice) != 0 || memcmp(hash, invoice.signing_hash, 32) != 0)
+            fail++;
+    }
+    /* All the vectors are signed by the same node, whose key is recovered and then verifies. */
+    static const unsigned char node_id[33] = {
+        0x03, 0xe7, 0x15, 0x6a, 0xe3, 0x3b, 0x0a, 0x20, 0x8d, 0x07, 0x44, 0x19, 0x91, 0x63, 0x17, 0x7e, 0x90,
+        0x9e, 0x80, 0x17, 0x6e, 0x55, 0xd9, 0x7a, 0x2f, 0x22, 0x1e, 0xde, 0x0f, 0x93, 0x4d, 0xd9, 0xad,
+    };
+    for (const auto& invoice : decoded) {
+        unsigned char other_hash[32];
+        std::copy(invoice.signing_hash, invoice.signing_hash + 32, other_hash);
+        other_hash[0] ^= 1;
+        if (!invoice.has_receiver_id || memcmp(invoice.receiver_id, node_id, 33) != 0 ||
+            !secp256k1::verify(invoice.signing_hash, invoice.sig, node_id) ||
+            secp256k1::verify(other_hash, invoice.sig, node_id))
+            fail++;
+    }
+    /* Checking signatures in a batch gives the same results as one at a time. */
+    std::vector<secp256k1::signature_check> checks;
+    for (const auto& invoice : decoded) {
+        for (int recovery_id = 0; recovery_id < 4; ++recovery_id) {
+            secp256k1::signature_check check;
+            check.hash = invoice.signing_hash;
+            check.sig = invoice.sig;
+            check.recovery_id = recovery_id;
+            check.recover = recovery_id % 2;
+            std::copy(node_id, node_id + 33, check.pubkey);
+            checks.push_back(check);
+        }
+    }
+    secp256k1::check_batch(checks.data(), checks.size());
+    for (const auto& check : checks) {
+        unsigned char pubkey[33];
+        bool valid = check.recover ? secp256k1::recover(check.hash, check.sig, check.recovery_id, pubkey)
+                                   : secp256k1::verify(check.hash, check.sig, check.pubkey);
+        if (valid != check.valid || (check.recover && valid && memcmp(pubkey, check.pubkey, 33) != 0))
+            fail++;
+    }
+    /* Signatures by other keys, made and checked with a separate big integer implementation of
+     * secp256k1. The last hash is above n. */
+    static const struct { const char* hash; const char* sig; int recovery_id; const char* pubkey; } ecdsa_vectors[] = {
+        {"b58d3a8f292c29af94c1f30f46b2692f7b7915f8d532890d8dac339dc9daf90c", "14122f8862c52aaba1814c70d860782c13d069aad0a40576d3f939bc7bd80d06b7eabddd11ddd5464592928b898da6e8f68c9b3e5a18ed66eead5badc90d1680", 0, "024f67524966501918649749ecd3dac18a720c0a0b238f2c73cd71812de7f07096"},
+        {"5e1b438d244c72dead055c5c0fade9e5ec0d9db2240b18a159801e4203110d65", "81b43123e59a6901ba53bb36cf27d72c919483b6c0fccbba69f5eacd4dc94441b2b15d07f944e80751c36746d41dddbe972d9b22c9455f5dcc997f057ddc087f", 0, "03e78f423679c1d9f73a148e680a8a5e5e4d9a8e53c173a2d2c546039610a93c9c"},
+        {"dc2c6d16cda768d891b368448eb7a0a01a381b4f08b57b648779dd9af82422ca", "dfddb5daca76c5da2604a8e7452232509bd33ef4ea67da435e72ca0443d9c73e9532e87dde2be86659f78e5220211e8e79638a238314fed7f514fcee07063c82", 1, "022c9259eb1667a9ca5baf1fb14e8513bb868b856a01c27bdf1aa8bb1f5b532b64"},
+        {"dd7247a2fb4ef3f73882b485b1c72ba22fb72c221dfb3412e13c3bc7aba9a1b3", "ac0f8c92a04cd0072b16b83c317d9cca366e55d193c836acdada2f453de14a14d78ff85d4dd7c675cfd862c9b83114ab80b483dc7ebd1f8f896d2dcf368fe6b2", 1, "0243fc19ea6a52e49f6c5950d49150d3a5eec03cff9e80b307c0ca8343cbd02b5f"},
+        {"f8d153b138d0dcf53cc365f65ccb6a04cf2789b0a6db7fa4e643f8118c1dc51d", "cfa07a15e6a49896f73764eb108a8f9c514833c4aa73998967fb000e002d57344cbbc89b624b473a115d7d83612f2e6a0ad69be8866623aad595b68edeff36c6", 1, "02f772702f285b1fdde5d8a84daa94a613640b8d54b533959b12983520d458340c"},
+        {"ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff", "204375708c23ca456d688da7f3dba2cc6534c3660b52d22728e670ef9420214393c4a3c49656a9cf4bc43f350f9a06b7f87ff14d43169f28c8e187a4a3125527", 0, "03e90cfe6475b38a7a5eda012adb765166e62cea93b5f7c534a6c7f36b9c7ec630"},
+    };
+    for (const auto& vector : ecdsa_vectors) {
+        unsigned char hash[32], sig[64], pubkey[33], recovered[33], other_key[33];
+        unhex(vector.hash, hash);
+        unhex(vector.sig, sig);
+        unhex(vector.pubkey, pubkey);
+        unhex(ecdsa_vectors[0].pubkey, other_key);
+        other_key[0] ^= 1;
+        if (!secp256k1::recover(hash, sig, vector.recovery_id, recovered) || memcmp(recovered, pubkey, 33) != 0 ||
+            !secp256k1::verify(hash, sig, pubkey) || secp256k1::verify(hash, sig, other_key))
+            fail++;
+        /* The other parity gives another key. r + n is not a field element, so ids 2 and 3 give none. */
+        if (!secp256k1::recover(hash, sig, vector.recovery_id ^ 1, recovered) || memcmp(recovered, pubkey, 33) == 0 ||
+            secp256k1::recover(hash, sig, vector.recovery_id | 2, recovered))
+            fail++;
+        /* n - s signs with -k: the same key comes back with the other parity. */
+        unsigned char negated[64];
+        unhex("fffffffffffffffffffffffffffffffebaaedce6af48a03bbfd25e8cd0364141", negated + 32);
+        std::copy(sig, sig + 32, negated);
+        for (int i = 63, borrow = 0; i >= 32; --i) {
+            const int difference = negated[i] - sig[i] - borrow;
+            negated[i] = static_cast<unsigned char>(difference);
+            borrow = difference < 0;
+        }
+        if (!secp256k1::recover(hash, negated, vector.recovery_id ^ 1, recovered) || memcmp(recovered, pubkey, 33) != 0)
+            fail++;
+    }
+    /* r = 2 is the x coordinate of a point less n, so all four recovery ids give a key, and the
+     * signature verifies against the one from id 3. */
+    {
+        static const char* const keys[4] = {
+            "02643890e9f79ab437d86415ce27dd27cc49c7215e8251007fc95a9b26c32b919c",
+            "029cc4fcc8b69e65f2dec96c3ddb015f1210f71d5e9037febe0e2a4599abf82eb2",
+            "03f6f74913203d963e91bf01902763785ae5f4d5e2dd3695195a1cf474277e62df",
+            "020ca65f040b172f01f5e617679298a1bbc7937ea71d3c939e84e9f6229b5cc296",
+        };
+        unsigned char hash[32], sig[64], pubkey[33];
+        unhex("146a464660ceafd35d17ae43fd1108282d08759a5133273b748c3f332f5e1707", hash);
+        unhex("0000000000000000000000000000000000000000000000000000000000000002ad81dff774d287b6f284e566e30854148dabb447adf5d0edbd1b60b7951c8575", sig);
+        for (int recovery_id = 0; recovery_id < 4; ++recovery_id) {
+            if (!secp256k1::recover(hash, sig, recovery_id, pubkey) || hex(pubkey, 33) != keys[recovery_id])
+                fail++;
+        }
+        unhex(keys[3], pubkey);
+        if (!secp256k1::verify(hash, sig, pubkey) || secp256k1::recover(hash, sig, 4, pubkey) || secp256k1::recover(hash, sig, -1, pubkey))
+            fail++;
+    }
+    /* r or s of zero, n or above, and public keys with a bad prefix, an x with no point or an x of
+     * p or above (p + 1 would be a point modulo p) are all rejected, alone and in a batch. */
+    {
+        static const char* const n = "fffffffffffffffffffffffffffffffebaaedce6af48a03bbfd25e8cd0364141";
+        static const char* const above_n = "fffffffffffffffffffffffffffffffebaaedce6af48a03bbfd25e8cd0364142";
+        static const char* const zero = "0000000000000000000000000000000000000000000000000000000000000000";
+        static const char* const all_ones = "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff";
+        unsigned char hash[32], good[64], pubkey[33];
+        unhex(ecdsa_vectors[0].hash, hash);
+        unhex(ecdsa_vectors[0].sig, good);
+        unhex(ecdsa_vectors[0].pubkey, pubkey);
+        std::vector<std::array<unsigned char, 64>> bad_sigs;
+        for (const char* value : {zero, n, above_n, all_ones}) {
+            for (int half = 0; half < 2; ++half) {
+                std::array<unsigned char, 64> sig;
+                std::copy(good, good + 64, sig.begin());
+                unhex(value, sig.data() + 32 * half);
+                bad_sigs.push_back(sig);
+            }
+        }
+        std::vector<std::array<unsigned char, 33>> bad_keys(5);
+        for (auto& key : bad_keys) std::copy(pubkey, pubkey + 33, key.begin());
+        bad_keys[0][0] = 0x04;
+        bad_keys[1][0] = 0x00;
+        unhex("020000000000000000000000000000000000000000000000000000000000000005", bad_keys[2].data());
+        unhex("02fffffffffffffffffffffffffffffffffffffffffffffffffffffffefffffc30", bad_keys[3].data());
+        unhex("03ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff", bad_keys[4].data());
+        std::vector<secp256k1::signature_check> edge_checks;
+        for (const auto& sig : bad_sigs) {
+            for (int recovery_id = 0; recovery_id < 4; ++recovery_id) {
+                if (secp256k1::recover(hash, sig.data(), recovery_id, pubkey))
+                    fail++;
+                edge_checks.push_back(secp256k1::signature_check{hash, sig.data(), recovery_id, true, {}, true});
+            }
+            edge_checks.push_back(secp256k1::signature_check{hash, sig.data(), 0, false, {}, true});
+            unhex(ecdsa_vectors[0].pubkey, edge_checks.back().pubkey);
+            if (secp256k1::verify(hash, sig.data(), edge_checks.back().pubkey))
+                fail++;
+        }
+        for (const auto& key : bad_keys) {
+            if (secp256k1::verify(hash, good, key.data()))
+                fail++;
+            edge_checks.push_back(secp256k1::signature_check{hash, good, 0, false, {}, true});
+            std::copy(key.begin(), key.end(), edge_checks.back().pubkey);
+        }
+        secp256k1::check_batch(edge_checks.data(), edge_checks.size());
+        for (const auto& check : edge_checks) {
+            if (check.valid)
+                fail++;
+        }
+    }
+    /* A cached signature is not checked again, and gives the same node id. The second round only
+     * hits; the first already does for the upper case copy of an invoice. */
+    payment_request::recovery_cache cache(1024);
+    uint64_t first_round_hits = 0;
+    for (int round = 0; round < 2; ++round) {
+        if (round == 1) first_round_hits = cache.hits();
+        for (const auto& input : valid_invoice) {
+            payment_request::bolt11 invoice;
+            if (payment_request::decode(input.bech32_data, invoice, cache) != 0 || memcmp(invoice.receiver_id, node_id, 33) != 0)
+                fail++;
+        }
+        for (const auto& input : invalid_invoice) {
+            payment_request::bolt11 invoice;
+            if (payment_request::decode(input.bech32_data, invoice, cache) == 0)
+                fail++;
+        }
+    }
+    if (cache.hits() - first_round_hits != sizeof(valid_invoice) / sizeof(valid_invoice[0]))
+        fail++;
+    /* The decode cache hands out the invoice decoded the first time, until it expires. */
+    const uint64_t now = 1496314658 + 10;   // shortly after the timestamp of most vectors
+    payment_request::decode_cache decoded_cache(1024);
+    auto first = decoded_cache.decode(valid_invoice[0].bech32_data, now);
+    auto second = decoded_cache.decode(valid_invoice[0].bech32_data, now);
+    auto expired = decoded_cache.decode(valid_invoice[0].bech32_data, now + 3600);
+    if (!first || first != second || !expired || expired == first || decoded_cache.hits() != 1 || decoded_cache.misses() != 2 ||
+        memcmp(first->payment_hash, decoded[0].payment_hash, 32) != 0 ||
+        decoded_cache.decode(invalid_invoice[0].bech32_data, now) != NULL)
+        fail++;
+    /* It never holds more than its capacity. */
+    payment_request::decode_cache small_cache(16);
+    for (const auto& input : valid_invoice) small_cache.decode(input.bech32_data, now);
+    for (const auto& input : valid_invoice) {
+        auto cached = small_cache.decode(input.bech32_data, now);
+        payment_request::bolt11 invoice;
+        if ((payment_request::decode(input.bech32_data, invoice) == 0) != (cached != NULL) ||
+            (cached && memcmp(cached->signing_hash, invoice.signing_hash, 32) != 0))
+            fail++;
+    }
+    if (small_cache.size() > 16)
+        fail++;
+    /* Cached invoices keep their route hints, fallback addresses and tagged fields, after the cache
+     * is gone too, so they encode back to the string they came from. */
+    std::vector<std::shared_ptr<const payment_request::bolt11> > kept;
+    {
+        payment_request::decode_cache hinted_cache(1024);
+        for (const auto& input : valid_invoice) kept.push_back(hinted_cache.decode(input.bech32_data, now));
+    }
+    for (size_t i = 0; i < kept.size(); ++i) {
+        char cached_encoded[2048], expected_encoded[2048];
+        const size_t cached_size = kept[i] ? payment_request::encode(*kept[i], cached_encoded, sizeof(cached_encoded)) : 0;
+        const size_t expected_size = payment_request::encode(decoded[i], expected_encoded, sizeof(expected_encoded));
+        if (!kept[i] || !same_hints(*kept[i], decoded[i]) || kept[i]->tagged_field_count != decoded[i].tagged_field_count ||
+            cached_size == 0 || std::string_view(cached_encoded, cached_size) != std::string_view(expected_encoded, expected_size))
+            fail++;
+    }
+    /* The store keeps one invoice per payment hash; most test vectors share theirs. */
+    payment_request::invoice_store store;
+    std::unique_ptr<bool[]> inserted(new bool[decoded.size()]);
+    size_t stored = store.insert_batch(decoded.data(), decoded.size(), inserted.get());
+    for (size_t i = 0; i < decoded.size(); ++i) {
+        const payment_request::compact_bolt11* found = store.find(decoded[i].payment_hash);
+        payment_request::bolt11 expanded;
+        if (found) store.expand(*found, expanded);
+        if (!found || memcmp(found->payment_hash, decoded[i].payment_hash, 32) != 0 ||
+            inserted[i] != (i == 0 || memcmp(decoded[i].payment_hash, decoded[0].payment_hash, 32) != 0) ||
+            (inserted[i] && !same_hints(expanded, decoded[i])))
+            fail++;
+    }
+    if (stored != store.size() || stored >= decoded.size() || store.insert(decoded[0]))
+        fail++;
+    /* Many more invoices, with payment hashes and secrets of their own, so the indexes grow. */
+    std::vector<payment_request::bolt11> many(10000, decoded[0]);
+    for (size_t i = 0; i < many.size(); ++i) {
+        memcpy(many[i].payment_hash, &i, sizeof(i));
+        many[i].payment_hash[31] = 0xa5;
+        memcpy(many[i].payment_secret, &i, sizeof(i));
+        many[i].payment_secret[31] = 0x5a;
+        many[i].sat_amount = i;
+        many[i].features = i * 0x9e3779b97f4a7c15ULL;
+    }
+    for (size_t i = 0; i < many.size(); i += 1000)
+        if (store.insert_batch(&many[i], 1000) != 1000)
+            fail++;
+    for (size_t i = 0; i < many.size(); ++i) {
+        const payment_request::compact_bolt11* found = store.find(many[i].payment_hash);
+        payment_request::bolt11 expanded;
+        if (found) store.expand(*found, expanded);
+        if (!found || found != store.find_by_secret(many[i].payment_secret) || expanded.sat_amount != i ||
+            expanded.features != many[i].features || memcmp(expanded.payment_secret, many[i].payment_secret, 32) != 0)
+            fail++;
+    }
+    unsigned char unknown[32] = {0xa5};
+    if (store.size() != stored + many.size() || store.find(unknown) || store.find_by_secret(unknown))
+        fail++;
+    /* Payment hashes and secrets are indexed by SipHash-2-4 under a key of the store's, so ones that
+     * share their first bytes, as an invoice writer may pick them, do not pile up in one run of slots. */
+    static const uint64_t sip_seed[2] = {0x0706050403020100ULL, 0x0f0e0d0c0b0a0908ULL};
+    unsigned char sip_message[32];
+    for (int i = 0; i < 32; ++i) sip_message[i] = i;
+    if (payment_request::keyed_bits(sip_message, sip_seed) != 0x7127512f72f27cceULL)
+        fail++;
+    payment_request::invoice_store colliding_store;
+    std::vector<payment_request::bolt11> colliding(many.begin(), many.begin() + 2000);
+    for (size_t i = 0; i < colliding.size(); ++i) {
+        memset(colliding[i].payment_secret, 0x5a, 8);
+        memcpy(colliding[i].payment_secret + 8, &i, sizeof(i));
+        memset(colliding[i].payment_hash, 0xa5, 8);
+        memcpy(colliding[i].payment_hash + 8, &i, sizeof(i));
+    }
+    if (colliding_store.insert_batch(colliding.data(), colliding.size()) != colliding.size())
+        fail++;
+    for (const auto& invoice : colliding) {
+        const payment_request::compact_bolt11* found = colliding_store.find_by_secret(invoice.payment_secret);
+        if (!found || memcmp(found->payment_hash, invoice.payment_hash, 32) != 0 || colliding_store.find(invoice.payment_hash) != found)
+            fail++;
+    }
+    /* An invoice file reads back every field, straight from the mapping. */
+    const char* path = "tests_invoices.bin";
+    payment_request::invoice_file file;
+    if (payment_request::write_invoice_file(path, many.data(), many.size()) != 0 || file.open(path) != 0 ||
+        file.size() != many.size())
+        fail++;
+    for (size_t i = 0; i < many.size(); ++i) {
+        const payment_request::invoice_record* found = file.find(many[i].payment_hash);
+        payment_request::bolt11 expanded;
+        if (found) file.expand(*found, expanded);
+        if (!found || found != &file.record(i) || expanded.prefix != many[i].prefix || expanded.sat_amount != i ||
+            expanded.timestamp != many[i].timestamp || expanded.expiry != many[i].expiry ||
+            expanded.has_receiver_id != many[i].has_receiver_id ||
+            memcmp(expanded.receiver_id, many[i].receiver_id, 33) != 0 ||
+            expanded.description_len != many[i].description_len ||
+            memcmp(expanded.description, many[i].description, many[i].description_len) != 0 ||
+            memcmp(expanded.sig, many[i].sig, 64) != 0 || memcmp(expanded.payment_secret, many[i].payment_secret, 32) != 0 ||
+            expanded.features != many[i].features || found->features != many[i].features)
+            fail++;
+    }
+    if (file.find(unknown))
+        fail++;
+    /* So do the test vectors, with the first of the invoices that share a payment hash found, and
+     * their route hints and fallbacks, given an arena to put them in. */
+    if (payment_request::write_invoice_file(path, decoded.data(), decoded.size()) != 0 || file.open(path) != 0 ||
+        file.size() != decoded.size() || file.find(decoded[0].payment_hash) != &file.record(0))
+        fail++;
+    payment_request::hint_arena file_hints;
+    for (size_t i = 0; i < file.size(); ++i) {
+        payment_request::bolt11 expanded, unhinted;
+        file.expand(file.record(i), expanded, &file_hints);
+        file.expand(file.record(i), unhinted);
+        if (!same_hints(expanded, decoded[i]) || unhinted.route_count != 0 || unhinted.fallback_count != 0 ||
+            expanded.prefix != decoded[i].prefix || expanded.has_description_hash != decoded[i].has_description_hash ||
+            (decoded[i].has_description_hash && memcmp(expanded.description_hash, decoded[i].description_hash, 32) != 0) ||
+            memcmp(expanded.signing_hash, decoded[i].signing_hash, 32) != 0 || expanded.features != decoded[i].features)
+            fail++;
+    }
+    /* A truncated file is refused. */
+    file.close();
+    if (truncate(path, 80 + 255) != 0 || file.open(path) == 0 || file.find(decoded[0].payment_hash))
+        fail++;
+    /* Payment hashes that share their first 8 bytes are all found too. */
+    if (payment_request::write_invoice_file(path, colliding.data(), colliding.size()) != 0 || file.open(path) != 0)
+        fail++;
+    for (size_t i = 0; i < colliding.size(); ++i) {
+        if (file.find(colliding[i].payment_hash) != &file.record(i))
+            fail++;
+    }
+    file.close();
+    remove(path);
+    /* What each invalid invoice is rejected for. */
+    using payment_request::reject_reason;
+    const reject_reason reasons[] = {reject_reason::FIELD, reject_reason::CHECKSUM, reject_reason::CHARSET,
+        reject_reason::CHARSET, reject_reason::SIGNATURE, reject_reason::TOO_SHORT, reject_reason::AMOUNT,
+        reject_reason::AMOUNT};
+    static_assert(sizeof(reasons) / sizeof(reasons[0]) == sizeof(invalid_invoice) / sizeof(invalid_invoice[0]),
+        "a reason for each invalid invoice");
+#ifndef NO_DECODE_STATS
+    /* Each invalid invoice is rejected for that, and counted, on whichever thread decoded it. */
+    const payment_request::decode_stats before = payment_request::collect_decode_stats();
+    std::thread([&]() {
+        for (size_t i = 0; i < sizeof(reasons) / sizeof(reasons[0]); ++i) {
+            payment_request::bolt11 invoice;
+            if (payment_request::decode(invalid_invoice[i].bech32_data, invoice) == 0 ||
+                payment_request::last_reject_reason() != reasons[i])
+                fail++;
+        }
+    }).join();
+    payment_request::bolt11 valid_decoded;
+    if (payment_request::decode(valid_invoice[0].bech32_data, valid_decoded) != 0 ||
+        payment_request::last_reject_reason() != reject_reason::NONE)
+        fail++;
+    const payment_request::decode_stats after = payment_request::collect_decode_stats();
+    uint64_t bech32_samples = 0;
+    for (size_t b = 0; b < after.BUCKETS; ++b)
+        bech32_samples += after.latency[static_cast<size_t>(payment_request::decode_stage::BECH32)][b] -
+            before.latency[static_cast<size_t>(payment_request::decode_stage::BECH32)][b];
+    if (after.decodes - before.decodes != 9 || bech32_samples != 9 ||
+        after.rejected[static_cast<size_t>(reject_reason::AMOUNT)] - before.rejected[static_cast<size_t>(reject_reason::AMOUNT)] != 2 ||
+        after.rejected[static_cast<size_t>(reject_reason::SIGNATURE)] - before.rejected[static_cast<size_t>(reject_reason::SIGNATURE)] != 1 ||
+        after.rejected[static_cast<size_t>(reject_reason::NONE)] != before.rejected[static_cast<size_t>(reject_reason::NONE)])
+        fail++;
+#endif
+    /* bolt11_decode, on three threads, writes a result for each invoice line in the order of the
+     * input, whichever format it writes, and sums up why the invalid ones were rejected. Blank
+     * lines are skipped but counted, and a CR before the newline is not part of the invoice. */
+    {
+#ifdef NO_DECODE_STATS
+        const bool reasons_known = false;   // then every invoice is rejected for "none"
+#else
+        const bool reasons_known = true;
+#endif
+        const char* input_path = "tests_decode_input.txt";
+        const char* output_path = "tests_decode_output";
+        const char* summary_path = "tests_decode_summary";
+        struct tool_line { uint64_t line; std::string payment_hash; const char* reason; };
+        std::vector<tool_line> tool_lines;
+        std::string input = "\n";
+        uint64_t line = 1;
+        size_t tool_rejected[static_cast<size_t>(reject_reason::COUNT)] = {};
+        const size_t valid_count = sizeof(valid_invoice) / sizeof(valid_invoice[0]);
+        for (size_t i = 0; i < valid_count + sizeof(reasons) / sizeof(reasons[0]); ++i) {
+            const bool valid = i < valid_count;
+            const std::string& invoice = valid ? valid_invoice[i].bech32_data : invalid_invoice[i - valid_count].bech32_data;
+            input += invoice + (i % 2 ? "\r\n" : "\n");
+            if (i % 3 == 0) input += i % 2 ? "\r\n" : "\n";
+            payment_request::bolt11 invoice_decoded;
+            if (valid && payment_request::decode(invoice, invoice_decoded) != 0)
+                fail++;
+            const reject_reason reason = valid || !reasons_known ? reject_reason::NONE : reasons[i - valid_count];
+            tool_lines.push_back({++line, valid ? hex(invoice_decoded.payment_hash, 32) : "", valid ? NULL : payment_request::name(reason)});
+            if (!valid) tool_rejected[static_cast<size_t>(reason)]++;
+            if (i % 3 == 0) line++;
+        }
+        FILE* input_file = fopen(input_path, "wb");
+        if (!input_file || fwrite(input.data(), 1, input.size(), input_file) != input.size() || fclose(input_file) != 0)
+            fail++;
+        for (const char* format : {"json", "csv", "binary"}) {
+            const std::string command = std::string("./bolt11_decode -t 3 -f ") + format + " -o " + output_path + " " +
+                input_path + " 2> " + summary_path;
+            if (system(command.c_str()) != 0) {
+                fail++;
+                continue;
+            }
+            const std::string output = read_file(output_path);
+            if (strcmp(format, "binary") == 0) {
+                /* A 16 byte header, then a 128 byte record per invoice. */
+                uint32_t version, record_size;
+                memcpy(&version, output.data() + 8, 4);
+                memcpy(&record_size, output.data() + 12, 4);
+                if (output.size() != 16 + 128 * tool_lines.size() || memcmp(output.data(), "BOLT11D", 8) != 0 ||
+                    version != 1 || record_size != 128)
+                    fail++;
+                for (size_t i = 0; i < tool_lines.size() && 16 + 128 * (i + 1) <= output.size(); ++i) {
+                    const unsigned char* record = reinterpret_cast<const unsigned char*>(output.data()) + 16 + 128 * i;
+                    uint64_t record_line;
+                    memcpy(&record_line, record, 8);
+                    const bool valid = tool_lines[i].reason == NULL;
+                    if (record_line != tool_lines[i].line || static_cast<int8_t>(record[44]) != (valid ? 0 : -1) ||
+                        (valid && hex(record + 48, 32) != tool_lines[i].payment_hash) ||
+                        (!valid && strcmp(payment_request::name(static_cast<reject_reason>(record[45])), tool_lines[i].reason) != 0))
+                        fail++;
+                }
+            } else {
+                const bool csv = strcmp(format, "csv") == 0;
+                std::vector<std::string> rows;
+                for (size_t pos = 0, end; (end = output.find('\n', pos)) != std::string::npos; pos = end + 1)
+                    rows.push_back(output.substr(pos, end - pos));
+                if (rows.size() != tool_lines.size() + csv || (csv && rows[0].compare(0, 12, "line,status,") != 0))
+                    fail++;
+                for (size_t i = 0; i < tool_lines.size() && i + csv < rows.size(); ++i) {
+                    const std::string& row = rows[i + csv];
+                    const std::string number = std::to_string(tool_lines[i].line);
+                    const bool valid = tool_lines[i].reason == NULL;
+                    const std::string expected = csv ? (valid ? number + ",ok," : number + ",rejected," + tool_lines[i].reason + ",")
+                                                     : (valid ? "{\"line\":" + number + ",\"status\":\"ok\"" :
+                                                               "{\"line\":" + number + ",\"status\":\"rejected\",\"reason\":\"" + tool_lines[i].reason + "\"}");
+                    if (row.compare(0, expected.size(), expected) != 0 ||
+                        (valid && row.find(tool_lines[i].payment_hash) == std::string::npos))
+                        fail++;
+                }
+            }
+            /* The summary has the totals, then a count per reason that rejected any. */
+            const std::string summary = read_file(summary_path);
+            unsigned long long lines, invoices, decoded_count, rejected;
+            if (sscanf(summary.c_str(), "%llu lines, %llu invoices, %llu decoded, %llu rejected in", &lines, &invoices,
+                    &decoded_count, &rejected) != 4 || lines != line || invoices != tool_lines.size() ||
+                rejected != sizeof(reasons) / sizeof(reasons[0]) || decoded_count != invoices - rejected)
+                fail++;
+            std::string expected_summary;
+            for (size_t r = 0; r < static_cast<size_t>(reject_reason::COUNT); ++r) {
+                if (!tool_rejected[r]) continue;
+                char reason_line[64];
+                snprintf(reason_line, sizeof(reason_line), "  %-14s %zu\n", payment_request::name(static_cast<reject_reason>(r)),
+                         tool_rejected[r]);
+                expected_summary += reason_line;
+            }
+            if (summary.find('\n') == std::string::npos || summary.substr(summary.find('\n') + 1) != expected_summary)
+                fail++;
+        }
+        /* A thread count that is not a number from 1 to 1024 gets the usage message. */
+        for (const char* threads : {"0", "-1", "x", "4x", "", "1025", "99999999999"}) {
+            const std::string command = std::string("./bolt11_decode -t '") + threads + "' -o " + output_path + " " +
+                input_path + " 2> " + summary_path;
+            const int status = system(command.c_str());
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 2 || read_file(summary_path).compare(0, 7, "usage: ") != 0)
+                fail++;
+        }
+        remove(input_path);
+        remove(output_path);
+        remove(summary_path);
+    }
+    /* The hrp is parsed at compile time as well as at run time, with exact amounts. */
+    static_assert([]() {
+        payment_request::hrp_fields f{0, 0, 0};
+        return payment_request::parse_hrp("lnbcrt2500u", f) == payment_request::reject_reason::NONE &&
+            f.prefix_size == 6 && f.network == 3 && f.sat_amount == 250000000;
+    }(), "parse_hrp is constexpr");
+    const struct {
+        const char* hrp;
+        payment_request::reject_reason reason;
+        size_t network;
+        uint64_t sat_amount;
+    } hrps[] = {
+        {"lnbc", payment_request::reject_reason::NONE, 0, 0},
+        {"lntb20m", payment_request::reject_reason::NONE, 1, 2000000000},
+        {"lntbs1n", payment_request::reject_reason::NONE, 2, 100},
+        {"lnbc9678785340p", payment_request::reject_reason::NONE, 0, 967878534},
+        {"lnbc18446744073709551610p", payment_request::reject_reason::NONE, 0, 1844674407370955161},
+        {"lnbc100000000", payment_request::reject_reason::NONE, 0, 10000000000000000000ULL},
+        {"lnbc200000000", payment_request::reject_reason::AMOUNT, 0, 0},                 // over 2^64 msat
+        {"lnbc18446744073709551620p", payment_request::reject_reason::AMOUNT, 0, 0},     // does not fit in 64 bits
+        {"lnbc1844674407370956m", payment_request::reject_reason::AMOUNT, 0, 0},
+        {"lnbc2500000001p", payment_request::reject_reason::AMOUNT, 0, 0},
+        {"lnbc2500x", payment_request::reject_reason::AMOUNT, 0, 0},
+        {"lnbc25mm", payment_request::reject_reason::AMOUNT, 0, 0},
+        {"lnbc25m1", payment_request::reject_reason::AMOUNT, 0, 0},
+        {"lnxy1m", payment_request::reject_reason::PREFIX, 0, 0},
+        {"lnbcr", payment_request::reject_reason::PREFIX, 0, 0},
+        {"lnbcrtxyz1m", payment_request::reject_reason::PREFIX, 0, 0},
+        {"2500u", payment_request::reject_reason::PREFIX, 0, 0},
+    };
+    for (const auto& h : hrps) {
+        payment_request::hrp_fields f{0, 0, 0};
+        const payment_request::reject_reason reason = payment_request::parse_hrp(h.hrp, f);
+        if (reason != h.reason || (reason == payment_request::reject_reason::NONE &&
+            (f.network != h.network || f.sat_amount != h.sat_amount ||
+             payment_request::NETWORK_PREFIXES[f.network].size() != f.prefix_size)))
+            fail++;
+    }
+    /* Route hints and fallback addresses, as the test vectors describe them. */
+    payment_request::hint_arena hints;
+    payment_request::bolt11 hinted;
+    if (payment_request::decode(valid_invoice[5].bech32_data, hinted, hints) != 0 || hinted.route_count != 1 ||
+        hinted.routes[0].size != 2 || hinted.fallback_count != 1)
+        fail++;
+    else {
+        const payment_request::route_hop* hop = hinted.routes[0].hops;
+        if (hex(hop[0].pubkey, 33) != "029e03a901b85534ff1e92c43c74431f7ce72046060fcf7a95c37e148f78c77255" ||
+            hop[0].short_channel_id != 0x0102030405060708 || hop[0].fee_base_msat != 1 ||
+            hop[0].fee_proportional_millionths != 20 || hop[0].cltv_expiry_delta != 3 ||
+            hex(hop[1].pubkey, 33) != "039e03a901b85534ff1e92c43c74431f7ce72046060fcf7a95c37e148f78c77255" ||
+            hop[1].short_channel_id != 0x030405060708090a || hop[1].fee_base_msat != 2 ||
+            hop[1].fee_proportional_millionths != 30 || hop[1].cltv_expiry_delta != 4 || hop + 1 != &hinted.routes[0].hops[1])
+            fail++;
+    }
+    const struct {
+        size_t index;
+        uint8_t version;
+        const char* program;
+    } fallbacks[] = {
+        {4, 17, "3172b5654f6683c8fb146959d347ce303cae4ca7"},
+        {5, 17, "04b61f7dc1ea0dc99424464cc4064dc564d91e89"},
+        {6, 18, "8f55563b9a19f321c211e9b9f38cdf686ea07845"},
+        {7, 0, "751e76e8199196d454941c45d1b3a323f1433bd6"},
+        {8, 0, "1863143c14c5166804bd19203356da136c985678cd4d27a1b8c6329604903262"},
+    };
+    for (const auto& expected : fallbacks) {
+        payment_request::bolt11 invoice;
+        if (payment_request::decode(valid_invoice[expected.index].bech32_data, invoice, hints) != 0 ||
+            invoice.fallback_count != 1 || invoice.fallbacks[0].version != expected.version ||
+            hex(invoice.fallbacks[0].program, invoice.fallbacks[0].size) != expected.program)
+            fail++;
+    }
+    /* Without an arena there are none; the encoder writes them back. */
+    payment_request::bolt11 plain;
+    char hinted_encoded[2048];
+    payment_request::bolt11 reencoded;
+    payment_request::signing_data reencoded_signed;
+    size_t hinted_size = payment_request::encode(hinted, hinted_encoded, sizeof(hinted_encoded));
+    if (payment_request::decode(valid_invoice[5].bech32_data, plain) != 0 || plain.route_count || plain.fallback_count ||
+        hinted_size == 0 ||
+        payment_request::decode(std::string_view(hinted_encoded, hinted_size), reencoded, reencoded_signed, &hints) != 0 ||
+        reencoded.route_count != 1 || reencoded.routes[0].size != 2 || reencoded.fallback_count != 1 ||
+        !std::equal(reencoded.routes[0].hops, reencoded.routes[0].hops + 2, hinted.routes[0].hops,
+            [](const payment_request::route_hop& a, const payment_request::route_hop& b) {
+                return memcmp(a.pubkey, b.pubkey, 33) == 0 && a.short_channel_id == b.short_channel_id &&
+                    a.fee_base_msat == b.fee_base_msat && a.fee_proportional_millionths == b.fee_proportional_millionths &&
+                    a.cltv_expiry_delta == b.cltv_expiry_delta;
+            }) ||
+        hex(reencoded.fallbacks[0].program, 20) != hex(hinted.fallbacks[0].program, 20))
+        fail++;
+    /* No field holds a route of 13 hops. */
+    std::vector<payment_request::route_hop> long_route(13, hinted.routes[0].hops[0]);
+    const payment_request::route_hint long_hint = {long_route.data(), long_route.size()};
+    const payment_request::route_hint* short_hint = hinted.routes;
+    hinted.routes = &long_hint;
+    if (payment_request::encode(hinted, hinted_encoded, sizeof(hinted_encoded)) != 0)
+        fail++;
+    /* The last timestamp 35 bits hold comes back; later ones are refused rather than cut short. */
+    hinted.routes = short_hint;
+    hinted.timestamp = (uint64_t{1} << 35) - 1;
+    hinted_size = payment_request::encode(hinted, hinted_encoded, sizeof(hinted_encoded));
+    if (hinted_size == 0 ||
+        payment_request::decode(std::string_view(hinted_encoded, hinted_size), reencoded, reencoded_signed, &hints) != 0 ||
+        reencoded.timestamp != hinted.timestamp)
+        fail++;
+    for (uint64_t timestamp : {uint64_t{1} << 35, UINT64_MAX}) {
+        hinted.timestamp = timestamp;
+        if (payment_request::encode(hinted, hinted_encoded, sizeof(hinted_encoded)) != 0)
+            fail++;
+    }
+    /* The field table is built at compile time; custom handlers see the fields the standard ones skip. */
+    constexpr payment_request::field_table with_metadata =
+        payment_request::STANDARD_FIELDS.with(payment_request::FIELD_METADATA, read_metadata);
+    static_assert(payment_request::STANDARD_FIELDS.entries[payment_request::FIELD_METADATA].handler == NULL);
+    static_assert(payment_request::STANDARD_FIELDS.entries[payment_request::FIELD_RECEIVER_ID].length == 53);
+    static_assert(with_metadata.entries[payment_request::FIELD_METADATA].handler == read_metadata);
+    std::string metadata;
+    payment_request::bolt11 custom;
+    if (payment_request::decode(valid_invoice[13].bech32_data, custom, with_metadata, &metadata) != 0 || metadata != "01fafaf0" ||
+        custom.description_len != valid_fields[4].description.size())
+        fail++;
+    /* A skipped field keeps its default; a required one skipped makes the invoice invalid. */
+    if (payment_request::decode(valid_invoice[13].bech32_data, custom,
+            payment_request::STANDARD_FIELDS.without(payment_request::FIELD_DESCRIPTION), NULL) != 0 || custom.description_len != 0 ||
+        payment_request::decode(valid_invoice[13].bech32_data, custom,
+            payment_request::STANDARD_FIELDS.without(payment_request::FIELD_PAYMENT_SECRET), NULL) == 0)
+        fail++;
+    /* Only the r and f fields the table hands to their handlers are stored. */
+    payment_request::bolt11 unrouted, unfallen;
+    if (payment_request::decode(valid_invoice[5].bech32_data, unrouted,
+            payment_request::STANDARD_FIELDS.without(payment_request::FIELD_ROUTE), NULL, &hints) != 0 ||
+        unrouted.route_count != 0 || unrouted.routes != NULL || unrouted.fallback_count != 1 ||
+        unrouted.fallbacks[0].version != 17 || unrouted.fallbacks[0].size != 20 ||
+        hex(unrouted.fallbacks[0].program, 20) != "04b61f7dc1ea0dc99424464cc4064dc564d91e89" ||
+        payment_request::decode(valid_invoice[5].bech32_data, unfallen,
+            payment_request::STANDARD_FIELDS.without(payment_request::FIELD_FALLBACK), NULL, &hints) != 0 ||
+        unfallen.fallback_count != 0 || unfallen.fallbacks != NULL || unfallen.route_count != 1 ||
+        unfallen.routes[0].size != 2 || unfallen.routes[0].hops[1].short_channel_id != 0x030405060708090a)
+        fail++;
+    /* Decoding in chunks of any size gives what decode() gives, and fails on the same invoices. */
+    for (size_t chunk : {1, 7, 64, 4096}) {
+        payment_request::bolt11 streamed;
+        payment_request::stream_decoder stream(streamed);
+        for (const auto& input : valid_invoice) {
+            payment_request::bolt11 expected;
+            stream.reset();
+            int status = 0;
+            for (size_t i = 0; i < input.bech32_data.size() && status == 0; i += chunk)
+                status = stream.push(std::string_view(input.bech32_data).substr(i, chunk));
+            if (status != 0 || stream.finish() != 0 || payment_request::decode(input.bech32_data, expected) != 0 ||
+                streamed.prefix != expected.prefix || streamed.timestamp != expected.timestamp ||
+                streamed.sat_amount != expected.sat_amount || streamed.expiry != expected.expiry ||
+                streamed.min_final_cltv_expiry != expected.min_final_cltv_expiry ||
+                hex(streamed.payment_hash, 32) != hex(expected.payment_hash, 32) ||
+                hex(streamed.receiver_id, 33) != hex(expected.receiver_id, 33) ||
+                hex(streamed.signing_hash, 32) != hex(expected.signing_hash, 32) ||
+                std::string_view(reinterpret_cast<const char*>(streamed.description), streamed.description_len) !=
+                    std::string_view(reinterpret_cast<const char*>(expected.description), expected.description_len))
+                fail++;
+        }
+        for (size_t i = 0; i < sizeof(invalid_invoice) / sizeof(invalid_invoice[0]); ++i) {
+            const std::string& input = invalid_invoice[i].bech32_data;
+            stream.reset();
+            int status = 0;
+            for (size_t j = 0; j < input.size() && status == 0; j += chunk)
+                status = stream.push(std::string_view(input).substr(j, chunk));
+            if (status == 0 && stream.finish() == 0)
+                fail++;
+#ifndef NO_DECODE_STATS
+            const payment_request::reject_reason streamed_reason = payment_request::last_reject_reason();
+            payment_request::bolt11 expected;
+            payment_request::decode(input, expected);
+            if (streamed_reason != payment_request::last_reject_reason())
+                fail++;
+#endif
+        }
+    }
+    /* A field reaches its handler as soon as the signature has been seen to follow it; a bad
+     * character is refused when it arrives. */
+    metadata.clear();
+    payment_request::stream_decoder metadata_stream(custom, with_metadata, &metadata);
+    const std::string& with_metadata_text = valid_invoice[13].bech32_data;
+    if (metadata_stream.push(with_metadata_text) != 0 || metadata != "01fafaf0" || metadata_stream.finish() != 0)
+        fail++;
+    metadata_stream.reset();
+    if (metadata_stream.push(with_metadata_text.substr(0, 100)) != 0 || metadata_stream.push("b") == 0 ||
+        metadata_stream.finish() == 0)
+        fail++;
+    /* The decoder keeps its own copy of the table, so it may be built from a temporary one. */
+    payment_request::stream_decoder undescribed_stream(custom, payment_request::STANDARD_FIELDS.without(payment_request::FIELD_DESCRIPTION));
+    if (undescribed_stream.push(with_metadata_text) != 0 || undescribed_stream.finish() != 0 || custom.description_len != 0)
+        fail++;
+    /* The 9 field sets feature bits 8 (var_onion_optin) and 14 (payment_secret); the prefix gives
+     * the network. */
+    payment_request::bolt11 featured;
+    if (payment_request::decode(valid_invoice[0].bech32_data, featured) != 0 || featured.network != 0 ||
+        featured.features != ((uint64_t{1} << 8) | (uint64_t{1} << 14)) ||
+        payment_request::decode(valid_invoice[4].bech32_data, featured) != 0 ||
+        payment_request::NETWORK_PREFIXES[featured.network] != "lntb")
+        fail++;
+    /* Every implementation of a filter selects the rows a check of each row selects; the rows cover
+     * both ends of each range, expiries that overflow and failed decodes. */
+    payment_request::decoded_batch rows;
+    rows.resize(1000);
+    std::mt19937_64 rng(1);
+    for (size_t i = 0; i < rows.size(); ++i) {
+        rows.status[i] = rng() % 8 == 0 ? -1 : 0;
+        rows.amount_msat[i] = rng() % 4 == 0 ? 0 : rng() % 3000000;
+        rows.timestamp[i] = 1600000000 + rng() % 100000;
+        rows.expiry[i] = rng() % 16 == 0 ? UINT64_MAX - rng() % 1000 : rng() % 100000;
+        rows.min_final_cltv_expiry[i] = rng() % 16 == 0 ? UINT32_MAX : rng() % 200;
+        rows.network[i] = rng() % payment_request::NETWORK_COUNT;
+        rows.features[i] = rng() & ((uint64_t{1} << 8) | (uint64_t{1} << 14) | (uint64_t{1} << 16) | (uint64_t{1} << 63));
+    }
+    payment_request::invoice_filter filters[4];
+    filters[1].min_amount = 1000;
+    filters[1].max_amount = 2000000;
+    filters[1].min_expires_at = 1600050000;
+    filters[2].max_expires_at = 1600100000;
+    filters[2].min_final_cltv_expiry = 40;
+    filters[2].max_final_cltv_expiry = UINT32_MAX - 1;
+    filters[2].networks = 1 | 4;
+    filters[3].required_features = (uint64_t{1} << 14) | (uint64_t{1} << 63);
+    filters[3].min_expires_at = UINT64_MAX;
+    for (const auto& filter : filters) {
+        std::vector<uint64_t> expected(payment_request::compiled_filter::selection_words(rows.size()));
+        size_t expected_count = 0;
+        for (size_t i = 0; i < rows.size(); ++i) {
+            const uint64_t sum = rows.timestamp[i] + rows.expiry[i];
+            const uint64_t expires_at = sum < rows.timestamp[i] ? UINT64_MAX : sum;
+            if (rows.status[i] == 0 && rows.amount_msat[i] >= filter.min_amount && rows.amount_msat[i] <= filter.max_amount &&
+                expires_at >= filter.min_expires_at && expires_at <= filter.max_expires_at &&
+                rows.min_final_cltv_expiry[i] >= filter.min_final_cltv_expiry &&
+                rows.min_final_cltv_expiry[i] <= filter.max_final_cltv_expiry && ((filter.networks >> rows.network[i]) & 1) &&
+                (rows.features[i] & filter.required_features) == filter.required_features) {
+                expected[i / 64] |= uint64_t{1} << (i % 64);
+                expected_count++;
+            }
+        }
+        for (int impl = 0; impl <= static_cast<int>(payment_request::filter_best()); ++impl) {
+            const payment_request::compiled_filter compiled(filter, static_cast<payment_request::filter_impl>(impl));
+            std::vector<uint64_t> selection(expected.size(), ~uint64_t{0});
+            if (compiled.select(rows, selection.data()) != expected_count || selection != expected)
+                fail++;
+        }
+    }
+    /* On decoded invoices: the valid test vectors on bitcoin mainnet that require payment_secret. */
+    payment_request::invoice_filter mainnet_secret;
+    mainnet_secret.networks = 1;
+    mainnet_secret.required_features = uint64_t{1} << 14;
+    std::vector<uint64_t> selected(payment_request::compiled_filter::selection_words(columns.size()));
+    size_t expected_selected = 0;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        payment_request::bolt11 invoice;
+        expected_selected += payment_request::decode(batch[i], invoice) == 0 && invoice.network == 0 && ((invoice.features >> 14) & 1);
+    }
+    if (expected_selected == 0 || payment_request::compiled_filter(mainnet_secret).select(columns, selected.data()) != expected_selected)
+        fail++;
+    /* The valid invoices, each under its own payment hash, expire at timestamp + expiry and not a
+     * second earlier, once. */
+    std::vector<payment_request::expired_invoice> expired_invoices;
+    payment_request::expiry_wheel wheel(1496314658);
+    std::multimap<uint64_t, size_t> expiries;
+    for (size_t i = 0; i < sizeof(valid_invoice) / sizeof(valid_invoice[0]); ++i) {
+        payment_request::bolt11 invoice;
+        if (payment_request::decode(valid_invoice[i].bech32_data, invoice) != 0) continue;
+        invoice.payment_hash[0] = i;
+        if (!wheel.insert(invoice) || wheel.insert(invoice))
+            fail++;
+        expiries.emplace(invoice.timestamp + invoice.expiry, i);
+    }
+    for (auto it = expiries.begin(); it != expiries.end(); it = expiries.upper_bound(it->first)) {
+        expired_invoices.clear();
+        if (wheel.advance(it->first - 1, collect_expired, &expired_invoices) != 0 ||
+            wheel.advance(it->first, collect_expired, &expired_invoices) != expiries.count(it->first) ||
+            expired_invoices.size() != expiries.count(it->first))
+            fail++;
+        for (const auto& e : expired_invoices) {
+            if (e.expires_at != it->first)
+                fail++;
+        }
+    }
+    if (wheel.size() != 0 || wheel.advance(UINT64_MAX, collect_expired, &expired_invoices) != 0)
+        fail++;
+    const unsigned char cancelled[32] = {1};
+    if (!wheel.insert(cancelled, UINT64_MAX) || !wheel.cancel(cancelled) || wheel.cancel(cancelled) || wheel.size() != 0)
+        fail++;
+    /* Payment hashes that share their first 8 bytes are tracked, cancelled and expired like any. */
+    payment_request::expiry_wheel colliding_wheel(1000);
+    for (uint64_t i = 0; i < 2000; ++i) {
+        unsigned char payment_hash[32] = {};
+        memset(payment_hash, 0xa5, 8);
+        memcpy(payment_hash + 8, &i, sizeof(i));
+        if (!colliding_wheel.insert(payment_hash, 1000 + i % 300) || (i % 2 && !colliding_wheel.cancel(payment_hash)))
+            fail++;
+    }
+    expired_invoices.clear();
+    if (colliding_wheel.size() != 1000 || colliding_wheel.advance(2000, collect_expired, &expired_invoices) != 1000 ||
+        expired_invoices.size() != 1000 || colliding_wheel.size() != 0)
+        fail++;
+    /* Random inserts, cancels and time jumps of up to 2^40 seconds expire what a sorted map of the
+     * open_invoices invoices expires. */
+    payment_request::expiry_wheel random_wheel(1600000000);
+    std::map<std::string, uint64_t> open_invoices;
+    uint64_t wheel_now = 1600000000;
+    for (int step = 0; step < 20000; ++step) {
+        const unsigned op = rng() % 16;
+        if (op < 10) {
+            unsigned char payment_hash[32];
+            for (auto& byte : payment_hash) byte = rng();
+            static const int reach[] = {0, 8, 16, 24, 36, 44};
+            const uint64_t expires_at = wheel_now - 10 + rng() % ((uint64_t{1} << reach[rng() % 6]) + 20);
+            if (!random_wheel.insert(payment_hash, expires_at))
+                fail++;
+            open_invoices.emplace(std::string(reinterpret_cast<char*>(payment_hash), 32), expires_at);
+        } else if (op < 12 && !open_invoices.empty()) {
+            auto it = open_invoices.lower_bound(std::string(32, static_cast<char>(rng())));
+            if (it == open_invoices.end()) it = open_invoices.begin();
+            if (!random_wheel.cancel(reinterpret_cast<const unsigned char*>(it->first.data())))
+                fail++;
+            open_invoices.erase(it);
+        } else {
+            static const int jumps[] = {0, 4, 12, 20, 34, 40};
+            wheel_now += rng() % (uint64_t{1} << jumps[rng() % 6]);
+            expired_invoices.clear();
+            random_wheel.advance(wheel_now, collect_expired, &expired_invoices);
+            std::vector<std::string> fired, due;
+            for (const auto& e : expired_invoices) {
+                fired.emplace_back(reinterpret_cast<const char*>(e.payment_hash), 32);
+                if (e.expires_at > wheel_now || open_invoices[fired.back()] != e.expires_at)
+                    fail++;
+            }
+            for (auto it = open_invoices.begin(); it != open_invoices.end();) {
+                if (it->second <= wheel_now) {
+                    due.push_back(it->first);
+                    it = open_invoices.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            std::sort(fired.begin(), fired.end());
+            if (fired != due || random_wheel.size() != open_invoices.size())
+                fail++;
+        }
+    }
+    /* Inserts from several threads while another advances the wheel: every invoice expires once. */
+    payment_request::expiry_wheel shared_wheel(0);
+    std::vector<std::thread> inserters;
+    for (unsigned t = 0; t < 4; ++t) {
+        inserters.emplace_back([&shared_wheel, t] {
+            std::mt19937_64 thread_rng(t);
+            for (uint32_t i = 0; i < 10000; ++i) {
+                unsigned char payment_hash[32] = {};
+                memcpy(payment_hash, &i, 4);
+                payment_hash[4] = t;
+                shared_wheel.insert(payment_hash, thread_rng() % 100000);
+            }
+        });
+    }
+    size_t shared_expired = 0;
+    for (uint64_t time = 0; time < 100000; time += 97) {
+        expired_invoices.clear();
+        shared_expired += shared_wheel.advance(time, collect_expired, &expired_invoices);
+    }
+    for (auto& thread : inserters) thread.join();
+    shared_expired += shared_wheel.advance(100000, collect_expired, &expired_invoices);
+    if (shared_expired != 40000 || shared_wheel.size() != 0)
+        fail++;
+    /* A pipeline with several workers on some stages gives each invoice the result decode() does,
+     * once. */
+    std::vector<std::string> pipeline_inputs;
+    for (int round = 0; round < 20; ++round) {
+        for (const auto& input : valid_invoice) pipeline_inputs.push_back(input.bech32_data);
+        for (const auto& input : invalid_invoice) pipeline_inputs.push_back(input.bech32_data);
+    }
+    std::vector<std::string_view> pipeline_views(pipeline_inputs.begin(), pipeline_inputs.end());
+    pipeline_output output;
+    payment_request::pipeline_config pipeline_config;
+    pipeline_config.workers[0] = 2;
+    pipeline_config.workers[3] = 3;
+    pipeline_config.batch_size = 7;
+    pipeline_config.batches = 3;
+    payment_request::decode_pipeline pipeline(pipeline_config, collect_decoded, &output);
+    pipeline.submit(pipeline_views.data(), pipeline_views.size() / 2);
+    pipeline.submit(pipeline_views.data() + pipeline_views.size() / 2, pipeline_views.size() - pipeline_views.size() / 2);
+    pipeline.flush();
+    size_t pipeline_rejected = 0;
+    for (const auto& input : pipeline_views) {
+        payment_request::bolt11 expected;
+        const int status = payment_request::decode(input, expected);
+        pipeline_rejected += status != 0;
+        auto it = output.results.find(input.data());
+        if (it == output.results.end() || it->second.first != status ||
+            (status == 0 && it->second.second != hex(expected.payment_hash, 32)))
+            fail++;
+    }
+    const payment_request::pipeline_metrics pipeline_metrics = pipeline.metrics();
+    const size_t pipeline_batches = (pipeline_views.size() / 2 + 6) / 7 + (pipeline_views.size() - pipeline_views.size() / 2 + 6) / 7;
+    if (output.results.size() != pipeline_views.size() || pipeline_metrics.invoices != pipeline_views.size() ||
+        pipeline_metrics.rejected != pipeline_rejected)
+        fail++;
+    for (size_t s = 0; s < payment_request::PIPELINE_STAGES; ++s) {
+        if (pipeline_metrics.batches[s] != pipeline_batches || pipeline_metrics.depth[s] != 0 || pipeline_metrics.max_depth[s] > 3)
+            fail++;
+    }
+    /* With every batch in flight, try_submit() refuses more until the sink lets one go. */
+    pipeline_output held;
+    held.hold = true;
+    pipeline_config.batches = 1;
+    payment_request::decode_pipeline full_pipeline(pipeline_config, collect_decoded, &held);
+    if (full_pipeline.try_submit(pipeline_views.data(), 3) != 3 || full_pipeline.try_submit(pipeline_views.data() + 3, 3) != 0)
+        fail++;
+    held.hold = false;
+    full_pipeline.submit(pipeline_views.data() + 3, 3);
+    full_pipeline.flush();
+    if (held.results.size() != 6 || full_pipeline.metrics().submit_waits > 1)
+        fail++;
     printf("%i failures\n", fail);
     return fail != 0;
 }